@@ -174,6 +174,30 @@ void load_configuration(bool reload)
 			xconfig.set_max_xs_retries(iv);
 	}
 
+	key = "report_watch";
+	vkeys.insert(std::string(key));
+	if (TriTrue == cfg_get_bool(cfg, key, &bv))
+	{
+		xconfig.set_report_watch(bv);
+	}
+
+	key = "pressure_alarm";
+	vkeys.insert(std::string(key));
+	if (TriTrue == cfg_get_bool(cfg, key, &bv))
+	{
+		xconfig.set_pressure_alarm(bv);
+	}
+
+	key = "metrics_port";
+	vkeys.insert(std::string(key));
+	if (TriTrue == cfg_get_int(cfg, key, &iv))
+	{
+		if (iv < 0 || iv > 65535)
+			inval(cname, key);
+		else
+			xconfig.set_metrics_port(iv);
+	}
+
 	key = "max_xen_init_retries";
 	vkeys.insert(std::string(key));
 	if (TriTrue == cfg_get_int_units(cfg, key, units_time, "sec", &iv, &unit) &&
@@ -207,6 +231,49 @@ void load_configuration(bool reload)
 			xconfig.set_domain_pending_timeout(iv);
 	}
 
+	key = "freemem_lien_timeout";
+	vkeys.insert(std::string(key));
+	if (TriTrue == cfg_get_int_units(cfg, key, units_time, "sec", &iv, &unit) &&
+	    convert_unit_second(cfg, key, &iv, unit))
+	{
+		if (iv < 0)
+			inval(cname, key);
+		else
+			xconfig.set_freemem_lien_timeout(iv);
+	}
+
+	key = "resize_lien_timeout";
+	vkeys.insert(std::string(key));
+	if (TriTrue == cfg_get_int_units(cfg, key, units_time, "sec", &iv, &unit) &&
+	    convert_unit_second(cfg, key, &iv, unit))
+	{
+		if (iv < 0)
+			inval(cname, key);
+		else
+			xconfig.set_resize_lien_timeout(iv);
+	}
+
+	key = "prepare_shrink_timeout";
+	vkeys.insert(std::string(key));
+	if (TriTrue == cfg_get_int(cfg, key, &iv))
+	{
+		if (iv < 0 || iv > config.max_prepare_shrink_timeout)
+			inval(cname, key);
+		else
+			xconfig.set_prepare_shrink_timeout(iv);
+	}
+
+	key = "state_save_interval";
+	vkeys.insert(std::string(key));
+	if (TriTrue == cfg_get_int_units(cfg, key, units_time, "sec", &iv, &unit) &&
+	    convert_unit_second(cfg, key, &iv, unit))
+	{
+		if (iv < 0)
+			inval(cname, key);
+		else
+			xconfig.set_state_save_interval(iv);
+	}
+
 	key = "host_reserved_hard";
 	vkeys.insert(std::string(key));
 	if (TriTrue == cfg_get_long_units(cfg, key, units_mem, "mb", &lv, &unit) &&
@@ -229,6 +296,13 @@ void load_configuration(bool reload)
 			xconfig.set_host_reserved_soft(lv);
 	}
 
+	key = "numa_balance";
+	vkeys.insert(std::string(key));
+	if (TriTrue == cfg_get_bool(cfg, key, &bv))
+	{
+		xconfig.set_numa_balance(bv);
+	}
+
 	key = "rate_high";
 	vkeys.insert(std::string(key));
 	if (TriTrue == cfg_get_ulong_units(cfg, key, units_rate, "kb/s", &ulv, &unit) &&
@@ -275,6 +349,27 @@ void load_configuration(bool reload)
 			inval(cname, key);
 	}
 
+	key = "superpage_align";
+	vkeys.insert(std::string(key));
+	if (TriTrue == cfg_get_long_units(cfg, key, units_mem, "mb", &lv, &unit) &&
+	    convert_unit_kb(cfg, key, &lv, unit))
+	{
+		if (lv < 0 || lv % memquant_kbs)
+			inval(cname, key);
+		else
+			xconfig.set_superpage_align(lv);
+	}
+
+	key = "priority";
+	vkeys.insert(std::string(key));
+	if (TriTrue == cfg_get_int(cfg, key, &iv))
+	{
+		if (iv >= config.min_priority && iv <= config.max_priority)
+			xconfig.set_priority(iv);
+		else
+			inval(cname, key);
+	}
+
 	key = "guest_free_threshold";
 	vkeys.insert(std::string(key));
 	if (TriTrue == cfg_get_float_units(cfg, key, units_percent, "%", &dfv, &unit))
@@ -286,6 +381,46 @@ void load_configuration(bool reload)
 			inval(cname, key);
 	}
 
+	key = "rate_fast_window";
+	vkeys.insert(std::string(key));
+	if (TriTrue == cfg_get_int(cfg, key, &iv))
+	{
+		if (iv >= 1 && iv <= RATE_HISTORY_SIZE)
+			xconfig.set_rate_fast_window(iv);
+		else
+			inval(cname, key);
+	}
+
+	key = "rate_slow_window";
+	vkeys.insert(std::string(key));
+	if (TriTrue == cfg_get_int(cfg, key, &iv))
+	{
+		if (iv >= 0 && iv <= RATE_HISTORY_SIZE)
+			xconfig.set_rate_slow_window(iv);
+		else
+			inval(cname, key);
+	}
+
+	key = "predict_window";
+	vkeys.insert(std::string(key));
+	if (TriTrue == cfg_get_int(cfg, key, &iv))
+	{
+		if (iv >= 2 && iv <= RATE_HISTORY_SIZE)
+			xconfig.set_predict_window(iv);
+		else
+			inval(cname, key);
+	}
+
+	key = "predict_horizon";
+	vkeys.insert(std::string(key));
+	if (TriTrue == cfg_get_int(cfg, key, &iv))
+	{
+		if (iv >= 1 && iv <= config.max_predict_horizon)
+			xconfig.set_predict_horizon(iv);
+		else
+			inval(cname, key);
+	}
+
 	key = "startup_time";
 	vkeys.insert(std::string(key));
 	if (TriTrue == cfg_get_int_units(cfg, key, units_time, "sec", &iv, &unit) &&
@@ -316,6 +451,17 @@ void load_configuration(bool reload)
 		}
 	}
 
+	key = "max_report_heartbeat";
+	vkeys.insert(std::string(key));
+	if (TriTrue == cfg_get_int_units(cfg, key, units_time, "sec", &iv, &unit) &&
+	    convert_unit_second(cfg, key, &iv, unit))
+	{
+		if (iv < 0)
+			inval(cname, key);
+		else
+			xconfig.set_max_report_heartbeat(iv);
+	}
+
 	key = "trim_unmanaged";
 	vkeys.insert(std::string(key));
 	if (TriTrue == cfg_get_bool(cfg, key, &bv))
@@ -331,7 +477,11 @@ void load_configuration(bool reload)
 		if (parse_control_mode(cfg_dbname(cfg), "dom0_membalance_mode",
 				       sv, &ctrl_modes_allowed))
 		{
-			xconfig.set_dom0_mode(ctrl_modes_allowed);
+			/* PREDICT mode is not supported for Dom0 */
+			if (ctrl_modes_allowed & CTRL_MODE_PREDICT)
+				inval(cfg, key);
+			else
+				xconfig.set_dom0_mode(ctrl_modes_allowed);
 		}
 	}
 
@@ -423,6 +573,27 @@ void reload_configuration(void)
 		update_membalance_interval();
 	}
 
+	/*
+	 * set or remove watches on domain report keys
+	 */
+	if (config.report_watch != sv.report_watch)
+		update_membalance_report_watches();
+
+	/*
+	 * set or remove watches on domain alarm keys
+	 */
+	if (config.pressure_alarm != sv.pressure_alarm)
+		update_membalance_alarm_watches();
+
+	/*
+	 * restart metrics server on a new port
+	 */
+	if (config.metrics_port != sv.metrics_port)
+	{
+		stop_metrics_server();
+		start_metrics_server();
+	}
+
 	/*
 	* daemon config parameters affecting domain_info::resolve_settings(...)
 	* etc. may have changed, making some currently unmanaged domains
@@ -716,6 +887,30 @@ bool parse_pct(const char* dbname, const char* key, const char* svalue, double*
 	return true;
 }
 
+/*
+ * Parse integer value in range [vmin ... vmax].
+ *
+ * Parameters:
+ *         @dbname = data source descriptive name (for error messaging)
+ *         @key = data item key name (for error messaging)
+ *         @value = string value of the item
+ *         @pvalue = where to return the value
+ *
+ * Return: @true if successful.
+ *         @false on error, and issue a message.
+ */
+bool parse_int(const char* dbname, const char* key, const char* svalue, int* pvalue,
+	       int vmin, int vmax)
+{
+	if (!a2int(svalue, pvalue) || *pvalue < vmin || *pvalue > vmax)
+	{
+		inval(dbname, key);
+		return false;
+	}
+
+	return true;
+}
+
 /*
  * Parse time (result value: seconds).
  *
@@ -772,6 +967,7 @@ bool parse_bool(const char* dbname, const char* key, const char* svalue,
  *    off
  *    auto
  *    direct
+ *    predict (implies auto)
  *    auto,direct (in various combinations/order)
  *
  * Return: @true if successful.
@@ -806,6 +1002,8 @@ bool parse_control_mode(const char* dbname, const char* key, const char* svalue,
 			rmask |= CTRL_MODE_AUTO;
 		else if (streqi(token, "direct"))
 			rmask |= CTRL_MODE_DIRECT;
+		else if (streqi(token, "predict"))
+			rmask |= CTRL_MODE_AUTO | CTRL_MODE_PREDICT;
 		else
 			res = false;
 	}
@@ -39,6 +39,7 @@ public:
 	membalance_config();
 	void defaults(void);
 	void merge(const membalance_config& src);
+	unsigned long changed_mask(const membalance_config& old) const;
 	membalance_config& operator=(const membalance_config& src);
 
 public:
@@ -176,6 +177,24 @@ inline void membalance_config::merge(const membalance_config& src)
 	#include "config_def.h"
 }
 
+/*
+ * Return mask of items that differ from @old
+ * in their availability or value
+ */
+#undef CONFIG_ITEM
+#undef CONFIG_ITEM_CONST
+#define CONFIG_ITEM(name, type, defval)						\
+	if (isval_##name() != old.isval_##name() ||				\
+	    (isval_##name() && name != old.name))				\
+		mask |= config_itemmask_##name;
+#define CONFIG_ITEM_CONST(name, type, defval)
+inline unsigned long membalance_config::changed_mask(const membalance_config& old) const
+{
+	unsigned long mask = 0;
+	#include "config_def.h"
+	return mask;
+}
+
 /*
  * Copy assignment
  */
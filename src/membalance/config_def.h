@@ -35,6 +35,27 @@ CONFIG_ITEM_CONST(tolerance_ms, int, 200)
  */
 CONFIG_ITEM(max_xs_retries, int, 20)
 
+/*
+ * Collect domain reports as they arrive, via xenstore watches set on
+ * domain "report" keys, rather than by reading (and resetting) the report
+ * keys of all managed domains in one xenstore transaction at each @interval
+ * tick.
+ */
+CONFIG_ITEM(report_watch, bool, false)
+
+/*
+ * Watch domain "alarm" keys, written by memprobed in between regular reports
+ * when it sees a sudden surge of data map-in rate or a collapse of guest free
+ * memory, and expand alarmed domains out of tick, drawing on host free memory.
+ */
+CONFIG_ITEM(pressure_alarm, bool, true)
+
+/*
+ * If not 0, serve host and domain metrics in Prometheus text exposition
+ * format at http://127.0.0.1:@metrics_port/metrics (see metrics.cpp).
+ */
+CONFIG_ITEM(metrics_port, int, 0)
+
 /*
  * Limit data update interval to a range of 2 ... 30 seconds
  */
@@ -89,6 +110,16 @@ CONFIG_ITEM(host_reserved_hard, long, 0)	/* in KBs */
  */
 CONFIG_ITEM(host_reserved_soft, long, 0)	/* in KBs */
 
+/*
+ * On a NUMA host, track free memory of each node and the node each domain
+ * is confined to by its node affinity. Expand domains confined to a node
+ * drawing on the free memory of that node and on shrinking other domains
+ * confined to it first, and only then on other nodes. @host_reserved_hard
+ * and @host_reserved_soft are also kept on each node, in proportion to
+ * node size.
+ */
+CONFIG_ITEM(numa_balance, bool, false)
+
 /*
  * The values of @rate_high, @rate_low, @dmem_incr and @dmem_decr specified
  * in this file are used as the defaults for domains, unless they are overriden
@@ -132,6 +163,31 @@ CONFIG_ITEM_CONST(max_dmem_decr, double, 0.1)   /* 10% */
 CONFIG_ITEM_CONST(min_dmem_incr, double, 0.005) /* 0.5% */
 CONFIG_ITEM_CONST(max_dmem_incr, double, 0.3)   /* 30% */
 
+/*
+ * Frequent small adjustments of domain size fragment guest and p2m superpages.
+ * If @superpage_align is not 0, domain expansion and contraction targets are
+ * rounded to a multiple of @superpage_align (normally 2 MB or 1 GB): expansion
+ * up to the next boundary, contraction up to the boundary above the target.
+ * Contraction by less than @superpage_align is thus not made at all, and
+ * partial expansion (when free memory is short) only in whole superpages.
+ * Bounds @dmem_min and @dmem_max, and trimming by more than @dmem_decr
+ * under dire host memory shortage are not affected.
+ */
+CONFIG_ITEM(superpage_align, long, 0)		/* in KBs */
+
+/*
+ * Domain SLA priority class. Forces with which a domain above @dmem_min
+ * claims memory (expand force) and holds on to it (resist force) are scaled
+ * by @priority/100, so a domain with priority 200 outbids a domain with
+ * priority 100 for the same memory pressure. When memory is reclaimed
+ * from domains that stay below their rate threshold, domains with lower
+ * priority are trimmed first. Thus batch domains (priority < 100) donate
+ * memory before latency-sensitive ones (priority > 100).
+ */
+CONFIG_ITEM(priority, int, 100)
+CONFIG_ITEM_CONST(min_priority, int, 1)
+CONFIG_ITEM_CONST(max_priority, int, 1000)
+
 /*
  * If guest data rate is <= @rate_zero, it is considered to be zero
  * regardless of the reported rate value.
@@ -145,6 +201,37 @@ CONFIG_ITEM(rate_zero, unsigned long, 30)	/* in KB/s */
  */
 CONFIG_ITEM(guest_free_threshold, double, 0.15)	/* fractions (%/100) */
 
+/*
+ * Domain data rate readings are smoothed with moving averages over the
+ * latest @rate_fast_window and @rate_slow_window samples. Fast average is
+ * used to calculate domain expansion force, slow average (taken at least
+ * as high as the latest reading) to calculate domain force to resist its
+ * contraction.
+ *
+ * @rate_slow_window of 0 selects default weighting of the latest 5 samples
+ * (10, 3, 2, 2, 1).
+ *
+ * At most RATE_HISTORY_SIZE (64) samples are kept per domain.
+ */
+CONFIG_ITEM(rate_fast_window, int, 1)		/* samples */
+CONFIG_ITEM(rate_slow_window, int, 0)		/* samples */
+
+/*
+ * For domains in PREDICT mode (membalance_mode = predict), data rate and
+ * guest free memory percentage are projected @predict_horizon ticks forward
+ * from their linear trend over the latest @predict_window samples.
+ *
+ * A rising projected rate raises domain expansion force ahead of the rate
+ * crossing @rate_high, a falling projected rate lowers domain resistance
+ * to contraction ahead of the domain going idle. Reported rate is not
+ * disregarded for plenty of guest free memory (@guest_free_threshold)
+ * if free memory is projected to fall under the threshold, and projected
+ * rate is taken as zero if free memory is projected to rise above it.
+ */
+CONFIG_ITEM(predict_window, int, 4)		/* samples */
+CONFIG_ITEM(predict_horizon, int, 2)		/* ticks */
+CONFIG_ITEM_CONST(max_predict_horizon, int, 10)	/* ticks */
+
 /*
  * To minimize the probability of a jitter of reallocating memory back and
  * forth between very similar domains (domain upsize/downsize jitter),
@@ -171,6 +258,16 @@ CONFIG_ITEM(trim_unmanaged, bool, true)
  */
 CONFIG_ITEM(trim_unresponsive, int, 200)
 
+/*
+ * Memprobed doing change-only reporting sends a report only when its
+ * readings change, and at least once per heartbeat interval it announces
+ * in the report. Until the heartbeat deadline expires, a silent domain
+ * is presumed to have unchanged readings, and counts as unresponsive only
+ * after that. Heartbeat intervals are capped at @max_report_heartbeat
+ * seconds.
+ */
+CONFIG_ITEM(max_report_heartbeat, int, 300)
+
 /*
  * Estimated threshold on domain guest OS startup time.
  *
@@ -223,19 +320,62 @@ CONFIG_ITEM_CONST(domain_expansion_timeout_abort, int, 4)
  * command will either fail or (depending on its options) return with whatever
  * memory it was able to obtain.
  *
- * Do not set @domain_freemem_timeout too high.
- *
- * First, it should definitely be less than @interval, preferably well under
- * @interval. Second, while waiting for free memory, membalance does not
- * respond to signals and RPC control requests.
+ * Do not set @domain_freemem_timeout too high: it should be less than
+ * @interval, preferably well under @interval. Requests arriving meanwhile
+ * are batched up and served together after the wait.
  */
 CONFIG_ITEM_CONST(domain_freemem_timeout, int, 700)
 
+/*
+ * Before shrinking domains for "membalancectl free-memory" command, ask
+ * memprobed in these domains to reclaim guest memory (such as clean page
+ * cache) by the amount they are going to be shrunk, and wait for up to
+ * @prepare_shrink_timeout ms for them to respond, so the balloon driver does
+ * not have to reclaim the pages under pressure and shrinking completes
+ * within @domain_freemem_timeout. Domains with memprobed that does not
+ * support the request are not waited for.
+ *
+ * If set to 0, domains are shrunk right away.
+ */
+CONFIG_ITEM(prepare_shrink_timeout, int, 500)
+CONFIG_ITEM_CONST(max_prepare_shrink_timeout, int, 10000)
+
+/*
+ * Memory obtained by "membalancectl free-memory" command is set aside for
+ * the requester, so that membalance won't expand domains into it before it
+ * is used (e.g. by a domain being started). The memory is released once
+ * allocated by the domains created after the command, or after
+ * @freemem_lien_timeout seconds in any event.
+ *
+ * If set to 0, memory is not set aside.
+ */
+CONFIG_ITEM(freemem_lien_timeout, int, 60)
+
+/*
+ * Memory that domains expanded by membalance are yet to take to reach their
+ * requested size is counted as a lien on Xen free memory, until a domain
+ * either reaches the requested size or makes no progress towards it for
+ * @resize_lien_timeout seconds (e.g. because its balloon driver is stalled).
+ *
+ * If set to 0, in-progress expansions of running domains are not counted
+ * as liens.
+ */
+CONFIG_ITEM(resize_lien_timeout, int, 30)
+
+/*
+ * Save data learned about managed domains (Xen private data size and
+ * scheduling history) every @state_save_interval seconds and at shutdown,
+ * so it can be picked up by the daemon after restart.
+ *
+ * If set to 0, domain state is neither saved nor restored.
+ */
+CONFIG_ITEM(state_save_interval, int, 60)
+
 /*
  * Enable or disable management of Dom0, in either AUTO or DIRECT modes.
  *
  * This is a flag bitmask of CTRL_MODE_AUTO and/or CTRL_MODE_DIRECT,
- * with either of the flags set or unset.
+ * with either of the flags set or unset. PREDICT mode is not accepted.
  *
  * Membalance management of Dom0 is currently not implemented, so this option
  * is undocumented and is to be currently left as "disabled" (0), since the
@@ -9,12 +9,58 @@
 
 #include "membalanced.h"
 
+/******************************************************************************
+*                             local definitions                               *
+******************************************************************************/
+
+/*
+ * Domain config file data parsed by libxlutil.
+ *
+ * Parsing is done by retrieve_config_file_settings() each time a domain goes
+ * through pending state, including when unmanaged domains are re-examined
+ * after configuration reload. Results are cached by the content of config
+ * data, so domains re-examined with unchanged config data, or started from
+ * a config file with the same content, are not parsed again.
+ */
+class xl_config_data
+{
+public:
+	int	parse_error;		/* parser errno, or 0 if parsed fine */
+	map_ss	kv;			/* "membalance_xxx" keys */
+	bool	has_memory;		/* "memory" key is present and numeric */
+	long	memory;			/* ... its value (MBs) */
+	bool	has_maxmem;		/* "maxmem" key is present and numeric */
+	long	maxmem;			/* ... its value (MBs) */
+};
+
+typedef std::map<std::string, xl_config_data> xl_config_cache;
+
+static const size_t xl_config_cache_max = 256;	/* flush cache beyond this many entries */
+
+
+/******************************************************************************
+*                               static data                                   *
+******************************************************************************/
+
+static xl_config_cache config_cache;	/* config data -> parse results */
+
+/*
+ * Config items (config_itemmask_xxx) each unmanaged domain took defaults from
+ * when it was last examined, or was not added if not known. Consulted on
+ * configuration reload to re-examine only the domains the change can affect.
+ */
+static std::map<long, unsigned long> unmanaged_deps;
+
+
 /******************************************************************************
 *                          forward declarations                               *
 ******************************************************************************/
 
 static void show_domains(FILE* fp, const char* title, const domid2info& xdoms, char kind);
+static bool parse_xl_config(xl_config_data* xd, const uint8_t* data, int len,
+			    const char* config_source);
 static const char* fetch_key(map_ss* kv, XLU_Config* xlu_config, const char* key);
+static void set_unmanaged_deps(long domain_id, const domain_info* dom);
 static void inval(const char* config_source, const char* key);
 static void show_status_header(FILE* fp);
 static void show_status_global(FILE* fp);
@@ -33,6 +79,9 @@ domain_info::domain_info(long domain_id)
 {
 	this->domain_id = domain_id;
 	qid = NULL;
+	report_watched = false;
+	alarm_watched = false;
+	pressure_alarm = false;
 
 	pending_cycle = 0;
 	pending_skipped = 0;
@@ -61,6 +110,8 @@ domain_info::domain_info(long domain_id)
 	xc_startup_time = -1;
 	xc_trim_unresponsive = -1;
 	xc_trim_unmanaged = TriMaybe;
+	xc_superpage_align = -1;
+	xc_priority = -1;
 
 	dmem_max = -1;
 	dmem_quota = -1;
@@ -74,9 +125,13 @@ domain_info::domain_info(long domain_id)
 	startup_time = -1;
 	trim_unresponsive = -1;
 	trim_unmanaged = true;
+	superpage_align = 0;
+	priority = 100;
+	rc_priority = -1;
 	xen_data_size = 0;
 
 	report_raw = NULL;
+	report_len = 0;
 }
 
 domain_info::~domain_info()
@@ -107,14 +162,24 @@ void domain_info::on_enter_managed(void)
 	no_report_time = 0;
 	time_rate_below_low = 0;
 	time_rate_below_high = 0;
+	pred_rate = 0;
+	pred_freepct = 0;
+	has_psi = false;
+	report_heartbeat = 0;
 	valid_data = false;
 	valid_memory_data = false;
+	numa_node = -1;
 	last_expand_tick = 0;
+	last_resize_time = 0;
+	last_resize_size = 0;
 	preshrink = 0;
 	preshrink_tick = 0;
 	xds_phase = 0;
 	xds_totsize0 = -1;
 	xds_memgoal0 = -1;
+
+	/* if managed before the restart of the daemon, pick up its history */
+	state_file_restore_history(this);
 }
 
 void domain_info::set_qid(const char* qid)
@@ -229,6 +294,9 @@ void unmanage_domain(long domain_id)
 void transition_managed_dead(long domain_id)
 {
 	debug_msg(5, "domain %ld transition: managed -> dead", domain_id);
+	unwatch_membalance_report(doms.managed[domain_id]);
+	unwatch_membalance_alarm(doms.managed[domain_id]);
+	forget_domain_lien(domain_id);
 	delete doms.managed[domain_id];
 	doms.managed.erase(domain_id);
 	qid_dead(domain_id);
@@ -247,6 +315,7 @@ void transition_unmanaged_dead(long domain_id)
 	debug_msg(5, "domain %ld transition: unmanaged -> dead", domain_id);
 	// delete doms.unmanaged[domain_id];  // always "delete NULL" so no-op
 	doms.unmanaged.erase(domain_id);
+	unmanaged_deps.erase(domain_id);
 	qid_dead(domain_id);
 }
 
@@ -277,6 +346,7 @@ void transition_pending_unmanaged(long domain_id)
 		notice_msg("will not manage domain %s",
 			   doms.pending[domain_id]->printable_name());
 	}
+	set_unmanaged_deps(domain_id, doms.pending[domain_id]);
 	delete doms.pending[domain_id];
 	doms.pending.erase(domain_id);
 	doms.unmanaged[domain_id] = NULL;
@@ -289,6 +359,10 @@ void transition_managed_unmanaged(long domain_id)
 	notice_msg("stopping to manage domain %s", dom->printable_name());
 	if (dom->trim_unmanaged)
 		trim_to_quota(dom);
+	unwatch_membalance_report(dom);
+	unwatch_membalance_alarm(dom);
+	forget_domain_lien(domain_id);
+	set_unmanaged_deps(domain_id, dom);
 	delete dom;
 	doms.managed.erase(domain_id);
 	doms.unmanaged[domain_id] = NULL;
@@ -300,11 +374,35 @@ void transition_unmanaged_pending(long domain_id)
 	debug_msg(5, "domain %ld transition: unmanaged -> pending", domain_id);
 	// delete doms.unmanaged[domain_id];  // always "delete NULL" so no-op
 	doms.unmanaged.erase(domain_id);
+	unmanaged_deps.erase(domain_id);
 	domain_info* dom = new domain_info(domain_id);
 	doms.pending[domain_id] = dom;
 	dom->on_enter_pending();
 }
 
+/*
+ * Record config items that domain @dom transitioning to unmanaged
+ * has taken defaults from
+ */
+static void set_unmanaged_deps(long domain_id, const domain_info* dom)
+{
+	if (dom->config_file_status == TriTrue)
+	{
+		/* i.e. only ones that can affect resolve_settings(...) */
+		unmanaged_deps[domain_id] = dom->resolve_settings_deps();
+	}
+	else if (dom->config_file_status == TriFalse)
+	{
+		/* config file disables membalance or is invalid */
+		unmanaged_deps[domain_id] = 0;
+	}
+	else
+	{
+		/* not known, re-examine on any change */
+		unmanaged_deps.erase(domain_id);
+	}
+}
+
 /******************************************************************************
 *                         reexamine domain status                             *
 ******************************************************************************/
@@ -338,16 +436,22 @@ void rescan_domains_on_config_change(const membalance_config& old_config)
 	keyset(mids, doms.managed);
 	keyset(umids, doms.unmanaged);
 
+	unsigned long changed = config.changed_mask(old_config);
+	unsigned long affected = domain_info::resolve_settings_affected(old_config);
+	std::map<long, unsigned long>::const_iterator dit;
+
 	/*
-	 * update current settings for managed domains (merging the defaults
-	 * from new global config) and also unmanage those previously managed
-	 * domains, whose aggregate settings went invalid or incomplete
+	 * update current settings for managed domains that take defaults
+	 * changed in the new global config, and also unmanage those previously
+	 * managed domains, whose aggregate settings went invalid or incomplete
 	 * as a result of global config change
 	 */
 	for (domid_set::const_iterator it = mids.begin(); it != mids.end(); ++it)
 	{
 		long domain_id = *it;
 		domain_info* dom = doms.managed[domain_id];
+		if (!(dom->resolve_settings_deps() & changed))
+			continue;
 		if (!dom->resolve_settings())
 			transition_managed_unmanaged(domain_id);
 	}
@@ -357,13 +461,17 @@ void rescan_domains_on_config_change(const membalance_config& old_config)
 	 * not manageable due to failing resolve_settings(...), but now new
 	 * global settings may possibly make then manageable
 	 */
-	if (domain_info::resolve_settings_affected(old_config))
+	if (affected)
 	{
 		for (domid_set::const_iterator it = umids.begin(); it != umids.end(); ++it)
 		{
 			long domain_id = *it;
-			if (domain_id != 0 || config.dom0_mode)
-				transition_unmanaged_pending(domain_id);
+			if (domain_id == 0 && !config.dom0_mode)
+				continue;
+			dit = unmanaged_deps.find(domain_id);
+			if (dit != unmanaged_deps.end() && !(dit->second & affected))
+				continue;
+			transition_unmanaged_pending(domain_id);
 		}
 	}
 }
@@ -460,20 +568,43 @@ void process_pending_domains(void)
 		return;
 
 	domid_set new_managed_ids;
+	domid_set failed_ids;
 	domid_set ids;
+	std::vector<long> due_ids;
+	std::vector<domain_info*> vread;
+	std::map<long, char> xs_status;
+
+	/*
+	 * Select pending domains due to be processed in this cycle,
+	 * and read xenstore data for those of them that need it in bulk
+	 */
 	keyset(ids, doms.pending);
 
+	for (domid_set::const_iterator it = ids.begin(); it != ids.end(); ++it)
+	{
+		domain_info* info = doms.pending[*it];
+		if (!info->pending_due())
+			continue;
+		due_ids.push_back(*it);
+		if (info->pending_needs_xs())
+			vread.push_back(info);
+	}
+
+	domain_info::bulk_read_pending_xs(vread, xs_status);
+
 	/*
-	 * Iterate all pending domain and try to resolve them as either
+	 * Iterate due pending domains and try to resolve them as either
 	 * managed, unmanaged, dead or still pending
 	 */
-	for (domid_set::const_iterator it = ids.begin(); it != ids.end(); ++it)
+	for (std::vector<long>::const_iterator it = due_ids.begin(); it != due_ids.end(); ++it)
 	{
 		long domain_id = *it;
 		domain_info* info = doms.pending[domain_id];
 
+		std::map<long, char>::const_iterator xs = xs_status.find(domain_id);
+
 		bool isdead;
-		tribool status = info->process_pending(&isdead);
+		tribool status = info->process_pending(&isdead, xs != xs_status.end() ? xs->second : 0);
 
 		if (isdead)
 		{
@@ -514,12 +645,10 @@ void process_pending_domains(void)
 	 * membalance structure (keys) in xenstore and assign them approriate access
 	 * rights for Dom0 and target domain.
 	 */
-	for (domid_set::const_iterator it = new_managed_ids.begin(); it != new_managed_ids.end(); ++it)
-	{
-		long domain_id = *it;
-		if (!init_membalance_report(domain_id))
-			transition_managed_unmanaged(domain_id);
-	}
+	init_membalance_reports(new_managed_ids, failed_ids);
+
+	for (domid_set::const_iterator it = failed_ids.begin(); it != failed_ids.end(); ++it)
+		transition_managed_unmanaged(*it);
 
 	/*
 	 * If managed list changed, update protection on the key (Dom0=rw, all managed=r)
@@ -594,13 +723,10 @@ void domain_info::retrieve_config_file_settings(void)
 	int config_len = 0;
 	int rc;
 
-	XLU_Config* xlu_config = NULL;
 	char config_source[256];
-	char* parser_msg_buffer = NULL;
-	size_t parser_msg_buffer_size = 0;
-	FILE* parser_msg_fp = NULL;
-	int e;
-	map_ss kv;
+	xl_config_data xdata;
+	const xl_config_data* xd;
+	xl_config_cache::iterator it;
 
 	/*
 	 * When a VM is created, libxl_userdata_store stores the whole XL CFG file
@@ -632,6 +758,72 @@ void domain_info::retrieve_config_file_settings(void)
 		goto cleanup;
 	}
 
+	/* same config data parsed before? */
+	{
+		std::string key((const char*) config_data, config_len);
+
+		it = config_cache.find(key);
+		if (it != config_cache.end())
+		{
+			debug_msg(5, "using cached parse of %s", config_source);
+			xd = &it->second;
+		}
+		else
+		{
+			if (!parse_xl_config(&xdata, config_data, config_len, config_source))
+				goto cleanup;
+
+			if (config_cache.size() >= xl_config_cache_max)
+				config_cache.clear();
+			xd = &(config_cache[key] = xdata);
+		}
+	}
+
+	if (xd->parse_error)
+	{
+		error_msg("unable to parse %s: %s", config_source, strerror(xd->parse_error));
+		goto unmanage;
+	}
+
+	if (!parse_config_file_settings(xd, config_source))
+		goto unmanage;
+
+	/*
+	 * Config file settings retrieved.
+	 * They still may be incomplete or incoherent.
+	 * resolve_settings(...) is responsible for validation.
+	 */
+	config_file_status = TriTrue;
+	goto cleanup;
+
+unmanage:
+	config_file_status = TriFalse;
+
+cleanup:
+
+	free_ptr(config_data);
+}
+
+/*
+ * Parse domain config file data @data of @len bytes into @xd.
+ * Parser errors are recorded in @xd->parse_error.
+ * If unable to parse for other reasons, issue message and return @false.
+ */
+static bool parse_xl_config(xl_config_data* xd, const uint8_t* data, int len,
+			    const char* config_source)
+{
+	XLU_Config* xlu_config = NULL;
+	char* parser_msg_buffer = NULL;
+	size_t parser_msg_buffer_size = 0;
+	FILE* parser_msg_fp = NULL;
+	bool done = false;
+	long lv;
+
+	xd->parse_error = 0;
+	xd->kv.clear();
+	xd->has_memory = xd->has_maxmem = false;
+	xd->memory = xd->maxmem = 0;
+
 	/* create in-memory file for parser messages */
 	parser_msg_fp = open_memstream(&parser_msg_buffer, &parser_msg_buffer_size);
 	if (!parser_msg_fp)
@@ -648,44 +840,43 @@ void domain_info::retrieve_config_file_settings(void)
 		goto cleanup;
 	}
 
+	done = true;
+
 	/* parse config */
-	e = xlu_cfg_readdata(xlu_config, (const char*) config_data, config_len);
-	if (e)
-	{
-		error_msg("unable to parse %s: %s", config_source, strerror(e));
-		goto unmanage;
-	}
+	xd->parse_error = xlu_cfg_readdata(xlu_config, (const char*) data, len);
+	if (xd->parse_error)
+		goto cleanup;
 
 	/*
 	 * Fetch membalance keys from domain config data
  	 */
-	fetch_key(&kv, xlu_config, "membalance_mode");
-	fetch_key(&kv, xlu_config, "membalance_dmem_max");
-	fetch_key(&kv, xlu_config, "membalance_dmem_min");
-	fetch_key(&kv, xlu_config, "membalance_dmem_quota");
-	fetch_key(&kv, xlu_config, "membalance_dmem_incr");
-	fetch_key(&kv, xlu_config, "membalance_dmem_decr");
-	fetch_key(&kv, xlu_config, "membalance_rate_high");
-	fetch_key(&kv, xlu_config, "membalance_rate_low");
-	fetch_key(&kv, xlu_config, "membalance_rate_zero");
-	fetch_key(&kv, xlu_config, "membalance_guest_free_threshold");
-	fetch_key(&kv, xlu_config, "membalance_startup_time");
-	fetch_key(&kv, xlu_config, "membalance_trim_unresponsive");
-	fetch_key(&kv, xlu_config, "membalance_trim_unmanaged");
-
-	if (!parse_config_file_settings(xlu_config, config_source, kv))
-		goto unmanage;
+	fetch_key(&xd->kv, xlu_config, "membalance_mode");
+	fetch_key(&xd->kv, xlu_config, "membalance_dmem_max");
+	fetch_key(&xd->kv, xlu_config, "membalance_dmem_min");
+	fetch_key(&xd->kv, xlu_config, "membalance_dmem_quota");
+	fetch_key(&xd->kv, xlu_config, "membalance_dmem_incr");
+	fetch_key(&xd->kv, xlu_config, "membalance_dmem_decr");
+	fetch_key(&xd->kv, xlu_config, "membalance_rate_high");
+	fetch_key(&xd->kv, xlu_config, "membalance_rate_low");
+	fetch_key(&xd->kv, xlu_config, "membalance_rate_zero");
+	fetch_key(&xd->kv, xlu_config, "membalance_guest_free_threshold");
+	fetch_key(&xd->kv, xlu_config, "membalance_startup_time");
+	fetch_key(&xd->kv, xlu_config, "membalance_trim_unresponsive");
+	fetch_key(&xd->kv, xlu_config, "membalance_trim_unmanaged");
+	fetch_key(&xd->kv, xlu_config, "membalance_superpage_align");
+	fetch_key(&xd->kv, xlu_config, "membalance_priority");
 
-	/*
-	 * Config file settings retrieved.
-	 * They still may be incomplete or incoherent.
-	 * resolve_settings(...) is responsible for validation.
-	 */
-	config_file_status = TriTrue;
-	goto cleanup;
+	if (!xlu_cfg_get_long(xlu_config, "memory", &lv, 0))
+	{
+		xd->has_memory = true;
+		xd->memory = lv;
+	}
 
-unmanage:
-	config_file_status = TriFalse;
+	if (!xlu_cfg_get_long(xlu_config, "maxmem", &lv, 0))
+	{
+		xd->has_maxmem = true;
+		xd->maxmem = lv;
+	}
 
 cleanup:
 
@@ -696,7 +887,8 @@ cleanup:
 		fclose(parser_msg_fp);
 
 	free_ptr(parser_msg_buffer);
-	free_ptr(config_data);
+
+	return done;
 }
 
 /*
@@ -704,10 +896,10 @@ cleanup:
  * On success, return @true.
  * On error, message and return @false.
  */
-bool domain_info::parse_config_file_settings(XLU_Config* xlu_config,
-					     const char* config_source,
-					     const map_ss& kv)
+bool domain_info::parse_config_file_settings(const xl_config_data* xd,
+					     const char* config_source)
 {
+	const map_ss& kv = xd->kv;
 	const char* cp;
 	const char* key;
 	bool done = false;
@@ -742,10 +934,10 @@ bool domain_info::parse_config_file_settings(XLU_Config* xlu_config,
 	 * start, otherwise leave the mode to be dynamically determined when
 	 * domain sends thevery first message to membalanced
 	 */
-	if (ctrl_modes_allowed == CTRL_MODE_AUTO ||
+	if ((ctrl_modes_allowed & ~CTRL_MODE_PREDICT) == CTRL_MODE_AUTO ||
 	    ctrl_modes_allowed == CTRL_MODE_DIRECT)
 	{
-		ctrl_mode = ctrl_modes_allowed;
+		ctrl_mode = ctrl_modes_allowed & ~CTRL_MODE_PREDICT;
 	}
 	else
 	{
@@ -755,8 +947,9 @@ bool domain_info::parse_config_file_settings(XLU_Config* xlu_config,
 	/*
 	 * Handle "memory" and "maxmem" keys
 	 */
-	if (!xlu_cfg_get_long(xlu_config, "memory", &lv, 0))
+	if (xd->has_memory)
 	{
+		lv = xd->memory;
 		if (lv > LONG_MAX / 1024 || lv < 0)
 		{
 			inval(config_source, "memory");
@@ -772,8 +965,9 @@ bool domain_info::parse_config_file_settings(XLU_Config* xlu_config,
 	}
 
 
-	if (!xlu_cfg_get_long(xlu_config, "maxmem", &lv, 0))
+	if (xd->has_maxmem)
 	{
+		lv = xd->maxmem;
 		if (lv > LONG_MAX / 1024 || lv < 0)
 		{
 			inval(config_source, "maxmem");
@@ -835,6 +1029,24 @@ bool domain_info::parse_config_file_settings(XLU_Config* xlu_config,
 	if ((cp = k2v(kv, key)) != NULL)
 		CHECK(parse_bool(config_source, key, cp, &xc_trim_unmanaged));
 
+	key = "membalance_superpage_align";
+	if ((cp = k2v(kv, key)) != NULL)
+	{
+		CHECK(parse_kb(config_source, key, cp, "mb", &xc_superpage_align));
+		if (xc_superpage_align < 0 || xc_superpage_align % memquant_kbs)
+		{
+			inval(config_source, key);
+			goto cleanup;
+		}
+	}
+
+	key = "membalance_priority";
+	if ((cp = k2v(kv, key)) != NULL)
+	{
+		CHECK(parse_int(config_source, key, cp, &xc_priority,
+				config.min_priority, config.max_priority));
+	}
+
 	done = true;
 
 cleanup:
@@ -880,7 +1092,7 @@ bool domain_info::resolve_settings(void)
 {
 	/*
 	 * IMPORTANT: This routine should be kept in sync with
-	 *            resolve_settings_affected(...) below.
+	 *            resolve_settings_affected(...) and resolve_settings_deps(...) below.
 	 */
 
 	bool valid = true;
@@ -981,6 +1193,20 @@ bool domain_info::resolve_settings(void)
 			trim_unmanaged = (bool) xc_trim_unmanaged;
 		else if (config.isval_trim_unmanaged())
 			trim_unmanaged = config.trim_unmanaged;
+
+		/* superpage_align */
+		if (xc_superpage_align >= 0)
+			superpage_align = xc_superpage_align;
+		else if (config.isval_superpage_align())
+			superpage_align = config.superpage_align;
+
+		/* priority */
+		if (rc_priority >= 0)
+			priority = rc_priority;
+		else if (xc_priority >= 0)
+			priority = xc_priority;
+		else if (config.isval_priority())
+			priority = config.priority;
 	}
 
 	CHECK(valid);
@@ -1072,7 +1298,7 @@ cleanup:
 
 	/*
 	 * IMPORTANT: This routine should be kept in sync with
-	 *            resolve_settings_affected(...) below.
+	 *            resolve_settings_affected(...) and resolve_settings_deps(...) below.
 	 */
 
 	return false;
@@ -1083,41 +1309,89 @@ cleanup:
  *
  * Configuration change may potentially affect those domains that previously
  * were not manageable under old settings due to failing resolve_settings(...),
- * but may be manageable under new settings. Return @true new config differs
- * from @old config in a way that justifies trying to re-examine unmanaged
- * domains. Return @false if the change may not affect the outcome of
+ * but may be manageable under new settings. Return mask of config items
+ * (config_itemmask_xxx) that differ between new config and @old config in
+ * a way that justifies re-examining unmanaged domains taking defaults from
+ * them. Return 0 if the change may not affect the outcome of
  * resolve_settings(...).
  *
  * This function control only whether unmanaged domains will be re-examined.
- * Its return value does not have an effect on managed domains, which will
- * have resolve_settings(...) called for them anyway.
+ * Managed domains will have resolve_settings(...) called for them if any
+ * of the items they take defaults from has changed at all.
  */
-bool domain_info::resolve_settings_affected(const membalance_config& old)
+unsigned long domain_info::resolve_settings_affected(const membalance_config& old)
 {
+	unsigned long mask = 0;
+
 	/* undefined -> defined */
-	if ((!old.isval_dmem_incr() && config.isval_dmem_incr()) ||
-	    (!old.isval_dmem_decr() && config.isval_dmem_decr()) ||
-	    (!old.isval_rate_high() && config.isval_rate_high()) ||
-	    (!old.isval_rate_low() && config.isval_rate_low()) ||
-	    (!old.isval_rate_zero() && config.isval_rate_zero()) ||
-	    (!old.isval_guest_free_threshold() && config.isval_guest_free_threshold()))
-	{
-		return true;
-	}
+	if (!old.isval_dmem_incr() && config.isval_dmem_incr())
+		mask |= membalance_config::config_itemmask_dmem_incr;
+	if (!old.isval_dmem_decr() && config.isval_dmem_decr())
+		mask |= membalance_config::config_itemmask_dmem_decr;
+	if (!old.isval_rate_high() && config.isval_rate_high())
+		mask |= membalance_config::config_itemmask_rate_high;
+	if (!old.isval_rate_low() && config.isval_rate_low())
+		mask |= membalance_config::config_itemmask_rate_low;
+	if (!old.isval_rate_zero() && config.isval_rate_zero())
+		mask |= membalance_config::config_itemmask_rate_zero;
+	if (!old.isval_guest_free_threshold() && config.isval_guest_free_threshold())
+		mask |= membalance_config::config_itemmask_guest_free_threshold;
 
 	if (old.isval_rate_high() && config.isval_rate_high() &&
 	    old.rate_high != config.rate_high)
 	{
-		return true;
+		mask |= membalance_config::config_itemmask_rate_high;
 	}
 
 	if (old.isval_rate_low() && config.isval_rate_low() &&
 	    old.rate_low != config.rate_low)
 	{
-		return true;
+		mask |= membalance_config::config_itemmask_rate_low;
 	}
 
-	return false;
+	return mask;
+}
+
+/*
+ * Return mask of config items (config_itemmask_xxx) resolve_settings(...)
+ * takes defaults from for this domain, i.e. ones not set in domain config file.
+ */
+unsigned long domain_info::resolve_settings_deps(void) const
+{
+	/*
+	 * IMPORTANT: This routine should be kept in sync with
+	 *            resolve_settings(...) above.
+	 */
+
+	unsigned long mask = 0;
+
+	if (!(ctrl_modes_allowed & CTRL_MODE_AUTO))
+		return 0;
+
+	if (xc_dmem_incr < 0)
+		mask |= membalance_config::config_itemmask_dmem_incr;
+	if (xc_dmem_decr < 0)
+		mask |= membalance_config::config_itemmask_dmem_decr;
+	if (xc_rate_high < 0)
+		mask |= membalance_config::config_itemmask_rate_high;
+	if (xc_rate_low < 0)
+		mask |= membalance_config::config_itemmask_rate_low;
+	if (xc_rate_zero < 0)
+		mask |= membalance_config::config_itemmask_rate_zero;
+	if (xc_guest_free_threshold < 0)
+		mask |= membalance_config::config_itemmask_guest_free_threshold;
+	if (xc_startup_time < 0)
+		mask |= membalance_config::config_itemmask_startup_time;
+	if (xc_trim_unresponsive < 0)
+		mask |= membalance_config::config_itemmask_trim_unresponsive;
+	if (xc_trim_unmanaged == TriMaybe)
+		mask |= membalance_config::config_itemmask_trim_unmanaged;
+	if (xc_superpage_align < 0)
+		mask |= membalance_config::config_itemmask_superpage_align;
+	if (xc_priority < 0 && rc_priority < 0)
+		mask |= membalance_config::config_itemmask_priority;
+
+	return mask;
 }
 
 void domain_info::undefined_setting(const char* key)
@@ -1321,6 +1595,7 @@ int get_domain_settings(long domain_id, char** message, map_ss& kv)
 	p = buf;
 	if (dom->ctrl_modes_allowed & CTRL_MODE_AUTO)    *p++ = 'A';
 	if (dom->ctrl_modes_allowed & CTRL_MODE_DIRECT)  *p++ = 'D';
+	if (dom->ctrl_modes_allowed & CTRL_MODE_PREDICT) *p++ = 'P';
 	*p = '\0';
 	setfmt(kv, "ctrl_modes_allowed", "%s", buf);
 
@@ -1381,6 +1656,10 @@ int get_domain_settings(long domain_id, char** message, map_ss& kv)
 
 	setfmt(kv, "trim_unmanaged", "%d", (int) dom->trim_unmanaged);
 
+	setfmt(kv, "superpage_align", "%ld", dom->superpage_align);
+
+	setfmt(kv, "priority", "%d", dom->priority);
+
 cleanup:
 
 	/* XDR cannot marshal null string pointers */
@@ -1391,6 +1670,71 @@ cleanup:
 }
 
 
+/*
+ * Change settings of domain @domain_id to the values in @in, and report
+ * updated settings in @kv like get_domain_settings(...) does.
+ *
+ * Only "priority" can be changed currently, and only for managed domain.
+ * The change stays in effect while the domain remains managed, and takes
+ * precedence over domain config file and membalance configuration.
+ *
+ * On error, make no change and return 'X' with message in @message.
+ */
+int set_domain_settings(long domain_id, const map_ss& in, char** message, map_ss& kv)
+{
+	domain_info* dom;
+	const char* key;
+	const char* value;
+	int priority = -1;
+
+	*message = NULL;
+
+	if (!contains(doms.managed, domain_id))
+	{
+		if (contains(doms.unmanaged, domain_id) || contains(doms.pending, domain_id))
+			*message = xprintf("Domain %ld is not managed", domain_id);
+		else
+			*message = xprintf("Domain %ld does not exist", domain_id);
+		return 'X';
+	}
+
+	dom = doms.managed[domain_id];
+
+	for (map_ss::const_iterator it = in.begin();  it != in.end();  ++it)
+	{
+		key = it->first.c_str();
+		value = it->second.c_str();
+
+		if (streq(key, "priority"))
+		{
+			if (!a2int(value, &priority) ||
+			    priority < config.min_priority || priority > config.max_priority)
+			{
+				*message = xprintf("Invalid value of %s: %s", key, value);
+				return 'X';
+			}
+		}
+		else
+		{
+			*message = xprintf("Setting %s cannot be changed", key);
+			return 'X';
+		}
+	}
+
+	if (priority >= 0)
+	{
+		if (priority != dom->priority)
+		{
+			notice_msg("changing priority of domain %s: %d -> %d",
+				   dom->printable_name(), dom->priority, priority);
+		}
+		dom->rc_priority = dom->priority = priority;
+	}
+
+	return get_domain_settings(domain_id, message, kv);
+}
+
+
 /******************************************************************************
 *                               debugging                                     *
 ******************************************************************************/
@@ -1475,6 +1819,14 @@ static void show_domains(FILE* fp, const char* title, const domid2info& xdoms, c
 			dom->trim_unresponsive,
 			dom->trim_unmanaged);
 
+		/* active (superpage_align) */
+		fprintf(fp, "%s         superpage_align: %ld\n",
+			offset2, dom->superpage_align);
+
+		/* active (priority) */
+		fprintf(fp, "%s         priority: %d (rc: %d)\n",
+			offset2, dom->priority, dom->rc_priority);
+
 		/*
 		 * print domain config file data
 		 */
@@ -1509,6 +1861,14 @@ static void show_domains(FILE* fp, const char* title, const domid2info& xdoms, c
 				dom->startup_time,
 				dom->xc_trim_unresponsive,
 				dom->xc_trim_unmanaged);
+
+			/* dom cfg (superpage_align) */
+			fprintf(fp, "%s         superpage_align: %ld\n",
+				offset2, dom->xc_superpage_align);
+
+			/* dom cfg (priority) */
+			fprintf(fp, "%s         priority: %d\n",
+				offset2, dom->xc_priority);
 		}
 		else if (dom->config_file_status == TriFalse)
 		{
@@ -1611,6 +1971,11 @@ static void show_status_global(FILE* fp)
 		    max(w1, w2), decode_memsize(config.host_reserved_hard));
 	fprintf(fp, "host_reserved_soft:  %*s (MB.KB)\n",
 		    max(w1, w2), decode_memsize(config.host_reserved_soft));
+	if (freemem_lien_amount())
+	{
+		fprintf(fp, "set aside for free-memory requests: %s (MB.KB)\n",
+			decode_memsize(freemem_lien_amount()));
+	}
 	fprintf(fp, "\n");
 }
 
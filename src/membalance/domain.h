@@ -70,13 +70,13 @@ public:
 		std::sort(begin(), end(), sortfunc_asc_by_resist_force);
 	}
 
-	/* sort by time_rate_below_low in descending order */
+	/* sort by priority in increasing order, then time_rate_below_low in descending order */
 	void sort_desc_by_time_rate_below_low(void)
 	{
 		std::sort(begin(), end(), sortfunc_desc_by_time_rate_below_low);
 	}
 
-	/* sort by time_rate_below_high in descending order */
+	/* sort by priority in increasing order, then time_rate_below_high in descending order */
 	void sort_desc_by_time_rate_below_high(void)
 	{
 		std::sort(begin(), end(), sortfunc_desc_by_time_rate_below_high);
@@ -143,12 +143,16 @@ protected:
 	/* return true if @d1 > @d2 */
 	static bool sortfunc_desc_by_time_rate_below_low(domain_info* d1, domain_info* d2)
 	{
+		if (d1->priority != d2->priority)
+			return d1->priority < d2->priority;
 		return sort_desc(d1, d2, d1->time_rate_below_low - d2->time_rate_below_low);
 	}
 
 	/* return true if @d1 > @d2 */
 	static bool sortfunc_desc_by_time_rate_below_high(domain_info* d1, domain_info* d2)
 	{
+		if (d1->priority != d2->priority)
+			return d1->priority < d2->priority;
 		return sort_desc(d1, d2, d1->time_rate_below_high - d2->time_rate_below_high);
 	}
 
@@ -171,7 +175,11 @@ protected:
 *                         helper class: dom2xcinfo                            *
 ******************************************************************************/
 
-class domid2xcinfo : public std::map<long, xc_domaininfo_t*>
+/*
+ * Snapshot of Xen domain information, kept as a flat array sorted by domain id.
+ * The buffer persists across calls to collect() and is reused.
+ */
+class domid2xcinfo
 {
 public:
 	domid2xcinfo();
@@ -180,8 +188,284 @@ public:
 	void reset(void);
 	const xc_domaininfo_t* get(long domain_id) const;
 
+	/* number of collected entries */
+	int count(void) const
+	{
+		return ndomains;
+	}
+
+	/* k-th entry in the order of domain id */
+	const xc_domaininfo_t* at(int k) const
+	{
+		return info + k;
+	}
+
+protected:
+	xc_domaininfo_t* info;	/* buffer */
+	int capacity;		/* size of buffer (entries) */
+	int ndomains;		/* collected entries */
+
+	void reserve(int n);
+
+	static bool less_by_domain(const xc_domaininfo_t& i1, const xc_domaininfo_t& i2)
+	{
+		return i1.domain < i2.domain;
+	}
+};
+
+/******************************************************************************
+*                         helper class: resize_batch                          *
+******************************************************************************/
+
+class resize_request
+{
+public:
+	domain_info* dom;
+	long domain_id;		/* @dom->domain_id */
+	long size;		/* requested target size (KBs) */
+
+	resize_request(domain_info* dom, long size)
+	{
+		this->dom = dom;
+		this->domain_id = dom->domain_id;
+		this->size = size;
+	}
+};
+
+/*
+ * A set of domain resize requests issued to Xen in one go and then
+ * verified together, with a single xenstore transaction, rather than
+ * with a read-back per each domain (see xen.cpp)
+ */
+class resize_batch : public std::vector<resize_request>
+{
+public:
+	resize_batch(char action = 0)
+	{
+		this->action = action;
+	}
+
+	void add(domain_info* dom, long size)
+	{
+		push_back(resize_request(dom, size));
+	}
+
+	/* issue and verify all requests in the batch, then clear it */
+	void execute(void);
+
+	/* memory yet to be released by domains being shrunk (KBs) */
+	long outstanding(const domid2xcinfo& xinfo) const;
+
+	/* drop requests for domains that are no longer managed */
+	void prune(void);
+
+protected:
+	char action;		/* '+', '-' or 0 */
+};
+
+
+/******************************************************************************
+*                     helper class: xen_free_memory_waiter                    *
+******************************************************************************/
+
+/*
+ * Resumable wait for Xen free memory to reach a target or to stabilize
+ * (see xen.cpp). Each call to poll() samples the state once and returns
+ * @true when the wait is over, with the latest reading of Xen free memory
+ * in @xfree. Otherwise the caller should call poll() again after
+ * step_ms() milliseconds.
+ */
+class xen_free_memory_waiter
+{
+public:
+	long xfree;		/* latest reading of Xen free memory (KBs) */
+
+	/* wait for free memory to reach @free_target, or @shrinks to complete */
+	void start(long free_target, int timeout_ms, const resize_batch* shrinks = NULL);
+
+	/* wait for free memory and domain allocations to stabilize */
+	void start_stable(int timeout_ms);
+
+	/* keep waiting for at least @timeout_ms from now */
+	void extend(int timeout_ms);
+
+	bool poll(void);
+
+	int step_ms(void) const
+	{
+		return step;
+	}
+
 protected:
-	xc_domaininfo_t* info;
+	bool stable;			/* waiting for stabilization */
+	long free_target;
+	int timeout_ms;
+	const resize_batch* shrinks;
+	struct timespec ts0;		/* start of the wait */
+	struct timespec ts_prev;	/* previous sample (or start of quiet period) */
+	long prev_xfree;		/* previous reading of Xen free memory */
+	std::vector<std::pair<long, uint64_t> > prev_pages;
+	int step;			/* current sleep interval (ms) */
+
+	bool poll_target(void);
+	bool poll_stable(void);
+};
+
+
+/******************************************************************************
+*                         helper class: freemem_request                       *
+******************************************************************************/
+
+/* single "membalancectl free-memory" request within freemem_request */
+class freemem_part
+{
+public:
+	/* request */
+	u_quad_t amt;			/* requested amount (KBs) */
+	bool above_slack;
+	bool draw_reserved_hard;
+	bool must;
+
+	/* result */
+	int status;			/* 0 (in progress), 'P', 'N' or 'A' */
+	u_quad_t freemem_with_slack;	/* attained free memory (KBs) */
+	u_quad_t freemem_less_slack;
+
+	/* memory to set aside for the request (KBs), 0 if none */
+	long req;
+
+	void complete(int status, long with_slack, long less_slack)
+	{
+		this->status = status;
+		this->freemem_with_slack = with_slack;
+		this->freemem_less_slack = less_slack;
+	}
+};
+
+/*
+ * "membalancectl free-memory" requests, performed as a state machine
+ * that can be advanced from the main loop without blocking it while
+ * waiting for Xen memory to stabilize or for domains to shrink (see
+ * sched_freemem in sched.cpp). Each call to step() performs as much
+ * work as possible without waiting and returns @true when the requests
+ * have been completed and their results are available. Otherwise the
+ * caller should call step() again after wait_ms() milliseconds.
+ *
+ * Requests arriving while memory is still being waited to stabilize can
+ * join in with add(), and then share the same reclaim plan, shrinking
+ * pass and wait. The wait for memory to stabilize is then extended with
+ * extend_timeout() to the latest deadline of the requests, so a request
+ * joining with a longer timeout does not have it cut short by the batch.
+ *
+ * Before the domains are shrunk, memprobed in them is asked to reclaim
+ * guest memory, and the shrinking is started after they respond or after
+ * @prepare_shrink_timeout (see request_prepare_shrink in xenstore.cpp).
+ */
+class freemem_request
+{
+public:
+	std::vector<freemem_part> parts;	/* requests in the order of arrival */
+
+	freemem_request(int timeout);
+
+	/* add request, return its index in @parts */
+	int add(u_quad_t amt, bool above_slack, bool draw_reserved_hard, bool must);
+
+	/* let joining request with @timeout (seconds) wait as long as it allows */
+	void extend_timeout(int timeout);
+
+	/* can more requests be added */
+	bool joinable(void) const
+	{
+		return phase == FREEMEM_START || phase == FREEMEM_STABILIZE;
+	}
+
+	bool step(void);
+
+	int wait_ms(void) const
+	{
+		if (phase == FREEMEM_PREPARE)
+			return prepare_step_ms;
+		return waiter.step_ms();
+	}
+
+protected:
+	typedef enum __phase
+	{
+		FREEMEM_START,		/* not started yet */
+		FREEMEM_STABILIZE,	/* waiting for Xen memory to stabilize */
+		FREEMEM_PREPARE,	/* waiting for domains to prepare for shrinking */
+		FREEMEM_SHRINK,		/* waiting for domains to shrink */
+		FREEMEM_DONE		/* completed */
+	}
+	phase_t;
+
+	phase_t phase;
+	int timeout;
+	long lien;			/* lien at planning time */
+	long prev_xen_free_memory;
+	long xen_free_target;
+	struct timespec ts_shrink;	/* when shrinking was started */
+	resize_batch shrinking;		/* domains being shrunk */
+	xen_free_memory_waiter waiter;
+	u_long prepare_seq;		/* prepare-shrink request number */
+	struct timespec ts_prepare;	/* when prepare-shrink was requested */
+	std::vector<long> preparing;	/* domains yet to respond to it */
+	long prepared;			/* memory reclaimed by guests that responded (KBs) */
+	long shrink_amount;		/* memory to be released by shrinking (KBs) */
+
+	static const int prepare_step_ms = 50;
+
+	bool plan(long xen_free_memory);
+	void request_prepare(void);
+	bool poll_prepare(void);
+	void start_shrink(void);
+	void finish(long xen_free_memory, bool waited);
+	void complete_all(int status);
+
+	static int stabilize_timeout_ms(int timeout);
+};
+
+
+/******************************************************************************
+*                      helper class: freemem_projection                       *
+******************************************************************************/
+
+/* domain that would be shrunk to satisfy projected free-memory request */
+class freemem_donor
+{
+public:
+	long domain_id;
+	long memsize;			/* current size (KBs) */
+	long target;			/* size it would be shrunk to (KBs) */
+};
+
+/* free memory attainable within one reserve tier (KBs) */
+class freemem_tier
+{
+public:
+	long free_with_slack;		/* available now, without shrinking domains */
+	long free_less_slack;
+	long max_with_slack;		/* after shrinking all domains down to dmem_min */
+	long max_less_slack;
+};
+
+/*
+ * What "membalancectl free-memory" request could achieve, as evaluated
+ * by sched_freemem_plan(...) without shrinking any domains
+ */
+class freemem_projection
+{
+public:
+	freemem_tier keep_reserved_hard;	/* leaving host_reserved_hard alone */
+	freemem_tier use_reserved_hard;		/* drawing on host_reserved_hard */
+
+	int status;				/* 'A' if request is attainable, 'N' if not */
+	long freemem_with_slack;		/* free memory once donors have shrunk (KBs) */
+	long freemem_less_slack;
+	long reclaim;				/* memory to reclaim from donors (KBs) */
+	int est_ms;				/* time to reclaim it, -1 if not known */
+	std::vector<freemem_donor> donors;
 };
 
 
@@ -20,20 +20,139 @@
  *     DIRECT - adjust domain size according to the instructions from the
  *              domain, target domain size is calculated by the domain
  *
+ *     PREDICT - a variant of AUTO that projects domain demand forward from
+ *               the trends of reported data rate and guest free memory,
+ *               so the domain is expanded ahead of crossing @rate_high
+ *               and loses resistance to shrinking ahead of going idle;
+ *               always set along with AUTO
+ *
  */
 #define CTRL_MODE_AUTO	   (1 << 0)
 #define CTRL_MODE_DIRECT   (1 << 1)
+#define CTRL_MODE_PREDICT  (1 << 2)
 
 class rate_record
 {
 public:
 	u_long tick;
 	long rate;
+	double freepct;
+
+	rate_record()
+	{
+		this->tick = 0;
+		this->rate = 0;
+		this->freepct = 0;
+	}
 
-	rate_record(u_long tick, long rate)
+	rate_record(u_long tick, long rate, double freepct)
 	{
 		this->tick = tick;
 		this->rate = rate;
+		this->freepct = freepct;
+	}
+};
+
+/*
+ * Maximum number of rate samples kept per domain,
+ * also the limit for @rate_fast_window and @rate_slow_window
+ */
+#define RATE_HISTORY_SIZE  64
+
+/*
+ * Fixed-capacity history of rate samples kept inline in domain_info,
+ * element [0] is the most recent sample.
+ *
+ * One extra slot keeps the sample that has just left a full-sized window,
+ * so rate_window can subtract it.
+ */
+class rate_ring
+{
+public:
+	rate_ring()
+	{
+		clear();
+	}
+
+	void clear(void)
+	{
+		head = 0;
+		count = 0;
+	}
+
+	int size(void) const
+	{
+		return count;
+	}
+
+	void push(const rate_record& rr)
+	{
+		head = (head + 1) % (RATE_HISTORY_SIZE + 1);
+		ring[head] = rr;
+		if (count < RATE_HISTORY_SIZE + 1)
+			count++;
+	}
+
+	const rate_record& operator[](int k) const
+	{
+		return ring[(head + RATE_HISTORY_SIZE + 1 - k) % (RATE_HISTORY_SIZE + 1)];
+	}
+
+protected:
+	rate_record ring[RATE_HISTORY_SIZE + 1];
+	int head;		/* index of the most recent sample */
+	int count;		/* number of samples in the ring */
+};
+
+/*
+ * Simple moving average of rate over the latest @width samples in rate_ring,
+ * maintained incrementally as samples are added
+ */
+class rate_window
+{
+public:
+	rate_window()
+	{
+		width = 0;
+		n = 0;
+		sum = 0;
+	}
+
+	/* account for a sample just pushed into @history */
+	void update(const rate_ring& history, int width, bool restart)
+	{
+		if (restart || width != this->width)
+		{
+			reset(history, width);
+		}
+		else if (n < width)
+		{
+			sum += history[0].rate;
+			n++;
+		}
+		else
+		{
+			sum += history[0].rate - history[width].rate;
+		}
+	}
+
+	long average(void) const
+	{
+		return n ? (long) (sum / n) : 0;
+	}
+
+protected:
+	int width;		/* window size (samples) */
+	int n;			/* samples in the window */
+	long long sum;		/* sum of rates in the window */
+
+	void reset(const rate_ring& history, int width)
+	{
+		this->width = width;
+		n = min(width, history.size());
+		sum = 0;
+		for (int k = 0;  k < n;  k++)
+			sum += history[k].rate;
 	}
 };
 
@@ -55,6 +174,9 @@ balside_t;
  */
 #define XS_MEM_VIDEORAM_UNSET  (-11)
 
+/* parsed domain config file, see domain.cpp */
+class xl_config_data;
+
 /*
  * Membalance keeps @domain_info object per each Xen domain
  * in managed or pending state
@@ -68,6 +190,9 @@ public:
 public:
 	long 	domain_id; 	    	/* xen domain id */
 	char*   qid;    		/* id for membalance keys in xenstore */
+	bool	report_watched;		/* xenstore watch is set on report key */
+	bool	alarm_watched;		/* xenstore watch is set on alarm key */
+	bool	pressure_alarm;		/* pressure alarm raised since last handled */
 
 	/**********************************************************************
 	*                 Processing of "pending" state                       *
@@ -110,6 +235,8 @@ public:
 	int	xc_startup_time;	/* "membalance_startup_time" in seconds */
 	int	xc_trim_unresponsive;	/* "membalance_trim_unresponsive" in seconds */
 	tribool	xc_trim_unmanaged;	/* "membalance_trim_unmanaged" yes/no/maybe */
+	long	xc_superpage_align;	/* "membalance_superpage_align" (in KBs) */
+	int	xc_priority;		/* "membalance_priority" */
 
 	/**********************************************************************
 	*                            Active settings 			      *
@@ -131,6 +258,10 @@ public:
 	int	startup_time;		/* in seconds */
 	int	trim_unresponsive;	/* in seconds */
 	bool	trim_unmanaged;		/* yes/no */
+	long	superpage_align;	/* in KBs, 0 if resize targets are not aligned */
+	int	priority;		/* SLA priority class, 100 is normal */
+	int	rc_priority;		/* set with rcmd_set_domain_settings, or -1;
+				   overrides config and lasts while domain is managed */
 	long	xen_data_size;		/* xen private data size (KBs),
 	                                   see explanation in sched.cpp */
 	u_int	xen_data_size_phase;	/* xen_data_size acquisition phase */
@@ -143,11 +274,14 @@ public:
 	u_long 	last_report_tick;	/* last time domain reported (sched tick#) */
 	long 	no_report_time;		/* aggregated time the domain did not provide
 					   a report (sec) while being runnable */
-	std::vector<rate_record>     	/* rate history data */
-		rate_history;
+	rate_ring rate_history;		/* rate history data */
+	rate_window fast_window;	/* moving average for @fast_rate */
+	rate_window slow_window;	/* moving average for @slow_rate */
 	long	time_rate_below_low;    /* time rate was <= @rate_low */
 	long	time_rate_below_high;   /* time rate was < @rate_high */
 	u_long 	last_expand_tick;	/* last time domain was expanded (sched tick#) */
+	time_t	last_resize_time;	/* last time resize was issued for domain, or 0 */
+	long	last_resize_size;	/* ... and its size (KBs) */
 
 	/*
 	 * If sched_freemem(...) shrinks this domain in between ticks to meet the
@@ -166,14 +300,24 @@ public:
 
 	const xc_domaininfo_t* xcinfo;	/* xenctrl-level info */
 	char*	report_raw;		/* raw domain report string */
+	unsigned int report_len;	/* size of @report_raw (bytes) */
 	bool	valid_data;		/* has valid rate etc. data for current tick to go on */
 	bool	valid_memory_data;	/* has valid memory sizing data for current tick */
 	bool	trimming_to_quota;	/* @true if currently trimming to @dmem_quota */
 	balside_t balside;		/* expanding, shrinking or staying neutral */
+	int	numa_node;		/* NUMA node domain is confined to, or -1 */
 	long 	rate;   		/* latest rate reading */
 	double	freepct;		/* latest guest free memory %-age reading */
+	bool	has_psi;		/* latest report included PSI data */
+	double	psi_some;		/* guest "some" memory stall %-age (avg10) */
+	double	psi_full;		/* guest "full" memory stall %-age (avg10) */
+	long	psi_some_us;		/* "some" stall time during report interval (usec) */
+	long	psi_full_us;		/* "full" stall time during report interval (usec) */
+	long	report_heartbeat;	/* heartbeat of change-only reporting (sec), or 0 */
 	long 	fast_rate;		/* fast moving average of rate */
 	long 	slow_rate;		/* slow moving average of rate */
+	long	pred_rate;		/* projected rate (PREDICT mode) */
+	double	pred_freepct;		/* projected freepct (PREDICT mode) */
 
 	/* memory amount (KBs) targeted by domain (less xen_data_size) */
 	long	memgoal0;    		/* ... at the start of the tick */
@@ -213,8 +357,18 @@ public:
 	/* called when domain is placed on managed domain list */
 	void on_enter_managed(void);
 
+	/* check if pending domain is due to be processed in this cycle */
+	bool pending_due(void);
+
+	/* check if pending domain data has yet to be read from xenstore */
+	bool pending_needs_xs(void);
+
+	/* read xenstore data for a set of pending domains */
+	static void bulk_read_pending_xs(const std::vector<domain_info*>& vdom,
+					 std::map<long, char>& xs_status);
+
 	/* process pending state (try to gather domain data) */
-	tribool process_pending(bool* p_is_dead);
+	tribool process_pending(bool* p_is_dead, char xs_status);
 
 	/* issue a message when was unable to collect data for the domain */
 	void pending_timeout_message(void);
@@ -223,10 +377,13 @@ public:
 	bool resolve_settings(void);
 
 	/*
-	 * check if the change old_config -> config affects
-	 * resolve_settings(...)
+	 * mask of config items (config_itemmask_xxx) whose change old_config -> config
+	 * can make unmanaged domains manageable
 	 */
-	static bool resolve_settings_affected(const membalance_config& old_config);
+	static unsigned long resolve_settings_affected(const membalance_config& old_config);
+
+	/* mask of config items resolve_settings(...) takes defaults from */
+	unsigned long resolve_settings_deps(void) const;
 
 	/* store generated qid */
 	void set_qid(const char* qid);
@@ -240,6 +397,18 @@ public:
 	/* calculate slow and fast moving averages of rate */
 	void calc_rates(unsigned long tick);
 
+	/* project guest free memory percentage forward (PREDICT mode) */
+	void predict_freepct(unsigned long tick, bool fresh);
+
+	/* re-project rates when readings of the previous tick are reused */
+	void reproject(unsigned long tick);
+
+	/* check if domain is in PREDICT mode */
+	bool is_predictive(void) const
+	{
+		return 0 != (ctrl_modes_allowed & CTRL_MODE_PREDICT);
+	}
+
 	/* re-evaluate xen_data_size */
 	void reeval_xen_data_size(long xen_free);
 
@@ -248,11 +417,14 @@ protected:
 	char process_pending_read_xs(void);
 	char eval_xen_data_size(void);
 	void retrieve_config_file_settings(void);
-	bool parse_config_file_settings(XLU_Config* config,
-					const char* config_source,
-					const map_ss& kv);
+	bool parse_config_file_settings(const xl_config_data* xd,
+					const char* config_source);
 	void undefined_setting(const char* key);
+	bool parse_text_report(void);
+	bool parse_binary_report(void);
 	double weight_samples(const double* weights, int nweights);
+	void eval_rates(unsigned long tick);
+	long predict_rate(unsigned long tick);
 
 private:
 	domain_info();
@@ -45,14 +45,19 @@ static void usage(int exitcode = EXIT_FAILURE)  __noreturn__;
 static void handle_cmdline_common_options(int* pargc, char*** pargv, bool* pdone);
 static void ivarg(const char* arg)  __noreturn__;
 static int cmd_list(int argc, char** argv);
+static int list_snapshot(void);
+static char dom_rate_code(const status_page_domain& d, long rate);
+static char dom_size_code(const status_page_domain& d, long size);
 static int cmd_pause(int argc, char** argv);
 static int cmd_resume(int argc, char** argv);
 static int cmd_free_memory(int argc, char** argv);
 static int cmd_dump_debug(int argc, char** argv);
 static int cmd_show_debug(int argc, char** argv);
+static int cmd_show_stats(int argc, char** argv);
 static int cmd_log_level(int argc, char** argv);
 static int cmd_log_sink(int argc, char** argv);
 static int cmd_manage_domain(int argc, char** argv);
+static int cmd_pressure_aggregate(int argc, char** argv);
 static int cmd_pause_sig(int argc, char** argv);
 static int cmd_resume_sig(int argc, char** argv);
 static int cmd_test(int argc, char** argv);
@@ -68,6 +73,8 @@ static const char* decode_sink(int sink);
 static unsigned long get_domain_id(const char* cp);
 static bool is_achieved(long needed_mem, bool above_slack, const rcmd_freemem_res& res);
 static void show_free(const char* msg, bool above_slack, const rcmd_freemem_res& res);
+static int do_free_memory_plan(long needed_mem, bool above_slack, bool use_reserved_hard);
+static void show_kbs(const char* msg, u_quad_t kbs);
 static long fetch_domain_config_needed_memory(const char* config_file);
 
 
@@ -81,6 +88,8 @@ static void show_usage()
 	fprintf(fp, "Usage:\n");
 	fprintf(fp, "\n");
 	fprintf(fp, "    list                 display domains and memory status\n");
+	fprintf(fp, "        [--snapshot]     read status published by the daemon at last tick,\n");
+	fprintf(fp, "                         ... without making a request to the daemon\n");
 	fprintf(fp, "\n");
 	fprintf(fp, "    pause                suspend automatic domain memory balancing\n");
 	fprintf(fp, "        [--quiet]        do not print pause level\n");
@@ -96,6 +105,8 @@ static void show_usage()
 	fprintf(fp, "        [--use-reserved-hard]   draw on host_reserved_hard if necessary\n");
 	fprintf(fp, "        [--must]         terminate with failure status if could not ...\n");
 	fprintf(fp, "                         ... allocate the full requested amount\n");
+	fprintf(fp, "        [--dry-run]      only show what could be freed and how, ...\n");
+	fprintf(fp, "                         ... without shrinking domains (no pause needed)\n");
 	fprintf(fp, "\n");
 	fprintf(fp, "    manage-domain <id>   request to manage domain that was in unmanaged state\n");
 	fprintf(fp, "    manage-domain --all  request to manage all currently unmanaged domains\n");
@@ -104,6 +115,16 @@ static void show_usage()
 	fprintf(fp, "    log-sink [which]     set logging sink to \"syslog\" or \"logfile\"\n");
 	fprintf(fp, "    dump-debug           dump daemon internal state to %s\n", membalanced_log_path);
 	fprintf(fp, "    show-debug           dump daemon internal state to stdout\n");
+	fprintf(fp, "    show-stats           show daemon latency statistics and counters\n");
+	fprintf(fp, "\n");
+	fprintf(fp, "    pressure-aggregate   rank hosts by memory pressure published by their ...\n");
+	fprintf(fp, "                         ... daemons and suggest domain migrations\n");
+	fprintf(fp, "        [--listen udp:[addr:]port]   receive summaries (addr can be multicast)\n");
+	fprintf(fp, "        [--file <path>]  read summary from file (can be repeated)\n");
+	fprintf(fp, "        [--interval <sec>]   report interval (default: 10)\n");
+	fprintf(fp, "        [--persist <n>]  suggest moving domains off host short of memory ...\n");
+	fprintf(fp, "                         ... for at least n ticks (default: 3)\n");
+	fprintf(fp, "        [--once]         report once and exit\n");
 #ifdef DEVEL
 	fprintf(fp, "\n");
 	fprintf(fp, "    test <id> [args...]  execute development-time test\n");
@@ -169,12 +190,16 @@ int do_main_membalancectl(int argc, char** argv)
 		 rc = cmd_dump_debug(argc, argv);
 	else if (streq(verb, "show-debug"))
 		 rc = cmd_show_debug(argc, argv);
+	else if (streq(verb, "show-stats"))
+		 rc = cmd_show_stats(argc, argv);
 	else if (streq(verb, "log-level"))
 		rc = cmd_log_level(argc, argv);
 	else if (streq(verb, "log-sink"))
 		rc = cmd_log_sink(argc, argv);
 	else if (streq(verb, "manage-domain"))
 		rc = cmd_manage_domain(argc, argv);
+	else if (streq(verb, "pressure-aggregate"))
+		rc = cmd_pressure_aggregate(argc, argv);
 #ifdef DEVEL
 	else if (streq(verb, "test"))
 		rc = cmd_test(argc, argv);
@@ -290,6 +315,9 @@ static void ivarg(const char* arg)  /* __noreturn__ */
  */
 static int cmd_list(int argc, char** argv)
 {
+	if (argc == 1 && streq(argv[0], "--snapshot"))
+		return list_snapshot();
+
 	if (argc)
 		usage();
 
@@ -312,6 +340,158 @@ cleanup:
 					 : EXIT_FAILURE;
 }
 
+/*
+ * "List --snapshot": display the status page published by the daemon.
+ * Works even if the daemon is busy, and does not disturb it.
+ */
+static int list_snapshot(void)
+{
+	status_page_hdr hdr;
+	std::vector<status_page_domain> domains;
+	char* message = NULL;
+	unsigned k, nunmanaged;
+	struct tm tm;
+	time_t t;
+	char tms[64];
+	long free_kbs;
+
+	if (!status_page_read(status_page_path, &hdr, domains, &message))
+	{
+		fprintf(stderr, "%s: %s\n", progname, message);
+		free_ptr(message);
+		return EXIT_FAILURE;
+	}
+
+	t = (time_t) hdr.update_time;
+	localtime_r(&t, &tm);
+	strftime(tms, countof(tms), "%F %T", &tm);
+
+	printf("Status of membalanced as of %s (tick %lld)\n", tms, (long long) hdr.tick);
+	if (kill(hdr.daemon_pid, 0) && errno == ESRCH)
+		printf("Warning: daemon (pid %d) is not running, status is outdated\n", (int) hdr.daemon_pid);
+	printf("\n");
+
+	printf("Domain adjustment is ");
+	if (hdr.pause_level)
+		printf("paused (depth %u)\n", (unsigned) hdr.pause_level);
+	else
+		printf("enabled\n");
+	printf("Memory balancing interval: %lld sec\n", (long long) hdr.interval);
+	printf("\n");
+
+	printf("host_reserved_hard:  %s (MB.KB)\n", decode_memsize(hdr.host_reserved_hard));
+	printf("host_reserved_soft:  %s (MB.KB)\n", decode_memsize(hdr.host_reserved_soft));
+	if (hdr.freemem_lien)
+		printf("set aside for free-memory requests: %s (MB.KB)\n", decode_memsize(hdr.freemem_lien));
+	printf("\n");
+
+	free_kbs = hdr.xen_free - hdr.xen_free_slack;
+	std::string xen_free_slack_str = decode_memsize(hdr.xen_free_slack);
+	printf("Free memory:   %s%s (MB.KB) + Xen free memory slack of %s (MB.KB)\n",
+	       free_kbs < 0 ? "(-) " : "", decode_memsize(labs(free_kbs)),
+	       xen_free_slack_str.c_str());
+	if (hdr.host_lien)
+		printf("Outstanding lien: %s (MB.KB)\n", decode_memsize(hdr.host_lien));
+	printf("\n");
+
+	if (hdr.nmanaged == 0)
+	{
+		printf("Managed domains: none\n\n");
+	}
+	else
+	{
+		printf("Managed domains:\n\n");
+		printf("                                                      size         rate       rate  trend\n");
+		printf("    ID                    name                      (MB.KB)     (MB.KB/sec)   (MB.KB/sec)\n");
+		printf("  ----- ---------------------------------------- ------------- ------------- -------------\n");
+	}
+
+	for (k = 0;  k < domains.size();  k++)
+	{
+		const status_page_domain& d = domains[k];
+		if (d.state != 'M')
+			continue;
+
+		printf("  %5d %-40s ", (int) d.domain_id, d.name);
+
+		if (d.flags & STATUS_DOM_VALID_MEMORY)
+			printf("%11s %c ", decode_memsize(d.memsize), dom_size_code(d, d.memsize));
+		else
+			printf("%11s %c ", "", ' ');
+
+		if (d.flags & STATUS_DOM_VALID_RATE)
+		{
+			printf("%11s %c ", decode_memsize(d.rate), dom_rate_code(d, d.rate));
+			printf("%11s %c", decode_memsize(d.slow_rate), dom_rate_code(d, d.slow_rate));
+		}
+
+		printf("\n");
+	}
+	if (hdr.nmanaged)
+		printf("\n");
+
+	if (hdr.npending == 0)
+	{
+		printf("Pending domains: none\n\n");
+	}
+	else
+	{
+		printf("Pending domains:\n\n");
+		printf("    ID                    name\n");
+		printf("  ----- ----------------------------------------\n");
+		for (k = 0;  k < domains.size();  k++)
+		{
+			if (domains[k].state == 'P')
+				printf("  %5d %-40s\n", (int) domains[k].domain_id, domains[k].name);
+		}
+		printf("\n");
+	}
+
+	nunmanaged = domains.size() - hdr.nmanaged - hdr.npending;
+	if (nunmanaged == 0)
+	{
+		printf("Unmanaged domains: none\n");
+	}
+	else if (nunmanaged == 1 && domains.back().domain_id == 0)
+	{
+		printf("Unmanaged domains: only Dom0\n");
+	}
+	else
+	{
+		printf("Unmanaged domains:\n\n");
+		printf("    ID\n");
+		printf("  -----\n");
+		for (k = 0;  k < domains.size();  k++)
+		{
+			if (domains[k].state == 'U')
+				printf("  %5d\n", (int) domains[k].domain_id);
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* same categories as in daemon's status display */
+static char dom_rate_code(const status_page_domain& d, long rate)
+{
+	if (rate >= d.rate_high)
+		return 'H';
+	else if (rate <= d.rate_low)
+		return 'L';
+	else
+		return ' ';
+}
+
+static char dom_size_code(const status_page_domain& d, long size)
+{
+	if (size > d.dmem_quota)
+		return 'H';
+	else if (size <= d.dmem_min)
+		return 'L';
+	else
+		return ' ';
+}
+
 
 /******************************************************************************
 *                            pause/resume commands                            *
@@ -411,6 +591,7 @@ static int cmd_free_memory(int argc, char** argv)
 	bool above_slack = false;
 	bool must = false;
 	bool use_reserved_hard = false;
+	bool dry_run = false;
 	const char* amount_str = NULL;
 	const char* config_file = NULL;
 	long needed_mem;
@@ -435,6 +616,10 @@ static int cmd_free_memory(int argc, char** argv)
 		{
 			use_reserved_hard = true;
 		}
+		else if (streq(argv[k], "--dry-run"))
+		{
+			dry_run = true;
+		}
 		else if (streq(argv[k], "--config"))
 		{
 			if (config_file || k == argc - 1)
@@ -472,6 +657,9 @@ static int cmd_free_memory(int argc, char** argv)
 		return EXIT_FAILURE;
 	}
 
+	if (dry_run)
+		return do_free_memory_plan(needed_mem, above_slack, use_reserved_hard);
+
 	/*
 	 * Invoke membalance daemon
 	 */
@@ -566,6 +754,75 @@ static void show_free(const char* msg, bool above_slack, const rcmd_freemem_res&
 		        avail / 1024, avail % 1024);
 }
 
+/*
+ * "free-memory --dry-run": show what the request could achieve
+ */
+static int do_free_memory_plan(long needed_mem, bool above_slack, bool use_reserved_hard)
+{
+	rcmd_freemem_plan_res res;
+	zap(res);
+	u_int k;
+
+	create_rpc_client();
+	enum clnt_stat rpc_status = rcmd_freemem_plan_1((u_quad_t) needed_mem,
+							above_slack,
+							use_reserved_hard,
+							&res,
+							clnt);
+	CHECK(rpc_status == RPC_SUCCESS);
+
+	printf("Free memory now:\n");
+	show_kbs("  keeping host_reserved_hard", res.keep_reserved_hard.free_with_slack);
+	show_kbs("  ... less slack", res.keep_reserved_hard.free_less_slack);
+	show_kbs("  drawing on host_reserved_hard", res.use_reserved_hard.free_with_slack);
+	show_kbs("  ... less slack", res.use_reserved_hard.free_less_slack);
+
+	printf("Maximum freeable memory:\n");
+	show_kbs("  keeping host_reserved_hard", res.keep_reserved_hard.max_with_slack);
+	show_kbs("  ... less slack", res.keep_reserved_hard.max_less_slack);
+	show_kbs("  drawing on host_reserved_hard", res.use_reserved_hard.max_with_slack);
+	show_kbs("  ... less slack", res.use_reserved_hard.max_less_slack);
+
+	printf("Requested amount is %sattainable\n", res.status == 'A' ? "" : "not ");
+	show_kbs("  free memory after the request", above_slack ? res.freemem_less_slack
+								 : res.freemem_with_slack);
+	show_kbs("  to be reclaimed from domains", res.reclaim);
+
+	if (res.est_ms >= 0)
+		printf("  estimated time to reclaim: %d.%03d sec\n", res.est_ms / 1000, res.est_ms % 1000);
+	else if (res.reclaim)
+		printf("  estimated time to reclaim: not known yet\n");
+
+	if (res.donors.donors_len)
+	{
+		printf("Domains to be shrunk:\n");
+		for (k = 0;  k < res.donors.donors_len;  k++)
+		{
+			const rcmd_freemem_donor& d = res.donors.donors_val[k];
+			printf("  %5lu  %s -> ", (unsigned long) d.domain_id, decode_memsize((long) d.memsize));
+			printf("%s (MB.KB)\n", decode_memsize((long) d.target));
+		}
+	}
+
+cleanup:
+
+	if (rpc_status != RPC_SUCCESS)
+		clnt_perror(clnt, rpc_call_error_msg);
+
+	/* deallocate results */
+	xdr_free((xdrproc_t) xdr_rcmd_freemem_plan_res, (caddr_t) &res);
+
+	return (rpc_status == RPC_SUCCESS && res.status == 'A') ? EXIT_SUCCESS
+								: EXIT_FAILURE;
+}
+
+static void show_kbs(const char* msg, u_quad_t kbs)
+{
+	printf("%s: %lu kbs = %lu mb + %lu kb\n",
+	       msg, (unsigned long) kbs,
+	       (unsigned long) kbs / 1024, (unsigned long) kbs % 1024);
+}
+
 /*
  * Parse Xen domain configuration file @config_file and determine
  * how much memory it requires to start the domain
@@ -702,6 +959,71 @@ cleanup:
 					 : EXIT_FAILURE;
 }
 
+/*
+ * "Show-stats" command handler.
+ * With --verbose, also list histogram buckets.
+ */
+static int cmd_show_stats(int argc, char** argv)
+{
+	rcmd_stats_res res;
+	const rcmd_histogram* h;
+	const rcmd_hist_bucket* b;
+	u_int k, j;
+
+	if (argc)
+		usage();
+
+	zap(res);
+
+	create_rpc_client();
+
+	enum clnt_stat rpc_status = rcmd_get_stats_1(&res, clnt);
+	CHECK(rpc_status == RPC_SUCCESS);
+
+	printf("%-22s %10s %10s %10s %10s %10s %10s\n",
+	       "latency (usec)", "count", "p50", "p90", "p99", "max", "mean");
+
+	for (k = 0;  k < res.histograms.histograms_len;  k++)
+	{
+		h = &res.histograms.histograms_val[k];
+		printf("%-22s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+		       h->name, (unsigned long long) h->count,
+		       (double) h->p50_ns / NSEC_PER_USEC,
+		       (double) h->p90_ns / NSEC_PER_USEC,
+		       (double) h->p99_ns / NSEC_PER_USEC,
+		       (double) h->max_ns / NSEC_PER_USEC,
+		       h->count ? (double) h->sum_ns / h->count / NSEC_PER_USEC : 0.0);
+
+		for (j = 0;  verbose && j < h->buckets.buckets_len;  j++)
+		{
+			b = &h->buckets.buckets_val[j];
+			printf("    >= %12.1f  %llu\n",
+			       (double) b->low_ns / NSEC_PER_USEC,
+			       (unsigned long long) b->count);
+		}
+	}
+
+	printf("\n");
+
+	for (k = 0;  k < res.counters.counters_len;  k++)
+	{
+		printf("%-22s %10llu\n",
+		       res.counters.counters_val[k].name,
+		       (unsigned long long) res.counters.counters_val[k].value);
+	}
+
+cleanup:
+
+	if (rpc_status != RPC_SUCCESS)
+		clnt_perror(clnt, rpc_call_error_msg);
+
+	/* deallocate results */
+	xdr_free((xdrproc_t) xdr_rcmd_stats_res, (caddr_t) &res);
+
+	return rpc_status == RPC_SUCCESS ? EXIT_SUCCESS
+					 : EXIT_FAILURE;
+}
+
 /*
  * "Log-level" command handler
  */
@@ -867,6 +1189,59 @@ cleanup:
 }
 
 
+/******************************************************************************
+*                            cross-host commands                              *
+******************************************************************************/
+
+/*
+ * "Pressure-aggregate" command handler.
+ * Does not interact with the local daemon.
+ */
+static int cmd_pressure_aggregate(int argc, char** argv)
+{
+	const char* listen_spec = NULL;
+	std::vector<std::string> files;
+	int interval = 10;
+	int persist = 3;
+	bool once = false;
+
+	for (int k = 0;  k < argc;  k++)
+	{
+		if (streq(argv[k], "--listen") && k != argc - 1)
+		{
+			listen_spec = argv[++k];
+		}
+		else if (streq(argv[k], "--file") && k != argc - 1)
+		{
+			files.push_back(argv[++k]);
+		}
+		else if (streq(argv[k], "--interval") && k != argc - 1)
+		{
+			if (!a2int(argv[++k], &interval) || interval < 1)
+				ivarg(argv[k]);
+		}
+		else if (streq(argv[k], "--persist") && k != argc - 1)
+		{
+			if (!a2int(argv[++k], &persist) || persist < 1)
+				ivarg(argv[k]);
+		}
+		else if (streq(argv[k], "--once"))
+		{
+			once = true;
+		}
+		else
+		{
+			usage();
+		}
+	}
+
+	if (!listen_spec && files.empty())
+		usage();
+
+	return pressure_aggregate(listen_spec, files, interval, persist, once);
+}
+
+
 /******************************************************************************
 *                                execute a test                               *
 ******************************************************************************/
@@ -34,6 +34,14 @@ static long page_size;		  	  /* system page size */
 static bool resuming_memsched = false;    /* resuming to call memsched,
                                              possibly after a long sleep */
 
+static bool use_trace = false;		  /* record trace to @membalanced_trace_path */
+static long trace_size_mb = 64;		  /* ... of this size (MB) */
+
+static const char* pressure_sink = NULL;  /* publish pressure summaries to */
+
+static char** bench_argv = NULL;          /* run scheduler benchmark with ... */
+static int bench_argc = 0;                /* ... these arguments */
+
 /******************************************************************************
 *                           forward declarations                              *
 ******************************************************************************/
@@ -66,6 +74,12 @@ static void usage(int exitcode)
 	fprintf(fp, "    --debug-level <n>    set debug level\n");
 	fprintf(fp, "    --log                instead of syslog, log to %s\n", membalanced_log_path);
 	fprintf(fp, "    --no-log-timestamps  do not prefix log records with timestamps\n");
+	fprintf(fp, "    --trace              record scheduler trace to %s\n", membalanced_trace_path);
+	fprintf(fp, "    --trace-size <mb>    size of trace file (default: %ld MB)\n", trace_size_mb);
+	fprintf(fp, "    --pressure-sink <s>  publish host memory pressure summaries to ...\n");
+	fprintf(fp, "                         ... udp:<host>:<port> or file:<path>\n");
+	if (IF_DEVEL_ELSE(true, false))
+		fprintf(fp, "    --bench [args...]    run scheduler benchmark on simulated domains\n");
 	exit(exitcode);
 }
 
@@ -165,7 +179,8 @@ static int do_main_membalanced(int argc, char** argv)
 {
 	sigset_t sigmask;
 	struct pollfd* pollfds = NULL;
-	int npollfds, nrpcs, npollfds_alloc = 0;
+	int npollfds, nrpcs, nmetrics, npollfds_alloc = 0;
+	int poll_ms;
 	int k;
 	int64_t wait_ms = 0;
 	bool wait_ms_valid = false;
@@ -181,6 +196,10 @@ static int do_main_membalanced(int argc, char** argv)
 	/* parse arguments */
 	handle_cmdline(argc, argv);
 
+	/* development build: run scheduler benchmark instead of the daemon */
+	if (bench_argv)
+		return execute_bench(bench_argc, bench_argv);
+
 	load_configuration();
 
 	if (run_as_daemon)
@@ -203,6 +222,12 @@ static int do_main_membalanced(int argc, char** argv)
         if (sigprocmask(SIG_BLOCK, &sigmask, NULL) < 0)
 		fatal_perror("sigprocmask");
 
+	/*
+	 * RPC client may go away before its deferred reply is sent,
+	 * let the write fail with EPIPE rather than kill the daemon
+	 */
+	signal(SIGPIPE, SIG_IGN);
+
 	/*
 	 * Receive signals on file descriptors
 	 */
@@ -251,6 +276,14 @@ static int do_main_membalanced(int argc, char** argv)
 		fatal_msg("system page size (%ld) is not multiple of 1024", page_size);
 	memquant_kbs = pagesize_kbs = page_size / 1024;
 
+	/* start recording scheduler trace */
+	if (use_trace && !trace_open(membalanced_trace_path, trace_size_mb))
+		fatal_msg("unable to start trace");
+
+	/* start publishing memory pressure summaries */
+	if (pressure_sink && !pressure_sink_open(pressure_sink))
+		fatal_msg("unable to set up pressure sink");
+
 	/* initial allocation of poll descriptors */
 	realloc_pollfds(&pollfds, &npollfds_alloc, NPFD_COUNT + 10);
 
@@ -279,15 +312,23 @@ static int do_main_membalanced(int argc, char** argv)
 	/* start built-in RPC server for daemon management requests */
 	start_rcmd_server();
 
+	/* start serving metrics, if configured */
+	start_metrics_server();
+
 	/* resresh membalance per-domain xenstore strucutres, and sync up doms.qid */
 	resync_qid();
 
+	/* pick up domain state saved by previous instance */
+	state_file_load();
+
 	/* initial scan of all local domains */
 	enumerate_local_domains_as_pending();
 	process_pending_domains();
+	status_page_update();
 
 	/* establish initial reference time points  */
 	ts0_pending = ts0_sched = getnow();
+	update_membalance_tick(ts0_sched);
 
 	/*
 	 * Main loop. Perform:
@@ -297,10 +338,16 @@ static int do_main_membalanced(int argc, char** argv)
 	 *     - handle signals (SIGTERM - exit, SIGHUP - reload config,
 	 *                       SIGUSR1 - debug, SIG_CTRL - pause/resume)
 	 *     - xenstore watch events (domain created/destroyed/changed)
+	 *     - pressure alarms raised by domains (out of tick expansion)
 	 *     - RPC requests to manage the daemon
+	 *     - metrics requests
 	 */
 	for (;;)
 	{
+		/* expand domains that raised pressure alarm */
+		if (pressure_alarms_pending)
+			sched_pressure_alarms();
+
 		/* calculate sleep time till next processing point */
 		if (!wait_ms_valid)
 			wait_ms = calc_wait_ms(ts0_sched, ts0_pending);
@@ -313,13 +360,20 @@ static int do_main_membalanced(int argc, char** argv)
 			for (k = 0;  k < NPFD_COUNT;  k++)
 				pollfds[k].revents = 0;
 
-			/* include RPC server handles */
+			/* include RPC and metrics server handles */
 			npollfds = NPFD_COUNT;
 			nrpcs = rcmd_get_npollfds();
-			realloc_pollfds(&pollfds, &npollfds_alloc, npollfds + nrpcs);
+			nmetrics = metrics_get_npollfds();
+			realloc_pollfds(&pollfds, &npollfds_alloc, npollfds + nrpcs + nmetrics);
 			rcmd_setup_pollfds(pollfds + npollfds);
+			metrics_setup_pollfds(pollfds + npollfds + nrpcs);
+
+			/* wake up in time to advance deferred RPC requests */
+			poll_ms = rcmd_deferred_wait_ms();
+			if (poll_ms < 0 || poll_ms > wait_ms)
+				poll_ms = wait_ms;
 
-			if (poll(pollfds, npollfds + nrpcs, wait_ms) < 0)
+			if (poll(pollfds, npollfds + nrpcs + nmetrics, poll_ms) < 0)
 			{
 				if (errno == EINTR)
 					continue;
@@ -337,6 +391,9 @@ static int do_main_membalanced(int argc, char** argv)
 
 			if (rcmd_handle_pollfds(pollfds + npollfds))
 				recheck_time = true;
+
+			if (metrics_handle_pollfds(pollfds + npollfds + nrpcs))
+				recheck_time = true;
 		}
 
 		/* if still too far away from scheduled processing, go sleep again */
@@ -359,6 +416,7 @@ static int do_main_membalanced(int argc, char** argv)
 		    1 * MSEC_PER_SEC - config.tolerance_ms)
 		{
 			process_pending_domains();
+			status_page_update();
 			ts0_pending = now = getnow();
 		}
 
@@ -372,7 +430,23 @@ static int do_main_membalanced(int argc, char** argv)
 			if (resuming_memsched)
 				sched_slept(timespec_diff_ms(now, ts0_sched));
 			sched_memory();
-			ts0_sched = getnow();
+			status_page_update();
+			state_file_update();
+			pressure_publish();
+
+			/*
+			 * Keep ticks on a fixed grid, so their phase published
+			 * to guests stays valid. Start a new grid on resumption
+			 * or if fell behind by a whole interval.
+			 */
+			ts0_sched.tv_sec += config.interval;
+			now = getnow();
+			if (resuming_memsched ||
+			    timespec_diff_ms(now, ts0_sched) >= config.interval * MSEC_PER_SEC)
+			{
+				ts0_sched = now;
+			}
+			update_membalance_tick(ts0_sched);
 			resuming_memsched = false;
 		}
 	}
@@ -399,11 +473,26 @@ void on_add_managed(void)
  */
 static void shutdown(void)
 {
+	/* save domain state for the next instance */
+	state_file_save();
+
 	/* close connection to xenstore */
 	shutdown_xs();
 
 	/* stop built-in RPC server */
 	stop_rcmd_server();
+
+	/* stop metrics server */
+	stop_metrics_server();
+
+	/* flush and close trace file */
+	trace_close();
+
+	/* remove status page */
+	status_page_close();
+
+	/* stop publishing pressure summaries */
+	pressure_sink_close();
 }
 
 /*
@@ -480,6 +569,32 @@ static void handle_cmdline(int argc, char** argv)
 		{
 			log_timestamps = false;
 		}
+		else if (streq(argv[k], "--trace"))
+		{
+			use_trace = true;
+		}
+		else if (streq(argv[k], "--trace-size"))
+		{
+			if (k == argc - 1)
+				ivarg(argv[k]);
+			cp = argv[++k];
+			if (!a2long(cp, &lv) || lv < 1 || lv > 4096)
+				ivarg(cp);
+			trace_size_mb = lv;
+		}
+		else if (streq(argv[k], "--pressure-sink"))
+		{
+			if (k == argc - 1)
+				ivarg(argv[k]);
+			pressure_sink = argv[++k];
+		}
+		else if (streq(argv[k], "--bench"))
+		{
+			/* the rest of arguments are for the benchmark */
+			bench_argv = argv + k + 1;
+			bench_argc = argc - k - 1;
+			break;
+		}
 		else
 		{
 			ivarg(argv[k]);
@@ -694,10 +809,18 @@ void refresh_xs(void)
 	pollfd.fd = xs_fileno(xs);
 	pollfd.events = POLLIN|POLLPRI;
 
-	DO_RESTARTABLE(rc, poll(&pollfd, 1, 0));
+	/*
+	 * drain all pending events, with @report_watch there can be many
+	 * of them queued up
+	 */
+	for (;;)
+	{
+		pollfd.revents = 0;
+		DO_RESTARTABLE(rc, poll(&pollfd, 1, 0));
 
-	if (pollfd.revents & (POLLIN|POLLPRI))
-		handle_xs_watch();
+		if (!(pollfd.revents & (POLLIN|POLLPRI)) || !handle_xs_watch())
+			break;
+	}
 }
 
 /* pause memory adjustment */
@@ -988,6 +1111,8 @@ void show_debugging_info(FILE* fp)
 	fprintf(fp, "rate_zero:               %lu KB/s\n", config.rate_zero);
 	fprintf(fp, "dmem_incr:               %g%%\n", config.dmem_incr * 100.0);
 	fprintf(fp, "dmem_decr:               %g%%\n", config.dmem_decr * 100.0);
+	fprintf(fp, "superpage_align:         %ld KB\n", config.superpage_align);
+	fprintf(fp, "priority:                %d\n", config.priority);
 	fprintf(fp, "guest_free_threshold:    %g%%\n", config.guest_free_threshold * 100.0);
 	fprintf(fp, "startup_time:            %d sec\n", config.startup_time);
 	fprintf(fp, "trim_unresponsive:       %d sec\n", config.trim_unresponsive);
@@ -157,6 +157,12 @@ using namespace std;
 /* nanoseconds in a millsecond */
 #define NSEC_PER_MSEC  (1000 * 1000)
 
+/* nanoseconds in a microsecond */
+#define NSEC_PER_USEC  1000
+
+/* nanoseconds in a second */
+#define NSEC_PER_SEC  (1000 * 1000 * 1000)
+
 /*
  * execute operation as restartable after a signal
  *
@@ -187,6 +193,18 @@ typedef enum __XsTransactionStatus
 }
 XsTransactionStatus;
 
+/* stages of sched_memory(...), for timing statistics */
+typedef enum __sched_stage
+{
+	SCHED_STAGE_COLLECT = 0,	/* stage_collect_data */
+	SCHED_STAGE_RESERVED_HARD,	/* sched_reserved_hard */
+	SCHED_STAGE_RESERVED_SOFT,	/* sched_reserved_soft */
+	SCHED_STAGE_REBALANCE,		/* sched_rebalance */
+	SCHED_STAGE_RESIZE,		/* do_resize_domains */
+	SCHED_STAGE_COUNT
+}
+sched_stage_t;
+
 #ifndef __MAP_SS_DEFINED__
   #define __MAP_SS_DEFINED__
   typedef std::map<std::string, std::string> map_ss;
@@ -309,6 +327,12 @@ void stop_rcmd_server(void);
 int rcmd_get_npollfds(void);
 void rcmd_setup_pollfds(struct pollfd* pollfds);
 bool rcmd_handle_pollfds(struct pollfd* pollfds);
+int rcmd_deferred_wait_ms(void);
+void start_metrics_server(void);
+void stop_metrics_server(void);
+int metrics_get_npollfds(void);
+void metrics_setup_pollfds(struct pollfd* pollfds);
+bool metrics_handle_pollfds(struct pollfd* pollfds);
 void begin_xs(void);
 void abort_xs(void);
 XsTransactionStatus commit_xs(int* p_nretries);
@@ -317,7 +341,7 @@ void begin_singleop_xs(void);
 XsTransactionStatus commit_singleop_xs(int* p_nretries);
 void abort_singleop_xs(void);
 void refresh_xs(void);
-void handle_xs_watch(void);
+bool handle_xs_watch(void);
 void handle_xs_watch_event(long domain_id, const char* subpath);
 void initialize_xs(struct pollfd* pollfds);
 void initialize_xl(void);
@@ -339,13 +363,24 @@ void rescan_domains_on_config_change(const membalance_config& old_config);
 int rescan_domain(long domain_id, char** message);
 void update_membalance_interval_and_protection(void);
 void update_membalance_interval(void);
-bool init_membalance_report(long domain_id);
+void update_membalance_tick(const struct timespec& ts0);
+void init_membalance_reports(const domid_set& ids, domid_set& failed);
+void watch_membalance_report(domain_info* dom);
+void unwatch_membalance_report(domain_info* dom);
+void update_membalance_report_watches(void);
+void watch_membalance_alarm(domain_info* dom);
+void unwatch_membalance_alarm(domain_info* dom);
+void update_membalance_alarm_watches(void);
+bool request_prepare_shrink(domain_info* dom, u_long seq, long kbs);
+bool prepare_shrink_done(domain_info* dom, u_long seq, long* p_reclaimed);
 tribool read_value_from_xs(domain_info* dom, const char* subpath, long* p_value, long minval);
 tribool read_value_from_xs(domain_info* dom, const char* subpath, char** p_value);
 int get_domain_settings(long domain_id, char** message, map_ss& kv);
+int set_domain_settings(long domain_id, const map_ss& in, char** message, map_ss& kv);
 void show_domains(FILE* fp);
 void sched_memory(void);
 void sched_slept(int64_t ms);
+void sched_pressure_alarms(void);
 int sched_freemem(u_quad_t amt,
 		  bool above_slack,
 		  bool draw_reserved_hard,
@@ -353,7 +388,15 @@ int sched_freemem(u_quad_t amt,
 		  int timeout,
 		  u_quad_t* p_freemem_with_slack,
 		  u_quad_t* p_freemem_less_slack);
+void sched_freemem_plan(u_quad_t amt,
+			bool above_slack,
+			bool draw_reserved_hard,
+			freemem_projection& proj);
 void collect_domain_memory_info(void);
+void note_memory_target(domain_info* dom, long size);
+void forget_domain_lien(long domain_id);
+long freemem_lien_amount(void);
+void release_freemem_liens(void);
 void read_siginfo(int fd, struct signalfd_siginfo* fdsi);
 u_int pause_memsched(void);
 u_int resume_memsched(bool force);
@@ -372,6 +415,8 @@ bool parse_pct(const char* dbname, const char* key, const char* svalue,
 	       double* pvalue);
 bool parse_pct(const char* dbname, const char* key, const char* svalue,
 	       double* pvalue, double vmin, double vmax);
+bool parse_int(const char* dbname, const char* key, const char* svalue,
+	       int* pvalue, int vmin, int vmax);
 bool parse_sec(const char* dbname, const char* key, const char* svalue,
 	       int* pvalue);
 bool parse_bool(const char* dbname, const char* key, const char* svalue,
@@ -386,17 +431,24 @@ bool trim_to_quota(domain_info* dom);
 void do_expand_domain(domain_info* dom, long size);
 void do_shrink_domain(domain_info* dom, long size);
 void do_resize_domain(domain_info* dom, long size, char action = 0);
-long xen_wait_free_memory(long free_target, int timeout_ms);
+long xen_wait_free_memory(long free_target, int timeout_ms,
+			  const resize_batch* shrinks = NULL);
 long get_xen_free_memory(void);
 long get_xen_free_slack(void);
 long get_xen_physical_memory(void);
+bool get_xen_numa_memory(std::vector<long>& node_free, std::vector<long>& node_size);
+bool get_xen_domain_info(long domain_id, xc_domaininfo_t* info);
+int get_xen_domain_node(long domain_id);
 long get_xen_dom0_minsize(void);
 long get_xen_dom0_target(void);
 long get_xen_dom_target(long domain_id);
+void get_xen_dom_targets(const resize_batch& batch, std::vector<long>& targets);
 long xen_wait_free_memory_stable(int timeout_ms);
 long xen_domain_uptime(long domain_id);
 bool is_runnable(const xc_domaininfo_t* xcinfo);
 bool is_runnable(domain_info* dom);
+unsigned long get_sched_tick(void);
+void set_sched_tick(unsigned long tick);
 char* show_status(int verbosity);
 const char* decode_memsize(long kbs);
 
@@ -439,6 +491,12 @@ EXTERN const char* membalanced_interlock_path INIT(MEMBALANCE_DIR_PATH "/membala
 /* Socket for daemon management connection */
 EXTERN const char* socket_path INIT(MEMBALANCE_DIR_PATH "/membalanced.socket");
 
+/* Shared memory status page, see status_page.h */
+EXTERN const char* status_page_path INIT(MEMBALANCE_DIR_PATH "/membalanced.status");
+
+/* Domain state kept across daemon restarts, see state_file.h */
+EXTERN const char* state_file_path INIT(MEMBALANCE_DIR_PATH "/membalanced.state");
+
 #ifdef DEVEL
   /* When not zero, membalanced runs in test mode */
   EXTERN int testmode INIT (0);
@@ -468,11 +526,30 @@ EXTERN bool update_interval_in_xs INIT(true);  /* update interval key in xenstor
 
 EXTERN u_int memsched_pause_level INIT(0);     /* suspend memory scheduling when not 0 */
 
+EXTERN bool pressure_alarms_pending INIT(false);  /* some domains raised pressure alarm */
+
+/* duration of sched_memory(...) stages in the latest tick (nsec), -1 if not run */
+EXTERN int64_t sched_stage_ns[SCHED_STAGE_COUNT];
+
+EXTERN bool tracing INIT(false);	/* recording scheduler trace (see trace.cpp) */
+
 EXTERN u_long memquant_kbs;       	/* Xen memory allocation quant in kbs */
 EXTERN u_long pagesize_kbs;       	/* Xen page size in kbs */
 
 EXTERN long xen_free_slack;		/* Xen free memory slack (in kbs) */
 
+/* host memory state as of the latest completed sched_memory(...) tick */
+EXTERN struct __sched_host_state
+{
+	time_t	time;		/* when the tick completed, 0 if none yet */
+	long	xen_free;	/* Xen free memory (KBs) */
+	long	slack;		/* Xen free memory slack (KBs) */
+	long	lien;		/* outstanding memory lien (KBs) */
+	long	free;		/* free memory less slack and lien, after
+				   the tick's domain adjustments (KBs) */
+	int64_t	tick_ns;	/* duration of the tick (nsec) */
+} sched_host;
+
 EXTERN struct __doms
 {
 	/*
@@ -504,6 +581,7 @@ EXTERN struct __doms
 } doms;
 
 EXTERN const char* membalanced_log_path INIT("/var/log/membalanced.log");
+EXTERN const char* membalanced_trace_path INIT("/var/log/membalanced.trace");
 
 /******************************************************************************
 *                          dependend includes                                 *
@@ -511,6 +589,11 @@ EXTERN const char* membalanced_log_path INIT("/var/log/membalanced.log");
 
 #include "config_parser.h"
 #include "test.h"
+#include "stats.h"
+#include "trace.h"
+#include "status_page.h"
+#include "state_file.h"
+#include "pressure.h"
 
 #endif // __MEMBALANCED_H__
 
@@ -0,0 +1,556 @@
+/*
+ *  MEMBALANCE daemon
+ *
+ *  metrics.cpp - Prometheus metrics endpoint
+ *
+ *  Portions Copyright (C) 2014 Sergey Oboguev (oboguev@yahoo.com)
+ *  For licensing terms see license.txt
+ */
+
+#include "membalanced.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/******************************************************************************
+*                             local definitions                               *
+******************************************************************************/
+
+/*
+ * When @metrics_port is configured, membalanced serves host and domain
+ * metrics in Prometheus text exposition format (version 0.0.4) over HTTP
+ * at http://127.0.0.1:<metrics_port>/metrics.
+ *
+ * The server is a minimal HTTP/1.0 responder multiplexed into the main
+ * poll(...) loop: one request per connection, the response is rendered from
+ * the state kept by the scheduler as of the latest tick (no Xen or xenstore
+ * calls), and the connection is closed after the response has been sent.
+ * All sockets are non-blocking, so a slow or stuck client cannot stall
+ * the daemon.
+ */
+
+#define METRICS_MAX_CLIENTS	8		/* concurrent connections */
+#define METRICS_MAX_REQUEST	4096		/* max size of request header */
+#define METRICS_TIMEOUT_MS	(5 * MSEC_PER_SEC)	/* connection lifetime */
+
+class metrics_client
+{
+public:
+	int fd;				/* connection socket or -1 if slot is free */
+	struct timespec ts0;		/* when accepted */
+	std::string request;		/* request received so far */
+	std::string response;		/* response to send */
+	size_t sent;			/* bytes of @response sent */
+
+	metrics_client()
+	{
+		fd = -1;
+		sent = 0;
+	}
+
+	void close_client(void)
+	{
+		if (fd != -1)
+			close(fd);
+		fd = -1;
+		request.clear();
+		response.clear();
+		sent = 0;
+	}
+};
+
+
+/******************************************************************************
+*                                static data                                  *
+******************************************************************************/
+
+static int sock = -1;				/* listener socket */
+static metrics_client clients[METRICS_MAX_CLIENTS];
+
+
+/******************************************************************************
+*                             forward declarations                            *
+******************************************************************************/
+
+static void accept_client(void);
+static void read_request(metrics_client& client);
+static void send_response(metrics_client& client);
+static void build_response(metrics_client& client);
+static void render_metrics(std::string& out);
+static void appendf(std::string& out, const char* fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+static void family(std::string& out, const char* name, const char* type, const char* help);
+static void domain_label(std::string& out, const domain_info* dom);
+
+
+/******************************************************************************
+*                         start/stop metrics server                           *
+******************************************************************************/
+
+/*
+ * Start listening for metrics requests, if configured.
+ * On error, log a message and leave the server disabled.
+ */
+void start_metrics_server(void)
+{
+	struct sockaddr_in addr;
+	int on = 1;
+
+	if (sock != -1 || config.metrics_port == 0)
+		return;
+
+	sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock == -1)
+	{
+		error_perror("unable to create metrics socket");
+		return;
+	}
+
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on))
+		warning_perror("unable to set SO_REUSEADDR on metrics socket");
+
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((uint16_t) config.metrics_port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(sock, (struct sockaddr*) &addr, sizeof addr) ||
+	    listen(sock, METRICS_MAX_CLIENTS))
+	{
+		error_perror("unable to listen for metrics requests on port %d",
+			     config.metrics_port);
+		close(sock);
+		sock = -1;
+		return;
+	}
+
+	debug_msg(1, "serving metrics on 127.0.0.1:%d", config.metrics_port);
+}
+
+/*
+ * Stop metrics server and drop its connections
+ */
+void stop_metrics_server(void)
+{
+	for (int k = 0;  k < METRICS_MAX_CLIENTS;  k++)
+		clients[k].close_client();
+
+	if (sock != -1)
+	{
+		close(sock);
+		sock = -1;
+	}
+}
+
+
+/******************************************************************************
+*                         poll(...) loop integration                          *
+******************************************************************************/
+
+/*
+ * Return number of poll descriptors needed by the metrics server
+ */
+int metrics_get_npollfds(void)
+{
+	int n = 0;
+
+	if (sock == -1)
+		return 0;
+
+	for (int k = 0;  k < METRICS_MAX_CLIENTS;  k++)
+	{
+		if (clients[k].fd != -1)
+			n++;
+	}
+
+	return n + 1;
+}
+
+/*
+ * Set up poll descriptors: listener socket, then active connections
+ * in the order of their slots. Connections that outlived their time
+ * are dropped first.
+ */
+void metrics_setup_pollfds(struct pollfd* pollfds)
+{
+	struct timespec now;
+	int k, n = 0;
+
+	if (sock == -1)
+		return;
+
+	now = getnow();
+
+	for (k = 0;  k < METRICS_MAX_CLIENTS;  k++)
+	{
+		if (clients[k].fd != -1 &&
+		    timespec_diff_ms(now, clients[k].ts0) >= METRICS_TIMEOUT_MS)
+		{
+			debug_msg(12, "dropping stale metrics connection");
+			clients[k].close_client();
+		}
+	}
+
+	pollfds[n].fd = sock;
+	pollfds[n].events = POLLIN;
+	pollfds[n].revents = 0;
+	n++;
+
+	for (k = 0;  k < METRICS_MAX_CLIENTS;  k++)
+	{
+		if (clients[k].fd == -1)
+			continue;
+		pollfds[n].fd = clients[k].fd;
+		pollfds[n].events = clients[k].response.empty() ? POLLIN : POLLOUT;
+		pollfds[n].revents = 0;
+		n++;
+	}
+}
+
+/*
+ * Handle poll(...) completion.
+ * Return @true if any event was processed, @false otherwise.
+ */
+bool metrics_handle_pollfds(struct pollfd* pollfds)
+{
+	bool res = false;
+	int k, n = 1;
+
+	if (sock == -1)
+		return false;
+
+	/* set up by metrics_setup_pollfds(...), slots did not change since */
+	for (k = 0;  k < METRICS_MAX_CLIENTS;  k++)
+	{
+		metrics_client& client = clients[k];
+
+		if (client.fd == -1)
+			continue;
+
+		short revents = pollfds[n++].revents;
+		if (revents == 0)
+			continue;
+
+		res = true;
+
+		if (revents & (POLLERR | POLLNVAL))
+			client.close_client();
+		else if (client.response.empty())
+			read_request(client);
+		else
+			send_response(client);
+	}
+
+	if (pollfds[0].revents & POLLIN)
+	{
+		res = true;
+		accept_client();
+	}
+
+	return res;
+}
+
+
+/******************************************************************************
+*                               HTTP handling                                 *
+******************************************************************************/
+
+/*
+ * Accept pending connection, if there is a free slot
+ */
+static void accept_client(void)
+{
+	int fd, k;
+
+	fd = accept4(sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd == -1)
+	{
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			error_perror("unable to accept metrics connection");
+		return;
+	}
+
+	for (k = 0;  k < METRICS_MAX_CLIENTS;  k++)
+	{
+		if (clients[k].fd == -1)
+			break;
+	}
+
+	if (k == METRICS_MAX_CLIENTS)
+	{
+		debug_msg(12, "too many metrics connections, dropping a new one");
+		close(fd);
+		return;
+	}
+
+	clients[k].fd = fd;
+	clients[k].ts0 = getnow();
+}
+
+/*
+ * Read available request data, when the header is complete,
+ * build the response and start sending it
+ */
+static void read_request(metrics_client& client)
+{
+	char buf[1024];
+	ssize_t nb;
+
+	nb = recv(client.fd, buf, sizeof buf, 0);
+	if (nb < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	if (nb <= 0)
+	{
+		client.close_client();
+		return;
+	}
+
+	client.request.append(buf, nb);
+
+	if (client.request.find("\r\n\r\n") == std::string::npos &&
+	    client.request.find("\n\n") == std::string::npos)
+	{
+		if (client.request.size() > METRICS_MAX_REQUEST)
+			client.close_client();
+		return;
+	}
+
+	build_response(client);
+	send_response(client);
+}
+
+/*
+ * Send as much of the response as the socket takes,
+ * close the connection when done
+ */
+static void send_response(metrics_client& client)
+{
+	ssize_t nb;
+
+	while (client.sent < client.response.size())
+	{
+		nb = send(client.fd,
+			  client.response.data() + client.sent,
+			  client.response.size() - client.sent,
+			  MSG_NOSIGNAL);
+		if (nb < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		client.sent += nb;
+	}
+
+	client.close_client();
+}
+
+/*
+ * Build HTTP response to the request
+ */
+static void build_response(metrics_client& client)
+{
+	const std::string& rq = client.request;
+	std::string body;
+	const char* status;
+
+	if (rq.compare(0, 13, "GET /metrics ") == 0 ||
+	    rq.compare(0, 14, "GET /metrics\r\n") == 0 ||
+	    rq.compare(0, 6, "GET / ") == 0)
+	{
+		status = "200 OK";
+		render_metrics(body);
+	}
+	else if (rq.compare(0, 4, "GET ") == 0)
+	{
+		status = "404 Not Found";
+		body = "not found\n";
+	}
+	else
+	{
+		status = "405 Method Not Allowed";
+		body = "method not allowed\n";
+	}
+
+	client.response.reserve(body.size() + 200);
+	appendf(client.response,
+		"HTTP/1.0 %s\r\n"
+		"Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+		"Content-Length: %lu\r\n"
+		"Connection: close\r\n"
+		"\r\n",
+		status, (unsigned long) body.size());
+	client.response += body;
+	client.sent = 0;
+}
+
+
+/******************************************************************************
+*                             metrics rendering                               *
+******************************************************************************/
+
+/* domain metric: name, help text, value extractor */
+#define DOMAIN_METRIC(name, type, help, fmt, expr)			\
+	do {								\
+		family(out, "membalance_domain_" name, type, help);	\
+		foreach_managed_domain(dom)				\
+		{							\
+			appendf(out, "membalance_domain_" name);	\
+			domain_label(out, dom);				\
+			appendf(out, " " fmt "\n", expr);		\
+		}							\
+	} while (0)
+
+/*
+ * Render metrics in Prometheus text exposition format into @out.
+ * Memory sizes are in bytes as the format prescribes.
+ */
+static void render_metrics(std::string& out)
+{
+	const double kb = 1024;
+	domain_info* dom;
+
+	out.reserve(1024 + doms.managed.size() * 1024);
+
+	family(out, "membalance_paused", "gauge",
+	       "Domain memory adjustment pause level (0 if not paused)");
+	appendf(out, "membalance_paused %u\n", memsched_pause_level);
+
+	family(out, "membalance_managed_domains", "gauge",
+	       "Number of domains managed by membalance");
+	appendf(out, "membalance_managed_domains %lu\n",
+		(unsigned long) doms.managed.size());
+
+	family(out, "membalance_ticks_total", "counter",
+	       "Memory scheduling ticks performed");
+	appendf(out, "membalance_ticks_total %llu\n",
+		(unsigned long long) stat_counter[STAT_SCHED_TICKS]);
+
+	if (sched_host.time)
+	{
+		family(out, "membalance_host_xen_free_bytes", "gauge",
+		       "Xen free memory at the latest tick");
+		appendf(out, "membalance_host_xen_free_bytes %.0f\n", sched_host.xen_free * kb);
+
+		family(out, "membalance_host_free_slack_bytes", "gauge",
+		       "Xen free memory slack at the latest tick");
+		appendf(out, "membalance_host_free_slack_bytes %.0f\n", sched_host.slack * kb);
+
+		family(out, "membalance_host_lien_bytes", "gauge",
+		       "Memory yet to be claimed by expanding domains at the latest tick");
+		appendf(out, "membalance_host_lien_bytes %.0f\n", sched_host.lien * kb);
+
+		family(out, "membalance_host_free_bytes", "gauge",
+		       "Host free memory less slack and lien, after the latest tick adjustments");
+		appendf(out, "membalance_host_free_bytes %.0f\n", sched_host.free * kb);
+
+		family(out, "membalance_host_reserved_hard_headroom_bytes", "gauge",
+		       "Host free memory above host_reserved_hard (negative if below)");
+		appendf(out, "membalance_host_reserved_hard_headroom_bytes %.0f\n",
+			(sched_host.free - config.host_reserved_hard) * kb);
+
+		family(out, "membalance_host_reserved_soft_headroom_bytes", "gauge",
+		       "Host free memory above host_reserved_soft (negative if below)");
+		appendf(out, "membalance_host_reserved_soft_headroom_bytes %.0f\n",
+			(sched_host.free - config.host_reserved_soft) * kb);
+
+		family(out, "membalance_tick_duration_seconds", "gauge",
+		       "Duration of the latest memory scheduling tick");
+		appendf(out, "membalance_tick_duration_seconds %.6f\n",
+			(double) sched_host.tick_ns / NSEC_PER_SEC);
+
+		family(out, "membalance_last_tick_timestamp_seconds", "gauge",
+		       "Time of the latest memory scheduling tick");
+		appendf(out, "membalance_last_tick_timestamp_seconds %ld\n",
+			(long) sched_host.time);
+	}
+
+	if (doms.managed.empty())
+		return;
+
+	DOMAIN_METRIC("memsize_bytes", "gauge",
+		      "Domain memory allocation targeted by the scheduler",
+		      "%.0f", dom->memsize * kb);
+	DOMAIN_METRIC("memgoal_bytes", "gauge",
+		      "Domain memory target at the start of the latest tick",
+		      "%.0f", dom->memgoal0 * kb);
+	DOMAIN_METRIC("rate_bytes_per_second", "gauge",
+		      "Latest reported data map-in rate",
+		      "%.0f", dom->rate * kb);
+	DOMAIN_METRIC("slow_rate_bytes_per_second", "gauge",
+		      "Slow moving average of data map-in rate",
+		      "%.0f", dom->slow_rate * kb);
+	DOMAIN_METRIC("free_ratio", "gauge",
+		      "Latest reported guest free memory fraction",
+		      "%.4f", dom->freepct / 100);
+	DOMAIN_METRIC("expand_force", "gauge",
+		      "Domain pressure force to expand",
+		      "%g", dom->expand_force);
+	DOMAIN_METRIC("resist_force", "gauge",
+		      "Domain force to resist contraction",
+		      "%g", dom->resist_force);
+	DOMAIN_METRIC("last_resize_timestamp_seconds", "gauge",
+		      "Time of the latest resize request for the domain (0 if none)",
+		      "%ld", (long) dom->last_resize_time);
+	DOMAIN_METRIC("last_resize_bytes", "gauge",
+		      "Target size of the latest resize request for the domain",
+		      "%.0f", dom->last_resize_size * kb);
+}
+
+#undef DOMAIN_METRIC
+
+static void appendf(std::string& out, const char* fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof buf, fmt, ap);
+	va_end(ap);
+
+	if (n < 0)
+		return;
+
+	if ((size_t) n < sizeof buf)
+	{
+		out.append(buf, n);
+	}
+	else
+	{
+		char* cp = (char*) xmalloc(n + 1);
+		va_start(ap, fmt);
+		vsnprintf(cp, n + 1, fmt, ap);
+		va_end(ap);
+		out.append(cp, n);
+		free(cp);
+	}
+}
+
+/* emit HELP and TYPE lines of metric family */
+static void family(std::string& out, const char* name, const char* type, const char* help)
+{
+	appendf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* emit label set of domain metric */
+static void domain_label(std::string& out, const domain_info* dom)
+{
+	appendf(out, "{domain=\"%ld\",name=\"", dom->domain_id);
+
+	for (const char* cp = dom->vm_name ? dom->vm_name : "";  *cp;  cp++)
+	{
+		switch (*cp)
+		{
+		case '\\':  out += "\\\\";  break;
+		case '"':   out += "\\\"";  break;
+		case '\n':  out += "\\n";   break;
+		default:    out += *cp;     break;
+		}
+	}
+
+	out += "\"}";
+}
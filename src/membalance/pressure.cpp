@@ -0,0 +1,789 @@
+/*
+ *  MEMBALANCE daemon
+ *
+ *  pressure.cpp - Host memory pressure summaries and their aggregation
+ *
+ *  Portions Copyright (C) 2014 Sergey Oboguev (oboguev@yahoo.com)
+ *  For licensing terms see license.txt
+ */
+
+#include "membalanced.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+/******************************************************************************
+*                             local definitions                               *
+******************************************************************************/
+
+/*
+ * See pressure.h for the format of the summary.
+ *
+ * The daemon side is driven from the main loop: scheduler notes domains it
+ * was unable to expand for lack of memory, and after the tick the summary is
+ * built from these notes and sched_host state, and is sent out. Nothing is
+ * requested from Xen or xenstore. The UDP socket is non-blocking, and a lost
+ * datagram is simply replaced by the next tick's one.
+ *
+ * The aggregator keeps the latest summary of every host, discarding ones not
+ * refreshed for PRESSURE_STALE_INTERVALS of the host's interval (judged by
+ * local receive time or file modification time, so clocks of the hosts need
+ * not be in sync). Hosts are ranked by pressure, i.e. unmet demand less free
+ * memory and surplus. Every domain listed as starved by a host that has been
+ * short of memory for @persist consecutive ticks is suggested to be moved to
+ * the host with most room (free + surplus - unmet, less memory of domains
+ * already suggested to move there) that can hold its wanted size.
+ */
+
+#define PRESSURE_MAX_LINE		2048	/* max summary size */
+#define PRESSURE_STALE_INTERVALS	3
+
+typedef enum __sink_kind
+{
+	SINK_NONE = 0,
+	SINK_UDP,
+	SINK_FILE
+} sink_kind;
+
+/* host as seen by the aggregator */
+class pressure_host
+{
+public:
+	pressure_summary s;
+	time_t seen;		/* when @s was received (local time) */
+	long room;		/* memory available for domains moving in (KBs) */
+};
+
+typedef std::map<std::string, pressure_host> name2host;
+
+
+/******************************************************************************
+*                               static data                                   *
+******************************************************************************/
+
+static sink_kind sink = SINK_NONE;		/* where to publish summaries */
+static int sink_fd = -1;			/* ... UDP socket */
+static struct sockaddr_in sink_addr;		/* ... its destination */
+static char* sink_path = NULL;			/* ... or file */
+static bool sink_failed = false;		/* last publishing attempt failed */
+static std::string hostname;			/* host name put into summaries */
+
+static std::vector<pressure_domain> noted;	/* domains short of memory in this tick */
+static int short_ticks = 0;			/* consecutive ticks with unmet demand */
+
+
+/******************************************************************************
+*                           forward declarations                              *
+******************************************************************************/
+
+static bool resolve_udp(const char* spec, struct sockaddr_in* addr, bool allow_any);
+static bool publish_file(const std::string& line);
+static bool shortage_ordered(const pressure_domain& a, const pressure_domain& b);
+static bool pressure_ordered(const pressure_host* a, const pressure_host* b);
+static long host_pressure(const pressure_summary& s);
+static std::string sanitize(const char* name);
+static void appendf(std::string& out, const char* fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+static void read_datagrams(int fd, int wait_ms, name2host& hosts);
+static void read_file(const char* path, name2host& hosts);
+static void accept_summary(const char* text, time_t seen, name2host& hosts);
+static void report(name2host& hosts, int persist);
+
+
+/******************************************************************************
+*                    summary text formatting and parsing                      *
+******************************************************************************/
+
+pressure_summary::pressure_summary()
+{
+	time = 0;
+	interval = 0;
+	unmet = 0;
+	short_ticks = 0;
+	free = 0;
+	surplus = 0;
+}
+
+std::string pressure_summary::format(void) const
+{
+	std::string out;
+
+	appendf(out, "%s %d host=%s time=%lld interval=%d unmet=%ld short_ticks=%d "
+		     "free=%ld surplus=%ld top=",
+		PRESSURE_MAGIC, PRESSURE_VERSION, host.c_str(), (long long) time,
+		interval, unmet, short_ticks, free, surplus);
+
+	for (unsigned k = 0;  k < top.size();  k++)
+	{
+		const pressure_domain& d = top[k];
+		appendf(out, "%s%ld:%ld:%ld:%s", k ? "," : "",
+			d.domain_id, d.memsize, d.shortage, d.name.c_str());
+	}
+
+	return out;
+}
+
+/*
+ * Parse summary line @text.
+ * Unknown keys are ignored. Return @false if @text is not a valid summary.
+ */
+bool pressure_summary::parse(const char* text)
+{
+	char* buf = xstrdup(text);
+	char* save = NULL;
+	char* tok;
+	char* val;
+	char* cp;
+	long lv;
+	bool ok = false;
+
+	*this = pressure_summary();
+
+	tok = strtok_r(buf, " \t\r\n", &save);
+	CHECK(tok && streq(tok, PRESSURE_MAGIC));
+	tok = strtok_r(NULL, " \t\r\n", &save);
+	CHECK(tok && a2long(tok, &lv) && lv == PRESSURE_VERSION);
+
+	while (NULL != (tok = strtok_r(NULL, " \t\r\n", &save)))
+	{
+		if (NULL == (val = strchr(tok, '=')))
+			continue;
+		*val++ = '\0';
+
+		if (streq(tok, "host"))
+		{
+			host = val;
+			continue;
+		}
+
+		if (streq(tok, "top"))
+		{
+			/* <id>:<memsize>:<shortage>:<name>,... */
+			for (char* item = val;  item && *item;  item = cp)
+			{
+				pressure_domain d;
+				char* f[4];
+				int nf = 0;
+
+				if (NULL != (cp = strchr(item, ',')))
+					*cp++ = '\0';
+
+				for (f[nf++] = item;  nf < 4;  nf++)
+				{
+					char* colon = strchr(f[nf - 1], ':');
+					CHECK(colon != NULL);
+					*colon = '\0';
+					f[nf] = colon + 1;
+				}
+
+				CHECK(a2long(f[0], &d.domain_id) &&
+				      a2long(f[1], &d.memsize) &&
+				      a2long(f[2], &d.shortage));
+				d.name = f[3];
+				top.push_back(d);
+			}
+			continue;
+		}
+
+		if (streq(tok, "time") ||
+		    streq(tok, "interval") ||
+		    streq(tok, "unmet") ||
+		    streq(tok, "short_ticks") ||
+		    streq(tok, "free") ||
+		    streq(tok, "surplus"))
+		{
+			CHECK(a2long(val, &lv));
+			if (streq(tok, "time"))
+				time = lv;
+			else if (streq(tok, "interval"))
+				interval = (int) lv;
+			else if (streq(tok, "unmet"))
+				unmet = lv;
+			else if (streq(tok, "short_ticks"))
+				short_ticks = (int) lv;
+			else if (streq(tok, "free"))
+				free = lv;
+			else
+				surplus = lv;
+		}
+	}
+
+	ok = host.length() != 0 && interval > 0;
+
+cleanup:
+
+	::free(buf);
+	return ok;
+}
+
+
+/******************************************************************************
+*                         daemon side: publishing                             *
+******************************************************************************/
+
+/*
+ * Set up publishing of pressure summaries to @spec,
+ * either "udp:<host>:<port>" or "file:<path>".
+ * On error, log a message and return @false.
+ */
+bool pressure_sink_open(const char* spec)
+{
+	char buf[256];
+
+	if (0 == strncmp(spec, "udp:", 4))
+	{
+		if (!resolve_udp(spec + 4, &sink_addr, false))
+			return false;
+
+		sink_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (sink_fd == -1)
+		{
+			error_perror("unable to create pressure sink socket");
+			return false;
+		}
+
+		sink = SINK_UDP;
+	}
+	else if (0 == strncmp(spec, "file:", 5) && spec[5])
+	{
+		sink_path = xstrdup(spec + 5);
+		sink = SINK_FILE;
+	}
+	else
+	{
+		error_msg("invalid pressure sink: %s", spec);
+		return false;
+	}
+
+	if (gethostname(buf, sizeof buf))
+		strcpy(buf, "unknown");
+	buf[sizeof buf - 1] = '\0';
+	hostname = sanitize(buf);
+
+	debug_msg(1, "publishing memory pressure summaries to %s", spec);
+
+	return true;
+}
+
+/*
+ * Stop publishing, on daemon shutdown
+ */
+void pressure_sink_close(void)
+{
+	if (sink_fd != -1)
+		close(sink_fd);
+	sink_fd = -1;
+
+	free(sink_path);
+	sink_path = NULL;
+
+	sink = SINK_NONE;
+}
+
+/*
+ * Called by the scheduler for domain @dom it was unable to expand in the
+ * current tick by @shortage kbs for lack of memory.
+ */
+void pressure_note_shortage(const domain_info* dom, long shortage)
+{
+	if (sink == SINK_NONE || shortage <= 0)
+		return;
+
+	pressure_domain d;
+	d.domain_id = dom->domain_id;
+	d.memsize = dom->memsize;
+	d.shortage = shortage;
+	d.name = sanitize(dom->vm_name);
+	noted.push_back(d);
+}
+
+/*
+ * Called after every scheduler tick.
+ * Build host pressure summary and publish it.
+ */
+void pressure_publish(void)
+{
+	pressure_summary s;
+	domain_info* dom;
+	unsigned k;
+	bool ok = false;
+
+	if (testmode || sink == SINK_NONE)
+	{
+		noted.clear();
+		return;
+	}
+
+	s.host = hostname;
+	s.time = sched_host.time ? sched_host.time : time(NULL);
+	s.interval = config.interval;
+
+	for (k = 0;  k < noted.size();  k++)
+		s.unmet += noted[k].shortage;
+
+	short_ticks = s.unmet ? short_ticks + 1 : 0;
+	s.short_ticks = short_ticks;
+
+	s.free = max(0, sched_host.free - config.host_reserved_soft);
+
+	/* memory above quota held by domains that currently do not need it */
+	foreach_managed_domain(dom)
+	{
+		if (!dom->valid_data || !dom->valid_memory_data || dom->slow_rate > dom->rate_low)
+			continue;
+		long floor = max(dom->dmem_quota, dom->dmem_min);
+		if (dom->memsize > floor)
+			s.surplus += dom->memsize - floor;
+	}
+
+	std::sort(noted.begin(), noted.end(), shortage_ordered);
+	for (k = 0;  k < noted.size() && k < PRESSURE_TOP_DOMAINS;  k++)
+		s.top.push_back(noted[k]);
+	noted.clear();
+
+	std::string line = s.format();
+
+	if (sink == SINK_UDP)
+	{
+		ok = line.length() == (size_t) sendto(sink_fd, line.c_str(), line.length(), 0,
+						      (struct sockaddr*) &sink_addr, sizeof sink_addr);
+	}
+	else
+	{
+		line += "\n";
+		ok = publish_file(line);
+	}
+
+	/* log failures once until publishing recovers */
+	if (!ok && !sink_failed)
+	{
+		if (sink == SINK_UDP)
+			warning_perror("unable to send memory pressure summary");
+		else
+			warning_perror("unable to write memory pressure summary to %s", sink_path);
+	}
+	sink_failed = !ok;
+}
+
+/*
+ * Replace content of the sink file with @line.
+ *
+ * The sink may be placed in a directory writable by others, so the temporary
+ * file is created under a unique name (with O_EXCL) rather than opened by
+ * a fixed name that could be planted as a symlink to an arbitrary file.
+ */
+static bool publish_file(const std::string& line)
+{
+	char* tmp_path = xprintf("%s.XXXXXX", sink_path);
+	bool ok = false;
+	int fd;
+
+	fd = mkostemp(tmp_path, O_CLOEXEC);
+	if (fd >= 0)
+	{
+		ok = line.length() == (size_t) write(fd, line.c_str(), line.length());
+		if (fchmod(fd, 0644))
+			ok = false;
+		if (close(fd))
+			ok = false;
+		if (ok && rename(tmp_path, sink_path))
+			ok = false;
+		if (!ok)
+			unlink(tmp_path);
+	}
+
+	free(tmp_path);
+	return ok;
+}
+
+/*
+ * Parse "[<host>:]<port>" into @addr.
+ * Empty or missing host is accepted only if @allow_any.
+ * On error, log a message and return @false.
+ */
+static bool resolve_udp(const char* spec, struct sockaddr_in* addr, bool allow_any)
+{
+	struct addrinfo hints;
+	struct addrinfo* res = NULL;
+	std::string host;
+	const char* port;
+	const char* cp;
+	long lv;
+	int err;
+
+	if (NULL != (cp = strrchr(spec, ':')))
+	{
+		host.assign(spec, cp - spec);
+		port = cp + 1;
+	}
+	else
+	{
+		port = spec;
+	}
+
+	if (!a2long(port, &lv) || lv <= 0 || lv > 65535 || (host.empty() && !allow_any))
+	{
+		error_msg("invalid UDP address: %s", spec);
+		return false;
+	}
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons((uint16_t) lv);
+	addr->sin_addr.s_addr = htonl(INADDR_ANY);
+
+	if (host.empty())
+		return true;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	err = getaddrinfo(host.c_str(), NULL, &hints, &res);
+	if (err || !res)
+	{
+		error_msg("unable to resolve %s: %s", host.c_str(), gai_strerror(err));
+		if (res)
+			freeaddrinfo(res);
+		return false;
+	}
+
+	addr->sin_addr = ((struct sockaddr_in*) res->ai_addr)->sin_addr;
+	freeaddrinfo(res);
+
+	return true;
+}
+
+/*
+ * Make domain name safe to put into summary: replace separators
+ * and non-printable characters with '_'
+ */
+static std::string sanitize(const char* name)
+{
+	std::string s(name ? name : "");
+
+	for (unsigned k = 0;  k < s.length();  k++)
+	{
+		unsigned char c = (unsigned char) s[k];
+		if (c <= ' ' || c >= 0x7F || c == ':' || c == ',' || c == '=')
+			s[k] = '_';
+	}
+
+	return s;
+}
+
+/*
+ * Most starved domains first
+ */
+static bool shortage_ordered(const pressure_domain& a, const pressure_domain& b)
+{
+	if (a.shortage != b.shortage)
+		return a.shortage > b.shortage;
+	return a.domain_id < b.domain_id;
+}
+
+static void appendf(std::string& out, const char* fmt, ...)
+{
+	char buf[512];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof buf, fmt, ap);
+	va_end(ap);
+
+	if (n < 0)
+		return;
+
+	if ((size_t) n < sizeof buf)
+	{
+		out.append(buf, n);
+	}
+	else
+	{
+		char* p = (char*) xmalloc(n + 1);
+		va_start(ap, fmt);
+		vsnprintf(p, n + 1, fmt, ap);
+		va_end(ap);
+		out.append(p, n);
+		free(p);
+	}
+}
+
+
+/******************************************************************************
+*                 aggregator side ("membalancectl pressure-aggregate")        *
+******************************************************************************/
+
+/*
+ * Collect summaries from @listen_spec ("udp:[<addr>:]<port>", multicast
+ * group address is joined), or NULL, and from @files. Every @interval seconds
+ * print host ranking and migration suggestions. With @once, do it one time
+ * only.
+ */
+int pressure_aggregate(const char* listen_spec,
+		       const std::vector<std::string>& files,
+		       int interval, int persist, bool once)
+{
+	struct sockaddr_in addr;
+	struct sockaddr_in baddr;
+	struct ip_mreq mreq;
+	name2host hosts;
+	name2host::iterator it;
+	bool first = true;
+	int fd = -1;
+	int on = 1;
+	time_t now;
+	unsigned k;
+
+	if (listen_spec)
+	{
+		if (0 != strncmp(listen_spec, "udp:", 4))
+		{
+			error_msg("invalid listen address: %s", listen_spec);
+			return EXIT_FAILURE;
+		}
+
+		if (!resolve_udp(listen_spec + 4, &addr, true))
+			return EXIT_FAILURE;
+
+		fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if (fd == -1)
+		{
+			error_perror("unable to create socket");
+			return EXIT_FAILURE;
+		}
+
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on))
+			warning_perror("unable to set SO_REUSEADDR");
+
+		/* multicast group is received on any address */
+		baddr = addr;
+		if (IN_MULTICAST(ntohl(addr.sin_addr.s_addr)))
+			baddr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+		if (bind(fd, (struct sockaddr*) &baddr, sizeof baddr))
+		{
+			error_perror("unable to listen on %s", listen_spec);
+			close(fd);
+			return EXIT_FAILURE;
+		}
+
+		if (IN_MULTICAST(ntohl(addr.sin_addr.s_addr)))
+		{
+			memset(&mreq, 0, sizeof mreq);
+			mreq.imr_multiaddr = addr.sin_addr;
+			mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+			if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof mreq))
+			{
+				error_perror("unable to join multicast group %s", inet_ntoa(addr.sin_addr));
+				close(fd);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	for (;;)
+	{
+		if (fd != -1)
+			read_datagrams(fd, interval * MSEC_PER_SEC, hosts);
+		else if (!first)
+			sleep(interval);
+		first = false;
+
+		for (k = 0;  k < files.size();  k++)
+			read_file(files[k].c_str(), hosts);
+
+		/* drop hosts that went silent */
+		now = time(NULL);
+		for (it = hosts.begin();  it != hosts.end(); )
+		{
+			if (now - it->second.seen > PRESSURE_STALE_INTERVALS * it->second.s.interval)
+				hosts.erase(it++);
+			else
+				++it;
+		}
+
+		report(hosts, persist);
+		fflush(stdout);
+
+		if (once)
+			break;
+
+		printf("\n");
+	}
+
+	if (fd != -1)
+		close(fd);
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Receive summaries for @wait_ms
+ */
+static void read_datagrams(int fd, int wait_ms, name2host& hosts)
+{
+	struct timespec ts0 = getnow();
+	struct pollfd pfd;
+	char buf[PRESSURE_MAX_LINE + 1];
+	int64_t left;
+	ssize_t n;
+
+	for (;;)
+	{
+		left = wait_ms - timespec_diff_ms(getnow(), ts0);
+		if (left <= 0)
+			break;
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, (int) left) <= 0)
+			continue;
+
+		n = recv(fd, buf, sizeof buf - 1, 0);
+		if (n <= 0)
+			continue;
+		buf[n] = '\0';
+
+		accept_summary(buf, time(NULL), hosts);
+	}
+}
+
+/*
+ * Read summary published to a file
+ */
+static void read_file(const char* path, name2host& hosts)
+{
+	char buf[PRESSURE_MAX_LINE + 1];
+	struct stat st;
+	FILE* fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+	{
+		warning_perror("unable to open %s", path);
+		return;
+	}
+
+	if (!fstat(fileno(fp), &st) && fgets(buf, sizeof buf, fp))
+		accept_summary(buf, st.st_mtime, hosts);
+
+	fclose(fp);
+}
+
+static void accept_summary(const char* text, time_t seen, name2host& hosts)
+{
+	pressure_summary s;
+
+	if (!s.parse(text))
+	{
+		debug_msg(1, "ignoring malformed pressure summary");
+		return;
+	}
+
+	pressure_host& h = hosts[s.host];
+	h.s = s;
+	h.seen = seen;
+}
+
+/*
+ * Print hosts ranked by pressure, followed by migration suggestions
+ */
+static void report(name2host& hosts, int persist)
+{
+	std::vector<pressure_host*> rank;
+	name2host::iterator it;
+	pressure_host* dst;
+	unsigned k, j, i;
+	int nsuggest = 0;
+
+	for (it = hosts.begin();  it != hosts.end();  ++it)
+	{
+		pressure_host& h = it->second;
+		h.room = -host_pressure(h.s);
+		rank.push_back(&h);
+	}
+
+	std::sort(rank.begin(), rank.end(), pressure_ordered);
+
+	printf("%-24s %12s %6s %12s %12s %12s\n",
+	       "host", "unmet (kb)", "ticks", "free (kb)", "surplus (kb)", "pressure");
+
+	for (k = 0;  k < rank.size();  k++)
+	{
+		const pressure_summary& s = rank[k]->s;
+		printf("%-24s %12ld %6d %12ld %12ld %12ld\n",
+		       s.host.c_str(), s.unmet, s.short_ticks, s.free, s.surplus,
+		       host_pressure(s));
+	}
+
+	printf("\n");
+
+	for (k = 0;  k < rank.size();  k++)
+	{
+		pressure_host* src = rank[k];
+
+		if (src->s.unmet <= 0 || src->s.short_ticks < persist)
+			continue;
+
+		for (j = 0;  j < src->s.top.size();  j++)
+		{
+			const pressure_domain& d = src->s.top[j];
+
+			dst = NULL;
+			for (i = 0;  i < rank.size();  i++)
+			{
+				pressure_host* h = rank[i];
+				if (h != src && h->room >= d.memsize && (!dst || h->room > dst->room))
+					dst = h;
+			}
+
+			if (dst)
+			{
+				printf("migrate domain %s (id %ld) from %s to %s: "
+				       "wants %ld kbs, short by %ld kbs\n",
+				       d.name.length() ? d.name.c_str() : "?", d.domain_id,
+				       src->s.host.c_str(), dst->s.host.c_str(),
+				       d.memsize, d.shortage);
+				dst->room -= d.memsize;
+			}
+			else
+			{
+				printf("no host has room for domain %s (id %ld) from %s: "
+				       "wants %ld kbs\n",
+				       d.name.length() ? d.name.c_str() : "?", d.domain_id,
+				       src->s.host.c_str(), d.memsize);
+			}
+
+			nsuggest++;
+		}
+	}
+
+	if (nsuggest == 0)
+		printf("no migrations suggested\n");
+}
+
+/*
+ * Positive when host needs more memory than it has free or reclaimable
+ */
+static long host_pressure(const pressure_summary& s)
+{
+	return s.unmet - (s.free + s.surplus);
+}
+
+/*
+ * Most pressured hosts first
+ */
+static bool pressure_ordered(const pressure_host* a, const pressure_host* b)
+{
+	long pa = host_pressure(a->s);
+	long pb = host_pressure(b->s);
+	if (pa != pb)
+		return pa > pb;
+	return a->s.host < b->s.host;
+}
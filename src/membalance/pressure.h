@@ -0,0 +1,76 @@
+/*
+ *  MEMBALANCE daemon
+ *
+ *  pressure.h - Host memory pressure summaries and their aggregation
+ *
+ *  Portions Copyright (C) 2014 Sergey Oboguev (oboguev@yahoo.com)
+ *  For licensing terms see license.txt
+ */
+
+#ifndef __MEMBALANCE_PRESSURE_H__
+#define __MEMBALANCE_PRESSURE_H__
+
+/*
+ * When started with --pressure-sink, the daemon publishes a pressure summary
+ * of its host at the end of every tick, either as a UDP datagram (to unicast
+ * or multicast address) or by replacing the content of a file. The summary is
+ * a single line of text:
+ *
+ *     membalance-pressure 1 host=<name> time=<unix time> interval=<sec>
+ *         unmet=<kbs> short_ticks=<n> free=<kbs> surplus=<kbs>
+ *         top=<id>:<wanted size kbs>:<short kbs>:<name>,...
+ *
+ * @unmet is memory domains could not be expanded by in the tick for lack of
+ * memory, the same shortage as reported in the "was unable to expand" message,
+ * and @short_ticks is the number of consecutive ticks it has been non-zero.
+ * @free is Xen free memory above slack, lien and host_reserved_soft, and
+ * @surplus is memory above dmem_quota held by domains with data rate at or
+ * below rate_low. @top lists up to PRESSURE_TOP_DOMAINS domains short of
+ * memory, most starved first. Domain names are stripped of the characters
+ * used as separators.
+ *
+ * "membalancectl pressure-aggregate" collects summaries of multiple hosts,
+ * ranks the hosts and suggests live migrations from hosts under persistent
+ * pressure to hosts that have room.
+ */
+
+#define PRESSURE_MAGIC		"membalance-pressure"
+#define PRESSURE_VERSION	1
+#define PRESSURE_TOP_DOMAINS	5
+
+/* domain short of memory */
+class pressure_domain
+{
+public:
+	long domain_id;
+	long memsize;			/* size the domain wants to have (KBs) */
+	long shortage;			/* KBs */
+	std::string name;
+};
+
+class pressure_summary
+{
+public:
+	std::string host;
+	int64_t time;			/* unix time */
+	int interval;			/* sec */
+	long unmet;			/* KBs */
+	int short_ticks;
+	long free;			/* KBs */
+	long surplus;			/* KBs */
+	std::vector<pressure_domain> top;
+
+	pressure_summary();
+	std::string format(void) const;
+	bool parse(const char* text);
+};
+
+bool pressure_sink_open(const char* spec);
+void pressure_sink_close(void);
+void pressure_note_shortage(const domain_info* dom, long shortage);
+void pressure_publish(void);
+int pressure_aggregate(const char* listen_spec,
+		       const std::vector<std::string>& files,
+		       int interval, int persist, bool once);
+
+#endif // __MEMBALANCE_PRESSURE_H__
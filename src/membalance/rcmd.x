@@ -58,6 +58,72 @@ struct rcmd_freemem_res
 	unsigned hyper freemem_less_slack;      /* free memory - slack */
 };
 
+struct rcmd_freemem_tier
+{
+	unsigned hyper free_with_slack;		/* available now, without shrinking */
+	unsigned hyper free_less_slack;		/* ... less slack */
+	unsigned hyper max_with_slack;		/* after shrinking all domains to dmem_min */
+	unsigned hyper max_less_slack;		/* ... less slack */
+};
+
+struct rcmd_freemem_donor
+{
+	unsigned hyper domain_id;
+	unsigned hyper memsize;			/* current size */
+	unsigned hyper target;			/* size it would be shrunk to */
+};
+
+struct rcmd_freemem_plan_res
+{
+	/*
+	 * status:
+	 *
+	 *    N => Requested amount is not attainable.
+	 *         Other fields show what could be attained.
+	 *
+	 *    A => Requested amount is attainable.
+	 */
+	int status;
+	rcmd_freemem_tier keep_reserved_hard;	/* leaving host_reserved_hard alone */
+	rcmd_freemem_tier use_reserved_hard;	/* drawing on host_reserved_hard */
+	unsigned hyper freemem_with_slack;	/* free memory once donors have shrunk */
+	unsigned hyper freemem_less_slack;	/* ... less slack */
+	unsigned hyper reclaim;			/* memory to take from donors */
+	int est_ms;				/* time to take it (ms), -1 if not known */
+	rcmd_freemem_donor donors<>;
+};
+
+struct rcmd_hist_bucket
+{
+	unsigned hyper low_ns;			/* smallest value in the bucket */
+	unsigned hyper count;
+};
+
+struct rcmd_histogram
+{
+	string name<>;
+	unsigned hyper count;			/* number of recorded durations */
+	unsigned hyper sum_ns;
+	unsigned hyper min_ns;
+	unsigned hyper max_ns;
+	unsigned hyper p50_ns;
+	unsigned hyper p90_ns;
+	unsigned hyper p99_ns;
+	rcmd_hist_bucket buckets<>;		/* non-empty buckets only */
+};
+
+struct rcmd_counter
+{
+	string name<>;
+	unsigned hyper value;
+};
+
+struct rcmd_stats_res
+{
+	rcmd_histogram histograms<>;		/* since daemon start */
+	rcmd_counter counters<>;		/* ... */
+};
+
 program RCMD_MEMBALANCED {
 	version RCMD_MEMBALANCED_V1 {
 		/*
@@ -173,6 +239,27 @@ program RCMD_MEMBALANCED {
 		 */
 		rcmd_status
 		rcmd_test(rcmd_str_listentry_ptr /*argv*/) = 12;
+
+		/*
+		 * Get latency histograms and event counters accumulated
+		 * since daemon start
+		 */
+		rcmd_stats_res
+		rcmd_get_stats(void) = 13;
+
+		/*
+		 * Evaluate what rcmd_freemem with the same arguments could
+		 * achieve, without shrinking any domains. Does not require
+		 * automatic memory adjustment to be paused.
+		 *
+		 * Return free memory attainable with and without drawing on
+		 * host_reserved_hard, projected result of the request and
+		 * domains that would be shrunk for it. All amounts are in KBs.
+		 */
+		rcmd_freemem_plan_res
+		rcmd_freemem_plan(unsigned hyper /*amt_kbs*/,
+				  bool /*above_slack*/,
+				  bool /*use_reserved_hard*/) = 14;
 	} = 1;
 } = 0x40000001;
 
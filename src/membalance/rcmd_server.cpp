@@ -25,6 +25,11 @@ void rcmd_membalanced_1(struct svc_req *rqstp, register SVCXPRT *transp);
 ******************************************************************************/
 
 static void on_addrinuse(const struct sockaddr_un& addr);
+static bool is_deferred(int fd);
+static bool process_deferred(void);
+static void complete_freemem(freemem_request* fm);
+static void marshal_kvs(const map_ss& kvm, struct rcmd_kv_listentry** pkvs);
+static void marshal_tier(const freemem_tier& tier, rcmd_freemem_tier* rt);
 
 
 /******************************************************************************
@@ -35,6 +40,35 @@ static int sock = -1;			/* listener socket */
 static bool sock_unlink = false;	/* remove socket file on shutdown */
 static bool svc_registered = false;	/* service registered */
 
+/*
+ * "membalancectl free-memory" requests may take seconds to complete while
+ * waiting for domains to shrink. Rather than stalling the main loop, their
+ * replies are deferred and the requests are advanced from the main loop.
+ *
+ * Requests arriving while memory is being waited to stabilize join the
+ * batch in progress (freemem_request), to be served by the same shrinking
+ * pass and wait. Requests arriving later start a new batch, performed after
+ * the current one completes, since it plans against the memory state left
+ * by the current one.
+ *
+ * The connection a deferred request came on is excluded from polling until
+ * the reply is sent, so the RPC library won't read from it or destroy it
+ * meanwhile.
+ */
+typedef struct __deferred_freemem
+{
+	SVCXPRT* transp;		/* connection to reply on */
+	freemem_request* fm;		/* batch the request belongs to */
+	int part;			/* index of the request in @fm->parts */
+	int64_t t0;			/* time of arrival (stat_now_ns) */
+}
+deferred_freemem;
+
+static std::vector<deferred_freemem> deferred;		/* awaiting reply */
+static std::vector<freemem_request*> freemem_queue;	/* batches, head is in progress */
+static bool freemem_started = false;			/* head has been advanced */
+static struct timespec ts_freemem_step;			/* ... last time */
+
 
 /******************************************************************************
 *                           start/stop RPC server                             *
@@ -200,12 +234,14 @@ void rcmd_setup_pollfds(struct pollfd* pollfds)
 	struct pollfd* pollfd;
 	int k;
 
-	/* RPC connection sockets */
+	/* RPC connection sockets, except those awaiting deferred reply */
 	for (k = 0, pollfd = pollfds;  k < svc_max_pollfd;  k++, pollfd++)
 	{
 		pollfd->fd = svc_pollfd[k].fd;
 		pollfd->events = svc_pollfd[k].events;
 		pollfd->revents = 0;
+		if (pollfd->fd != -1 && is_deferred(pollfd->fd))
+			pollfd->fd = -1;
 	}
 
 	/* listener socket */
@@ -274,9 +310,113 @@ bool rcmd_handle_pollfds(struct pollfd* pollfds)
 		}
 	}
 
+	/* advance deferred requests */
+	if (process_deferred())
+		res = true;
+
 	return res;
 }
 
+/*
+ * Get time (ms) till deferred requests need to be advanced,
+ * or -1 if there are none
+ */
+int rcmd_deferred_wait_ms(void)
+{
+	int64_t wms;
+
+	if (freemem_queue.empty())
+		return -1;
+
+	if (!freemem_started)
+		return 0;
+
+	wms = freemem_queue.front()->wait_ms() - timespec_diff_ms(getnow(), ts_freemem_step);
+
+	return (int) max(wms, (int64_t) 0);
+}
+
+/*
+ * Check if connection @fd has a deferred request
+ */
+static bool is_deferred(int fd)
+{
+	for (unsigned k = 0;  k < deferred.size();  k++)
+	{
+		if (deferred[k].transp->xp_sock == fd)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Advance the batch of requests at the head of the queue if it is due.
+ * Return @true if any batch was processed.
+ */
+static bool process_deferred(void)
+{
+	freemem_request* fm;
+	bool res = false;
+
+	while (!freemem_queue.empty())
+	{
+		if (freemem_started && rcmd_deferred_wait_ms() > 0)
+			break;
+
+		res = true;
+		fm = freemem_queue.front();
+		freemem_started = true;
+		if (!fm->step())
+		{
+			ts_freemem_step = getnow();
+			break;
+		}
+
+		complete_freemem(fm);
+	}
+
+	return res;
+}
+
+/*
+ * Batch at the head of the queue has been completed:
+ * send deferred replies and dispose of the batch
+ */
+static void complete_freemem(freemem_request* fm)
+{
+	rcmd_freemem_res result;
+
+	for (unsigned k = 0;  k < deferred.size();  )
+	{
+		deferred_freemem& df = deferred[k];
+		if (df.fm != fm)
+		{
+			k++;
+			continue;
+		}
+
+		const freemem_part& part = fm->parts[df.part];
+		result.status = part.status;
+		result.freemem_with_slack = part.freemem_with_slack;
+		result.freemem_less_slack = part.freemem_less_slack;
+
+		if (!svc_sendreply(df.transp, (xdrproc_t) xdr_rcmd_freemem_res, (caddr_t) &result))
+			error_msg("unable to send reply to free-memory request");
+
+		stat_hist[STAT_HIST_FREEMEM].record(stat_now_ns() - df.t0);
+
+		deferred.erase(deferred.begin() + k);
+	}
+
+	debug_msg(5, "completed %lu free-memory request(s)",
+		  (unsigned long) fm->parts.size());
+
+	delete fm;
+	freemem_queue.erase(freemem_queue.begin());
+	freemem_started = false;
+}
+
 
 /******************************************************************************
 *                             RPC service routines                            *
@@ -330,6 +470,14 @@ rcmd_resume_1_svc(bool_t force, u_int *level, struct svc_req *rqstp)
  * If Xen memory is in the state of a flux, e.g. domains are continuing to
  * expand or contract, allow membalance daemon to wait up to @timeout
  * seconds for the flux to stabilize if deemed necessary.
+ *
+ * If the request cannot be completed right away, the reply is deferred
+ * (see process_deferred) and the main loop keeps running meanwhile.
+ *
+ * Requests arriving while the latest batch is still waiting for memory
+ * to stabilize join the batch. The batch then waits until the timeout of
+ * the latest-expiring request in it, so joining does not shorten the wait
+ * any request is entitled to (but can lengthen the wait for the others).
  */
 bool_t
 rcmd_freemem_1_svc(u_quad_t amt,
@@ -339,14 +487,94 @@ rcmd_freemem_1_svc(u_quad_t amt,
 		   int timeout,
 		   rcmd_freemem_res *result, struct svc_req *rqstp)
 {
-	result->status = sched_freemem(amt, above_slack, use_reserved_hard, must,
-				       timeout,
-				       &result->freemem_with_slack,
-				       &result->freemem_less_slack);
+	deferred_freemem df;
+	freemem_request* fm;
+
+	/* join the latest batch if it is still open, otherwise start a new one */
+	if (freemem_queue.empty() || !freemem_queue.back()->joinable())
+		freemem_queue.push_back(new freemem_request(timeout));
+	else
+		freemem_queue.back()->extend_timeout(timeout);
+
+	fm = freemem_queue.back();
+	df.transp = rqstp->rq_xprt;
+	df.fm = fm;
+	df.part = fm->add(amt, above_slack, use_reserved_hard, must);
+	df.t0 = stat_now_ns();
+	deferred.push_back(df);
+
+	/* if the batch can be started right away, try to complete it right away */
+	if (fm == freemem_queue.front() && !freemem_started)
+	{
+		freemem_started = true;
+		if (fm->step())
+		{
+			const freemem_part& part = fm->parts[df.part];
+			result->status = part.status;
+			result->freemem_with_slack = part.freemem_with_slack;
+			result->freemem_less_slack = part.freemem_less_slack;
+			deferred.pop_back();
+			stat_hist[STAT_HIST_FREEMEM].record(stat_now_ns() - df.t0);
+			complete_freemem(fm);
+			return true;
+		}
+		ts_freemem_step = getnow();
+	}
+
+	debug_msg(5, "deferring free-memory request (batch of %lu, %lu batches queued)",
+		  (unsigned long) fm->parts.size(), (unsigned long) freemem_queue.size());
+
+	/* do not reply now */
+	return false;
+}
+
+/*
+ * Evaluate what rcmd_freemem with the same arguments could achieve,
+ * without shrinking any domains (see sched_freemem_plan)
+ */
+bool_t
+rcmd_freemem_plan_1_svc(u_quad_t amt,
+			bool_t above_slack,
+			bool_t use_reserved_hard,
+			rcmd_freemem_plan_res *result, struct svc_req *rqstp)
+{
+	freemem_projection proj;
+	rcmd_freemem_donor* rd;
+	unsigned k;
+
+	sched_freemem_plan(amt, above_slack, use_reserved_hard, proj);
+
+	result->status = proj.status;
+	marshal_tier(proj.keep_reserved_hard, &result->keep_reserved_hard);
+	marshal_tier(proj.use_reserved_hard, &result->use_reserved_hard);
+	result->freemem_with_slack = proj.freemem_with_slack;
+	result->freemem_less_slack = proj.freemem_less_slack;
+	result->reclaim = proj.reclaim;
+	result->est_ms = proj.est_ms;
+
+	result->donors.donors_len = proj.donors.size();
+	result->donors.donors_val =
+		(rcmd_freemem_donor*) xmalloc(sizeof(rcmd_freemem_donor) * max(proj.donors.size(), (size_t) 1));
+
+	for (k = 0;  k < proj.donors.size();  k++)
+	{
+		rd = &result->donors.donors_val[k];
+		rd->domain_id = proj.donors[k].domain_id;
+		rd->memsize = proj.donors[k].memsize;
+		rd->target = proj.donors[k].target;
+	}
 
 	return true;
 }
 
+static void marshal_tier(const freemem_tier& tier, rcmd_freemem_tier* rt)
+{
+	rt->free_with_slack = tier.free_with_slack;
+	rt->free_less_slack = tier.free_less_slack;
+	rt->max_with_slack = tier.max_with_slack;
+	rt->max_less_slack = tier.max_less_slack;
+}
+
 /*
  * Rescan domain and try to make it managed.
  * When returns, the domain may still be in a pending state.
@@ -450,21 +678,13 @@ rcmd_get_domain_settings_1_svc(u_quad_t arg1,
 			       struct rcmd_domain_settings_res *result,
 			       struct svc_req *rqstp)
 {
-	struct rcmd_kv_listentry* kvp;
 	map_ss kvm;
 
 	/* get properties as a key-value map */
 	result->status = get_domain_settings((long) arg1, &result->message, kvm);
 
 	/* marshal properties as a key-value list */
-	for (map_ss::const_iterator it = kvm.begin();  it != kvm.end();  ++it)
-	{
-		kvp = (struct rcmd_kv_listentry*) xmalloc(sizeof(*kvp));
-		kvp->key = xstrdup(it->first.c_str());
-		kvp->value = xstrdup(it->second.c_str());
-		kvp->next = result->kvs;
-		result->kvs = kvp;
-	}
+	marshal_kvs(kvm, &result->kvs);
 
 	return true;
 }
@@ -478,16 +698,40 @@ rcmd_set_domain_settings_1_svc(u_quad_t arg1,
 			       struct rcmd_domain_settings_res *result,
 			       struct svc_req *rqstp)
 {
-	/*
-	 * not implemented yet
-	 */
-	result->status = 'X';
-	result->message = xstrdup("function is not implemented yet");
-	result->kvs = NULL;
+	struct rcmd_kv_listentry* kvp;
+	map_ss in;
+	map_ss kvm;
+
+	/* unmarshal requested changes */
+	for (kvp = arg2;  kvp;  kvp = kvp->next)
+		in[std::string(kvp->key)] = std::string(kvp->value);
+
+	/* apply them and get updated properties as a key-value map */
+	result->status = set_domain_settings((long) arg1, in, &result->message, kvm);
+
+	/* marshal properties as a key-value list */
+	marshal_kvs(kvm, &result->kvs);
 
 	return true;
 }
 
+/*
+ * Marshal key-value map @kvm as a key-value list prepended to *@pkvs
+ */
+static void marshal_kvs(const map_ss& kvm, struct rcmd_kv_listentry** pkvs)
+{
+	struct rcmd_kv_listentry* kvp;
+
+	for (map_ss::const_iterator it = kvm.begin();  it != kvm.end();  ++it)
+	{
+		kvp = (struct rcmd_kv_listentry*) xmalloc(sizeof(*kvp));
+		kvp->key = xstrdup(it->first.c_str());
+		kvp->value = xstrdup(it->second.c_str());
+		kvp->next = *pkvs;
+		*pkvs = kvp;
+	}
+}
+
 /*
  * Execute development-time test
  */
@@ -520,6 +764,71 @@ rcmd_test_1_svc(rcmd_str_listentry_ptr arg1, rcmd_status *result, struct svc_req
 	return true;
 }
 
+/*
+ * Get latency histograms and event counters accumulated since daemon start.
+ * Histograms are sent with non-empty buckets only.
+ */
+bool_t
+rcmd_get_stats_1_svc(rcmd_stats_res *result, struct svc_req *rqstp)
+{
+	const latency_histogram* hist;
+	rcmd_histogram* rh;
+	rcmd_counter* rc;
+	int k, j, nb;
+
+	result->histograms.histograms_len = STAT_HIST_COUNT;
+	result->histograms.histograms_val =
+		(rcmd_histogram*) xmalloc(sizeof(rcmd_histogram) * STAT_HIST_COUNT);
+
+	for (k = 0;  k < STAT_HIST_COUNT;  k++)
+	{
+		hist = &stat_hist[k];
+		rh = &result->histograms.histograms_val[k];
+
+		rh->name = xstrdup(stat_hist_name(k));
+		rh->count = hist->count;
+		rh->sum_ns = hist->sum;
+		rh->min_ns = hist->vmin;
+		rh->max_ns = hist->vmax;
+		rh->p50_ns = hist->percentile(50);
+		rh->p90_ns = hist->percentile(90);
+		rh->p99_ns = hist->percentile(99);
+
+		for (nb = j = 0;  j < latency_histogram::HIST_NBUCKETS;  j++)
+		{
+			if (hist->buckets[j])
+				nb++;
+		}
+
+		rh->buckets.buckets_len = nb;
+		rh->buckets.buckets_val =
+			(rcmd_hist_bucket*) xmalloc(sizeof(rcmd_hist_bucket) * max(nb, 1));
+
+		for (nb = j = 0;  j < latency_histogram::HIST_NBUCKETS;  j++)
+		{
+			if (hist->buckets[j])
+			{
+				rh->buckets.buckets_val[nb].low_ns = latency_histogram::bucket_low(j);
+				rh->buckets.buckets_val[nb].count = hist->buckets[j];
+				nb++;
+			}
+		}
+	}
+
+	result->counters.counters_len = STAT_COUNTER_COUNT;
+	result->counters.counters_val =
+		(rcmd_counter*) xmalloc(sizeof(rcmd_counter) * STAT_COUNTER_COUNT);
+
+	for (k = 0;  k < STAT_COUNTER_COUNT;  k++)
+	{
+		rc = &result->counters.counters_val[k];
+		rc->name = xstrdup(stat_counter_name(k));
+		rc->value = stat_counter[k];
+	}
+
+	return true;
+}
+
 /*
  * May insert additional freeing code here, if needed
  */
@@ -14,6 +14,252 @@
 *                            local declarations                               *
 ******************************************************************************/
 
+/*
+ * Records durations of sched_memory(...) stages into @sched_stage_ns
+ * and stage latency histograms
+ */
+class stage_timer
+{
+public:
+	stage_timer()
+	{
+		for (int k = 0;  k < SCHED_STAGE_COUNT;  k++)
+			sched_stage_ns[k] = -1;
+		t0 = stat_now_ns();
+	}
+
+	/* record time since the previous lap as the duration of @stage */
+	void lap(sched_stage_t stage)
+	{
+		int64_t t = stat_now_ns();
+		sched_stage_ns[stage] = t - t0;
+		stat_hist[stage].record(t - t0);
+		t0 = t;
+	}
+
+protected:
+	int64_t t0;
+};
+
+/*
+ * Snapshot of the fields of managed domains that are hot in scheduling
+ * stages 2-4, laid out as a structure of arrays indexed by domain slot.
+ * Slots follow the order of doms.managed (ascending domain id).
+ *
+ * The snapshot is loaded after data collection (or by sched_freemem before
+ * reclaiming memory), the stages operate on it rather than on domain_info
+ * objects, and the results are stored back into domain_info before domain
+ * size changes are applied.
+ */
+class sched_snapshot
+{
+public:
+	int ndoms;
+
+	std::vector<domain_info*> info;
+
+	/* domain size (KBs) */
+	std::vector<long> memsize;
+	std::vector<long> memsize0;
+	std::vector<long> memsize_incr;
+	std::vector<long> memsize_decr;
+
+	/* lien (KBs) of expansion in flight not yet drawn on by the plan */
+	std::vector<long> lien;
+
+	/* domain settings */
+	std::vector<long> dmem_min;
+	std::vector<long> dmem_quota;
+	std::vector<long> dmem_max;
+	std::vector<double> dmem_decr;
+	std::vector<long> rate_low;
+	std::vector<long> rate_high;
+
+	/* rate data */
+	std::vector<long> rate;
+	std::vector<long> slow_rate;
+	std::vector<long> fast_rate;
+	std::vector<long> time_rate_below_low;
+	std::vector<long> time_rate_below_high;
+
+	/* SLA priority class */
+	std::vector<int> priority;
+
+	/* forces */
+	std::vector<double> expand_force;
+	std::vector<double> resist_force;
+	std::vector<double> expand_force0;
+	std::vector<balside_t> balside;
+
+	/* NUMA node domain is confined to, or -1 */
+	std::vector<int> numa_node;
+
+	/* SNAP_xxx flags */
+	std::vector<u_char> flags;
+
+public:
+	sched_snapshot()
+	{
+		ndoms = 0;
+	}
+
+	void load(void);
+	void store(void);
+
+	bool valid_data(int dom) const
+	{
+		return 0 != (flags[dom] & SNAP_VALID_DATA);
+	}
+
+	bool runnable(int dom) const
+	{
+		return 0 != (flags[dom] & SNAP_RUNNABLE);
+	}
+
+	void set_runnable(int dom, bool runnable)
+	{
+		if (runnable)
+			flags[dom] |= SNAP_RUNNABLE;
+		else
+			flags[dom] &= ~SNAP_RUNNABLE;
+	}
+
+	bool trimming_to_quota(int dom) const
+	{
+		return 0 != (flags[dom] & SNAP_TRIMMING_TO_QUOTA);
+	}
+
+	/* see is_shrink_soft_protected(...) */
+	bool soft_protected(int dom) const
+	{
+		return 0 != (flags[dom] & SNAP_SOFT_PROTECTED);
+	}
+
+protected:
+	static const u_char SNAP_VALID_DATA = (1 << 0);
+	static const u_char SNAP_RUNNABLE = (1 << 1);
+	static const u_char SNAP_TRIMMING_TO_QUOTA = (1 << 2);
+	static const u_char SNAP_SOFT_PROTECTED = (1 << 3);
+};
+
+/*
+ * Vector of domain slots in sched_snapshot, with sorting orders
+ * equivalent to those of domvector
+ */
+class slotvec : public std::vector<int>
+{
+public:
+	/* sort by resist_force in increasing order */
+	void sort_asc_by_resist_force(void);
+
+	/* sort by priority in increasing order, then time_rate_below_low in descending order */
+	void sort_desc_by_time_rate_below_low(void);
+
+	/* sort by priority in increasing order, then time_rate_below_high in descending order */
+	void sort_desc_by_time_rate_below_high(void);
+};
+
+/*
+ * Indexed priority queue of domain slots in sched_snapshot, ordered by
+ * force @key, in descending (@desc = true) or ascending order.
+ *
+ * Retrieves slots in the same order as a slotvec sorted by @key and then
+ * maintained by removing the front element and re-inserting it ahead of
+ * other slots with an equal key, but at O(log N) cost per operation.
+ */
+class slotqueue
+{
+public:
+	slotqueue(const std::vector<double>& key, bool desc) : key(key)
+	{
+		this->desc = desc;
+		nstamp = 0;
+	}
+
+	/* populate queue with slots in @vec */
+	void build(const slotvec& vec);
+
+	bool empty(void) const
+	{
+		return heap.size() == 0;
+	}
+
+	/* highest priority slot */
+	int top(void) const
+	{
+		return heap[0];
+	}
+
+	/* remove highest priority slot */
+	void pop(void);
+
+	/* check if @dom is in the queue */
+	bool queued(int dom) const
+	{
+		return pos[dom] >= 0;
+	}
+
+	/*
+	 * Reposition @dom after its key has changed, placing it ahead
+	 * of other slots with an equal key
+	 */
+	void update(int dom);
+
+protected:
+	const std::vector<double>& key;
+	bool desc;
+	std::vector<int> heap;		/* binary heap of slots */
+	std::vector<int> pos;		/* slot -> index in @heap, or -1 */
+	std::vector<long> stamp;	/* slot -> tie-breaking stamp */
+	long nstamp;			/* last issued stamp */
+
+	bool before(int d1, int d2) const;
+	void sift_up(unsigned k);
+	void sift_down(unsigned k);
+
+	void place(unsigned k, int dom)
+	{
+		heap[k] = dom;
+		pos[dom] = k;
+	}
+};
+
+/*
+ * Least-squares linear fit of samples (x, y), used to project
+ * rate and free memory trends forward in PREDICT mode
+ */
+class trend_fit
+{
+public:
+	trend_fit()
+	{
+		n = 0;
+		sx = sy = sxx = sxy = 0;
+	}
+
+	void add(double x, double y)
+	{
+		n++;
+		sx += x;
+		sy += y;
+		sxx += x * x;
+		sxy += x * y;
+	}
+
+	/* slope of fitted line (0 if undetermined) */
+	double slope(void) const
+	{
+		double d = n * sxx - sx * sx;
+		if (n < 2 || d == 0)
+			return 0;
+		return (n * sxy - sx * sy) / d;
+	}
+
+protected:
+	int n;
+	double sx, sy, sxx, sxy;
+};
+
 class eval_force_context
 {
 public:
@@ -30,8 +276,8 @@ public:
 	double base[3][3];
 
 public:
-	void eval_resist_force_context(const domvector& vec, int vk1, int vk2);
-	void eval_expand_force_context(const domvector& vec, int vk1, int vk2);
+	void eval_resist_force_context(const slotvec& vec, int vk1, int vk2);
+	void eval_expand_force_context(const slotvec& vec, int vk1, int vk2);
 
 protected:
 	void pre_eval(void)
@@ -84,11 +330,99 @@ static long xen_free0;
  */
 static long host_lien0;
 
+/*
+ * NUMA nodes, as read by stage_collect_data() when NUMA-aware balancing
+ * is in effect, otherwise @numa_nodes is 0.
+ *
+ * @node_free is node free memory less the node's share of slack and lien,
+ * kept updated along with @host_free. Node's share of host-wide amounts
+ * (slack, lien, reserves) is proportional to its size.
+ */
+static int numa_nodes;
+static long numa_size;			/* total size of the nodes */
+static std::vector<long> node_size;
+static std::vector<long> node_free;
+
 /*
  * map: domain id -> xc_domaininfo_t*
  */
 static domid2xcinfo id2xcinfo;
 
+/*
+ * Memory set aside for completed "membalancectl free-memory" requests,
+ * so that ticks won't expand domains into it before the requester (such
+ * as a domain being started) gets to use it. A lien is consumed by the
+ * allocation of domains created after it has been taken, and expires
+ * after @freemem_lien_timeout seconds in any event (see eval_freemem_lien).
+ */
+class freemem_lien
+{
+public:
+	long amount;		/* memory set aside (KBs) */
+	long remaining;		/* ... not consumed yet */
+	struct timespec expires;
+	domid_set known;	/* domains that existed when the lien was taken */
+};
+
+static std::vector<freemem_lien> freemem_liens;	/* in the order taken */
+
+/*
+ * Ledger of expansions issued by membalance and not completed yet (see
+ * note_memory_target). Memory that a domain is yet to take to reach its
+ * requested size is a lien on Xen free memory. The ledger is updated as
+ * domain memory data is collected (see update_domain_lien): an entry is
+ * dropped once the domain reaches the requested allocation, when its
+ * target gets changed by somebody else, or when it makes no progress
+ * for @resize_lien_timeout seconds.
+ */
+class inflight_resize
+{
+public:
+	long target;		/* requested size (G+V, KBs) */
+	long alloc;		/* expected Xen allocation at @target (G+V+X, KBs) */
+	long progress;		/* allocation at the last observed progress (KBs) */
+	struct timespec ts_progress;
+};
+
+static std::map<long, inflight_resize> inflight_resizes;	/* by domain id */
+
+/*
+ * Current lien of each managed domain that has any, either from the ledger
+ * or, for domains not in the ledger, from the pending expansion of a paused
+ * domain. @domain_lien_total is kept as the sum of the values.
+ */
+static std::map<long, long> domain_liens;			/* by domain id */
+static long domain_lien_total = 0;
+
+/*
+ * Rate at which shrinking domains released memory to "membalancectl
+ * free-memory" requests (KB/s, moving average), 0 if not observed yet
+ */
+static double freemem_reclaim_rate = 0;
+
+/*
+ * Number of the latest prepare-shrink request to guests
+ * (see freemem_request::request_prepare)
+ */
+static u_long prepare_shrink_seq = 0;
+
+/*
+ * Scheduling snapshot of managed domains
+ */
+static sched_snapshot snap;
+
+/*
+ * Domain information read by do_resize_domains() while expanding
+ */
+static domid2xcinfo resize_id2xcinfo;
+
+/*
+ * Private domain data of sched_freemem_plan(...),
+ * kept apart from @id2xcinfo and @snap
+ */
+static domid2xcinfo plan_id2xcinfo;
+static sched_snapshot plan_snap;
+
 /*
  * Contraction-resist force of "soft" free space
  * between host_reserved_soft and host_reserved_hard.
@@ -104,6 +438,8 @@ static const double eps = DBL_EPSILON;
 ******************************************************************************/
 
 static void stage_collect_data(void);
+static void record_host_state(void);
+static void collect_numa_state(void);
 static void record_memory_info(domain_info* dom, const xc_domaininfo_t* xcinfo);
 static void reset_preshrink(domain_info* dom);
 static void sched_reserved_hard(void);
@@ -113,38 +449,47 @@ static void hard_reclaim_round_2(long& goal);
 static void hard_reclaim_round_3(long& goal);
 static void hard_reclaim_round_4(long& goal);
 static void hard_reclaim_round_5(long& goal);
-static void eval_resist_force(const domvector& vec);
-static void eval_resist_force(const domvector& vec, int vk1, int vk2);
-static void eval_resist_force(eval_force_context& ctx, domain_info* dom);
-static void eval_expand_force(const domvector& vec);
-static void eval_expand_force(const domvector& vec, int vk1, int vk2);
-static void eval_expand_force(eval_force_context& ctx, domain_info* dom);
+static void eval_resist_force(const slotvec& vec);
+static void eval_resist_force(const slotvec& vec, int vk1, int vk2);
+static void eval_resist_force(eval_force_context& ctx, int dom);
+static void eval_expand_force(const slotvec& vec);
+static void eval_expand_force(const slotvec& vec, int vk1, int vk2);
+static void eval_expand_force(eval_force_context& ctx, int dom);
 static void sched_reserved_soft(void);
 static long soft_reclaim(long goal);
 static void soft_reclaim_round_1(long& goal);
 static void soft_reclaim_round_2(long& goal);
 static void soft_reclaim_round_3(long& goal);
 static void sched_rebalance(void);
-static bool expand_into_freemem(domain_info* dom, long need);
-static void rebalance_domains(domain_info* dom,
+static bool expand_into_freemem(int dom, long need, int node);
+static void rebalance_domains(int dom,
 			      long need,
 			      eval_force_context& resist_force_context,
-			      domvector& vec_shrink);
-static long free_allocate(double expand_force, long need);
-static void insert_into_vec_expand(domvector& vec, domain_info* dom);
-static void insert_into_vec_shrink(domvector& vec, domain_info* dom);
+			      slotqueue& queue_shrink,
+			      std::vector<slotqueue>& queue_node,
+			      int node);
+static long free_allocate(double expand_force, long need, int node);
+static void node_credit(int node, long amount);
+static void node_debit(int node, long amount, long reserve);
 static void do_resize_domains(void);
 static void unrecognized_domain_state(const xc_domaininfo_t* xcinfo);
 static void log_resize(domain_info* dom, const char* action);
 static void log_unexpanded(domvector& vec_up, bool warn, bool partial, long prev_goal);
 static long mem_released_by(const domvector& vec_down, const domid2xcinfo& xinfo);
 static long eval_allocate(domain_info* dom, long curr_size, long prev_alloc,
-			  const domvector& vec_down,
-			  const domid2xcinfo& xinfo,
-			  long allocated);
-static void regoal(domain_info* dom, long size);
+			  long released, long allocated, long xen_free, long lien);
+static void regoal(domain_info* dom, long size, resize_batch& batch);
 static long mem_shortage(domvector& vec_up, bool partial, long prev_goal);
 static long eval_memory_lien(void);
+static long peek_memory_lien(const domid2xcinfo& xinfo);
+static void update_domain_lien(domain_info* dom);
+static void set_domain_lien(long domain_id, long lien);
+static long domain_lien(const domain_info* dom);
+static long eval_freemem_lien(void);
+static void take_freemem_lien(long amount);
+static void fill_freemem_tier(freemem_tier& tier, long xen_free_memory, long max_xen_free_memory,
+			      long lien, bool draw_reserved_hard);
+static void note_freemem_reclaim_rate(long released, int64_t elapsed_ms);
 static void print_plan(const domvector& vec_down, const domvector& vec_up);
 static void print_reclaimed(void);
 
@@ -204,11 +549,11 @@ static void unrecognized_domain_state(const xc_domaininfo_t* xcinfo)
  *     C_MID:    RATE = ] RATE_LOW ... RATE_HIGH [
  *     C_HIGH:	 RATE >= RATE_HIGH
  */
-inline static category_t rate_category(domain_info* dom, long rate)
+inline static category_t rate_category(int dom, long rate)
 {
-	if (rate >= dom->rate_high)
+	if (rate >= snap.rate_high[dom])
 		return C_HIGH;
-	else if (rate <= dom->rate_low)
+	else if (rate <= snap.rate_low[dom])
 		return C_LOW;
 	else
 		return C_MID;
@@ -222,11 +567,11 @@ inline static category_t rate_category(domain_info* dom, long rate)
  *     C_HIGH:	 DMEM_SIZE > DMEM_QUOTA
  *
  */
-inline static category_t size_resist_category(domain_info* dom, long size)
+inline static category_t size_resist_category(int dom, long size)
 {
-	if (size > dom->dmem_quota)
+	if (size > snap.dmem_quota[dom])
 		return C_HIGH;
-	else if (size <= dom->dmem_min)
+	else if (size <= snap.dmem_min[dom])
 		return C_LOW;
 	else
 		return C_MID;
@@ -240,16 +585,33 @@ inline static category_t size_resist_category(domain_info* dom, long size)
  *     C_HIGH:	 DMEM_SIZE >= DMEM_QUOTA
  *
  */
-inline static category_t size_expand_category(domain_info* dom, long size)
+inline static category_t size_expand_category(int dom, long size)
 {
-	if (size >= dom->dmem_quota)
+	if (size >= snap.dmem_quota[dom])
 		return C_HIGH;
-	else if (size < dom->dmem_min)
+	else if (size < snap.dmem_min[dom])
 		return C_LOW;
 	else
 		return C_MID;
 }
 
+/*
+ * Scale force of domain @dom by its SLA priority class (100 is normal).
+ * Forces of domain at or below @dmem_min (size category @c_size is C_LOW)
+ * are left alone, and scaled forces of other domains are kept below the
+ * lowest C_LOW band force @c_low_force, so priority only reorders domains
+ * within a band and the minimum stays guaranteed regardless of priority.
+ */
+inline static void weigh_by_priority(int dom, category_t c_size, double& force,
+				     double c_low_force)
+{
+	if (c_size != C_LOW && snap.priority[dom] != 100)
+	{
+		force *= snap.priority[dom] / 100.0;
+		force = min(force, c_low_force - 1);
+	}
+}
+
 /*
  * Check if domain is protected from shrinking in the current tick due to been
  * just recently expanded. This protection applies only against meeting
@@ -261,107 +623,389 @@ inline static bool is_shrink_soft_protected(domain_info* dom)
 	return (sched_tick - dom->last_expand_tick) <= config.shrink_protection_time;
 }
 
+/*
+ * Heartbeat interval (sec) of domain doing change-only reporting, or 0
+ */
+inline static long report_heartbeat(const domain_info* dom)
+{
+	return min(dom->report_heartbeat, (long) config.max_report_heartbeat);
+}
+
+/*
+ * Share of host-wide @amount (KBs) attributable to NUMA @node
+ */
+inline static long node_share(long amount, int node)
+{
+	return (long) ((double) amount * node_size[node] / numa_size);
+}
+
+/*
+ * Free memory on NUMA @node available for domain expansion
+ * when host-wide @reserve is to be left alone
+ */
+inline static long node_avail(int node, long reserve)
+{
+	return node_free[node] - node_share(reserve, node);
+}
+
 
 /******************************************************************************
-*                             main scheduling routine                         *
+*                             scheduling snapshot                             *
 ******************************************************************************/
 
 /*
- * Memory scheduling algorithm dynamically balances host memory allocation
- * between participating domains according to their current memory demand
- * measured as domain data map-in rate (hard page faults rate + file system
- * cache block read-in rate, kb/sec) over current sampling interval.
- *
- * The algorithm is invoked every INTERVAL seconds - but only if there is
- * at least one currently managed domain. If there are no managed domains,
- * the algorithm is not invoked. (Once there appear managed domains, tick
- * count is incremented accordingly to refelect elapsed sleep time.)
- *
- * If automatic domain memory allocation is paused by system administrator,
- * the algorithm is invoked only to collect data (stage 1 as described below),
- * but does not perform any adjustments (stages 2-4 are not invoked).
- *
- * The algorithm tries to provide good memory-supply responsivness for domains
- * that need to expand, while avoiding premature domain contraction and
- * upsize-downsize thrashing. The algorithm's motto is "expand fast, contract
- * slow" (wherever possible at all). To this end:
- *
- *     - Algorithm allows domains to grow in a time of plenty and trims
- *       domains only when there is actual demand for memory. When there
- *       is no demand, domains are allowed to keep memory allocated to them.
- *
- *     - Algorithm reserves a part of memory (defined by HOST_RESERVED_SOFT)
- *       for domains in a substantial need of memory, otherwise keeping it
- *       free and immediatelly available for expansion of a domain when it
- *       comes in a substantial need of extra memory.
- *
- *     - Algorithm employs SLOW_RATE moving average to track recent history
- *       of domain's data map-in rate in order to avoid premature contraction
- *       of a domain just because it did not show memory demand for a tick
- *       or two.
- *
- *     - Maximum domain expansion amount at a normal interval (@dmem_incr)
- *       is larger by default than trimming amount (@dmem_decr), unless the
- *       memory is in very short supply, albeit the values are aqjustable
- *       by system administrator.
- *
- * The algorithm uses the following data items.
- *
- * Global dynamic values:
- *
- *     HOST_FREE = current amount of host free memory
- *
- * Global settings:
- *
- *     INTERVAL = interval between successive invocations of the algorithm
- *
- *     HOST_RESERVED_HARD = host memory to leave alone and never consume
- *      		    for allocation during domain size auto-adjustment
- *      		    by membalance:
- *
- *      	            1) membalance will not expand existing domains if such an
- *      		       expansion would leave HOST_FREE below HOST_RESERVED_HARD
- *
- *      	            2) if membalance detects that HOST_FREE dropped below
- *      		       HOST_RESERVED_HARD (e.g. because a new virtual machine
- *      		       has been launched or a domain was expanded manually
- *      		       by the system administrator) membalance will try to
- *      		       reclaim memory from domains managed by membalance to
- *      		       bring HOST_FREE up to HOST_RESERVED_HARD again
- *      		       or as close to it as possible for membalance
- *
- *      		    this amount is in addition to (on top of)
- *      		    Xen free memory slack
- *
- *     HOST_RESERVED_SOFT = host memory between HOST_RESERVED_SOFT and HOST_RESERVED_HARD
- *      		    is made available only for domains in significant need of memory
- *
- *      		    1) domains with DMEM_SIZE < DMEM_QUOTA and RATE > RATE_LOW
- *
- *      		    2) domains any size with data map-in rate >= RATE_HIGH
- *
- *      		    as follows:
- *
- *      		    1) if HOST_FREE <= HOST_RESERVED_SOFT, domain can
- *      		       only expand beyond DMEM_QUOTA when its data
- *      		       map-in RATE >= RATE_HIGH
- *
- *      		       this is the only constraint HOST_RESERVED_SOFT
- *      		       imposes on domain expansion
- *
- *      		       if domain size is below DMEM_QUOTA, domain still
- *      		       can expand up to DMEM_QUOTA if its RATE > RATE_LOW,
- *      		       regardless of HOST_RESERVED_SOFT
- *
- *      		    2) if HOST_FREE drops below (<) HOST_RESERVED_SOFT,
- *      		       membalance will try to shrink those domains that
- *      		       have rate < RATE_HIGH and size above their DMEM_QUOTA
- *      		       down to but not below DMEM_QUOTA, and will also
- *      		       try to shrink domains sized below QUOTA and having
- *      		       RATE <= RATE_LOW
- *
- *      		    in other words, a domain can expand above DMEM_QUOTA
- *      		    at the expense of free memory only if its RATE >= RATE_HIGH
+ * Load snapshot from managed domains
+ */
+void sched_snapshot::load(void)
+{
+	domain_info* dom;
+	int k = 0;
+
+	ndoms = (int) doms.managed.size();
+
+	info.resize(ndoms);
+	memsize.resize(ndoms);
+	memsize0.resize(ndoms);
+	memsize_incr.resize(ndoms);
+	memsize_decr.resize(ndoms);
+	lien.resize(ndoms);
+	dmem_min.resize(ndoms);
+	dmem_quota.resize(ndoms);
+	dmem_max.resize(ndoms);
+	dmem_decr.resize(ndoms);
+	rate_low.resize(ndoms);
+	rate_high.resize(ndoms);
+	rate.resize(ndoms);
+	slow_rate.resize(ndoms);
+	fast_rate.resize(ndoms);
+	time_rate_below_low.resize(ndoms);
+	time_rate_below_high.resize(ndoms);
+	priority.resize(ndoms);
+	expand_force.resize(ndoms);
+	resist_force.resize(ndoms);
+	expand_force0.resize(ndoms);
+	balside.resize(ndoms);
+	numa_node.resize(ndoms);
+	flags.resize(ndoms);
+
+	foreach_managed_domain(dom)
+	{
+		info[k] = dom;
+		memsize[k] = dom->memsize;
+		memsize0[k] = dom->memsize0;
+		memsize_incr[k] = dom->memsize_incr;
+		memsize_decr[k] = dom->memsize_decr;
+		lien[k] = domain_lien(dom);
+		dmem_min[k] = dom->dmem_min;
+		dmem_quota[k] = dom->dmem_quota;
+		dmem_max[k] = dom->dmem_max;
+		dmem_decr[k] = dom->dmem_decr;
+		rate_low[k] = dom->rate_low;
+		rate_high[k] = dom->rate_high;
+		rate[k] = dom->rate;
+		slow_rate[k] = dom->slow_rate;
+		fast_rate[k] = dom->fast_rate;
+		time_rate_below_low[k] = dom->time_rate_below_low;
+		time_rate_below_high[k] = dom->time_rate_below_high;
+		priority[k] = dom->priority;
+		expand_force[k] = dom->expand_force;
+		resist_force[k] = dom->resist_force;
+		expand_force0[k] = dom->expand_force0;
+		balside[k] = dom->balside;
+		numa_node[k] = dom->numa_node;
+
+		flags[k] = 0;
+		if (dom->valid_data)
+			flags[k] |= SNAP_VALID_DATA;
+		if (::runnable(dom))
+			flags[k] |= SNAP_RUNNABLE;
+		if (dom->trimming_to_quota)
+			flags[k] |= SNAP_TRIMMING_TO_QUOTA;
+		if (is_shrink_soft_protected(dom))
+			flags[k] |= SNAP_SOFT_PROTECTED;
+
+		k++;
+	}
+}
+
+/*
+ * Store the fields modified by scheduling stages back into domain_info
+ */
+void sched_snapshot::store(void)
+{
+	domain_info* dom;
+
+	for (int k = 0;  k < ndoms;  k++)
+	{
+		dom = info[k];
+		dom->memsize = memsize[k];
+		dom->rate = rate[k];
+		dom->slow_rate = slow_rate[k];
+		dom->fast_rate = fast_rate[k];
+		dom->expand_force = expand_force[k];
+		dom->resist_force = resist_force[k];
+		dom->expand_force0 = expand_force0[k];
+		dom->balside = balside[k];
+	}
+}
+
+/*
+ * Predicate for sorting domain slots by @key, yielding the same order as
+ * domvector predicates (including breaking the ties by domain_info address)
+ */
+template<typename T>
+class slot_order
+{
+public:
+	slot_order(const std::vector<T>& key, bool desc) : key(key)
+	{
+		this->desc = desc;
+	}
+
+	bool operator()(int d1, int d2) const
+	{
+		T delta = key[d1] - key[d2];
+		if (desc)
+			delta = -delta;
+		if (delta < 0)   return true;
+		if (delta > 0)   return false;
+		return snap.info[d1] < snap.info[d2];
+	}
+
+protected:
+	const std::vector<T>& key;
+	bool desc;
+};
+
+/*
+ * Same as slot_order, but domains of lower priority class go first
+ */
+template<typename T>
+class slot_priority_order : public slot_order<T>
+{
+public:
+	slot_priority_order(const std::vector<T>& key, bool desc) : slot_order<T>(key, desc)
+	{
+	}
+
+	bool operator()(int d1, int d2) const
+	{
+		if (snap.priority[d1] != snap.priority[d2])
+			return snap.priority[d1] < snap.priority[d2];
+		return slot_order<T>::operator()(d1, d2);
+	}
+};
+
+void slotvec::sort_asc_by_resist_force(void)
+{
+	std::sort(begin(), end(), slot_order<double>(snap.resist_force, false));
+}
+
+void slotvec::sort_desc_by_time_rate_below_low(void)
+{
+	std::sort(begin(), end(), slot_priority_order<long>(snap.time_rate_below_low, true));
+}
+
+void slotvec::sort_desc_by_time_rate_below_high(void)
+{
+	std::sort(begin(), end(), slot_priority_order<long>(snap.time_rate_below_high, true));
+}
+
+void slotqueue::build(const slotvec& vec)
+{
+	heap = vec;
+	pos.assign(snap.ndoms, -1);
+	stamp.assign(snap.ndoms, 0);
+	nstamp = 0;
+
+	for (unsigned k = 0;  k < heap.size();  k++)
+		pos[heap[k]] = k;
+
+	for (unsigned k = heap.size() / 2;  k-- != 0; )
+		sift_down(k);
+}
+
+void slotqueue::pop(void)
+{
+	int dom = heap[0];
+	int last = heap.back();
+
+	heap.pop_back();
+	pos[dom] = -1;
+
+	if (heap.size() != 0)
+	{
+		place(0, last);
+		sift_down(0);
+	}
+}
+
+void slotqueue::update(int dom)
+{
+	unsigned k = pos[dom];
+
+	/* later updates go ahead of earlier ones and of never updated slots */
+	stamp[dom] = --nstamp;
+
+	sift_up(k);
+	sift_down(pos[dom]);
+}
+
+/*
+ * Return true if @d1 has higher priority than @d2
+ */
+bool slotqueue::before(int d1, int d2) const
+{
+	double delta = key[d1] - key[d2];
+	if (desc)
+		delta = -delta;
+	if (delta < 0)   return true;
+	if (delta > 0)   return false;
+
+	if (stamp[d1] != stamp[d2])
+		return stamp[d1] < stamp[d2];
+
+	return snap.info[d1] < snap.info[d2];
+}
+
+void slotqueue::sift_up(unsigned k)
+{
+	int dom = heap[k];
+
+	while (k != 0)
+	{
+		unsigned parent = (k - 1) / 2;
+		if (!before(dom, heap[parent]))
+			break;
+		place(k, heap[parent]);
+		k = parent;
+	}
+
+	place(k, dom);
+}
+
+void slotqueue::sift_down(unsigned k)
+{
+	int dom = heap[k];
+	unsigned n = heap.size();
+
+	for (;;)
+	{
+		unsigned child = 2 * k + 1;
+		if (child >= n)
+			break;
+		if (child + 1 < n && before(heap[child + 1], heap[child]))
+			child++;
+		if (!before(heap[child], dom))
+			break;
+		place(k, heap[child]);
+		k = child;
+	}
+
+	place(k, dom);
+}
+
+
+/******************************************************************************
+*                             main scheduling routine                         *
+******************************************************************************/
+
+/*
+ * Memory scheduling algorithm dynamically balances host memory allocation
+ * between participating domains according to their current memory demand
+ * measured as domain data map-in rate (hard page faults rate + file system
+ * cache block read-in rate, kb/sec) over current sampling interval.
+ *
+ * The algorithm is invoked every INTERVAL seconds - but only if there is
+ * at least one currently managed domain. If there are no managed domains,
+ * the algorithm is not invoked. (Once there appear managed domains, tick
+ * count is incremented accordingly to refelect elapsed sleep time.)
+ *
+ * If automatic domain memory allocation is paused by system administrator,
+ * the algorithm is invoked only to collect data (stage 1 as described below),
+ * but does not perform any adjustments (stages 2-4 are not invoked).
+ *
+ * The algorithm tries to provide good memory-supply responsivness for domains
+ * that need to expand, while avoiding premature domain contraction and
+ * upsize-downsize thrashing. The algorithm's motto is "expand fast, contract
+ * slow" (wherever possible at all). To this end:
+ *
+ *     - Algorithm allows domains to grow in a time of plenty and trims
+ *       domains only when there is actual demand for memory. When there
+ *       is no demand, domains are allowed to keep memory allocated to them.
+ *
+ *     - Algorithm reserves a part of memory (defined by HOST_RESERVED_SOFT)
+ *       for domains in a substantial need of memory, otherwise keeping it
+ *       free and immediatelly available for expansion of a domain when it
+ *       comes in a substantial need of extra memory.
+ *
+ *     - Algorithm employs SLOW_RATE moving average to track recent history
+ *       of domain's data map-in rate in order to avoid premature contraction
+ *       of a domain just because it did not show memory demand for a tick
+ *       or two.
+ *
+ *     - Maximum domain expansion amount at a normal interval (@dmem_incr)
+ *       is larger by default than trimming amount (@dmem_decr), unless the
+ *       memory is in very short supply, albeit the values are aqjustable
+ *       by system administrator.
+ *
+ * The algorithm uses the following data items.
+ *
+ * Global dynamic values:
+ *
+ *     HOST_FREE = current amount of host free memory
+ *
+ * Global settings:
+ *
+ *     INTERVAL = interval between successive invocations of the algorithm
+ *
+ *     HOST_RESERVED_HARD = host memory to leave alone and never consume
+ *      		    for allocation during domain size auto-adjustment
+ *      		    by membalance:
+ *
+ *      	            1) membalance will not expand existing domains if such an
+ *      		       expansion would leave HOST_FREE below HOST_RESERVED_HARD
+ *
+ *      	            2) if membalance detects that HOST_FREE dropped below
+ *      		       HOST_RESERVED_HARD (e.g. because a new virtual machine
+ *      		       has been launched or a domain was expanded manually
+ *      		       by the system administrator) membalance will try to
+ *      		       reclaim memory from domains managed by membalance to
+ *      		       bring HOST_FREE up to HOST_RESERVED_HARD again
+ *      		       or as close to it as possible for membalance
+ *
+ *      		    this amount is in addition to (on top of)
+ *      		    Xen free memory slack
+ *
+ *     HOST_RESERVED_SOFT = host memory between HOST_RESERVED_SOFT and HOST_RESERVED_HARD
+ *      		    is made available only for domains in significant need of memory
+ *
+ *      		    1) domains with DMEM_SIZE < DMEM_QUOTA and RATE > RATE_LOW
+ *
+ *      		    2) domains any size with data map-in rate >= RATE_HIGH
+ *
+ *      		    as follows:
+ *
+ *      		    1) if HOST_FREE <= HOST_RESERVED_SOFT, domain can
+ *      		       only expand beyond DMEM_QUOTA when its data
+ *      		       map-in RATE >= RATE_HIGH
+ *
+ *      		       this is the only constraint HOST_RESERVED_SOFT
+ *      		       imposes on domain expansion
+ *
+ *      		       if domain size is below DMEM_QUOTA, domain still
+ *      		       can expand up to DMEM_QUOTA if its RATE > RATE_LOW,
+ *      		       regardless of HOST_RESERVED_SOFT
+ *
+ *      		    2) if HOST_FREE drops below (<) HOST_RESERVED_SOFT,
+ *      		       membalance will try to shrink those domains that
+ *      		       have rate < RATE_HIGH and size above their DMEM_QUOTA
+ *      		       down to but not below DMEM_QUOTA, and will also
+ *      		       try to shrink domains sized below QUOTA and having
+ *      		       RATE <= RATE_LOW
+ *
+ *      		    in other words, a domain can expand above DMEM_QUOTA
+ *      		    at the expense of free memory only if its RATE >= RATE_HIGH
  *      		    *and* FREE > FREE_RESERVED_SOFT
  *
  *      		    note that if FREE memory drops down to FREE_RESERVED_SOFT,
@@ -1205,23 +1849,66 @@ void sched_memory(void)
 			  memsched_pause_level ? " (adjustments suspended)" : "");
 	}
 
+	stage_timer timer;
+
+	stat_count(STAT_SCHED_TICKS);
+
 	stage_collect_data();	    /* stage 1*/
 
 	if (memsched_pause_level != 0)
+	{
+		timer.lap(SCHED_STAGE_COLLECT);
 		return;
+	}
+
+	snap.load();
+	timer.lap(SCHED_STAGE_COLLECT);
 
 	sched_reserved_hard();      /* stage 2 */
+	timer.lap(SCHED_STAGE_RESERVED_HARD);
+
 	sched_reserved_soft();      /* stage 3 */
 
 	if (debug_level >= 30)
 		print_reclaimed();
+	timer.lap(SCHED_STAGE_RESERVED_SOFT);
 
 	sched_rebalance();    	    /* stage 4 */
+	timer.lap(SCHED_STAGE_REBALANCE);
+
+	snap.store();
+
+	if (unlikely(tracing))
+	{
+		for (int dom = 0;  dom < snap.ndoms;  dom++)
+		{
+			trace_domain_decision(snap.info[dom]->domain_id,
+					      snap.memsize0[dom], snap.memsize[dom]);
+		}
+	}
 
 	do_resize_domains(); 	    /* apply pending size changes */
+	timer.lap(SCHED_STAGE_RESIZE);
+
+	record_host_state();
 }
 
 
+/*
+ * Record host memory state at the end of the tick (for metrics)
+ */
+static void record_host_state(void)
+{
+	sched_host.time = time(NULL);
+	sched_host.xen_free = xen_free0;
+	sched_host.slack = xen_free_slack;
+	sched_host.lien = host_lien0;
+	sched_host.free = host_free;
+	sched_host.tick_ns = 0;
+	for (int k = 0;  k < SCHED_STAGE_COUNT;  k++)
+		sched_host.tick_ns += max(sched_stage_ns[k], (int64_t) 0);
+}
+
 /*
  * Called if membalanced was sleeping for some time
  * because managed domains list was empty
@@ -1236,14 +1923,13 @@ void sched_slept(int64_t ms)
  */
 static void print_reclaimed(void)
 {
-	domain_info* dom;
-
-	foreach_managed_domain(dom)
+	for (int dom = 0;  dom < snap.ndoms;  dom++)
 	{
-		if (dom->memsize0 != dom->memsize)
+		if (snap.memsize0[dom] != snap.memsize[dom])
 		{
 			notice_msg("  [%ld] -> freemem %ld",
-				   dom->domain_id, dom->memsize0 - dom->memsize);
+				   snap.info[dom]->domain_id,
+				   snap.memsize0[dom] - snap.memsize[dom]);
 		}
 	}
 }
@@ -1258,6 +1944,7 @@ static void stage_collect_data(void)
 	const xc_domaininfo_t* xcinfo;
 	domain_info* dom;
 	bool has_report;
+	bool presumed;
 	long freeing = 0;
 
 	/*
@@ -1288,12 +1975,18 @@ static void stage_collect_data(void)
 	xen_free_slack = get_xen_free_slack();
 	xen_free0 = get_xen_free_memory();
 
+	if (unlikely(tracing))
+		trace_tick(sched_tick, xen_free0, xen_free_slack);
+
 	/*
 	 * Collect data from the domains: for each domain managed by membalance
 	 * read its xenstore "report" key and reset the key, then parse the report
 	 */
 	id2xcinfo.collect();
-	read_domain_reports();
+	{
+		stat_timer timer(STAT_HIST_READ_REPORTS);
+		read_domain_reports();
+	}
 
 	foreach_managed_domain(dom)
 	{
@@ -1307,9 +2000,13 @@ static void stage_collect_data(void)
 
 		dom->begin_sched_tick();
 
+		if (unlikely(tracing))
+			trace_domain_input(dom, xcinfo);
+
 		record_memory_info(dom, xcinfo);
 		reset_preshrink(dom);
 		dom->reeval_xen_data_size(xen_free0);
+		update_domain_lien(dom);
 	}
 
 	foreach_managed_domain(dom)
@@ -1322,12 +2019,26 @@ static void stage_collect_data(void)
 		if (has_report && !dom->parse_domain_report())
 			has_report = false;
 
-		if (has_report)
+		/*
+		 * Domain doing change-only reporting sends no report while its
+		 * readings stay the same. Until its heartbeat deadline expires,
+		 * presume the readings have not changed since the last report.
+		 * Allow for sampling and reading of the heartbeat report to lag
+		 * behind the deadline by up to an interval each.
+		 */
+		presumed = !has_report &&
+			   report_heartbeat(dom) > 0 &&
+			   dom->no_report_time <= report_heartbeat(dom) + config.interval;
+
+		if (has_report || presumed)
 		{
 			/*
 			 * record when we saw last report
 			 */
-			dom->no_report_time = 0;
+			if (presumed)
+				dom->no_report_time += config.interval;
+			else
+				dom->no_report_time = 0;
 			dom->last_report_tick = sched_tick;
 
 			/*
@@ -1336,8 +2047,15 @@ static void stage_collect_data(void)
 			 * guest system memory), treat reported data map-in rate as 0,
 			 * regardless of the reported rate value.
 			 */
-			if (dom->freepct > config.guest_free_threshold * 100)
+			if (dom->is_predictive())
+				dom->predict_freepct(sched_tick, true);
+
+			if (dom->freepct > config.guest_free_threshold * 100 &&
+			    !(dom->is_predictive() &&
+			      dom->pred_freepct <= config.guest_free_threshold * 100))
+			{
 				dom->rate = 0;
+			}
 
 			/*
 			 * If domain data map-in rate is <= RATE_ZERO, treat reported data map-in
@@ -1368,13 +2086,14 @@ static void stage_collect_data(void)
 		else if (runnable(dom))
 		{
 			/*
-			 * if domain did not report in for a while,
+			 * if domain did not report in for a while
+			 * (past its heartbeat deadline, if it has one),
 			 * trim it down to quota
 			 */
 			dom->no_report_time += config.interval;
 
 			if (dom->trim_unresponsive > 0 &&
-			    dom->no_report_time > dom->trim_unresponsive &&
+			    dom->no_report_time - report_heartbeat(dom) > dom->trim_unresponsive &&
 			    memsched_pause_level == 0)
 			{
 				if (trim_to_quota(dom))
@@ -1411,6 +2130,10 @@ static void stage_collect_data(void)
 		if (sched_tick > dom->last_report_tick + 1)
 			continue;
 
+		/* keep projections ahead of this tick, not of the reused readings */
+		if (dom->last_report_tick != sched_tick && dom->is_predictive())
+			dom->reproject(sched_tick);
+
 		dom->valid_data = true;
 
 		debug_msg(10, "memsched: collected domain %s\n"
@@ -1423,6 +2146,19 @@ static void stage_collect_data(void)
 			  dom->memsize_incr, dom->memsize_incr / 1024, dom->memsize_incr % 1024,
 			  dom->memsize_decr, dom->memsize_decr / 1024, dom->memsize_decr % 1024,
 			  dom->rate, dom->slow_rate, dom->fast_rate, dom->freepct);
+
+		if (dom->is_predictive())
+		{
+			debug_msg(10, "    pred_rate=%ld, pred_freepct=%g%%",
+				  dom->pred_rate, dom->pred_freepct);
+		}
+
+		if (dom->has_psi)
+		{
+			debug_msg(10, "    psi_some=%g%%, psi_full=%g%%, psi_some_us=%ld, psi_full_us=%ld",
+				  dom->psi_some, dom->psi_full,
+				  dom->psi_some_us, dom->psi_full_us);
+		}
 	}
 
 	/*
@@ -1460,6 +2196,8 @@ static void stage_collect_data(void)
 	 */
 	// host_free += freeing;
 
+	collect_numa_state();
+
 	if (debug_level >= 10)
 	{
 		bool neg = host_free < 0;
@@ -1479,30 +2217,98 @@ static void stage_collect_data(void)
 }
 
 /*
- * domain_info method called at the beginning of scheduling tick
- * (for managed domains only)
+ * Read free memory of NUMA nodes and the nodes managed domains are confined to.
+ * Called by stage_collect_data() after @host_free has been calculated.
  */
-void domain_info::begin_sched_tick(void)
+static void collect_numa_state(void)
 {
-	/* @report_raw is already refreshed by read_domain_reports(...) */
-	trimming_to_quota = false;
-	valid_data = false;
-	valid_memory_data = false;
-	balside = RebalanceSide_NEUTRAL;
-	expand_force0 = 0;
-}
+	std::vector<long> xfree;
+	domain_info* dom;
+	long shared;
+	int k;
 
-/*
- * Get current memory size.
- *
- * Total domain size is:
- *     xcinfo->tot_pages (posessed pages)
- * plus
- *     xcinfo->outstanding_pages (claimed but not posessed pages)
- *
- * However do not include xcinfo->outstanding_pages in the
- * calculations of desired domain size adjustment, since
- * measured data map-in rate was sampled based on guest system
+	numa_nodes = 0;
+
+	if (!config.numa_balance ||
+	    !get_xen_numa_memory(xfree, node_size) ||
+	    node_size.size() < 2)
+	{
+		goto none;
+	}
+
+	numa_size = 0;
+	for (k = 0;  k < (int) node_size.size();  k++)
+		numa_size += node_size[k];
+	if (numa_size <= 0)
+		goto none;
+
+	numa_nodes = (int) node_size.size();
+
+	shared = xen_free_slack + host_lien0;
+	node_free.resize(numa_nodes);
+	for (k = 0;  k < numa_nodes;  k++)
+		node_free[k] = xfree[k] - node_share(shared, k);
+
+	foreach_managed_domain(dom)
+	{
+		dom->numa_node = get_xen_domain_node(dom->domain_id);
+		if (dom->numa_node >= numa_nodes)
+			dom->numa_node = -1;
+	}
+
+	if (debug_level >= 10)
+	{
+		for (k = 0;  k < numa_nodes;  k++)
+		{
+			notice_msg("memsched: node %d free memory less slack = %ld kbs (size %ld kbs)",
+				   k, node_free[k], node_size[k]);
+		}
+	}
+
+	return;
+
+none:
+
+	foreach_managed_domain(dom)
+		dom->numa_node = -1;
+}
+
+/*
+ * domain_info method called at the beginning of scheduling tick
+ * (for managed domains only)
+ */
+void domain_info::begin_sched_tick(void)
+{
+	/* @report_raw is already refreshed by read_domain_reports(...) */
+	trimming_to_quota = false;
+	valid_data = false;
+	valid_memory_data = false;
+	balside = RebalanceSide_NEUTRAL;
+	expand_force0 = 0;
+}
+
+/*
+ * Round resize target @m up to domain superpage boundary (@superpage_align),
+ * if set for the domain
+ */
+inline static long superpage_roundup(const domain_info* dom, long m)
+{
+	if (dom->superpage_align > 0)
+		m = roundup(m, dom->superpage_align);
+	return m;
+}
+
+/*
+ * Get current memory size.
+ *
+ * Total domain size is:
+ *     xcinfo->tot_pages (posessed pages)
+ * plus
+ *     xcinfo->outstanding_pages (claimed but not posessed pages)
+ *
+ * However do not include xcinfo->outstanding_pages in the
+ * calculations of desired domain size adjustment, since
+ * measured data map-in rate was sampled based on guest system
  * having only xcinfo->tot_pages in its posession (or rather this
  * is a better estimate), therefore any expansion or contraction
  * should be calculated off this base line.
@@ -1510,8 +2316,8 @@ void domain_info::begin_sched_tick(void)
  * Calculate margins around it corresponding to dmem_decr and dmem_incr.
  */
 
-/* try to increase domain size by up to @dmem_incr */
-inline static long eval_incr(const domain_info* dom)
+/* try to increase domain size @m0 by up to @dmem_incr */
+inline static long eval_incr(const domain_info* dom, long m0)
 {
 	long m;
 
@@ -1520,28 +2326,30 @@ inline static long eval_incr(const domain_info* dom)
 	 * (without claimed pages) since data map rate is a function
 	 * of physically allocated memory, not claimed memory
 	 */
-	m = dom->memsize0;
+	m = m0;
 	m = (long) (m * (1 + dom->dmem_incr));
 	m = roundup(m, memquant_kbs);
+	m = superpage_roundup(dom, m);
 	m = max(dom->dmem_min, m);
 	m = min(dom->dmem_max, m);
 
 	return m;
 }
 
-/* graze up to @dmem_decr off current domain size */
-inline static long eval_decr(const domain_info* dom)
+/* graze up to @dmem_decr off current domain size @m0 */
+inline static long eval_decr(const domain_info* dom, long m0)
 {
-	long m, m0, decr;
+	long m, decr;
 
 	/*
 	 * base calculations on the actual "core size" of the domain
 	 * (without claimed pages) since data map rate is a function
 	 * of physically allocated memory, not claimed memory
 	 */
-	m = m0 = dom->memsize0;
+	m = m0;
 	m = (long) (m * (1 - dom->dmem_decr));
 	m = roundup(m, memquant_kbs);
+	m = min(superpage_roundup(dom, m), m0);
 	m = max(dom->dmem_min, m);
 	m = min(dom->dmem_max, m);
 
@@ -1557,6 +2365,7 @@ inline static long eval_decr(const domain_info* dom)
 		m = m0 - decr;
 
 		m = roundup(m, memquant_kbs);
+		m = min(superpage_roundup(dom, m), m0);
 		m = max(dom->dmem_min, m);
 		m = min(dom->dmem_max, m);
 	}
@@ -1576,8 +2385,8 @@ static void record_memory_info(domain_info* dom, const xc_domaininfo_t* xcinfo)
 
 	dom->memgoal0 = roundup(dom->xs_mem_target + dom->xs_mem_videoram, pagesize_kbs);
 
-	dom->memsize_incr = eval_incr(dom);
-	dom->memsize_decr = eval_decr(dom);
+	dom->memsize_incr = eval_incr(dom, dom->memsize0);
+	dom->memsize_decr = eval_decr(dom, dom->memsize0);
 
 	dom->valid_memory_data = true;
 }
@@ -1594,6 +2403,131 @@ static void reset_preshrink(domain_info* dom)
 	dom->preshrink_tick = 0;
 }
 
+/******************************************************************************
+*                           domain report parsing                             *
+******************************************************************************/
+
+/*
+ * Domain reports come in two formats, selected by the leading
+ * struct_version byte.
+ *
+ * Text format ('A'): lines of "key: value" following the "A\n" header,
+ * in any order, with unknown keys ignored (see memprobed.c).
+ *
+ * Binary format ('B'), all integers little-endian:
+ *
+ *     offset  size
+ *        0      1    'B'
+ *        1      1    flags (REPORT_B_PSI, REPORT_B_HEARTBEAT)
+ *        2      8    seq
+ *       10      8    kb
+ *       18      8    kbsec
+ *       26      4    freepct, in 1/1000 of percent
+ *     with REPORT_B_PSI:
+ *       30      4    psisome, in 1/1000 of percent
+ *       34      4    psifull, in 1/1000 of percent
+ *       38      8    psisomeus
+ *       46      8    psifullus
+ *     with REPORT_B_HEARTBEAT, after the above:
+ *        +      4    heartbeat, in seconds
+ *
+ * Trailing bytes beyond the known layout are ignored.
+ */
+#define REPORT_B_PSI		(1 << 0)
+#define REPORT_B_HEARTBEAT	(1 << 1)
+#define REPORT_B_SIZE		30
+#define REPORT_B_SIZE_PSI	54
+#define REPORT_B_SIZE_HEARTBEAT	4
+
+/*
+ * Text report fields used by the scheduler
+ */
+enum report_field
+{
+	RF_ACTION = 0,
+	RF_KBSEC,
+	RF_FREEPCT,
+	RF_PSISOME,
+	RF_PSIFULL,
+	RF_PSISOMEUS,
+	RF_PSIFULLUS,
+	RF_HEARTBEAT,
+	RF_COUNT
+};
+
+static const struct
+{
+	const char* name;
+	size_t len;
+}
+report_fields[RF_COUNT] =
+{
+	{ "action",    6 },
+	{ "kbsec",     5 },
+	{ "freepct",   7 },
+	{ "psisome",   7 },
+	{ "psifull",   7 },
+	{ "psisomeus", 9 },
+	{ "psifullus", 9 },
+	{ "heartbeat", 9 }
+};
+
+/*
+ * Location of a field value within the text of the report
+ */
+class report_value
+{
+public:
+	char* begin;
+	char* end;	/* past the value */
+
+	report_value()
+	{
+		begin = end = NULL;
+	}
+
+	bool present(void) const
+	{
+		return begin != NULL;
+	}
+
+	bool equals(const char* s) const
+	{
+		size_t len = strlen(s);
+		return (size_t) (end - begin) == len && 0 == memcmp(begin, s, len);
+	}
+
+	/*
+	 * Convert the value in place, by terminating it temporarily
+	 * and restoring the terminating character afterwards.
+	 */
+	bool get(long* pval) const
+	{
+		char c = *end;
+		*end = '\0';
+		bool res = a2long(begin, pval);
+		*end = c;
+		return res;
+	}
+
+	bool get(double* pval) const
+	{
+		char c = *end;
+		*end = '\0';
+		bool res = a2double(begin, pval);
+		*end = c;
+		return res;
+	}
+};
+
+static inline u_quad_t get_le(const unsigned char* p, int size)
+{
+	u_quad_t val = 0;
+	for (int k = size - 1;  k >= 0;  k--)
+		val = (val << 8) | p[k];
+	return val;
+}
+
 /*
  * Parse raw report string -> dom structure.
  *
@@ -1604,50 +2538,28 @@ static void reset_preshrink(domain_info* dom)
  */
 bool domain_info::parse_domain_report(void)
 {
-	char* saveptr;
-	char* token;
-	char* key;
-	char* val;
-	char* dp;
-	map_ss kv;
-	const char* cp;
+	bool ok;
 
 	if (!report_raw)
 		return false;
 
 	/* check report structure version */
-	if (report_raw[0] != 'A' || report_raw[1] != '\n')
-		goto unmanage;
-
-	/* break down report into key-value map */
-	for (token = strtok_r(report_raw + 2, "\n", &saveptr);
-	     token != NULL;
-	     token = strtok_r(NULL, "\n", &saveptr))
+	switch (report_raw[0])
 	{
-		dp = strchr(token, ':');
-		if (!dp)
-			continue;
-
-		key = token;
-		*dp = '\0';
-		val = dp + 1;
-		while (isblank(*val))
-			val++;
-		set_kv(kv, key, val);
-		*dp = ':';
-	}
+	case 'A':
+		ok = parse_text_report();
+		break;
 
-	/* must include "action: report" */
-	cp = k2v(kv, "action");
-	if (!(cp && streq(cp, "report")))
-		goto unmanage;
+	case 'B':
+		ok = parse_binary_report();
+		break;
 
-	cp = k2v(kv, "kbsec");
-	if (!(cp && a2long(cp, &rate)))
-		goto unmanage;
+	default:
+		ok = false;
+		break;
+	}
 
-	cp = k2v(kv, "freepct");
-	if (!(cp && a2double(cp, &freepct)))
+	if (!ok)
 		goto unmanage;
 
 	free_ptr(report_raw);
@@ -1656,9 +2568,18 @@ bool domain_info::parse_domain_report(void)
 
 	/* unmanage domain */
 unmanage:
-	debug_msg(1, "domain %s reported malformatted data [%s]",
-		  printable_name(),
-		  report_raw);
+	if (report_raw[0] == 'B')
+	{
+		debug_msg(1, "domain %s reported malformatted binary data [%u bytes]",
+			  printable_name(),
+			  report_len);
+	}
+	else
+	{
+		debug_msg(1, "domain %s reported malformatted data [%s]",
+			  printable_name(),
+			  report_raw);
+	}
 	error_msg("unmanaging domain %s because it submitted malformatted report",
 		  printable_name());
 	free_ptr(report_raw);
@@ -1667,6 +2588,136 @@ unmanage:
 	return false;
 }
 
+/*
+ * Parse text report ('A') in a single pass over @report_raw,
+ * without copying keys or values out of it.
+ *
+ * If a key is repeated, the last instance is used.
+ * The content of @report_raw is left intact.
+ */
+bool domain_info::parse_text_report(void)
+{
+	report_value fv[RF_COUNT];
+	char* cp;
+	char* lp;
+	char* dp;
+	size_t klen;
+	int k;
+
+	if (report_raw[1] != '\n')
+		return false;
+
+	for (cp = report_raw + 2;  *cp;  cp = *lp ? lp + 1 : lp)
+	{
+		lp = strchrnul(cp, '\n');
+		dp = (char*) memchr(cp, ':', lp - cp);
+		if (!dp)
+			continue;
+
+		klen = dp - cp;
+		for (k = 0;  k < RF_COUNT;  k++)
+		{
+			if (klen == report_fields[k].len &&
+			    0 == memcmp(cp, report_fields[k].name, klen))
+			{
+				for (dp++;  isblank(*dp);  dp++)
+					;
+				fv[k].begin = dp;
+				fv[k].end = lp;
+				break;
+			}
+		}
+	}
+
+	/* must include "action: report" */
+	if (!(fv[RF_ACTION].present() && fv[RF_ACTION].equals("report")))
+		return false;
+
+	if (!(fv[RF_KBSEC].present() && fv[RF_KBSEC].get(&rate)))
+		return false;
+
+	if (!(fv[RF_FREEPCT].present() && fv[RF_FREEPCT].get(&freepct)))
+		return false;
+
+	/*
+	 * pressure stall information is optional: reported only by memprobed
+	 * running on guest kernels with PSI support
+	 */
+	has_psi = false;
+	if (fv[RF_PSIFULL].present())
+	{
+		if (!(fv[RF_PSIFULL].get(&psi_full) &&
+		      fv[RF_PSISOME].present() && fv[RF_PSISOME].get(&psi_some) &&
+		      fv[RF_PSISOMEUS].present() && fv[RF_PSISOMEUS].get(&psi_some_us) &&
+		      fv[RF_PSIFULLUS].present() && fv[RF_PSIFULLUS].get(&psi_full_us)))
+		{
+			return false;
+		}
+
+		has_psi = true;
+	}
+
+	/* heartbeat is reported only by memprobed doing change-only reporting */
+	report_heartbeat = 0;
+	if (fv[RF_HEARTBEAT].present())
+	{
+		if (!fv[RF_HEARTBEAT].get(&report_heartbeat) || report_heartbeat < 0)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Parse binary report ('B')
+ */
+bool domain_info::parse_binary_report(void)
+{
+	const unsigned char* bp = (const unsigned char*) report_raw;
+	unsigned int len = REPORT_B_SIZE;
+	u_quad_t kbsec;
+	u_quad_t some_us;
+	u_quad_t full_us;
+
+	if (report_len < REPORT_B_SIZE)
+		return false;
+
+	kbsec = get_le(bp + 18, 8);
+	if (kbsec > (u_quad_t) LONG_MAX)
+		return false;
+	rate = (long) kbsec;
+	freepct = get_le(bp + 26, 4) / 1000.0;
+
+	has_psi = false;
+	if (bp[1] & REPORT_B_PSI)
+	{
+		if (report_len < REPORT_B_SIZE_PSI)
+			return false;
+
+		psi_some = get_le(bp + 30, 4) / 1000.0;
+		psi_full = get_le(bp + 34, 4) / 1000.0;
+		some_us = get_le(bp + 38, 8);
+		full_us = get_le(bp + 46, 8);
+		if (some_us > (u_quad_t) LONG_MAX || full_us > (u_quad_t) LONG_MAX)
+			return false;
+		psi_some_us = (long) some_us;
+		psi_full_us = (long) full_us;
+
+		has_psi = true;
+		len = REPORT_B_SIZE_PSI;
+	}
+
+	report_heartbeat = 0;
+	if (bp[1] & REPORT_B_HEARTBEAT)
+	{
+		if (report_len < len + REPORT_B_SIZE_HEARTBEAT)
+			return false;
+		report_heartbeat = (long) get_le(bp + len, REPORT_B_SIZE_HEARTBEAT);
+	}
+
+	return true;
+}
+
 /*
  * Calculate slow_rate and fast_rate
  * (fast and slow moving averages of rate).
@@ -1678,6 +2729,30 @@ unmanage:
  * of domain force to resist its contraction.
  */
 void domain_info::calc_rates(unsigned long tick)
+{
+	/*
+	 * If there is a breach in history over 1 missing sample,
+	 * history is considered stopped, start it anew
+	 */
+	bool restart = rate_history.size() != 0 &&
+		       tick - rate_history[0].tick > 2;
+
+	/* insert current element at the start */
+	if (restart)
+		rate_history.clear();
+	rate_history.push(rate_record(tick, rate, freepct));
+
+	fast_window.update(rate_history, config.rate_fast_window, restart);
+	slow_window.update(rate_history, config.rate_slow_window, restart);
+
+	eval_rates(tick);
+}
+
+/*
+ * Calculate slow_rate and fast_rate from the samples in @rate_history
+ * (see calc_rates), with projection for @tick in PREDICT mode
+ */
+void domain_info::eval_rates(unsigned long tick)
 {
 	/*
 	 * for slow rate, weight recent samples
@@ -1686,19 +2761,114 @@ void domain_info::calc_rates(unsigned long tick)
 	static const double slow_weights[] = { 10, 3, 2, 2, 1 };
 	static const int nslow_weights = countof(slow_weights);
 
-	/* insert current element at the start, remove excess */
-	rate_history.insert(rate_history.begin(), rate_record(tick, rate));
-	while (rate_history.size() > nslow_weights)
-		rate_history.pop_back();
-
 	/*
-	 * for fast rate, use just current sample
+	 * for fast rate, use moving average (by default just current sample)
 	 */
-	fast_rate = rate;
+	fast_rate = fast_window.average();
 
 	/* slow weight: weight the samples and max with current */
-	slow_rate = (long) weight_samples(slow_weights, nslow_weights);
+	if (config.rate_slow_window == 0)
+		slow_rate = (long) weight_samples(slow_weights, nslow_weights);
+	else
+		slow_rate = slow_window.average();
 	slow_rate = max(rate, slow_rate);
+
+	/*
+	 * In PREDICT mode, let the projected rate raise fast_rate (and hence
+	 * expansion force) ahead of an upcoming surge of paging, and lower
+	 * slow_rate (and hence resistance to contraction) down to current
+	 * rate ahead of the domain going idle
+	 */
+	if (is_predictive())
+	{
+		pred_rate = predict_rate(tick);
+		fast_rate = max(fast_rate, pred_rate);
+		slow_rate = max(rate, min(slow_rate, pred_rate));
+	}
+}
+
+/*
+ * Called on a tick the domain has not reported for, when its readings
+ * from the previous tick are reused: project them @predict_horizon ticks
+ * past the current @tick rather than past the readings, and re-evaluate
+ * slow_rate and fast_rate with the new projection.
+ */
+void domain_info::reproject(unsigned long tick)
+{
+	if (rate_history.size() == 0)
+		return;
+
+	predict_freepct(tick, false);
+	eval_rates(tick);
+}
+
+/*
+ * Project guest free memory percentage @predict_horizon ticks past @tick
+ * from its trend over the latest @predict_window samples, store the result
+ * in @pred_freepct.
+ *
+ * If @fresh, the samples include the current one taken at @tick (not in
+ * @rate_history yet). Otherwise the latest sample in @rate_history is
+ * the current one, reused from an earlier tick.
+ */
+void domain_info::predict_freepct(unsigned long tick, bool fresh)
+{
+	trend_fit fit;
+	unsigned long base_tick = tick;
+	int nel = config.predict_window;
+
+	if (fresh)
+	{
+		fit.add(0, freepct);
+		nel--;
+
+		/* disregard history that is going to be restarted */
+		if (rate_history.size() != 0 && tick - rate_history[0].tick > 2)
+			nel = 0;
+	}
+	else
+	{
+		base_tick = rate_history[0].tick;
+	}
+
+	nel = min(nel, rate_history.size());
+	for (int k = 0;  k < nel;  k++)
+	{
+		const rate_record& rr = rate_history[k];
+		fit.add(- (double) (tick - rr.tick), rr.freepct);
+	}
+
+	pred_freepct = freepct + fit.slope() * (config.predict_horizon + (tick - base_tick));
+}
+
+/*
+ * Project rate @predict_horizon ticks past @tick from its trend over
+ * the latest @predict_window samples in @rate_history.
+ *
+ * If guest free memory is projected to rise over @guest_free_threshold,
+ * rate is expected to be disregarded, and projected rate is 0.
+ */
+long domain_info::predict_rate(unsigned long tick)
+{
+	trend_fit fit;
+	int nel = min(config.predict_window, rate_history.size());
+	u_long base_tick = rate_history[0].tick;
+	double pr;
+
+	if (pred_freepct > config.guest_free_threshold * 100)
+		return 0;
+
+	for (int k = 0;  k < nel;  k++)
+	{
+		const rate_record& rr = rate_history[k];
+		fit.add(- (double) (tick - rr.tick), rr.rate);
+	}
+
+	pr = rate + fit.slope() * (config.predict_horizon + (tick - base_tick));
+	if (pr <= rate_zero)
+		return 0;
+
+	return (long) pr;
 }
 
 /*
@@ -1812,13 +2982,13 @@ static long hard_reclaim(long goal)
  * Calculate new size for @dom after decreasing it down
  * by one slice of @dmem_decr
  */
-inline static long eval_more_decr(domain_info* dom)
+inline static long eval_more_decr(int dom)
 {
-	long m = (long) (dom->memsize * (1 - dom->dmem_decr));
+	long m = (long) (snap.memsize[dom] * (1 - snap.dmem_decr[dom]));
 
 	m = roundup(m, memquant_kbs);
-	m = max(dom->dmem_min, m);
-	m = min(dom->dmem_max, m);
+	m = max(snap.dmem_min[dom], m);
+	m = min(snap.dmem_max[dom], m);
 
 	return m;
 }
@@ -1840,20 +3010,20 @@ static void hard_reclaim_round_1(long& goal)
 	if (goal <= 0)
 		return;
 
-	domain_info* dom;
-	domvector vec;
+	int dom;
+	slotvec vec;
 
 	/*
 	 * Enumerate candidate domains. Leave alone domains in the following
 	 * states: paused, dying, shutdown, crashed (a variant of shutdown),
 	 * currently being trimmed, or no valid rate data.
 	 */
-	foreach_managed_domain(dom)
+	for (dom = 0;  dom < snap.ndoms;  dom++)
 	{
-		if (dom->valid_data &&
-		    dom->time_rate_below_low != 0 &&
-		    runnable(dom) &&
-		    !dom->trimming_to_quota)
+		if (snap.valid_data(dom) &&
+		    snap.time_rate_below_low[dom] != 0 &&
+		    snap.runnable(dom) &&
+		    !snap.trimming_to_quota(dom))
 		{
 			vec.push_back(dom);
 		}
@@ -1865,11 +3035,11 @@ static void hard_reclaim_round_1(long& goal)
 	for (unsigned k = 0;  k < vec.size();  k++)
 	{
 		dom = vec[k];
-		long trim = dom->memsize - dom->memsize_decr;
+		long trim = snap.memsize[dom] - snap.memsize_decr[dom];
 		if (trim > 0)
 		{
 			trim = min(trim, goal);
-			dom->memsize -= trim;
+			snap.memsize[dom] -= trim;
 			goal -= trim;
 			if (goal <= 0)   break;
 		}
@@ -1890,8 +3060,8 @@ static void hard_reclaim_round_2(long& goal)
 	if (goal <= 0)
 		return;
 
-	domain_info* dom;
-	domvector vec;
+	int dom;
+	slotvec vec;
 
 	/*
 	 * Enumerate candidate domains. Leave alone domains in the following
@@ -1899,14 +3069,14 @@ static void hard_reclaim_round_2(long& goal)
 	 * or currently being trimmed, or have been trimmed in the previous
 	 * round, or no valid rate data.
 	 */
-	foreach_managed_domain(dom)
+	for (dom = 0;  dom < snap.ndoms;  dom++)
 	{
-		if (dom->valid_data &&
-		    dom->time_rate_below_high != 0 &&
-		    dom->memsize > dom->dmem_quota &&
-		    dom->memsize == dom->memsize0 &&
-		    runnable(dom) &&
-		    !dom->trimming_to_quota)
+		if (snap.valid_data(dom) &&
+		    snap.time_rate_below_high[dom] != 0 &&
+		    snap.memsize[dom] > snap.dmem_quota[dom] &&
+		    snap.memsize[dom] == snap.memsize0[dom] &&
+		    snap.runnable(dom) &&
+		    !snap.trimming_to_quota(dom))
 		{
 			vec.push_back(dom);
 		}
@@ -1918,11 +3088,11 @@ static void hard_reclaim_round_2(long& goal)
 	for (unsigned k = 0;  k < vec.size();  k++)
 	{
 		dom = vec[k];
-		long trim = dom->memsize - max(dom->memsize_decr, dom->dmem_quota);
+		long trim = snap.memsize[dom] - max(snap.memsize_decr[dom], snap.dmem_quota[dom]);
 		if (trim > 0)
 		{
 			trim = min(trim, goal);
-			dom->memsize -= trim;
+			snap.memsize[dom] -= trim;
 			goal -= trim;
 			if (goal <= 0)   break;
 		}
@@ -1944,21 +3114,21 @@ static void hard_reclaim_round_3(long& goal)
 	if (goal <= 0)
 		return;
 
-	domain_info* dom;
-	domvector vec;
+	int dom;
+	slotvec vec;
 
 	/*
 	 * Enumerate candidate domains. Leave alone domains in the following
 	 * states: paused, dying, shutdown, crashed (a variant of shutdown),
 	 * or currently being trimmed, or no valid rate data.
 	 */
-	foreach_managed_domain(dom)
+	for (dom = 0;  dom < snap.ndoms;  dom++)
 	{
-		if (dom->valid_data &&
-		    dom->time_rate_below_high != 0 &&
-		    dom->memsize > dom->dmem_quota &&
-		    runnable(dom) &&
-		    !dom->trimming_to_quota)
+		if (snap.valid_data(dom) &&
+		    snap.time_rate_below_high[dom] != 0 &&
+		    snap.memsize[dom] > snap.dmem_quota[dom] &&
+		    snap.runnable(dom) &&
+		    !snap.trimming_to_quota(dom))
 		{
 			vec.push_back(dom);
 		}
@@ -1975,11 +3145,11 @@ static void hard_reclaim_round_3(long& goal)
 	{
 		dom = vec[k];
 		long m = eval_more_decr(dom);
-		long trim = dom->memsize - max(m, dom->dmem_quota);
+		long trim = snap.memsize[dom] - max(m, snap.dmem_quota[dom]);
 		if (trim > 0)
 		{
 			trim = min(trim, goal);
-			dom->memsize -= trim;
+			snap.memsize[dom] -= trim;
 			goal -= trim;
 			if (goal <= 0)   break;
 		}
@@ -2010,8 +3180,8 @@ static void hard_reclaim_round_4(long& goal)
 	if (goal <= 0)
 		return;
 
-	domain_info* dom;
-	domvector vec;
+	int dom;
+	slotvec vec;
 	long m, trim;
 
 	/*
@@ -2019,21 +3189,21 @@ static void hard_reclaim_round_4(long& goal)
 	 * states: paused, dying, shutdown, crashed (a variant of shutdown),
 	 * or currently being trimmed.
 	 */
-	foreach_managed_domain(dom)
+	for (dom = 0;  dom < snap.ndoms;  dom++)
 	{
-		if (dom->memsize > dom->dmem_quota &&
-		    runnable(dom) &&
-		    !dom->trimming_to_quota)
+		if (snap.memsize[dom] > snap.dmem_quota[dom] &&
+		    snap.runnable(dom) &&
+		    !snap.trimming_to_quota(dom))
 		{
 			/*
 			 * treat domains with no recent valid data rate,
 			 * as having rate = 0
 			 */
-			if (!dom->valid_data)
+			if (!snap.valid_data(dom))
 			{
-				dom->rate = 0;
-				dom->slow_rate = 0;
-				dom->fast_rate = 0;
+				snap.rate[dom] = 0;
+				snap.slow_rate[dom] = 0;
+				snap.fast_rate[dom] = 0;
 			}
 			vec.push_back(dom);
 		}
@@ -2070,16 +3240,16 @@ static void hard_reclaim_round_4(long& goal)
 
 			/* try to trim down physically allocated part */
 			m = eval_more_decr(dom);
-			trim = dom->memsize - max(m, dom->dmem_quota);
+			trim = snap.memsize[dom] - max(m, snap.dmem_quota[dom]);
 			if (trim > 0)
 			{
 				trim = min(trim, goal);
-				dom->memsize -= trim;
+				snap.memsize[dom] -= trim;
 				goal -= trim;
 				if (goal <= 0)   break;
 			}
 
-			if (dom->memsize <= dom->dmem_quota)
+			if (snap.memsize[dom] <= snap.dmem_quota[dom])
 			{
 				/* remove element from vec */
 				remove_at(vec, k--);
@@ -2110,8 +3280,8 @@ static void hard_reclaim_round_5(long& goal)
 	if (goal <= 0)
 		return;
 
-	domain_info* dom;
-	domvector vec;
+	int dom;
+	slotvec vec;
 	long m, trim;
 
 	/*
@@ -2119,31 +3289,31 @@ static void hard_reclaim_round_5(long& goal)
 	 * states: paused, dying, shutdown, crashed (a variant of shutdown),
 	 * or currently being trimmed.
 	 */
-	foreach_managed_domain(dom)
+	for (dom = 0;  dom < snap.ndoms;  dom++)
 	{
-		if (dom->memsize > dom->dmem_min &&
-		    runnable(dom))
+		if (snap.memsize[dom] > snap.dmem_min[dom] &&
+		    snap.runnable(dom))
 		{
 			/*
 			 * treat domains with no recent valid data rate,
 			 * as having rate = 0, except for young domains
 			 */
-			if (!dom->valid_data)
+			if (!snap.valid_data(dom))
 			{
 				/* Dom0 is never young */
-				if (dom->domain_id != 0 &&
-				    dom->startup_time >= 0 &&
-				    xen_domain_uptime(dom->domain_id) <= dom->startup_time)
+				if (snap.info[dom]->domain_id != 0 &&
+				    snap.info[dom]->startup_time >= 0 &&
+				    xen_domain_uptime(snap.info[dom]->domain_id) <= snap.info[dom]->startup_time)
 				{
-					dom->rate =
-					dom->slow_rate =
-					dom->fast_rate = dom->rate_high + 1;
+					snap.rate[dom] =
+					snap.slow_rate[dom] =
+					snap.fast_rate[dom] = snap.rate_high[dom] + 1;
 				}
 				else
 				{
-					dom->rate = 0;
-					dom->slow_rate = 0;
-					dom->fast_rate = 0;
+					snap.rate[dom] = 0;
+					snap.slow_rate[dom] = 0;
+					snap.fast_rate[dom] = 0;
 				}
 			}
 			vec.push_back(dom);
@@ -2170,16 +3340,16 @@ static void hard_reclaim_round_5(long& goal)
 		{
 			dom = vec[k];
 			m = eval_more_decr(dom);
-			trim = dom->memsize - max(m, dom->dmem_min);
+			trim = snap.memsize[dom] - max(m, snap.dmem_min[dom]);
 			if (trim > 0)
 			{
 				trim = min(trim, goal);
-				dom->memsize -= trim;
+				snap.memsize[dom] -= trim;
 				goal -= trim;
 				if (goal <= 0)   break;
 			}
 
-			if (dom->memsize <= dom->dmem_min)
+			if (snap.memsize[dom] <= snap.dmem_min[dom])
 			{
 				/* remove element from vec */
 				remove_at(vec, k--);
@@ -2255,8 +3425,8 @@ static void soft_reclaim_round_1(long& goal)
 	if (goal <= 0)
 		return;
 
-	domain_info* dom;
-	domvector vec;
+	int dom;
+	slotvec vec;
 	long trim;
 
 	/*
@@ -2265,15 +3435,15 @@ static void soft_reclaim_round_1(long& goal)
 	 * or currently being trimmed, or no valid rate data, or protected
 	 * from shrinking due to been just recently expanded.
 	 */
-	foreach_managed_domain(dom)
+	for (dom = 0;  dom < snap.ndoms;  dom++)
 	{
-		if (dom->valid_data &&
-		    dom->time_rate_below_low != 0 &&
-		    dom->memsize > dom->dmem_quota &&
-		    dom->memsize > dom->dmem_decr &&
-		    runnable(dom) &&
-		    !dom->trimming_to_quota &&
-		    !is_shrink_soft_protected(dom))
+		if (snap.valid_data(dom) &&
+		    snap.time_rate_below_low[dom] != 0 &&
+		    snap.memsize[dom] > snap.dmem_quota[dom] &&
+		    snap.memsize[dom] > snap.dmem_decr[dom] &&
+		    snap.runnable(dom) &&
+		    !snap.trimming_to_quota(dom) &&
+		    !snap.soft_protected(dom))
 		{
 			vec.push_back(dom);
 		}
@@ -2285,11 +3455,11 @@ static void soft_reclaim_round_1(long& goal)
 	for (unsigned k = 0;  k < vec.size();  k++)
 	{
 		dom = vec[k];
-		trim = dom->memsize - max(dom->memsize_decr, dom->dmem_quota);
+		trim = snap.memsize[dom] - max(snap.memsize_decr[dom], snap.dmem_quota[dom]);
 		if (trim > 0)
 		{
 			trim = min(trim, goal);
-			dom->memsize -= trim;
+			snap.memsize[dom] -= trim;
 			goal -= trim;
 			if (goal <= 0)   break;
 		}
@@ -2317,8 +3487,8 @@ static void soft_reclaim_round_2(long& goal)
 	if (goal <= 0)
 		return;
 
-	domain_info* dom;
-	domvector vec;
+	int dom;
+	slotvec vec;
 	long trim;
 
 	/*
@@ -2327,14 +3497,14 @@ static void soft_reclaim_round_2(long& goal)
 	 * or currently being trimmed, or no valid rate data, or protected
 	 * from shrinking due to been just recently expanded.
 	 */
-	foreach_managed_domain(dom)
+	for (dom = 0;  dom < snap.ndoms;  dom++)
 	{
-		if (dom->valid_data &&
-		    dom->time_rate_below_low != 0 &&
-		    dom->memsize > dom->dmem_decr &&
-		    runnable(dom) &&
-		    !dom->trimming_to_quota &&
-		    !is_shrink_soft_protected(dom))
+		if (snap.valid_data(dom) &&
+		    snap.time_rate_below_low[dom] != 0 &&
+		    snap.memsize[dom] > snap.dmem_decr[dom] &&
+		    snap.runnable(dom) &&
+		    !snap.trimming_to_quota(dom) &&
+		    !snap.soft_protected(dom))
 		{
 			vec.push_back(dom);
 		}
@@ -2346,11 +3516,11 @@ static void soft_reclaim_round_2(long& goal)
 	for (unsigned k = 0;  k < vec.size();  k++)
 	{
 		dom = vec[k];
-		trim = dom->memsize - max(dom->memsize_decr, dom->dmem_min);
+		trim = snap.memsize[dom] - max(snap.memsize_decr[dom], snap.dmem_min[dom]);
 		if (trim > 0)
 		{
 			trim = min(trim, goal);
-			dom->memsize -= trim;
+			snap.memsize[dom] -= trim;
 			goal -= trim;
 			if (goal <= 0)   break;
 		}
@@ -2378,8 +3548,8 @@ static void soft_reclaim_round_3(long& goal)
 	if (goal <= 0)
 		return;
 
-	domain_info* dom;
-	domvector vec;
+	int dom;
+	slotvec vec;
 	long trim;
 
 	/*
@@ -2388,15 +3558,15 @@ static void soft_reclaim_round_3(long& goal)
 	 * or currently being trimmed, or no valid rate data, or protected
 	 * from shrinking due to been just recently expanded.
 	 */
-	foreach_managed_domain(dom)
+	for (dom = 0;  dom < snap.ndoms;  dom++)
 	{
-		if (dom->valid_data &&
-		    dom->time_rate_below_high != 0 &&
-		    dom->memsize > dom->dmem_quota &&
-		    dom->memsize > dom->dmem_decr &&
-		    runnable(dom) &&
-		    !dom->trimming_to_quota &&
-		    !is_shrink_soft_protected(dom))
+		if (snap.valid_data(dom) &&
+		    snap.time_rate_below_high[dom] != 0 &&
+		    snap.memsize[dom] > snap.dmem_quota[dom] &&
+		    snap.memsize[dom] > snap.dmem_decr[dom] &&
+		    snap.runnable(dom) &&
+		    !snap.trimming_to_quota(dom) &&
+		    !snap.soft_protected(dom))
 		{
 			vec.push_back(dom);
 		}
@@ -2408,11 +3578,11 @@ static void soft_reclaim_round_3(long& goal)
 	for (unsigned k = 0;  k < vec.size();  k++)
 	{
 		dom = vec[k];
-		trim = dom->memsize - max(dom->memsize_decr, dom->dmem_quota);
+		trim = snap.memsize[dom] - max(snap.memsize_decr[dom], snap.dmem_quota[dom]);
 		if (trim > 0)
 		{
 			trim = min(trim, goal);
-			dom->memsize -= trim;
+			snap.memsize[dom] -= trim;
 			goal -= trim;
 			if (goal <= 0)   break;
 		}
@@ -2426,13 +3596,20 @@ static void soft_reclaim_round_3(long& goal)
 
 static void sched_rebalance(void)
 {
-	domvector vec_expand;	/* expansion candidates */
-	domvector vec_shrink;   /* shrinking candidates */
+	slotvec vec;		/* rebalancing candidates */
+	slotvec vec_expand;	/* expansion candidates */
+	slotvec vec_shrink;	/* shrinking candidates */
+
+	slotqueue queue_expand(snap.expand_force, true);
+	slotqueue queue_shrink(snap.resist_force, false);
+
+	/* shrinking candidates confined to each NUMA node */
+	std::vector<slotqueue> queue_node(numa_nodes, slotqueue(snap.resist_force, false));
 
 	eval_force_context resist_force_context;
 	eval_force_context expand_force_context;
 
-	domain_info* dom;
+	int dom, node;
 	unsigned k, ndoms;
 	long need, m;
 
@@ -2443,32 +3620,43 @@ static void sched_rebalance(void)
 	 * shutdown, crashed (a variant of shutdown), or currently being
 	 * trimmed, or no valid rate data.
 	 */
-	foreach_managed_domain(dom)
+	for (dom = 0;  dom < snap.ndoms;  dom++)
 	{
-		if (dom->valid_data &&
-		    runnable(dom) &&
-		    !dom->trimming_to_quota)
+		if (snap.valid_data(dom) &&
+		    snap.runnable(dom) &&
+		    !snap.trimming_to_quota(dom))
 		{
-			vec_expand.push_back(dom);
+			vec.push_back(dom);
 		}
 	}
 
 	/* no domains to rebalance? */
-	ndoms = vec_expand.size();
+	ndoms = vec.size();
 	if (ndoms == 0)
 		return;
 
-	vec_shrink = vec_expand;
+	/*
+	 * Memory reclaimed by the preceding stages has been credited
+	 * to @host_free, credit it to the nodes as well
+	 */
+	if (numa_nodes != 0)
+	{
+		for (dom = 0;  dom < snap.ndoms;  dom++)
+		{
+			if (snap.memsize[dom] < snap.memsize0[dom])
+				node_credit(snap.numa_node[dom], snap.memsize0[dom] - snap.memsize[dom]);
+		}
+	}
 
 	/*
 	 * Calculate expansion and resistance-to-contraction forces
 	 */
-	expand_force_context.eval_expand_force_context(vec_expand, 0, ndoms - 1);
-	resist_force_context.eval_resist_force_context(vec_shrink, 0, ndoms - 1);
+	expand_force_context.eval_expand_force_context(vec, 0, ndoms - 1);
+	resist_force_context.eval_resist_force_context(vec, 0, ndoms - 1);
 	for (k = 0;  k < ndoms;  k++)
 	{
-		eval_expand_force(expand_force_context, vec_expand[k]);
-		eval_resist_force(resist_force_context, vec_shrink[k]);
+		eval_expand_force(expand_force_context, vec[k]);
+		eval_resist_force(resist_force_context, vec[k]);
 	}
 
 	/*
@@ -2479,12 +3667,12 @@ static void sched_rebalance(void)
 	 * Also record expansion force at the start of the rebalancing to
 	 * esablish a precedence order at the resizing execution phase.
 	 */
-	for (k = 0;  k < vec_expand.size();  k++)
+	for (k = 0;  k < ndoms;  k++)
 	{
-		dom = vec_expand[k];
-		dom->expand_force0 = dom->expand_force;
-		if (dom->expand_force <= eps || dom->memsize >= dom->memsize_incr)
-			remove_at(vec_expand, k--);
+		dom = vec[k];
+		snap.expand_force0[dom] = snap.expand_force[dom];
+		if (!(snap.expand_force[dom] <= eps || snap.memsize[dom] >= snap.memsize_incr[dom]))
+			vec_expand.push_back(dom);
 	}
 
 	/*
@@ -2493,42 +3681,57 @@ static void sched_rebalance(void)
 	 * soft-shrinking size per tick, or are protected from shrinking
 	 * due to been just recently expanded.
 	 */
-	for (k = 0;  k < vec_shrink.size();  k++)
+	for (k = 0;  k < ndoms;  k++)
 	{
-		dom = vec_shrink[k];
-		if (dom->memsize <= dom->memsize_decr ||
-		    is_shrink_soft_protected(dom))
+		dom = vec[k];
+		if (!(snap.memsize[dom] <= snap.memsize_decr[dom] ||
+		      snap.soft_protected(dom)))
 		{
-			remove_at(vec_shrink, k--);
+			vec_shrink.push_back(dom);
 		}
 	}
 
 	/*
-	 * Sort vectors
+	 * Order candidates.
+	 *
+	 * Domains are re-evaluated and repositioned each time they cross
+	 * a size category threshold, so keep them in priority queues rather
+	 * than in sorted vectors to avoid O(N) re-insertions.
 	 */
-	vec_expand.sort_desc_by_expand_force();
-	vec_shrink.sort_asc_by_resist_force();
+	queue_expand.build(vec_expand);
+	queue_shrink.build(vec_shrink);
+
+	for (node = 0;  node < numa_nodes;  node++)
+	{
+		slotvec vec_node;
+		for (k = 0;  k < vec_shrink.size();  k++)
+		{
+			if (snap.numa_node[vec_shrink[k]] == node)
+				vec_node.push_back(vec_shrink[k]);
+		}
+		queue_node[node].build(vec_node);
+	}
 
 	/*
 	 * Process domains wishing to expand
 	 */
-	while (vec_expand.size() != 0)
+	while (!queue_expand.empty())
 	{
 		/* Get element with the highest expansion pressure */
-		dom = vec_expand[0];
+		dom = queue_expand.top();
 
 		/*
 		 * Is this domain in the process of being shrinked in a rebalancing
-		 * process? If so, we reached right-side @vec_expand area of low-pressure
-		 * domains. This domain is not an eligible candidate for an expansion,
+		 * process? If so, we reached low-pressure tail of @queue_expand.
+		 * This domain is not an eligible candidate for an expansion,
 		 * as most likely all domains past it.
 		 */
-		if (dom->balside == RebalanceSide_SHRINKING)
+		if (snap.balside[dom] == RebalanceSide_SHRINKING)
 		{
-			remove_at(vec_expand, 0);
+			queue_expand.pop();
 			continue;
 		}
-		dom->balside = RebalanceSide_EXPANDING;
+		snap.balside[dom] = RebalanceSide_EXPANDING;
 
 		/*
 		 * We want to expand the domain all way up to @memsize_incr,
@@ -2536,65 +3739,85 @@ static void sched_rebalance(void)
 		 * and @dmem_quota and change its size category and hence expansion
 		 * pressure. Once this happens, it may become not the most
 		 * demanding domain anymore at that point, and expansion priority
-		 * may go to another domain in @vec_expand.
+		 * may go to another domain in @queue_expand.
 		 *
 		 * Therefore try to grow the domain in chunks sized up to the
 		 * next category-changing threshold, so after reaching the
 		 * threshold we can re-evaluate domain expansion force and
-		 * possibly reposition the domain in @vec_expand.
+		 * possibly reposition the domain in @queue_expand.
 		 *
 		 * Notice that eval_incr(...) previously ensured that memsize_incr
 		 * is in range [dmem_min ... dmem_max].
 		 */
-		if (dom->memsize < dom->dmem_min)
-			m = min(dom->dmem_min, dom->memsize_incr);
-		else if (dom->memsize < dom->dmem_quota)
-			m = min(dom->dmem_quota, dom->memsize_incr);
+		if (snap.memsize[dom] < snap.dmem_min[dom])
+			m = min(snap.dmem_min[dom], snap.memsize_incr[dom]);
+		else if (snap.memsize[dom] < snap.dmem_quota[dom])
+			m = min(snap.dmem_quota[dom], snap.memsize_incr[dom]);
 		else
-			m = dom->memsize_incr;
+			m = snap.memsize_incr[dom];
 
 		/* In this round, try to expand @dom by @need */
-		need = m - dom->memsize;
+		need = m - snap.memsize[dom];
 
 		/* record current size category */
-		category_t c_size = size_expand_category(dom, dom->memsize);
+		category_t c_size = size_expand_category(dom, snap.memsize[dom]);
 
 		/*
 		 * Try to satisfy domain's demand at the cost of free space
+		 * (of its NUMA node, if it is confined to one)
 		 */
-		if (!expand_into_freemem(dom, need))
+		node = snap.numa_node[dom];
+		if (!expand_into_freemem(dom, need, node))
 		{
+			m = snap.memsize[dom];
+
+			/*
+			 * Domain confined to a NUMA node is better off with memory
+			 * of shrinking domains on the same node than with memory of
+			 * other nodes, so try this first, then free space on other
+			 * nodes
+			 */
+			if (node >= 0)
+			{
+				rebalance_domains(dom, need, resist_force_context,
+						  queue_shrink, queue_node, node);
+				if (snap.memsize[dom] == m)
+					expand_into_freemem(dom, need, -1);
+			}
+
 			/*
 			 * Try to satisfy domain's demand at the cost of
 			 * shrinking other domains
 			 */
-			m = dom->memsize;
-			rebalance_domains(dom, need, resist_force_context, vec_shrink);
+			if (snap.memsize[dom] == m)
+			{
+				rebalance_domains(dom, need, resist_force_context,
+						  queue_shrink, queue_node, -1);
+			}
 
 			/* if could not grow it at all, we are done with rebalancing */
-			if (dom->memsize == m)
+			if (snap.memsize[dom] == m)
 				break;
 		}
 
 		/* is domain expansion need for the current tick fully satisfied? */
-		if (dom->memsize >= dom->memsize_incr)
+		if (snap.memsize[dom] >= snap.memsize_incr[dom])
 		{
-			remove_at(vec_expand, 0);
+			queue_expand.pop();
 			continue;
 		}
 
 		/*
 		 * if domain changed size category:
 		 *   - recalculate domain expansion force
-		 *   - move domain to correct position in @vec_expand
+		 *   - move domain to correct position in @queue_expand
 		 */
-		if (size_expand_category(dom, dom->memsize) != c_size)
+		if (size_expand_category(dom, snap.memsize[dom]) != c_size)
 		{
 			eval_expand_force(expand_force_context, dom);
-			remove_at(vec_expand, 0);
-			insert_into_vec_expand(vec_expand, dom);
+			queue_expand.update(dom);
 		}
-		else if (dom->memsize == m)
+		else if (snap.memsize[dom] == m)
 		{
 			fatal_msg("bug: sched_rebalance: size category did not change");
 		}
@@ -2602,25 +3825,44 @@ static void sched_rebalance(void)
 }
 
 /*
- * Try to expand @dom by up to @need at the cost of free memory.
+ * Try to expand @dom by up to @need at the cost of free memory
+ * of NUMA @node, or of any node if @node is -1.
  *
  * If returns @true, memory has been added to the domain drawing on
- * free memory area.
+ * free memory area or on the lien of its expansion in flight.
  *
  * If returns @false, no free memory was allocated and caller must
- * try to allocate memory by trimming other domains (those in @vec_shrink).
+ * try to allocate memory by trimming other domains (those in @queue_shrink).
  */
-static bool expand_into_freemem(domain_info* dom, long need)
+static bool expand_into_freemem(int dom, long need, int node)
 {
-	long chunk = free_allocate(dom->expand_force, need);
+	/*
+	 * Growth of the domain still in flight from the previous resize is
+	 * already set aside as its lien (deducted from @host_free), so do not
+	 * draw on free memory for it a second time
+	 */
+	long covered = min(snap.lien[dom], need);
+	long chunk;
+
+	if (covered > 0)
+	{
+		snap.memsize[dom] += covered;
+		snap.lien[dom] -= covered;
+		need -= covered;
+
+		debug_msg(30, "  lien -> [%ld] %ld",
+			      snap.info[dom]->domain_id, covered);
+	}
+
+	chunk = (need != 0) ? free_allocate(snap.expand_force[dom], need, node) : 0;
 
 	if (chunk == 0)
-		return false;
+		return covered > 0;
 
-	dom->memsize += chunk;
+	snap.memsize[dom] += chunk;
 
 	debug_msg(30, "  freemem -> [%ld] %ld at force %g, leaves free %ld",
-		      dom->domain_id, chunk, dom->expand_force, host_free);
+		      snap.info[dom]->domain_id, chunk, snap.expand_force[dom], host_free);
 
 	return true;
 }
@@ -2631,11 +3873,16 @@ static bool expand_into_freemem(domain_info* dom, long need)
  * be anywhere between 0 and @need. If returned value is less than @need,
  * then this is the maximum that can be allocated at a given @expand_force.
  *
+ * When NUMA-aware balancing is in effect, allocate memory of @node,
+ * or of any node if @node is -1, and leave alone the share of reserve
+ * of every node in addition to host-wide reserve.
+ *
  * Allocation is always multiple of @memquant_kbs.
  */
-static long free_allocate(double expand_force, long need)
+static long free_allocate(double expand_force, long need, int node)
 {
-	long avail, reserve, allocated;
+	long avail, reserve, allocated, sum;
+	int k;
 
 	if (need < 0)
 		fatal_msg("bug: free_allocate: need < 0");
@@ -2644,6 +3891,18 @@ static long free_allocate(double expand_force, long need)
 				                          : config.host_reserved_soft;
 
 	avail = host_free - reserve;
+
+	if (numa_nodes != 0 && node >= 0)
+	{
+		avail = min(avail, node_avail(node, reserve));
+	}
+	else if (numa_nodes != 0)
+	{
+		for (sum = 0, k = 0;  k < numa_nodes;  k++)
+			sum += max(node_avail(k, reserve), 0);
+		avail = min(avail, sum);
+	}
+
 	if (avail <= 0)
 		return 0;
 
@@ -2651,27 +3910,102 @@ static long free_allocate(double expand_force, long need)
 	allocated = rounddown(allocated, memquant_kbs);
 	host_free -= allocated;
 
+	if (numa_nodes != 0)
+		node_debit(node, allocated, reserve);
+
 	return allocated;
 }
 
+/*
+ * Credit @amount (KBs) of memory released by a domain confined
+ * to NUMA @node (or -1 if not confined) to node free memory
+ */
+static void node_credit(int node, long amount)
+{
+	int k;
+
+	if (node >= 0)
+	{
+		node_free[node] += amount;
+	}
+	else
+	{
+		/* domain memory is likely to be spread over the nodes */
+		for (k = 0;  k < numa_nodes;  k++)
+			node_free[k] += node_share(amount, k);
+	}
+}
+
+/*
+ * Debit @amount (KBs) of memory allocated by free_allocate(...)
+ * from node free memory
+ */
+static void node_debit(int node, long amount, long reserve)
+{
+	long chunk, avail, sum, left;
+	int k, kmax;
+
+	if (node >= 0)
+	{
+		node_free[node] -= amount;
+		return;
+	}
+
+	/*
+	 * Take from nodes in proportion to their available memory, leaving
+	 * alone their share of @reserve, so that no single node is drained
+	 * ahead of the others. Xen may well pick other nodes, but the total
+	 * is what matters. Rounding remainder goes to the node with most
+	 * memory available.
+	 */
+	for (sum = 0, kmax = 0, k = 0;  k < numa_nodes;  k++)
+	{
+		avail = max(node_avail(k, reserve), 0);
+		sum += avail;
+		if (avail > max(node_avail(kmax, reserve), 0))
+			kmax = k;
+	}
+
+	if (sum <= 0)
+		return;
+
+	for (left = amount, k = 0;  k < numa_nodes;  k++)
+	{
+		avail = max(node_avail(k, reserve), 0);
+		chunk = (long) ((double) amount * avail / sum);
+		chunk = min(chunk, left);
+		node_free[k] -= chunk;
+		left -= chunk;
+	}
+
+	node_free[kmax] -= left;
+}
+
 /*
  * Try to expand @dom by up to @need at the cost of shrinking
- * other domains listed in @vec_shrink listed there in the order
+ * other domains queued in @queue_shrink in the order
  * of ascending shrink-resistance function.
+ *
+ * If @node is not -1, shrink only domains confined to NUMA @node,
+ * taken from @queue_node[node]. A victim stays in both queues
+ * till weeded out from each.
  */
 static void rebalance_domains(
-	domain_info* dom,
+	int dom,
 	long need,
 	eval_force_context& resist_force_context,
-	domvector& vec_shrink)
+	slotqueue& queue_shrink,
+	std::vector<slotqueue>& queue_node,
+	int node)
 {
-	domain_info* victim;
+	slotqueue& queue = (node >= 0) ? queue_node[node] : queue_shrink;
+	int victim, vnode;
 	long m, chunk;
 
-	while (need > 0 && vec_shrink.size() != 0)
+	while (need > 0 && !queue.empty())
 	{
 		/* potential victim doman */
-		victim = vec_shrink[0];
+		victim = queue.top();
 
 		/*
 		 * Weed out domains ineligible to be victims:
@@ -2679,10 +4013,10 @@ static void rebalance_domains(
 		 *     - domain that was already expanded during the current tick
 		 *     - domain is at its minimum decrement and cannot be shrunk any further
 		 */
-		if (victim->balside == RebalanceSide_EXPANDING ||
-		    victim->memsize <= victim->memsize_decr)
+		if (snap.balside[victim] == RebalanceSide_EXPANDING ||
+		    snap.memsize[victim] <= snap.memsize_decr[victim])
 		{
-			remove_at(vec_shrink, 0);
+			queue.pop();
 			continue;
 		}
 
@@ -2690,116 +4024,59 @@ static void rebalance_domains(
 		 * If requestor's expansion force is not stronger than
 		 * the weakest victim's contraction-resistance force, quit
 		 */
-		if (dom->expand_force <= victim->resist_force)
+		if (snap.expand_force[dom] <= snap.resist_force[victim])
 			return;
 
 		/*
 		 * How much we can shave off this victim till its next
 		 * size threshold?
 		 */
-		if (victim->memsize > victim->dmem_quota)
-			m = max(victim->memsize_decr, victim->dmem_quota);
+		if (snap.memsize[victim] > snap.dmem_quota[victim])
+			m = max(snap.memsize_decr[victim], snap.dmem_quota[victim]);
 		else
-			m = victim->memsize_decr;
+			m = snap.memsize_decr[victim];
 
-		chunk = victim->memsize - m;
+		chunk = snap.memsize[victim] - m;
 
 		/* record current size category */
-		category_t c_size = size_resist_category(victim, victim->memsize);
+		category_t c_size = size_resist_category(victim, snap.memsize[victim]);
 
 		/*
 		 * Transfer memory from @victim to @dom
 		 */
 		chunk = min(chunk, need);
-		victim->memsize -= chunk;
-		dom->memsize += chunk;
+		snap.memsize[victim] -= chunk;
+		snap.memsize[dom] += chunk;
 		need -= chunk;
-		victim->balside = RebalanceSide_SHRINKING;
+		snap.balside[victim] = RebalanceSide_SHRINKING;
 		debug_msg(30, "  [%ld] -> [%ld]  %ld",
-			      victim->domain_id, dom->domain_id, chunk);
+			      snap.info[victim]->domain_id, snap.info[dom]->domain_id, chunk);
 
 		/*
 		 * Is victim totally spent as a supplier of memory?
 		 */
-		if (victim->memsize <= victim->memsize_decr)
+		if (snap.memsize[victim] <= snap.memsize_decr[victim])
 		{
-			remove_at(vec_shrink, 0);
+			queue.pop();
 		}
-		else if (c_size != size_resist_category(victim, victim->memsize))
+		else if (c_size != size_resist_category(victim, snap.memsize[victim]))
 		{
 			/*
 			 * victim domain changed size category:
 			 *   - recalculate domain resistance force
-			 *   - move domain to correct position in @vec_shrink
+			 *   - move domain to correct position in @queue_shrink
+			 *     and in the queue of its node
 			 */
 			eval_resist_force(resist_force_context, victim);
-			remove_at(vec_shrink, 0);
-			insert_into_vec_shrink(vec_shrink, victim);
-		}
-	}
-}
-
-/*
- * Insert domain into @vec pre-sorted by descending expansion force.
- *
- * Try to insert it before other domains with the same expansion
- * force, to minimize the number of domain expansions (better to
- * expand one domain than two). Thus consider ">=" as effective ">".
- */
-static void insert_into_vec_expand(domvector& vec, domain_info* dom)
-{
-	int start = 0;
-	int end = vec.size() - 1;
-	int mid;
-
-	while (start <= end)
-	{
-		mid = (start + end) / 2;
-
-		if (dom->expand_force >= vec[mid]->expand_force)
-		{
-			end = mid - 1;
-		}
-		else
-		{
-			start = mid + 1;
-		}
-	}
-
-	insert_at(vec, start, dom);
-}
-
-/*
- * Insert domain into @vec pre-sorted by ascending resistance force.
- *
- * Try to insert it before other domains with the same resistance
- * force, to minimize the number of domain contractions (better to
- * shrink one domain than two). Thus consider "<=" as effective "<".
- */
-static void insert_into_vec_shrink(domvector& vec, domain_info* dom)
-{
-	int start = 0;
-	int end = vec.size() - 1;
-	int mid;
-
-	while (start <= end)
-	{
-		mid = (start + end) / 2;
-
-		if (dom->resist_force <= vec[mid]->resist_force)
-		{
-			end = mid - 1;
-		}
-		else
-		{
-			start = mid + 1;
+			if (queue_shrink.queued(victim))
+				queue_shrink.update(victim);
+			vnode = snap.numa_node[victim];
+			if (vnode >= 0 && numa_nodes != 0 && queue_node[vnode].queued(victim))
+				queue_node[vnode].update(victim);
 		}
 	}
-
-	insert_at(vec, start, dom);
 }
 
-
 /******************************************************************************
 *                         memory pressure force calculus                      *
 ******************************************************************************/
@@ -2817,16 +4094,16 @@ inline static double eval_force(long rate, double base, long rmax)
 *                                resist force calculations                                *
 ******************************************************************************************/
 
-void eval_force_context::eval_resist_force_context(const domvector& vec, int vk1, int vk2)
+void eval_force_context::eval_resist_force_context(const slotvec& vec, int vk1, int vk2)
 {
 	pre_eval();
 
 	/* find out actual rmax for each category */
 	for (int k = vk1;  k <= vk2;  k++)
 	{
-		domain_info* dom = vec[k];
-		if (dom->valid_data)
-			rmax = max(rmax, dom->slow_rate);
+		int dom = vec[k];
+		if (snap.valid_data(dom))
+			rmax = max(rmax, snap.slow_rate[dom]);
 	}
 
 	/* base[c_rate][c_size] */
@@ -2838,38 +4115,40 @@ void eval_force_context::eval_resist_force_context(const domvector& vec, int vk1
 	post_eval();
 }
 
-static void eval_resist_force(eval_force_context& ctx, domain_info* dom)
+static void eval_resist_force(eval_force_context& ctx, int dom)
 {
 	/* handle domains with no valid data in a special way */
-	if (!dom->valid_data)
+	if (!snap.valid_data(dom))
 	{
-		switch (size_resist_category(dom, dom->memsize))
+		category_t c_size = size_resist_category(dom, snap.memsize[dom]);
+		switch (c_size)
 		{
-		case C_LOW:    	dom->resist_force = 500;  break;
-		case C_MID:    	dom->resist_force = 62;	  break;
-		case C_HIGH:   	dom->resist_force = 32;   break;
+		case C_LOW:    	snap.resist_force[dom] = 500;  break;
+		case C_MID:    	snap.resist_force[dom] = 62;	  break;
+		case C_HIGH:   	snap.resist_force[dom] = 32;   break;
 		}
+		weigh_by_priority(dom, c_size, snap.resist_force[dom], 500);
 		return;
 	}
 
-	category_t c_rate = rate_category(dom, dom->slow_rate);
-	category_t c_size = size_resist_category(dom, dom->memsize);
+	category_t c_rate = rate_category(dom, snap.slow_rate[dom]);
+	category_t c_size = size_resist_category(dom, snap.memsize[dom]);
 
 	switch (c_size)
 	{
 	case C_LOW:
-		dom->resist_force = 500;
+		snap.resist_force[dom] = 500;
 		break;
 
 	case C_MID:
 		switch (c_rate)
 		{
 		case C_LOW:
-			dom->resist_force = 40;
+			snap.resist_force[dom] = 40;
 			break;
 		case C_MID:
 		case C_HIGH:
-			dom->resist_force = eval_force(dom->slow_rate,
+			snap.resist_force[dom] = eval_force(snap.slow_rate[dom],
 						       ctx.base[c_rate][c_size],
 						       ctx.rmax);
 			break;
@@ -2880,23 +4159,25 @@ static void eval_resist_force(eval_force_context& ctx, domain_info* dom)
 		switch (c_rate)
 		{
 		case C_LOW:
-			dom->resist_force = 0;
+			snap.resist_force[dom] = 0;
 			break;
 		case C_MID:
 		case C_HIGH:
-			dom->resist_force = eval_force(dom->slow_rate,
+			snap.resist_force[dom] = eval_force(snap.slow_rate[dom],
 						       ctx.base[c_rate][c_size],
 						       ctx.rmax);
 			break;
 		}
 		break;
 	}
+
+	weigh_by_priority(dom, c_size, snap.resist_force[dom], 500);
 }
 
 /*
- * Evaluate dom->resist_force for domain set
+ * Evaluate snap.resist_force[dom] for domain set
  */
-static void eval_resist_force(const domvector& vec)
+static void eval_resist_force(const slotvec& vec)
 {
 	int size = (int) vec.size();
 	if (size)
@@ -2904,16 +4185,16 @@ static void eval_resist_force(const domvector& vec)
 }
 
 /*
- * Evaluate dom->resist_force for domain set vec[kv1...kv2].
+ * Evaluate snap.resist_force[dom] for domain set vec[kv1...kv2].
  */
-static void eval_resist_force(const domvector& vec, int vk1, int vk2)
+static void eval_resist_force(const slotvec& vec, int vk1, int vk2)
 {
 	eval_force_context ctx;
 	ctx.eval_resist_force_context(vec, vk1, vk2);
 
 	for (int k = vk1;  k <= vk2;  k++)
 	{
-		domain_info* dom = vec[k];
+		int dom = vec[k];
 		eval_resist_force(ctx, dom);
 	}
 }
@@ -2923,19 +4204,19 @@ static void eval_resist_force(const domvector& vec, int vk1, int vk2)
 *                                expand force calculations                                *
 ******************************************************************************************/
 
-void eval_force_context::eval_expand_force_context(const domvector& vec, int vk1, int vk2)
+void eval_force_context::eval_expand_force_context(const slotvec& vec, int vk1, int vk2)
 {
 	pre_eval();
 
 	/* find out actual rmax for each category */
 	for (int k = vk1;  k <= vk2;  k++)
 	{
-		domain_info* dom = vec[k];
+		int dom = vec[k];
 
-		if (!dom->valid_data)
+		if (!snap.valid_data(dom))
 			fatal_msg("bug: eval_expand_force: domain with no valid_data");
 
-		rmax = max(rmax, dom->fast_rate);
+		rmax = max(rmax, snap.fast_rate[dom]);
 	}
 
 	/* base[c_rate][c_size] */
@@ -2947,26 +4228,26 @@ void eval_force_context::eval_expand_force_context(const domvector& vec, int vk1
 	post_eval();
 }
 
-static void eval_expand_force(eval_force_context& ctx, domain_info* dom)
+static void eval_expand_force(eval_force_context& ctx, int dom)
 {
-	category_t c_rate = rate_category(dom, dom->fast_rate);
-	category_t c_size = size_expand_category(dom, dom->memsize);
+	category_t c_rate = rate_category(dom, snap.fast_rate[dom]);
+	category_t c_size = size_expand_category(dom, snap.memsize[dom]);
 
 	switch (c_rate)
 	{
 	case C_LOW:
-		dom->expand_force = 0;
+		snap.expand_force[dom] = 0;
 		break;
 
 	case C_MID:
 		switch (c_size)
 		{
 		case C_LOW:
-			dom->expand_force = 200;
+			snap.expand_force[dom] = 200;
 			break;
 		case C_MID:
 		case C_HIGH:
-			dom->expand_force = eval_force(dom->fast_rate,
+			snap.expand_force[dom] = eval_force(snap.fast_rate[dom],
 						       ctx.base[c_rate][c_size],
 						       ctx.rmax);
 			break;
@@ -2977,23 +4258,25 @@ static void eval_expand_force(eval_force_context& ctx, domain_info* dom)
 		switch (c_size)
 		{
 		case C_LOW:
-			dom->expand_force = 300;
+			snap.expand_force[dom] = 300;
 			break;
 		case C_MID:
 		case C_HIGH:
-			dom->expand_force = eval_force(dom->fast_rate,
+			snap.expand_force[dom] = eval_force(snap.fast_rate[dom],
 						       ctx.base[c_rate][c_size],
 						       ctx.rmax);
 			break;
 		}
 		break;
 	}
+
+	weigh_by_priority(dom, c_size, snap.expand_force[dom], 200);
 }
 
 /*
- * Evaluate dom->expand_force for domain set
+ * Evaluate snap.expand_force[dom] for domain set
  */
-static void eval_expand_force(const domvector& vec)
+static void eval_expand_force(const slotvec& vec)
 {
 	int size = (int) vec.size();
 	if (size)
@@ -3001,16 +4284,16 @@ static void eval_expand_force(const domvector& vec)
 }
 
 /*
- * Evaluate dom->expand_force for domain set vec[kv1...kv2].
+ * Evaluate snap.expand_force[dom] for domain set vec[kv1...kv2].
  */
-static void eval_expand_force(const domvector& vec, int vk1, int vk2)
+static void eval_expand_force(const slotvec& vec, int vk1, int vk2)
 {
 	eval_force_context ctx;
 	ctx.eval_expand_force_context(vec, vk1, vk2);
 
 	for (int k = vk1;  k <= vk2;  k++)
 	{
-		domain_info* dom = vec[k];
+		int dom = vec[k];
 		eval_expand_force(ctx, dom);
 	}
 }
@@ -3028,6 +4311,9 @@ static void do_resize_domains(void)
 {
 	domain_info* dom;
 	domvector vec_up, vec_down;
+	resize_batch regoals;
+	resize_batch shrinks('-');
+	resize_batch expands('+');
 	long delta;
 	unsigned k;
 
@@ -3066,7 +4352,7 @@ static void do_resize_domains(void)
 
 			/* already overshooting? */
 			if (dom->memgoal0 > dom->memsize)
-				regoal(dom, dom->memsize);
+				regoal(dom, dom->memsize, regoals);
 		}
 		else if (dom->memsize < dom->memsize0)
 		{
@@ -3075,7 +4361,7 @@ static void do_resize_domains(void)
 
 			/* already undershooting? */
 			if (dom->memgoal0 < dom->memsize)
-				regoal(dom, dom->memsize);
+				regoal(dom, dom->memsize, regoals);
 		}
 		else /* memsize == memsize0 */
 		{
@@ -3143,7 +4429,7 @@ static void do_resize_domains(void)
 
 			/* Deviating? */
 			if (dom->memgoal0 != dom->memsize0 && false)
-				regoal(dom, dom->memsize0);
+				regoal(dom, dom->memsize0, regoals);
 		}
 	}
 
@@ -3164,15 +4450,23 @@ static void do_resize_domains(void)
 		print_plan(vec_down, vec_up);
 
 	/*
-	 * Execute shrinking
+	 * Execute regoals and shrinking.
+	 *
+	 * All shrink requests are issued in one go, and then verified together,
+	 * so domains being shrunk start releasing memory at about the same time
+	 * and we can wait for the freed memory as a group.
 	 */
+	regoals.execute();
+
 	for (k = 0;  k < vec_down.size();  k++)
 	{
 		dom = vec_down[k];
 		log_resize(dom, "shrink");
-		do_shrink_domain(dom, dom->memsize);
+		shrinks.add(dom, dom->memsize);
 	}
 
+	shrinks.execute();
+
 	/*
 	 * We are about to execute planned domain expansions. Unfortunately as
 	 * of now (v4.4) Xen does not provide an adequate facility for tracking
@@ -3209,7 +4503,10 @@ static void do_resize_domains(void)
 	 *     xen_free  = "live" amount of free memory
 	 *
 	 *     lien0     = outstanding liens calculated at the beginning of
-	 *                 rebalancing cycle
+	 *                 rebalancing cycle, less the liens of domains in
+	 *                 @vec_up still expanding per earlier requests: these
+	 *                 domains are re-targeted from their current allocation,
+	 *                 so their pending growth is part of allocated_by(vec_up)
 	 *
 	 *     reserved_xxx = xxx is "soft" or "hard" depending on the expansion
 	 *      	   force of domain currently being processed; we approximate
@@ -3221,6 +4518,15 @@ static void do_resize_domains(void)
 	 *     allocated_by(vec_up) = amount of memory reallocated to domains in
 	 *      	   @vec_up since the start of expansion
 	 *
+	 * Expansions are planned in passes. Each pass reads Xen data once,
+	 * then walks @vec_up in the order of expansion force granting memory
+	 * to domains for as long as it is available, and issues resulting
+	 * expansion requests as a single batch. If there was not enough memory
+	 * to satisfy all the domains, we wait for shrinking domains to release
+	 * more memory and run another pass.
+	 *
+	 * Live free memory does not reflect expansions issued during the current
+	 * pass yet, so the amount allocated within the pass is deducted from it.
 	 */
 
 	/*
@@ -3228,11 +4534,14 @@ static void do_resize_domains(void)
 	 */
 	struct timespec ts0 = getnow();
 	long allocated = 0;
-	domid2xcinfo xinfo;
-	bool read_xinfo = true;
+	long lien = host_lien0;
+	domid2xcinfo& xinfo = resize_id2xcinfo;
 	int nomem_cycles = 0;    /* sleep cycles when we saw no memory released */
 	bool warn = false;
 
+	for (k = 0;  k < vec_up.size();  k++)
+		lien -= domain_lien(vec_up[k]);
+
 	struct __prev
 	{
 		domain_info* dom;
@@ -3243,54 +4552,72 @@ static void do_resize_domains(void)
 
 	while (vec_up.size() != 0)
 	{
-		if (read_xinfo)
+		/*
+		 * Read domain data on the very first pass or after sleep
+		 */
+		xinfo.collect();
+		long xen_free = get_xen_free_memory();
+		long released = mem_released_by(vec_down, xinfo);
+		long pass_allocated = 0;
+		bool short_of_memory = false;
+
+		for (k = 0;  k < vec_up.size();  k++)
 		{
-			/*
-			 * Read domain data on the very first pass or after sleep
-			 */
-			xinfo.collect();
-			read_xinfo = false;
-		}
+			dom = vec_up[k];
 
-		dom = vec_up[0];
+			const xc_domaininfo_t* xcinfo = xinfo.get(dom->domain_id);
+			if (!xcinfo)
+			{
+				/* domain is gone */
+				continue;
+			}
 
-		const xc_domaininfo_t* xcinfo = xinfo.get(dom->domain_id);
-		if (!xcinfo)
-		{
-			/* domain is gone */
-			remove_at(vec_up, 0);
-			continue;
-		}
+			if (prev.dom != dom)
+			{
+				/* starting to expand yet another domain */
+				prev.dom = dom;
+				prev.goal = dom->memgoal0;
+				prev.alloc = dom->memsize0;
+			}
 
-		if (prev.dom != dom)
-		{
-			/* starting to expand yet another domain */
-			prev.dom = dom;
-			prev.goal = dom->memgoal0;
-			prev.alloc = dom->memsize0;
-		}
+			long curr_size = pagesize_kbs * xcinfo->tot_pages - dom->xen_data_size;
+			long goal = eval_allocate(dom, curr_size, prev.alloc, released,
+						  allocated, xen_free - pass_allocated, lien);
 
-		long curr_size = pagesize_kbs * xcinfo->tot_pages - dom->xen_data_size;
-		long goal = eval_allocate(dom, curr_size, prev.alloc, vec_down, xinfo, allocated);
+			if (goal > prev.goal)
+			{
+				expands.add(dom, goal);
+				allocated += goal - prev.alloc;
+				pass_allocated += goal - prev.alloc;
+				prev.alloc = goal;
+				prev.goal = goal;
+				dom->last_expand_tick = sched_tick;
+				nomem_cycles = 0;
+			}
 
-		if (goal > prev.goal)
-		{
-			do_expand_domain(dom, goal);
-			allocated += goal - prev.alloc;
-			prev.alloc = goal;
-			prev.goal = goal;
-			dom->last_expand_tick = sched_tick;
-			nomem_cycles = 0;
-		}
+			if (goal == dom->memsize)
+			{
+				/* achieved expansion goal for this domain */
+				log_resize(dom, "expand");
+				continue;
+			}
 
-		if (goal == dom->memsize)
-		{
-			/* achieved expansion goal for this domain */
-			log_resize(dom, "expand");
-			remove_at(vec_up, 0);
-			continue;
+			/*
+			 * Not enough memory to fully satisfy the expansion of @dom,
+			 * it stays at the head of @vec_up
+			 */
+			short_of_memory = true;
+			break;
 		}
 
+		/* drop domains that are done or gone */
+		vec_up.erase(vec_up.begin(), vec_up.begin() + k);
+
+		expands.execute();
+
+		if (!short_of_memory)
+			break;
+
 		/*
 		 * Comes here if there is not enough memory to fully satisfy
 		 * the expansion of @dom. If timeout allows us to wait for free
@@ -3312,7 +4639,6 @@ static void do_resize_domains(void)
 			break;
 		ms = min(100, ms);
 		usleep(ms * USEC_PER_MSEC);
-		read_xinfo = true;
 		nomem_cycles++;
 	}
 
@@ -3362,11 +4688,11 @@ static void do_resize_domains(void)
 
 /*
  * Called on domains with movement already in progress and with current goal
- * overshooting the re-calculated goal.
+ * overshooting the re-calculated goal. The resize request is queued to @batch.
  */
-static void regoal(domain_info* dom, long size)
+static void regoal(domain_info* dom, long size, resize_batch& batch)
 {
-	do_resize_domain(dom, size);
+	batch.add(dom, size);
 	dom->memgoal0 = size;
 	debug_msg(10, "regoal domain %s", dom->printable_name());
 }
@@ -3376,19 +4702,23 @@ static void regoal(domain_info* dom, long size)
  * Return new goal size for @dom.
  *
  * @curr_size is @dom actual current memory allocation reported by Xen.
- * @vec_down lists domain being concurrently shrinked.
  *
- * @xinfo is "current" memory allocation data for domains in @vec_down.
- * Read it at the start of the expansion process, re-read again after some
- * time passes, such as after a memory wait sleep.
+ * @released is the amount of memory released by domains being concurrently
+ * shrinked, as calculated by mem_released_by(...) from "current" memory
+ * allocation data. Re-evaluated after some time passes, such as after
+ * a memory wait sleep.
  *
  * @allocated is an aggregate amount of memory that had already been allocated
  * for expansion of the domains during current rebalancing tick.
+ *
+ * @xen_free is "live" amount of Xen free memory, less allocations not
+ * reflected in it yet.
+ *
+ * @lien is outstanding lien on Xen free memory, not counting the liens
+ * of the domains being expanded.
  */
 static long eval_allocate(domain_info* dom, long curr_size, long prev_alloc,
-			  const domvector& vec_down,
-			  const domid2xcinfo& xinfo,
-			  long allocated)
+			  long released, long allocated, long xen_free, long lien)
 {
 	long m1, m2, m;
 
@@ -3402,8 +4732,8 @@ static long eval_allocate(domain_info* dom, long curr_size, long prev_alloc,
 	 * legitimately being under host_reserved_soft, in case domains
 	 * with high memory demand are present in the mix.
 	 */
-	m1 = xen_free0 - config.host_reserved_hard - xen_free_slack - host_lien0 +
-	     mem_released_by(vec_down, xinfo) - allocated;
+	m1 = xen_free0 - config.host_reserved_hard - xen_free_slack - lien +
+	     released - allocated;
 	m1 = max(m1, 0);
 	m1 = rounddown(m1, pagesize_kbs);
 	m1 += prev_alloc;
@@ -3411,12 +4741,17 @@ static long eval_allocate(domain_info* dom, long curr_size, long prev_alloc,
 	/*
 	 * Accounting from the current time point (on top of curr_size)
 	 */
-	m2 = get_xen_free_memory() - config.host_reserved_hard - xen_free_slack - host_lien0;
+	m2 = xen_free - config.host_reserved_hard - xen_free_slack - lien;
 	m2 = max(m2, 0);
 	m2 = rounddown(m2, pagesize_kbs);
 	m2 += curr_size;
 
 	m = min(m1, m2);
+
+	/* partial expansion only in whole superpages */
+	if (dom->superpage_align > 0 && m < dom->memsize)
+		m = rounddown(m, dom->superpage_align);
+
 	m = max(m, dom->memsize0);   /* expanding, do not shrink (unless memsize0 > memsize) */
 	m = min(m, dom->memsize);    /* do not expand beyond goal */
 
@@ -3426,7 +4761,7 @@ static long eval_allocate(domain_info* dom, long curr_size, long prev_alloc,
 		      dom->memsize, m1, m2, dom->memgoal0);
 
 	debug_msg(21, "               released=%ld  allocated=%ld",
-		      mem_released_by(vec_down, xinfo), allocated);
+		      released, allocated);
 
 	return m;
 }
@@ -3522,6 +4857,8 @@ static void log_unexpanded(domvector& vec_up, bool warn, bool partial, long prev
 			      "short by %ld kbs = %ld mb + %ld kb",
 			      dom->printable_name(),
 			      amt, amt / 1024, amt % 1024);
+		if (warn)
+			pressure_note_shortage(dom, amt);
 		remove_at(vec_up, 0);
 		nshort++;
 	}
@@ -3533,6 +4870,8 @@ static void log_unexpanded(domvector& vec_up, bool warn, bool partial, long prev
 	{
 		dom = vec_up[0];
 		log_resize(dom, "will not expand");
+		if (warn)
+			pressure_note_shortage(dom, dom->memsize - dom->memsize0);
 		remove_at(vec_up, 0);
 		nshort++;
 	}
@@ -3612,6 +4951,7 @@ void collect_domain_memory_info(void)
 		}
 
 		record_memory_info(dom, xcinfo);
+		update_domain_lien(dom);
 	}
 }
 
@@ -3626,6 +4966,16 @@ bool is_runnable(domain_info* dom)
 	return runnable(dom);
 }
 
+unsigned long get_sched_tick(void)
+{
+	return sched_tick;
+}
+
+void set_sched_tick(unsigned long tick)
+{
+	sched_tick = tick;
+}
+
 
 /*
  * Debgging printout
@@ -3690,6 +5040,103 @@ static void print_plan(const domvector& vec_down, const domvector& vec_up)
 }
 
 
+/******************************************************************************
+*                     expand domains on pressure alarm                        *
+******************************************************************************/
+
+/*
+ * Handle pressure alarms raised by domains in between scheduling ticks
+ * (see handle_alarm_watch_event).
+ *
+ * Each alarmed domain is expanded right away by up to its regular per-tick
+ * increment (see eval_incr) over its current size, drawing only on host free
+ * memory available above @host_reserved_hard. Other domains are not shrunk
+ * to make room for it, this is left to the next regular tick.
+ *
+ * Only the alarmed domains are queried from Xen, and memory data collected
+ * for the tick (@memsize0, @memgoal0 etc.) is left alone. Host free memory
+ * is read after domain sizes, so that memory taken by the domains in between
+ * is not counted as free.
+ *
+ * A domain is expanded at most once per tick, whether by a regular tick
+ * or by an alarm, and the expansion protects it from soft shrinking in the
+ * next tick (see is_shrink_soft_protected).
+ */
+void sched_pressure_alarms(void)
+{
+	resize_batch expands('+');
+	std::vector<resize_request> alarmed;
+	xc_domaininfo_t xcinfo;
+	domain_info* dom;
+	long xen_free, avail, size, goal, base, chunk, delta;
+	unsigned k;
+
+	xen_free_slack = get_xen_free_slack();
+
+	/* may process more alarm events */
+	refresh_xs();
+
+	pressure_alarms_pending = false;
+
+	/*
+	 * Read current sizes of alarmed domains
+	 */
+	foreach_managed_domain(dom)
+	{
+		if (!dom->pressure_alarm)
+			continue;
+		dom->pressure_alarm = false;
+
+		if (memsched_pause_level != 0 ||
+		    !dom->valid_memory_data ||
+		    dom->last_expand_tick == sched_tick ||
+		    !get_xen_domain_info(dom->domain_id, &xcinfo) ||
+		    !runnable(&xcinfo))
+		{
+			continue;
+		}
+
+		size = pagesize_kbs * xcinfo.tot_pages - dom->xen_data_size;
+		alarmed.push_back(resize_request(dom, max(size, 0)));
+	}
+
+	if (alarmed.empty())
+		return;
+
+	/* liens are taken as of their latest evaluation */
+	xen_free = get_xen_free_memory();
+	avail = xen_free - xen_free_slack - domain_lien_total - freemem_lien_amount() -
+		config.host_reserved_hard;
+
+	for (k = 0;  k < alarmed.size();  k++)
+	{
+		dom = alarmed[k].dom;
+		size = alarmed[k].size;
+
+		/* expand from current size or from current target, if above */
+		goal = roundup(dom->xs_mem_target + dom->xs_mem_videoram, pagesize_kbs);
+		base = max(size, goal);
+		chunk = min(eval_incr(dom, size) - base, avail);
+		if (chunk <= 0)
+			continue;
+		chunk = rounddown(chunk, memquant_kbs);
+		if (chunk == 0)
+			continue;
+
+		dom->last_expand_tick = sched_tick;
+		avail -= chunk;
+		delta = base + chunk - size;
+
+		debug_msg(10, "alarm: expand domain %s (%ld kb -> %ld kb) by [+] %ld kbs = %ld mb + %ld kb",
+			      dom->printable_name(), size, base + chunk,
+			      delta, delta / 1024, delta % 1024);
+		expands.add(dom, base + chunk);
+	}
+
+	expands.execute();
+}
+
+
 /******************************************************************************
 *                       free up requested amount of memory                    *
 ******************************************************************************/
@@ -3752,190 +5199,347 @@ int sched_freemem(u_quad_t u_reqamt,
 		  u_quad_t* p_freemem_with_slack,
 		  u_quad_t* p_freemem_less_slack)
 {
-	long req = (long) u_reqamt;
-	long xen_free_memory;
-	long max_xen_free_memory, xen_free_target, prev_xen_free_memory;
-	long avail, avail_with_slack, avail_less_slack;
-	long max_avail, max_avail_with_slack, max_avail_less_slack;
-	long lien, freeable, reclaim, reclaimed, cond_free_slack;
-	domain_info* dom;
+	freemem_request fm(timeout);
 
-	/*
-	 * Automatic memory adjustment must be paused,
-	 * or the request does not make sense
-	 */
-	if (memsched_pause_level == 0)
-	{
-		*p_freemem_with_slack = 0;
-		*p_freemem_less_slack = 0;
-		return 'P';
-	}
+	fm.add(u_reqamt, above_slack, draw_reserved_hard, must);
+	while (!fm.step())
+		usleep(fm.wait_ms() * USEC_PER_MSEC);
 
-	/*
-	 * CAVEAT:
-	 *
-	 * Unfortunately Xen does not provide a way for an outside application
-	 * to really know Xen memory allocation and commitments.
-	 *
-	 * A proper memory allocation/commitments tracking facility ought to
-	 * provide the following data:
-	 *
-	 *   1) Currently allocated G+V+X size for every domain.
-	 *
-	 *   2) Separately, X part of current allocation.
-	 *
-	 *   3) Target G+V+X size for every domain (distinct from item#1 for
-	 *      domains in the process of expansion or contraction).
-	 *
-	 *   4) Separately, X part of target allocation if different from (2).
-	 *
-	 *   5) Summary (1) and (3) for all the domains.
-	 *
-	 *   6) Liens data should be lockable (perhaps for lien increase only).
-	 *
-	 * Unfortunately as of current version (4.4) Xen does not provide this
-	 * data.
-	 *
-	 * There are "target" and "videoram" sizes recorded in Xenstore, but they
-	 * constitute only "G+V" part of domain size which does not include the
-	 * "X" part -- the size of a domain's Xen internal data area which is
-	 * not stored or published anywhere. Therefore capturing "target" and
-	 * "videoram" values for all the domains
-	 *
-	 *     (overhead issues aside -- but this can be worked around by
-	 *      reading watch-updates from Xenstore /local/domain key and
-	 *      its subkeys, rather than reading Xenstore keys every time
-	 *      the values are needed)
-	 *
-	 * does not provide us means to find "true free size" because the "X"
-	 * part cannot be accounted for. Speaking in terms of Xen interface
-	 * structures, knowing "target" + "videoram" does not let us reason
-	 * about xc_domaininfo_t.tot_pages and vice versa. In effect, Xen/XL
-	 * created two disjoint spaces of memory sizing with no conversion
-	 * between them possible for an outside application.
-	 *
-	 * Domains may be in the process of shrinking or expansion (including
-	 * domains not managed by membalance) and their current size can be
-	 * distinct from their allocation targets and in the process of moving
-	 * towards the targets. Thus capturing just current size or free memory
-	 * does not provide us "true free size" until such movement is completed,
-	 * since Xen does not let us know the outstanding commitments.
-	 *
-	 * Thus the only way left for us to find or rather pray to approximate
-	 * "true free size" is to wait for domain resizings in progress to
-	 * complete by observing free memory size to stabilize over some time.
-	 *
-	 * This is very unreliable because:
-	 *
-	 *    1) A domain in the process of expansion or contraction may temporary
-	 *       stall, either because it is not alloted enough CPU time, or because
-	 *       some intra-guest activity temporarily preempted the balloon driver.
-	 *
-	 *    2) A domain can be paused.
-	 *
-	 *    3) Multiple domains can be expanding and shrinking simultaneously
-	 *       compensating each others group impact on free memory and creating an
-	 *       illusion that a stabilization had been achieved.
-	 *
-	 * Once these conditions clear, domain will resume its expansion or
-	 * contraction, or multi-domain expansion and contraction will get out of mutual
-	 * balance, and the assumption of having acquired "true free memory size" based
-	 * on an apparent stability of free memory amount on the host will prove wrong.
-	 *
-	 * To reiterate, relying on "stable free memory size" obsveration is damned
-	 * unreliable, but unfortunately Xen does not provide us any better way.
-	 */
+	*p_freemem_with_slack = fm.parts[0].freemem_with_slack;
+	*p_freemem_less_slack = fm.parts[0].freemem_less_slack;
 
-	/*
-	 * Collect memory allocation data
-	 */
-	timeout = timeout * MSEC_PER_SEC - config.domain_freemem_timeout;
-	timeout = max(0, timeout);
-	if (testmode)  timeout = 0;
-	xen_free_memory = xen_wait_free_memory_stable(timeout);
-	xen_free_slack = get_xen_free_slack();
-	collect_domain_memory_info();
-	lien = eval_memory_lien();
+	return fm.parts[0].status;
+}
 
-	/*
-	 * Calculate absolute maximum of memory attainable after
-	 * shrinking all managed runnable domains down to dmem_min
-	 */
-	freeable = 0;
-	foreach_managed_domain(dom)
-	{
-		if (dom->memsize > dom->dmem_min && runnable(dom))
-			freeable += dom->memsize - dom->dmem_min;
-	}
-	max_xen_free_memory = xen_free_memory + freeable;
+/*
+ * The body of sched_freemem(...), split into phases separated by waits for
+ * Xen memory, so that "membalancectl free-memory" RPC can be performed
+ * without stalling the main loop (see rcmd_server.cpp).
+ *
+ * Multiple requests are planned together: each is evaluated as described
+ * for sched_freemem(...), with memory granted to the requests preceding it
+ * counted as a lien. Domains are then shrunk to satisfy all of them at
+ * once, and memory attained for each request is set aside for it by
+ * a lien (see eval_freemem_lien).
+ */
+freemem_request::freemem_request(int timeout)
+	: shrinking('-')
+{
+	this->phase = FREEMEM_START;
+	this->timeout = timeout;
+	this->lien = 0;
+	this->prev_xen_free_memory = 0;
+	this->xen_free_target = 0;
+	this->prepare_seq = 0;
+	this->prepared = 0;
+	this->shrink_amount = 0;
+}
 
-	/*
-	 * Calculate absolute maximum of memory that might be made available
-	 */
-	max_avail = calc_avail(max_xen_free_memory, lien, above_slack, draw_reserved_hard);
-	max_avail_with_slack = calc_avail(max_xen_free_memory, lien, false, draw_reserved_hard);
-	max_avail_less_slack = calc_avail(max_xen_free_memory, lien, true, draw_reserved_hard);
+int freemem_request::add(u_quad_t amt, bool above_slack, bool draw_reserved_hard, bool must)
+{
+	freemem_part part;
 
-	/*
-	 * check if @req is not negative or zero
-	 */
-	if (req <= 0)
+	part.amt = amt;
+	part.above_slack = above_slack;
+	part.draw_reserved_hard = draw_reserved_hard;
+	part.must = must;
+	part.status = 0;
+	part.freemem_with_slack = 0;
+	part.freemem_less_slack = 0;
+	part.req = 0;
+
+	parts.push_back(part);
+
+	return (int) parts.size() - 1;
+}
+
+/*
+ * Called when a request with @timeout (seconds) joins the batch: if the
+ * batch would stop waiting for Xen memory to stabilize before the timeout
+ * of the joining request expires, extend the wait till then.
+ */
+void freemem_request::extend_timeout(int timeout)
+{
+	if (phase == FREEMEM_START)
+		this->timeout = max(this->timeout, timeout);
+	else if (phase == FREEMEM_STABILIZE)
+		waiter.extend(stabilize_timeout_ms(timeout));
+}
+
+/*
+ * Time to wait for Xen memory to stabilize for request with @timeout
+ * (seconds), leaving @domain_freemem_timeout for domains to shrink
+ */
+int freemem_request::stabilize_timeout_ms(int timeout)
+{
+	if (testmode)
+		return 0;
+	return max(0, timeout * MSEC_PER_SEC - config.domain_freemem_timeout);
+}
+
+/*
+ * Advance the requests as far as possible without waiting.
+ * Return @true if the requests have been completed.
+ */
+bool freemem_request::step(void)
+{
+	if (phase == FREEMEM_START)
 	{
-		*p_freemem_with_slack = max_avail_with_slack;
-		*p_freemem_less_slack = max_avail_less_slack;
-		return 'A';
+		/*
+		 * Automatic memory adjustment must be paused,
+		 * or the request does not make sense
+		 */
+		if (memsched_pause_level == 0)
+		{
+			complete_all('P');
+			return true;
+		}
+
+		/*
+		 * CAVEAT:
+		 *
+		 * Unfortunately Xen does not provide a way for an outside application
+		 * to really know Xen memory allocation and commitments.
+		 *
+		 * A proper memory allocation/commitments tracking facility ought to
+		 * provide the following data:
+		 *
+		 *   1) Currently allocated G+V+X size for every domain.
+		 *
+		 *   2) Separately, X part of current allocation.
+		 *
+		 *   3) Target G+V+X size for every domain (distinct from item#1 for
+		 *      domains in the process of expansion or contraction).
+		 *
+		 *   4) Separately, X part of target allocation if different from (2).
+		 *
+		 *   5) Summary (1) and (3) for all the domains.
+		 *
+		 *   6) Liens data should be lockable (perhaps for lien increase only).
+		 *
+		 * Unfortunately as of current version (4.4) Xen does not provide this
+		 * data.
+		 *
+		 * There are "target" and "videoram" sizes recorded in Xenstore, but they
+		 * constitute only "G+V" part of domain size which does not include the
+		 * "X" part -- the size of a domain's Xen internal data area which is
+		 * not stored or published anywhere. Therefore capturing "target" and
+		 * "videoram" values for all the domains
+		 *
+		 *     (overhead issues aside -- but this can be worked around by
+		 *      reading watch-updates from Xenstore /local/domain key and
+		 *      its subkeys, rather than reading Xenstore keys every time
+		 *      the values are needed)
+		 *
+		 * does not provide us means to find "true free size" because the "X"
+		 * part cannot be accounted for. Speaking in terms of Xen interface
+		 * structures, knowing "target" + "videoram" does not let us reason
+		 * about xc_domaininfo_t.tot_pages and vice versa. In effect, Xen/XL
+		 * created two disjoint spaces of memory sizing with no conversion
+		 * between them possible for an outside application.
+		 *
+		 * Domains may be in the process of shrinking or expansion (including
+		 * domains not managed by membalance) and their current size can be
+		 * distinct from their allocation targets and in the process of moving
+		 * towards the targets. Thus capturing just current size or free memory
+		 * does not provide us "true free size" until such movement is completed,
+		 * since Xen does not let us know the outstanding commitments.
+		 *
+		 * Thus the only way left for us to find or rather pray to approximate
+		 * "true free size" is to wait for domain resizings in progress to
+		 * complete by observing free memory size to stabilize over some time.
+		 *
+		 * This is very unreliable because:
+		 *
+		 *    1) A domain in the process of expansion or contraction may temporary
+		 *       stall, either because it is not alloted enough CPU time, or because
+		 *       some intra-guest activity temporarily preempted the balloon driver.
+		 *
+		 *    2) A domain can be paused.
+		 *
+		 *    3) Multiple domains can be expanding and shrinking simultaneously
+		 *       compensating each others group impact on free memory and creating an
+		 *       illusion that a stabilization had been achieved.
+		 *
+		 * Once these conditions clear, domain will resume its expansion or
+		 * contraction, or multi-domain expansion and contraction will get out of mutual
+		 * balance, and the assumption of having acquired "true free memory size" based
+		 * on an apparent stability of free memory amount on the host will prove wrong.
+		 *
+		 * To reiterate, relying on "stable free memory size" obsveration is damned
+		 * unreliable, but unfortunately Xen does not provide us any better way.
+		 */
+
+		/*
+		 * Wait for memory allocation to stabilize
+		 */
+		waiter.start_stable(stabilize_timeout_ms(timeout));
+		phase = FREEMEM_STABILIZE;
 	}
 
+	if (phase == FREEMEM_STABILIZE)
+	{
+		if (!waiter.poll())
+			return false;
+		if (!plan(waiter.xfree))
+			return true;
+	}
+
+	if (phase == FREEMEM_PREPARE)
+	{
+		if (!poll_prepare())
+			return false;
+		start_shrink();
+		return false;
+	}
+
+	if (phase == FREEMEM_SHRINK)
+	{
+		/* domains might have been deleted since the shrinking was started */
+		shrinking.prune();
+		if (!waiter.poll())
+			return false;
+		finish(waiter.xfree, true);
+	}
+
+	return phase == FREEMEM_DONE;
+}
+
+/*
+ * Calculate how much memory to reclaim and start shrinking the domains.
+ * Return @false if the requests have been completed without waiting.
+ */
+bool freemem_request::plan(long xen_free_memory)
+{
+	long req, lien_req, granted, need;
+	long max_xen_free_memory;
+	long max_avail, max_avail_with_slack, max_avail_less_slack;
+	long freeable, reclaim, reclaimed;
+	domain_info* dom;
+	bool any = false;
+	unsigned k;
+
 	/*
-	 * check if @req is sane and not prone to easy overflow,
-	 * to avoid arithmetic overflow in subsequent calculations
+	 * Automatic memory adjustment might have been resumed
+	 * while waiting for memory to stabilize
 	 */
-	if (req >= LONG_MAX / 2)
+	if (memsched_pause_level == 0)
 	{
-		*p_freemem_with_slack = 0;
-		*p_freemem_less_slack = 0;
-		return 'A';
+		complete_all('P');
+		return false;
 	}
 
 	/*
-	 * Allocation will be in quants
+	 * Collect memory allocation data
 	 */
-	req = roundup(req, memquant_kbs);
+	xen_free_slack = get_xen_free_slack();
+	collect_domain_memory_info();
+	lien = eval_memory_lien();
 
 	/*
-	 * Check if sufficient amount of free memory is attainable
-	 * at all by shrinking down managed domains.
+	 * Calculate absolute maximum of memory attainable after
+	 * shrinking all managed runnable domains down to dmem_min
 	 */
-	if (must && req > max_avail)
+	freeable = 0;
+	foreach_managed_domain(dom)
 	{
-		*p_freemem_with_slack = max_avail_with_slack;
-		*p_freemem_less_slack = max_avail_less_slack;
-		return 'N';
+		if (dom->memsize > dom->dmem_min && runnable(dom))
+			freeable += dom->memsize - dom->dmem_min;
 	}
+	max_xen_free_memory = xen_free_memory + freeable;
 
 	/*
-	 * check if @req is already available without shrinking
-	 * down managed domains and drawing on draw_reserved_hard
+	 * Evaluate the requests in the order of arrival,
+	 * and calculate how much memory is needed to satisfy them
 	 */
-	avail = calc_avail(xen_free_memory, lien, above_slack, false);
-	avail_with_slack = calc_avail(xen_free_memory, lien, false, false);
-	avail_less_slack = calc_avail(xen_free_memory, lien, true, false);
-	if (req <= avail)
+	granted = 0;
+	reclaim = 0;
+
+	for (k = 0;  k < parts.size();  k++)
 	{
-		*p_freemem_with_slack = avail_with_slack;
-		*p_freemem_less_slack = avail_less_slack;
-		return 'A';
+		freemem_part& part = parts[k];
+
+		/* memory granted to preceding requests is not available to this one */
+		lien_req = lien + granted;
+
+		/*
+		 * Calculate absolute maximum of memory that might be made available
+		 */
+		max_avail = calc_avail(max_xen_free_memory, lien_req, part.above_slack, part.draw_reserved_hard);
+		max_avail_with_slack = calc_avail(max_xen_free_memory, lien_req, false, part.draw_reserved_hard);
+		max_avail_less_slack = calc_avail(max_xen_free_memory, lien_req, true, part.draw_reserved_hard);
+
+		/*
+		 * check if @req is not negative or zero
+		 */
+		req = (long) part.amt;
+		if (req <= 0)
+		{
+			part.complete('A', max_avail_with_slack, max_avail_less_slack);
+			continue;
+		}
+
+		/*
+		 * check if @req is sane and not prone to easy overflow,
+		 * to avoid arithmetic overflow in subsequent calculations
+		 */
+		if (req >= LONG_MAX / 2)
+		{
+			part.complete('A', 0, 0);
+			continue;
+		}
+
+		/*
+		 * Allocation will be in quants
+		 */
+		req = roundup(req, memquant_kbs);
+
+		/*
+		 * Check if sufficient amount of free memory is attainable
+		 * at all by shrinking down managed domains.
+		 */
+		if (part.must && req > max_avail)
+		{
+			part.complete('N', max_avail_with_slack, max_avail_less_slack);
+			continue;
+		}
+
+		/*
+		 * Memory to reclaim for this request, if it is not already
+		 * available without shrinking down managed domains
+		 */
+		need = req + lien_req - xen_free_memory;
+		if (!part.draw_reserved_hard)
+			need += config.host_reserved_hard;
+		if (part.above_slack)
+			need += xen_free_slack;
+		reclaim = max(reclaim, need);
+
+		part.req = req;
+		granted += req;
+		any = true;
+	}
+
+	if (!any)
+	{
+		phase = FREEMEM_DONE;
+		return false;
+	}
+
+	if (reclaim <= 0)
+	{
+		finish(xen_free_memory, false);
+		return false;
 	}
 
 	/*
 	 * Perform domain squeeze scheduling
 	 */
-	cond_free_slack = above_slack ? xen_free_slack : 0;
-	reclaim = req + config.host_reserved_hard + cond_free_slack + lien - xen_free_memory;
-	reclaim = max(reclaim, 0);
 	reclaim = min(reclaim, freeable);
 	reclaim = roundup(reclaim, memquant_kbs);
+	snap.load();
 	reclaimed = hard_reclaim(reclaim);
+	snap.store();
 
 	/*
 	 * Bug catching sieve: should never happen
@@ -3944,23 +5548,40 @@ int sched_freemem(u_quad_t u_reqamt,
 	{
 		error_msg("bug: sched_freemem: reclaimed (%ld) < reclaim (%ld)",
 			  reclaimed, reclaim);
-		if (must)
+		any = false;
+		for (k = 0;  k < parts.size();  k++)
 		{
-			*p_freemem_with_slack = avail_with_slack;
-			*p_freemem_less_slack = avail_less_slack;
-			return 'N';
+			freemem_part& part = parts[k];
+			if (part.req && part.must)
+			{
+				part.complete('N',
+					      calc_avail(xen_free_memory, lien, false, false),
+					      calc_avail(xen_free_memory, lien, true, false));
+				part.req = 0;
+			}
+			else if (part.req)
+			{
+				any = true;
+			}
+		}
+
+		if (!any)
+		{
+			phase = FREEMEM_DONE;
+			return false;
 		}
 	}
 
 	/*
-	 * Execute shrinking
+	 * Select domains to shrink
 	 */
+	shrinking.clear();
 	foreach_managed_domain(dom)
 	{
 		if (dom->memsize < dom->memgoal0 && runnable(dom))
 		{
 			log_resize(dom, "shrink");
-			do_shrink_domain(dom, dom->memsize);
+			shrinking.add(dom, dom->memsize);
 
 			/* record shrinkage data */
 			if (dom->preshrink_tick != sched_tick)
@@ -3972,37 +5593,339 @@ int sched_freemem(u_quad_t u_reqamt,
 		}
 	}
 
+	prev_xen_free_memory = xen_free_memory;
+	shrink_amount = min(reclaimed, reclaim);
+
 	/*
-	 * Wait for a limited time for shrinking to complete to the target.
-	 * Result may be less than a target if some domains fail to shrink
-	 * promptly enough.
+	 * Let the guests reclaim memory they are about to give away,
+	 * then execute shrinking
 	 */
-	prev_xen_free_memory = xen_free_memory;
-	xen_free_target = xen_free_memory + min(reclaimed, reclaim);
-	xen_free_memory = xen_wait_free_memory(xen_free_target,
-					       config.domain_freemem_timeout);
+	request_prepare();
+	if (phase != FREEMEM_PREPARE)
+		start_shrink();
+
+	return true;
+}
+
+/*
+ * Ask memprobed in the domains selected for shrinking to reclaim guest
+ * memory by the amount the domain is going to be shrunk. If any of them
+ * is to respond, enter FREEMEM_PREPARE phase.
+ */
+void freemem_request::request_prepare(void)
+{
+	long amt;
+	unsigned k;
+
+	preparing.clear();
+	prepared = 0;
+
+	if (config.prepare_shrink_timeout <= 0)
+		return;
+
+	prepare_seq = ++prepare_shrink_seq;
+
+	for (k = 0;  k < shrinking.size();  k++)
+	{
+		const resize_request& r = shrinking[k];
+		amt = r.dom->memsize0 - r.size;
+		if (amt > 0 && request_prepare_shrink(r.dom, prepare_seq, amt))
+			preparing.push_back(r.domain_id);
+	}
+
+	if (preparing.size())
+	{
+		ts_prepare = getnow();
+		phase = FREEMEM_PREPARE;
+	}
+}
+
+/*
+ * Collect responses to prepare-shrink request.
+ * Return @true when all the domains have responded,
+ * or @prepare_shrink_timeout has expired.
+ */
+bool freemem_request::poll_prepare(void)
+{
+	domid2info::const_iterator it;
+	long amt;
+	unsigned k;
 
-	if (xen_free_memory < xen_free_target)
+	for (k = 0;  k < preparing.size(); )
 	{
-		warning_msg("membalancectl free-memory was unable to reclaim "
-			    "enough memory: reclaimed only %ld instead of %ld kbs",
-			    xen_free_memory - prev_xen_free_memory,
-			    xen_free_target - prev_xen_free_memory);
+		it = doms.managed.find(preparing[k]);
+		if (it == doms.managed.end() || it->second == NULL)
+		{
+			/* domain is gone */
+			remove_at(preparing, k);
+		}
+		else if (prepare_shrink_done(it->second, prepare_seq, &amt))
+		{
+			debug_msg(5, "domain %s reclaimed %ld kbs in preparation for shrinking",
+				  it->second->printable_name(), amt);
+			prepared += amt;
+			remove_at(preparing, k);
+		}
+		else
+		{
+			k++;
+		}
+	}
+
+	if (preparing.size() &&
+	    timespec_diff_ms(getnow(), ts_prepare) < config.prepare_shrink_timeout)
+	{
+		return false;
+	}
+
+	debug_msg(3, "guests reclaimed %ld kbs in preparation for shrinking in %ld ms%s",
+		  prepared, (long) timespec_diff_ms(getnow(), ts_prepare),
+		  preparing.size() ? " (timed out)" : "");
+
+	return true;
+}
+
+/*
+ * Execute shrinking and wait for a limited time for it to complete
+ * to the target. Result may be less than a target if some domains fail
+ * to shrink promptly enough.
+ */
+void freemem_request::start_shrink(void)
+{
+	/* domains might have been deleted while preparing */
+	shrinking.prune();
+
+	resize_batch shrinks = shrinking;
+	shrinks.execute();
+
+	xen_free_target = prev_xen_free_memory + shrink_amount;
+	ts_shrink = getnow();
+	waiter.start(xen_free_target, config.domain_freemem_timeout, &shrinking);
+	phase = FREEMEM_SHRINK;
+}
+
+/*
+ * Shrinking (if @waited) has completed or timed out,
+ * report the results and set aside the memory attained
+ */
+void freemem_request::finish(long xen_free_memory, bool waited)
+{
+	long lien_req, got, granted = 0;
+	unsigned k;
+
+	if (waited)
+	{
+		if (xen_free_memory < xen_free_target)
+		{
+			warning_msg("membalancectl free-memory was unable to reclaim "
+				    "enough memory: reclaimed only %ld instead of %ld kbs",
+				    xen_free_memory - prev_xen_free_memory,
+				    xen_free_target - prev_xen_free_memory);
+		}
+
+		note_freemem_reclaim_rate(xen_free_memory - prev_xen_free_memory,
+					  timespec_diff_ms(getnow(), ts_shrink));
+
+		/*
+		 * Outstandling lien might have changed while waiting for the shrinking
+		 */
+		collect_domain_memory_info();
+		lien = eval_memory_lien();
 	}
 
 	/*
-	 * Outstandling lien might have changed during xen_wait_free_memory(...)
+	 * Report how much we got
 	 */
-	collect_domain_memory_info();
-	lien = eval_memory_lien();
+	for (k = 0;  k < parts.size();  k++)
+	{
+		freemem_part& part = parts[k];
+		if (!part.req)
+			continue;
+
+		lien_req = lien + granted;
+		part.complete('A',
+			      calc_avail(xen_free_memory, lien_req, false, part.draw_reserved_hard),
+			      calc_avail(xen_free_memory, lien_req, true, part.draw_reserved_hard));
+
+		got = calc_avail(xen_free_memory, lien_req, part.above_slack, part.draw_reserved_hard);
+		got = min(got, part.req);
+		take_freemem_lien(got);
+		granted += got;
+	}
+
+	phase = FREEMEM_DONE;
+}
+
+void freemem_request::complete_all(int status)
+{
+	for (unsigned k = 0;  k < parts.size();  k++)
+		parts[k].complete(status, 0, 0);
+	phase = FREEMEM_DONE;
+}
+
+/*
+ * Update moving average of the rate at which domains shrunk for
+ * "membalancectl free-memory" request released memory
+ */
+static void note_freemem_reclaim_rate(long released, int64_t elapsed_ms)
+{
+	double rate;
+
+	if (released <= 0)
+		return;
+
+	rate = (double) released * MSEC_PER_SEC / max(elapsed_ms, (int64_t) 1);
+
+	if (freemem_reclaim_rate == 0)
+		freemem_reclaim_rate = rate;
+	else
+		freemem_reclaim_rate = (freemem_reclaim_rate + rate) / 2;
+}
+
+
+/******************************************************************************
+*                       project free memory request outcome                   *
+******************************************************************************/
+
+/*
+ * Evaluate what sched_freemem(...) could achieve for the request of @u_reqamt
+ * kbs with @above_slack and @draw_reserved_hard, without shrinking any domains
+ * and without requiring automatic memory adjustment to be paused.
+ *
+ * Invoked by "membalancectl free-memory --dry-run" via RPC, e.g. to let
+ * an orchestrator choose a host for a new domain before asking it to free
+ * the memory.
+ *
+ * The RPC can arrive mid-interval or while a "free-memory" request is in
+ * progress, so the projection must not disturb the daemon's state: domain
+ * sizes are read into @plan_id2xcinfo and @plan_snap rather than into
+ * domain_info, @snap and @id2xcinfo, liens are evaluated without updating
+ * them (see peek_memory_lien), and reclaim rounds are run against
+ * @plan_snap swapped in for @snap for the duration of the rounds.
+ *
+ * The projection is based on current domain sizes, and does not wait for
+ * Xen memory to stabilize, so it is less precise than the result of actually
+ * performing the request. Time estimate is based on the rate domains shrunk
+ * for preceding "free-memory" requests, and is not known until there was one.
+ */
+void sched_freemem_plan(u_quad_t u_reqamt,
+			bool above_slack,
+			bool draw_reserved_hard,
+			freemem_projection& proj)
+{
+	long xen_free_memory, max_xen_free_memory;
+	long freeable, lien, req, need;
+	const xc_domaininfo_t* xcinfo;
+	domain_info* dom;
+	int k;
 
 	/*
-	 * Report how much we got
+	 * Collect memory allocation data
+	 */
+	xen_free_slack = get_xen_free_slack();
+	plan_id2xcinfo.collect();
+	plan_snap.load();
+
+	freeable = 0;
+	for (k = 0;  k < plan_snap.ndoms;  k++)
+	{
+		dom = plan_snap.info[k];
+		xcinfo = plan_id2xcinfo.get(dom->domain_id);
+		if (!xcinfo || !dom->valid_memory_data)
+		{
+			/* domain is dead or has not been sized yet */
+			plan_snap.memsize[k] = plan_snap.memsize0[k];
+			plan_snap.set_runnable(k, false);
+			continue;
+		}
+
+		plan_snap.memsize[k] = pagesize_kbs * xcinfo->tot_pages - dom->xen_data_size;
+		plan_snap.memsize[k] = max(plan_snap.memsize[k], 0);
+		plan_snap.memsize0[k] = plan_snap.memsize[k];
+		plan_snap.memsize_decr[k] = eval_decr(dom, plan_snap.memsize0[k]);
+		plan_snap.set_runnable(k, runnable(xcinfo));
+
+		if (plan_snap.memsize[k] > plan_snap.dmem_min[k] && plan_snap.runnable(k))
+			freeable += plan_snap.memsize[k] - plan_snap.dmem_min[k];
+	}
+
+	lien = peek_memory_lien(plan_id2xcinfo);
+	xen_free_memory = get_xen_free_memory();
+	max_xen_free_memory = xen_free_memory + freeable;
+
+	fill_freemem_tier(proj.keep_reserved_hard, xen_free_memory, max_xen_free_memory, lien, false);
+	fill_freemem_tier(proj.use_reserved_hard, xen_free_memory, max_xen_free_memory, lien, true);
+
+	proj.status = 'A';
+	proj.freemem_with_slack = calc_avail(xen_free_memory, lien, false, draw_reserved_hard);
+	proj.freemem_less_slack = calc_avail(xen_free_memory, lien, true, draw_reserved_hard);
+	proj.reclaim = 0;
+	proj.est_ms = 0;
+	proj.donors.clear();
+
+	/*
+	 * Same checks as in freemem_request::plan(...)
+	 */
+	req = (long) u_reqamt;
+	if (req <= 0)
+		return;
+
+	if (req >= LONG_MAX / 2)
+	{
+		proj.status = 'N';
+		return;
+	}
+
+	req = roundup(req, memquant_kbs);
+
+	if (req > calc_avail(max_xen_free_memory, lien, above_slack, draw_reserved_hard))
+		proj.status = 'N';
+
+	need = req + lien - xen_free_memory;
+	if (!draw_reserved_hard)
+		need += config.host_reserved_hard;
+	if (above_slack)
+		need += xen_free_slack;
+	need = min(need, freeable);
+
+	if (need <= 0)
+		return;
+
+	/*
+	 * Perform domain squeeze scheduling on the private snapshot
 	 */
-	*p_freemem_with_slack = calc_avail(xen_free_memory, lien, false, draw_reserved_hard);
-	*p_freemem_less_slack = calc_avail(xen_free_memory, lien, true, draw_reserved_hard);
+	std::swap(snap, plan_snap);
+	proj.reclaim = hard_reclaim(roundup(need, memquant_kbs));
+	std::swap(snap, plan_snap);
+
+	for (k = 0;  k < plan_snap.ndoms;  k++)
+	{
+		if (plan_snap.memsize[k] < plan_snap.memsize0[k])
+		{
+			freemem_donor donor;
+			donor.domain_id = plan_snap.info[k]->domain_id;
+			donor.memsize = plan_snap.memsize0[k];
+			donor.target = plan_snap.memsize[k];
+			proj.donors.push_back(donor);
+		}
+	}
+
+	proj.freemem_with_slack = calc_avail(xen_free_memory + proj.reclaim, lien, false, draw_reserved_hard);
+	proj.freemem_less_slack = calc_avail(xen_free_memory + proj.reclaim, lien, true, draw_reserved_hard);
 
-	return 'A';
+	if (freemem_reclaim_rate > 0)
+		proj.est_ms = (int) min((double) proj.reclaim * MSEC_PER_SEC / freemem_reclaim_rate, (double) INT_MAX);
+	else
+		proj.est_ms = -1;
+}
+
+static void fill_freemem_tier(freemem_tier& tier, long xen_free_memory, long max_xen_free_memory,
+			      long lien, bool draw_reserved_hard)
+{
+	tier.free_with_slack = calc_avail(xen_free_memory, lien, false, draw_reserved_hard);
+	tier.free_less_slack = calc_avail(xen_free_memory, lien, true, draw_reserved_hard);
+	tier.max_with_slack = calc_avail(max_xen_free_memory, lien, false, draw_reserved_hard);
+	tier.max_less_slack = calc_avail(max_xen_free_memory, lien, true, draw_reserved_hard);
 }
 
 
@@ -4013,25 +5936,290 @@ int sched_freemem(u_quad_t u_reqamt,
 /*
  * Evaluate the amount of outstanding lien on Xen free memory.
  *
- * Currently (see CAVEAT notes above) the only lien source we are able to
- * (at least partially meaningfully) account for is managed domains in the
- * paused state with expansion pending.
+ * Currently (see CAVEAT notes above) the only lien sources we are able to
+ * (at least partially meaningfully) account for are expansions of managed
+ * domains issued by membalance itself and still in progress, and managed
+ * domains in the paused state with expansion pending.
+ *
+ * Per-domain liens are maintained by update_domain_lien as domain memory
+ * data is collected, so the domains do not need to be walked here.
  */
 static long eval_memory_lien(void)
 {
-	long delta, lien = 0;
-	domain_info* dom;
+	return domain_lien_total + eval_freemem_lien();
+}
 
-	foreach_managed_domain(dom)
+/*
+ * Evaluate the amount of outstanding lien on Xen free memory with domain
+ * sizes from @xinfo, same as eval_memory_lien(), but without updating the
+ * ledger or the liens. Liens of paused domains and of "membalancectl
+ * free-memory" requests are taken as of their latest evaluation.
+ */
+static long peek_memory_lien(const domid2xcinfo& xinfo)
+{
+	std::map<long, long>::const_iterator it;
+	std::map<long, inflight_resize>::const_iterator op;
+	const xc_domaininfo_t* xcinfo;
+	long total = freemem_lien_amount();
+
+	for (it = domain_liens.begin();  it != domain_liens.end();  ++it)
+	{
+		xcinfo = xinfo.get(it->first);
+		if (!xcinfo)
+			continue;
+
+		op = inflight_resizes.find(it->first);
+		if (op != inflight_resizes.end())
+			total += max(op->second.alloc - pagesize_kbs * (long) xcinfo->tot_pages, 0);
+		else
+			total += it->second;
+	}
+
+	return total;
+}
+
+/*
+ * Record that memory target of managed domain @dom has been set to @size
+ * by membalance, just before the request is issued to Xen.
+ *
+ * Expansion is entered into the ledger of requests in flight, with its
+ * lien taken as the difference between expected and last known current
+ * allocation. Shrinking supersedes preceding expansion.
+ */
+void note_memory_target(domain_info* dom, long size)
+{
+	long alloc = size + dom->xen_data_size;
+	long curr = dom->memsize0 + dom->xen_data_size;
+
+	if (config.resize_lien_timeout <= 0 || !dom->valid_memory_data || alloc <= curr)
 	{
-		if (dom->xcinfo->flags & XEN_DOMINF_paused)
+		if (inflight_resizes.erase(dom->domain_id))
+			set_domain_lien(dom->domain_id, 0);
+		return;
+	}
+
+	inflight_resize& op = inflight_resizes[dom->domain_id];
+	op.target = size;
+	op.alloc = alloc;
+	op.progress = curr;
+	op.ts_progress = getnow();
+
+	set_domain_lien(dom->domain_id, alloc - curr);
+}
+
+/*
+ * Update the lien of managed domain @dom from freshly collected memory data
+ * (@xcinfo, @memsize0, @memgoal0 and @xen_data_size).
+ */
+static void update_domain_lien(domain_info* dom)
+{
+	std::map<long, inflight_resize>::iterator it;
+	long curr = pagesize_kbs * (long) dom->xcinfo->tot_pages;
+	const char* why = NULL;
+	struct timespec now;
+
+	it = inflight_resizes.find(dom->domain_id);
+	if (it != inflight_resizes.end())
+	{
+		inflight_resize& op = it->second;
+
+		if (curr >= op.alloc)
+		{
+			/* completed */
+		}
+		else if (op.target != dom->memgoal0)
+		{
+			why = "superseded";
+		}
+		else
+		{
+			now = getnow();
+			if (curr > op.progress)
+			{
+				op.progress = curr;
+				op.ts_progress = now;
+			}
+
+			if (timespec_diff_ms(now, op.ts_progress) < config.resize_lien_timeout * MSEC_PER_SEC)
+			{
+				set_domain_lien(dom->domain_id, op.alloc - curr);
+				return;
+			}
+
+			why = "stalled";
+		}
+
+		if (why)
+		{
+			debug_msg(15, "expansion of domain %s to %ld kbs %s, %ld kbs short",
+				  dom->printable_name(), op.target, why, op.alloc - curr);
+		}
+
+		inflight_resizes.erase(it);
+	}
+
+	if (dom->xcinfo->flags & XEN_DOMINF_paused)
+		set_domain_lien(dom->domain_id, max(0, dom->memgoal0 + dom->xen_data_size - dom->memsize0));
+	else
+		set_domain_lien(dom->domain_id, 0);
+}
+
+/*
+ * Drop lien records of domain @domain_id,
+ * called when the domain is no longer managed
+ */
+void forget_domain_lien(long domain_id)
+{
+	inflight_resizes.erase(domain_id);
+	set_domain_lien(domain_id, 0);
+}
+
+static void set_domain_lien(long domain_id, long lien)
+{
+	std::map<long, long>::iterator it = domain_liens.find(domain_id);
+
+	if (it != domain_liens.end())
+	{
+		domain_lien_total -= it->second;
+		if (lien == 0)
+			domain_liens.erase(it);
+		else
+			it->second = lien;
+	}
+	else if (lien != 0)
+	{
+		domain_liens[domain_id] = lien;
+	}
+
+	domain_lien_total += lien;
+}
+
+/*
+ * Current lien of managed domain @dom
+ */
+static long domain_lien(const domain_info* dom)
+{
+	std::map<long, long>::const_iterator it = domain_liens.find(dom->domain_id);
+	return it == domain_liens.end() ? 0 : it->second;
+}
+
+/*
+ * Evaluate the memory still set aside for "membalancectl free-memory"
+ * requests (see freemem_lien above), based on @id2xcinfo.
+ *
+ * Allocation (including outstanding claims) of domains that did not exist
+ * when a lien was taken is counted as consumption of the lien, oldest liens
+ * first. The remaining amount of a lien never grows back, even if domains
+ * consuming it shrink or go away. Fully consumed and expired liens are
+ * dropped, and domains that consumed them are not counted against the
+ * remaining liens afterwards.
+ */
+static long eval_freemem_lien(void)
+{
+	std::map<long, long> unclaimed;		/* domain id -> allocation not counted yet */
+	std::map<long, long>::iterator it;
+	const xc_domaininfo_t* xcinfo;
+	struct timespec now;
+	long domain_id, consumed, take, total = 0;
+	unsigned k, j;
+	int i;
+
+	if (freemem_liens.empty())
+		return 0;
+
+	now = getnow();
+
+	for (k = 0;  k < freemem_liens.size();  )
+	{
+		freemem_lien& fl = freemem_liens[k];
+
+		consumed = 0;
+		for (i = 0;  i < id2xcinfo.count() && consumed < fl.amount;  i++)
+		{
+			xcinfo = id2xcinfo.at(i);
+			domain_id = (long) xcinfo->domain;
+			if (contains(fl.known, domain_id))
+				continue;
+
+			it = unclaimed.find(domain_id);
+			if (it == unclaimed.end())
+			{
+				take = pagesize_kbs * (long) (xcinfo->tot_pages + xcinfo->outstanding_pages);
+				it = unclaimed.insert(std::make_pair(domain_id, take)).first;
+			}
+
+			take = min(it->second, fl.amount - consumed);
+			it->second -= take;
+			consumed += take;
+		}
+
+		fl.remaining = min(fl.remaining, fl.amount - consumed);
+
+		if (fl.remaining > 0 && timespec_diff_ms(now, fl.expires) < 0)
 		{
-			delta = dom->memgoal0 + dom->xen_data_size - dom->memsize0;
-			lien += max(0, delta);
+			total += fl.remaining;
+			k++;
+			continue;
 		}
 
+		debug_msg(5, "freemem lien of %ld kbs %s", fl.amount,
+			  fl.remaining > 0 ? "expired" : "consumed");
+
+		for (i = 0;  i < id2xcinfo.count();  i++)
+		{
+			domain_id = (long) id2xcinfo.at(i)->domain;
+			if (contains(fl.known, domain_id))
+				continue;
+			for (j = k + 1;  j < freemem_liens.size();  j++)
+				freemem_liens[j].known.insert(domain_id);
+		}
+
+		freemem_liens.erase(freemem_liens.begin() + k);
 	}
 
-	return lien;
+	return total;
+}
+
+/*
+ * Set aside @amount kbs of memory for "membalancectl free-memory" requester
+ */
+static void take_freemem_lien(long amount)
+{
+	if (amount <= 0 || config.freemem_lien_timeout <= 0)
+		return;
+
+	freemem_liens.push_back(freemem_lien());
+	freemem_lien& fl = freemem_liens.back();
+
+	fl.amount = fl.remaining = amount;
+	fl.expires = getnow();
+	fl.expires.tv_sec += config.freemem_lien_timeout;
+	for (int i = 0;  i < id2xcinfo.count();  i++)
+		fl.known.insert((long) id2xcinfo.at(i)->domain);
+
+	debug_msg(5, "freemem: set aside %ld kbs for up to %d sec",
+		  amount, config.freemem_lien_timeout);
+}
+
+/*
+ * Memory currently set aside for "membalancectl free-memory" requesters,
+ * as of the latest evaluation
+ */
+long freemem_lien_amount(void)
+{
+	long total = 0;
+
+	for (unsigned k = 0;  k < freemem_liens.size();  k++)
+		total += freemem_liens[k].remaining;
+
+	return total;
+}
+
+/*
+ * Drop all liens taken by "membalancectl free-memory" requests
+ */
+void release_freemem_liens(void)
+{
+	freemem_liens.clear();
 }
 
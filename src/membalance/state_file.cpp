@@ -0,0 +1,378 @@
+/*
+ *  MEMBALANCE daemon
+ *
+ *  state_file.cpp - Per-domain scheduler state kept across daemon restarts
+ *
+ *  Portions Copyright (C) 2014 Sergey Oboguev (oboguev@yahoo.com)
+ *  For licensing terms see license.txt
+ */
+
+#include "membalanced.h"
+
+/******************************************************************************
+*                             local definitions                               *
+******************************************************************************/
+
+/*
+ * See state_file.h for the layout of the file.
+ */
+
+/* domain record loaded from the state file */
+class saved_domain
+{
+public:
+	state_file_domain rec;
+	std::vector<state_file_rate> rates;
+};
+
+typedef std::map<long, saved_domain> domid2saved;
+
+
+/******************************************************************************
+*                               static data                                   *
+******************************************************************************/
+
+static domid2saved saved;			/* records loaded on startup */
+static bool saved_history_valid = false;	/* saved tick numbers are usable */
+static bool saved_once = false;			/* state file has been written */
+static struct timespec ts_saved;		/* ... time of last write */
+
+
+/******************************************************************************
+*                           forward declarations                              *
+******************************************************************************/
+
+static bool matches(const state_file_domain& rec, const domain_info* dom);
+static bool fill_record(state_file_domain& rec, const domain_info* dom);
+static bool fit(char* buf, size_t size, const char* s);
+
+
+/******************************************************************************
+*                                 routines                                    *
+******************************************************************************/
+
+/*
+ * Called on startup, before local domains are enumerated.
+ * Load state file written by the previous instance of the daemon,
+ * and continue tick numbering from where it left off.
+ */
+void state_file_load(void)
+{
+	state_file_hdr hdr;
+	saved_domain sd;
+	FILE* fp;
+	uint32_t k;
+	int64_t gap;
+
+	if (testmode || config.state_save_interval <= 0)
+		return;
+
+	fp = fopen(state_file_path, "r");
+	if (!fp)
+	{
+		if (errno != ENOENT)
+			warning_perror("unable to open state file %s", state_file_path);
+		return;
+	}
+
+	if (1 != fread(&hdr, sizeof hdr, 1, fp) ||
+	    memcmp(hdr.magic, STATE_FILE_MAGIC, sizeof hdr.magic) ||
+	    hdr.version != STATE_FILE_VERSION ||
+	    hdr.header_size != sizeof(state_file_hdr) ||
+	    hdr.domain_size != sizeof(state_file_domain) ||
+	    hdr.rate_size != sizeof(state_file_rate))
+	{
+		warning_msg("ignoring state file %s: unknown format", state_file_path);
+		goto cleanup;
+	}
+
+	for (k = 0;  k < hdr.ndomains;  k++)
+	{
+		if (1 != fread(&sd.rec, sizeof sd.rec, 1, fp) ||
+		    sd.rec.nrates > RATE_HISTORY_SIZE + 1)
+		{
+			goto truncated;
+		}
+
+		sd.rates.resize(sd.rec.nrates);
+		if (sd.rec.nrates &&
+		    sd.rec.nrates != fread(&sd.rates[0], sizeof(state_file_rate), sd.rec.nrates, fp))
+		{
+			goto truncated;
+		}
+
+		sd.rec.uuid[STATE_FILE_UUID_SIZE - 1] = '\0';
+		sd.rec.start_time[STATE_FILE_START_SIZE - 1] = '\0';
+		saved[sd.rec.domain_id] = sd;
+	}
+
+	/*
+	 * Tick numbers recorded in the file stay meaningful only if the
+	 * interval did not change. Advance tick number by the time the
+	 * daemon was down, so history breach is detected as usual.
+	 */
+	gap = (int64_t) time(NULL) - hdr.save_time;
+	if (hdr.interval == config.interval && gap >= 0)
+	{
+		set_sched_tick(hdr.tick + gap / config.interval);
+		saved_history_valid = true;
+	}
+
+	notice_msg("loaded saved state for %u domains (saved %lld seconds ago)",
+		   hdr.ndomains, (long long) gap);
+
+	goto cleanup;
+
+truncated:
+
+	warning_msg("state file %s is truncated, ignoring it", state_file_path);
+	saved.clear();
+
+cleanup:
+
+	fclose(fp);
+}
+
+/*
+ * Called after every scheduler tick.
+ * Write state file if it is due.
+ */
+void state_file_update(void)
+{
+	if (testmode || config.state_save_interval <= 0)
+		return;
+
+	if (!saved_once ||
+	    timespec_diff_ms(getnow(), ts_saved) >= config.state_save_interval * MSEC_PER_SEC)
+	{
+		state_file_save();
+	}
+}
+
+/*
+ * Write state of managed domains to state file.
+ * Called periodically and at daemon shutdown.
+ */
+void state_file_save(void)
+{
+	state_file_hdr hdr;
+	std::vector<state_file_domain> recs;
+	std::vector<const domain_info*> vdom;
+	state_file_rate rr;
+	domain_info* dom;
+	char* tmp_path = NULL;
+	FILE* fp = NULL;
+	int fd = -1;
+	size_t k;
+	int j;
+
+	if (testmode || config.state_save_interval <= 0)
+		return;
+
+	saved_once = true;
+	ts_saved = getnow();
+
+	foreach_managed_domain(dom)
+	{
+		state_file_domain rec;
+		if (fill_record(rec, dom))
+		{
+			recs.push_back(rec);
+			vdom.push_back(dom);
+		}
+	}
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, STATE_FILE_MAGIC, sizeof hdr.magic);
+	hdr.version = STATE_FILE_VERSION;
+	hdr.header_size = sizeof(state_file_hdr);
+	hdr.domain_size = sizeof(state_file_domain);
+	hdr.rate_size = sizeof(state_file_rate);
+	hdr.ndomains = recs.size();
+	hdr.save_time = time(NULL);
+	hdr.tick = get_sched_tick();
+	hdr.interval = config.interval;
+
+	make_membalance_rundir();
+
+	tmp_path = xprintf("%s.new", state_file_path);
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0 || !(fp = fdopen(fd, "w")))
+		goto error;
+	fd = -1;
+
+	if (1 != fwrite(&hdr, sizeof hdr, 1, fp))
+		goto error;
+
+	for (k = 0;  k < recs.size();  k++)
+	{
+		if (1 != fwrite(&recs[k], sizeof recs[k], 1, fp))
+			goto error;
+
+		for (j = 0;  j < (int) recs[k].nrates;  j++)
+		{
+			const rate_record& r = vdom[k]->rate_history[j];
+			memset(&rr, 0, sizeof rr);
+			rr.tick = r.tick;
+			rr.rate = r.rate;
+			rr.freepct = r.freepct;
+			if (1 != fwrite(&rr, sizeof rr, 1, fp))
+				goto error;
+		}
+	}
+
+	if (fflush(fp) || fsync(fileno(fp)))
+		goto error;
+
+	if (fclose(fp))
+	{
+		fp = NULL;
+		goto error;
+	}
+	fp = NULL;
+
+	if (rename(tmp_path, state_file_path))
+		goto error;
+
+	debug_msg(5, "saved state for %lu domains", (unsigned long) recs.size());
+
+	free(tmp_path);
+	return;
+
+error:
+
+	error_perror("unable to write state file %s", tmp_path);
+	if (fp)
+		fclose(fp);
+	if (fd >= 0)
+		close(fd);
+	unlink(tmp_path);
+	free(tmp_path);
+}
+
+/*
+ * Called for pending domain once its xenstore data has been read, and before
+ * xen_data_size is sampled. If the domain was managed by the previous instance
+ * of the daemon, take xen_data_size it has learned.
+ */
+void state_file_restore_xds(domain_info* dom)
+{
+	domid2saved::iterator it = saved.find(dom->domain_id);
+
+	if (it == saved.end())
+		return;
+
+	if (!matches(it->second.rec, dom))
+	{
+		/* domain id has been reused by another domain */
+		saved.erase(it);
+		return;
+	}
+
+	dom->xen_data_size = it->second.rec.xen_data_size;
+	dom->xen_data_size_phase = config.xen_private_data_size_samples;
+
+	debug_msg(2, "restored xen_data_size of domain %s: %ld kbs",
+		  dom->printable_name(), dom->xen_data_size);
+}
+
+/*
+ * Called when domain enters managed state.
+ * Restore its scheduling history kept by the previous instance of the daemon.
+ */
+void state_file_restore_history(domain_info* dom)
+{
+	domid2saved::iterator it = saved.find(dom->domain_id);
+	uint32_t k;
+
+	if (it == saved.end())
+		return;
+
+	const state_file_domain& rec = it->second.rec;
+	const std::vector<state_file_rate>& rates = it->second.rates;
+
+	if (saved_history_valid && matches(rec, dom))
+	{
+		dom->last_report_tick = rec.last_report_tick;
+		dom->no_report_time = rec.no_report_time;
+		dom->time_rate_below_low = rec.time_rate_below_low;
+		dom->time_rate_below_high = rec.time_rate_below_high;
+		dom->last_expand_tick = rec.last_expand_tick;
+		dom->last_resize_time = rec.last_resize_time;
+		dom->last_resize_size = rec.last_resize_size;
+
+		/* push oldest first */
+		dom->rate_history.clear();
+		for (k = rates.size();  k != 0;  k--)
+		{
+			const state_file_rate& rr = rates[k - 1];
+			dom->rate_history.push(rate_record(rr.tick, rr.rate, rr.freepct));
+		}
+
+		dom->fast_window.update(dom->rate_history, config.rate_fast_window, true);
+		dom->slow_window.update(dom->rate_history, config.rate_slow_window, true);
+
+		debug_msg(2, "restored scheduling history of domain %s (%d samples)",
+			  dom->printable_name(), dom->rate_history.size());
+	}
+
+	saved.erase(it);
+}
+
+/*
+ * Check if saved record @rec describes domain @dom
+ */
+static bool matches(const state_file_domain& rec, const domain_info* dom)
+{
+	/* DomU must have both uuid and start time */
+	if (dom->domain_id != 0 && (!rec.uuid[0] || !rec.start_time[0]))
+		return false;
+
+	return streq(rec.uuid, dom->vm_uuid ? dom->vm_uuid : "") &&
+	       streq(rec.start_time, dom->xs_start_time ? dom->xs_start_time : "");
+}
+
+/*
+ * Fill state file record for managed domain @dom.
+ * Return @false if domain has nothing worth saving.
+ */
+static bool fill_record(state_file_domain& rec, const domain_info* dom)
+{
+	if (dom->xen_data_size_phase < config.xen_private_data_size_samples)
+		return false;
+
+	memset(&rec, 0, sizeof rec);
+
+	if (!fit(rec.uuid, sizeof rec.uuid, dom->vm_uuid) ||
+	    !fit(rec.start_time, sizeof rec.start_time, dom->xs_start_time))
+	{
+		return false;
+	}
+
+	rec.domain_id = dom->domain_id;
+	rec.nrates = dom->rate_history.size();
+	rec.xen_data_size = dom->xen_data_size;
+	rec.last_report_tick = dom->last_report_tick;
+	rec.no_report_time = dom->no_report_time;
+	rec.time_rate_below_low = dom->time_rate_below_low;
+	rec.time_rate_below_high = dom->time_rate_below_high;
+	rec.last_expand_tick = dom->last_expand_tick;
+	rec.last_resize_time = dom->last_resize_time;
+	rec.last_resize_size = dom->last_resize_size;
+
+	return true;
+}
+
+/*
+ * Copy @s (can be NULL) to @buf of @size bytes.
+ * Return @false if it does not fit.
+ */
+static bool fit(char* buf, size_t size, const char* s)
+{
+	if (!s)
+		s = "";
+	if (strlen(s) >= size)
+		return false;
+	strcpy(buf, s);
+	return true;
+}
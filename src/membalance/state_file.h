@@ -0,0 +1,75 @@
+/*
+ *  MEMBALANCE daemon
+ *
+ *  state_file.h - Per-domain scheduler state kept across daemon restarts
+ *
+ *  Portions Copyright (C) 2014 Sergey Oboguev (oboguev@yahoo.com)
+ *  For licensing terms see license.txt
+ */
+
+#ifndef __MEMBALANCE_STATE_FILE_H__
+#define __MEMBALANCE_STATE_FILE_H__
+
+/*
+ * State file is kept in membalance run directory. It is written by the daemon
+ * every @state_save_interval seconds and at shutdown, and holds data learned
+ * about managed domains over their lifetime: xen_data_size and scheduling
+ * history. On startup, a domain whose uuid and start time match a record in
+ * the file passes through pending state without re-sampling xen_data_size,
+ * and enters managed state with its history restored.
+ *
+ * The file holds the header followed by @ndomains domain records, each
+ * followed by its rate history samples. The file is private to the daemon,
+ * all fields are in host byte order.
+ */
+
+#define STATE_FILE_MAGIC	"MBSTATE"
+#define STATE_FILE_VERSION	1
+#define STATE_FILE_UUID_SIZE	40
+#define STATE_FILE_START_SIZE	40
+
+typedef struct __state_file_hdr
+{
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	header_size;		/* sizeof(state_file_hdr) */
+	uint32_t	domain_size;		/* sizeof(state_file_domain) */
+	uint32_t	rate_size;		/* sizeof(state_file_rate) */
+	uint32_t	ndomains;		/* domain records following the header */
+	uint32_t	reserved;
+	int64_t		save_time;		/* unix time */
+	uint64_t	tick;			/* scheduler tick number */
+	int64_t		interval;		/* scheduler interval (sec) */
+} state_file_hdr;
+
+typedef struct __state_file_rate
+{
+	uint64_t	tick;
+	int64_t		rate;
+	double		freepct;
+} state_file_rate;
+
+typedef struct __state_file_domain
+{
+	int32_t		domain_id;
+	uint32_t	nrates;			/* rate history samples following the record,
+						   most recent first */
+	char		uuid[STATE_FILE_UUID_SIZE];		/* vm_uuid or empty */
+	char		start_time[STATE_FILE_START_SIZE];	/* xs_start_time or empty */
+	int64_t		xen_data_size;
+	uint64_t	last_report_tick;
+	int64_t		no_report_time;
+	int64_t		time_rate_below_low;
+	int64_t		time_rate_below_high;
+	uint64_t	last_expand_tick;
+	int64_t		last_resize_time;
+	int64_t		last_resize_size;
+} state_file_domain;
+
+void state_file_load(void);
+void state_file_update(void);
+void state_file_save(void);
+void state_file_restore_xds(domain_info* dom);
+void state_file_restore_history(domain_info* dom);
+
+#endif // __MEMBALANCE_STATE_FILE_H__
@@ -0,0 +1,78 @@
+/*
+ *  MEMBALANCE daemon
+ *
+ *  stats.cpp - Latency histograms and event counters
+ *
+ *  Portions Copyright (C) 2014 Sergey Oboguev (oboguev@yahoo.com)
+ *  For licensing terms see license.txt
+ */
+
+#include "membalanced.h"
+
+/******************************************************************************
+*                                static data                                  *
+******************************************************************************/
+
+/* names of histograms as reported by rcmd_get_stats */
+static const char* const hist_names[STAT_HIST_COUNT] =
+{
+	"sched_collect_data",
+	"sched_reserved_hard",
+	"sched_reserved_soft",
+	"sched_rebalance",
+	"sched_resize_domains",
+	"read_domain_reports",
+	"set_memory_target",
+	"sched_freemem"
+};
+
+/* names of counters as reported by rcmd_get_stats */
+static const char* const counter_names[STAT_COUNTER_COUNT] =
+{
+	"sched_ticks",
+	"xs_commits",
+	"xs_commit_retries",
+	"xs_commit_failures",
+	"resize_requests"
+};
+
+
+/******************************************************************************
+*                                 routines                                    *
+******************************************************************************/
+
+/*
+ * Estimate the value below which @pct percent of recorded values fall.
+ * The estimate is the upper bound of the bucket holding the value,
+ * but no more than the largest recorded value.
+ */
+u_quad_t latency_histogram::percentile(double pct) const
+{
+	u_quad_t rank, n = 0;
+	int k;
+
+	if (count == 0)
+		return 0;
+
+	rank = (u_quad_t) ceil(pct / 100.0 * count);
+	rank = max(rank, (u_quad_t) 1);
+
+	for (k = 0;  k < HIST_NBUCKETS - 1;  k++)
+	{
+		n += buckets[k];
+		if (n >= rank)
+			return min(bucket_low(k + 1) - 1, vmax);
+	}
+
+	return vmax;
+}
+
+const char* stat_hist_name(int hist)
+{
+	return hist_names[hist];
+}
+
+const char* stat_counter_name(int counter)
+{
+	return counter_names[counter];
+}
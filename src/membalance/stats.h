@@ -0,0 +1,150 @@
+/*
+ *  MEMBALANCE daemon
+ *
+ *  stats.h - Latency histograms and event counters
+ *
+ *  Portions Copyright (C) 2014 Sergey Oboguev (oboguev@yahoo.com)
+ *  For licensing terms see license.txt
+ */
+
+#ifndef __MEMBALANCE_STATS_H__
+#define __MEMBALANCE_STATS_H__
+
+/* latency histograms, the first ones are for sched_memory(...) stages */
+typedef enum __stat_hist
+{
+	STAT_HIST_READ_REPORTS = SCHED_STAGE_COUNT,	/* read_domain_reports(...) */
+	STAT_HIST_SET_TARGET,				/* libxl_set_memory_target(...) */
+	STAT_HIST_FREEMEM,				/* sched_freemem(...) */
+	STAT_HIST_COUNT
+}
+stat_hist_t;
+
+/* event counters */
+typedef enum __stat_counter
+{
+	STAT_SCHED_TICKS,		/* calls to sched_memory(...) */
+	STAT_XS_COMMITS,		/* xenstore transaction commits attempted */
+	STAT_XS_RETRIES,		/* ... conflicted and retried (XSTS_RETRY) */
+	STAT_XS_FAILURES,		/* ... failed (XSTS_NORETRY or XSTS_FAIL) */
+	STAT_RESIZE_REQUESTS,		/* domain resize requests issued to Xen */
+	STAT_COUNTER_COUNT
+}
+stat_counter_t;
+
+/*
+ * Log-linear (HDR-style) histogram of durations in nanoseconds.
+ *
+ * Each power-of-2 range of values is split into HIST_SUB equal buckets,
+ * so bucket width is within 1/HIST_SUB (12.5%) of the values it holds.
+ * Values below HIST_SUB (ns) are counted exactly, values above
+ * 2^HIST_MAXBITS (about 73 minutes) are counted in the last bucket.
+ * Recording is a few arithmetic operations and no memory allocation.
+ */
+class latency_histogram
+{
+public:
+	enum
+	{
+		HIST_SUB_BITS = 3,
+		HIST_SUB = 1 << HIST_SUB_BITS,
+		HIST_MAXBITS = 42,
+		HIST_NBUCKETS = (HIST_MAXBITS - HIST_SUB_BITS + 1) * HIST_SUB
+	};
+
+	u_quad_t count;			/* number of recorded values */
+	u_quad_t sum;			/* sum of recorded values */
+	u_quad_t vmin;			/* smallest recorded value */
+	u_quad_t vmax;			/* largest recorded value */
+	u_quad_t buckets[HIST_NBUCKETS];
+
+	latency_histogram()
+	{
+		reset();
+	}
+
+	void reset(void)
+	{
+		count = sum = vmin = vmax = 0;
+		memset(buckets, 0, sizeof buckets);
+	}
+
+	void record(int64_t ns)
+	{
+		u_quad_t v = ns < 0 ? 0 : (u_quad_t) ns;
+		if (count == 0 || v < vmin)
+			vmin = v;
+		if (v > vmax)
+			vmax = v;
+		count++;
+		sum += v;
+		buckets[bucket_index(v)]++;
+	}
+
+	static int bucket_index(u_quad_t v)
+	{
+		if (v < HIST_SUB)
+			return (int) v;
+		int msb = 63 - __builtin_clzll(v);
+		if (msb >= HIST_MAXBITS)
+			return HIST_NBUCKETS - 1;
+		int shift = msb - HIST_SUB_BITS;
+		return (shift + 1) * HIST_SUB + (int) ((v >> shift) & (HIST_SUB - 1));
+	}
+
+	/* smallest value counted in bucket @k */
+	static u_quad_t bucket_low(int k)
+	{
+		if (k < HIST_SUB)
+			return k;
+		int shift = k / HIST_SUB - 1;
+		return (u_quad_t) (k % HIST_SUB + HIST_SUB) << shift;
+	}
+
+	u_quad_t percentile(double pct) const;
+};
+
+/* latency histograms and event counters since daemon start */
+EXTERN latency_histogram stat_hist[STAT_HIST_COUNT];
+EXTERN u_quad_t stat_counter[STAT_COUNTER_COUNT];
+
+/* read monotonic clock (nsec) */
+static inline int64_t stat_now_ns(void)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		fatal_perror("clock_gettime");
+	return (int64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * Records the duration of its scope into histogram @hist
+ */
+class stat_timer
+{
+public:
+	stat_timer(stat_hist_t hist)
+	{
+		this->hist = hist;
+		this->t0 = stat_now_ns();
+	}
+
+	~stat_timer()
+	{
+		stat_hist[hist].record(stat_now_ns() - t0);
+	}
+
+protected:
+	stat_hist_t hist;
+	int64_t t0;
+};
+
+static inline void stat_count(stat_counter_t counter)
+{
+	stat_counter[counter]++;
+}
+
+const char* stat_hist_name(int hist);
+const char* stat_counter_name(int counter);
+
+#endif // __MEMBALANCE_STATS_H__
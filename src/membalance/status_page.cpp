@@ -0,0 +1,361 @@
+/*
+ *  MEMBALANCE daemon
+ *
+ *  status_page.cpp - Shared memory status page
+ *
+ *  Portions Copyright (C) 2014 Sergey Oboguev (oboguev@yahoo.com)
+ *  For licensing terms see license.txt
+ */
+
+#include "membalanced.h"
+
+#include <sys/mman.h>
+
+/******************************************************************************
+*                             local definitions                               *
+******************************************************************************/
+
+/*
+ * See status_page.h for the layout of the page and the update protocol.
+ */
+
+static int page_fd = -1;			/* status page file handle */
+static size_t page_size = 0;			/* ... its size */
+static status_page_hdr* page_hdr = NULL;	/* ... its mapping */
+
+static const uint32_t page_min_capacity = 64;	/* domain records */
+
+static bool page_grow(uint32_t ndomains, long xen_free);
+static void page_unmap(void);
+static void page_write(status_page_hdr* hdr, long xen_free);
+static uint32_t page_fill(status_page_domain* rec, const domid2info& dmap, char state);
+
+
+/******************************************************************************
+*                                 routines                                    *
+******************************************************************************/
+
+/*
+ * Publish current daemon status to the status page.
+ * If the page cannot be created, retry on the next call.
+ */
+void status_page_update(void)
+{
+	size_t ndomains;
+	long xen_free;
+
+	if (testmode)
+		return;
+
+	/* Xen is queried outside of the sequence lock, so readers do not spin on it */
+	xen_free = get_xen_free_memory();
+
+	ndomains = doms.managed.size() + doms.pending.size() + doms.unmanaged.size();
+
+	if (page_hdr == NULL || ndomains > page_hdr->capacity)
+	{
+		/* also writes out the content */
+		page_grow((uint32_t) ndomains, xen_free);
+		return;
+	}
+
+	page_write(page_hdr, xen_free);
+}
+
+/*
+ * Remove status page, on daemon shutdown
+ */
+void status_page_close(void)
+{
+	if (page_hdr)
+	{
+		page_unmap();
+		(void) unlink(status_page_path);
+	}
+}
+
+/*
+ * Replace status page with a new one that has room for @ndomains domain
+ * records (plus some spare), and write the content to it (with Xen free
+ * memory @xen_free). Readers holding the old page are notified by
+ * STATUS_PAGE_STALE flag.
+ *
+ * On error, log a message and return @false.
+ */
+static bool page_grow(uint32_t ndomains, long xen_free)
+{
+	uint32_t capacity = max(page_min_capacity, ndomains + ndomains / 2);
+	size_t size = sizeof(status_page_hdr) + (size_t) capacity * sizeof(status_page_domain);
+	char* tmp_path = xprintf("%s.new", status_page_path);
+	status_page_hdr* hdr = NULL;
+	int fd = -1;
+	int err;
+
+	make_membalance_rundir();
+
+	fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		error_perror("unable to create status page %s", tmp_path);
+		goto cleanup;
+	}
+
+	/* allocate blocks upfront so that stores into the mapping cannot fault on ENOSPC */
+	err = posix_fallocate(fd, 0, size);
+	if (err)
+	{
+		errno = err;
+		error_perror("unable to allocate status page %s", tmp_path);
+		goto cleanup;
+	}
+
+	hdr = (status_page_hdr*) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == (status_page_hdr*) MAP_FAILED)
+	{
+		hdr = NULL;
+		error_perror("unable to map status page %s", tmp_path);
+		goto cleanup;
+	}
+
+	memset(hdr, 0, sizeof(status_page_hdr));
+	memcpy(hdr->magic, STATUS_PAGE_MAGIC, sizeof hdr->magic);
+	hdr->version = STATUS_PAGE_VERSION;
+	hdr->header_size = sizeof(status_page_hdr);
+	hdr->domain_size = sizeof(status_page_domain);
+	hdr->capacity = capacity;
+	page_write(hdr, xen_free);
+
+	if (rename(tmp_path, status_page_path))
+	{
+		error_perror("unable to rename %s to %s", tmp_path, status_page_path);
+		goto cleanup;
+	}
+
+	/* let readers of the old page know it has been replaced */
+	if (page_hdr)
+	{
+		page_hdr->seq++;
+		__sync_synchronize();
+		page_hdr->flags |= STATUS_PAGE_STALE;
+		__sync_synchronize();
+		page_hdr->seq++;
+		page_unmap();
+	}
+
+	page_fd = fd;
+	page_size = size;
+	page_hdr = hdr;
+	free(tmp_path);
+
+	debug_msg(5, "status page has room for %u domains", (unsigned) capacity);
+
+	return true;
+
+cleanup:
+
+	if (hdr)
+		munmap(hdr, size);
+	if (fd >= 0)
+	{
+		close(fd);
+		unlink(tmp_path);
+	}
+	free(tmp_path);
+	return false;
+}
+
+static void page_unmap(void)
+{
+	if (page_hdr)
+	{
+		munmap(page_hdr, page_size);
+		page_hdr = NULL;
+	}
+
+	if (page_fd >= 0)
+	{
+		close(page_fd);
+		page_fd = -1;
+	}
+}
+
+/*
+ * Write current status to the page, under sequence lock.
+ * @xen_free is Xen free memory, read by the caller.
+ */
+static void page_write(status_page_hdr* hdr, long xen_free)
+{
+	status_page_domain* rec = (status_page_domain*) (hdr + 1);
+	uint32_t n = 0;
+
+	hdr->seq++;
+	__sync_synchronize();
+
+	hdr->daemon_pid = getpid();
+	hdr->pause_level = memsched_pause_level;
+	hdr->update_time = time(NULL);
+	hdr->tick = get_sched_tick();
+	hdr->interval = config.interval;
+	hdr->xen_free = xen_free;
+	hdr->xen_free_slack = xen_free_slack;
+	hdr->freemem_lien = freemem_lien_amount();
+	hdr->host_lien = sched_host.lien;
+	hdr->host_reserved_hard = config.host_reserved_hard;
+	hdr->host_reserved_soft = config.host_reserved_soft;
+
+	hdr->nmanaged = page_fill(rec + n, doms.managed, 'M');
+	n += hdr->nmanaged;
+	hdr->npending = page_fill(rec + n, doms.pending, 'P');
+	n += hdr->npending;
+	n += page_fill(rec + n, doms.unmanaged, 'U');
+	hdr->ndomains = n;
+
+	__sync_synchronize();
+	hdr->seq++;
+}
+
+/*
+ * Fill in records for domains in @dmap, in the order of domain id.
+ * Return the number of records.
+ */
+static uint32_t page_fill(status_page_domain* rec, const domid2info& dmap, char state)
+{
+	const domain_info* dom;
+	uint32_t n = 0;
+
+	for (domid2info::const_iterator it = dmap.begin();  it != dmap.end();  ++it, ++rec, ++n)
+	{
+		dom = it->second;
+
+		memset(rec, 0, sizeof(*rec));
+		rec->domain_id = (int32_t) it->first;
+		rec->state = state;
+
+		if (dom == NULL)
+			continue;
+
+		if (dom->vm_name)
+			strncpy(rec->name, dom->vm_name, sizeof(rec->name) - 1);
+
+		if (state != 'M')
+			continue;
+
+		if (dom->valid_memory_data)
+		{
+			rec->flags |= STATUS_DOM_VALID_MEMORY;
+			rec->memsize = dom->memsize;
+		}
+
+		if (dom->valid_data)
+		{
+			rec->flags |= STATUS_DOM_VALID_RATE;
+			rec->rate = dom->rate;
+			rec->slow_rate = dom->slow_rate;
+		}
+
+		rec->dmem_min = dom->dmem_min;
+		rec->dmem_quota = dom->dmem_quota;
+		rec->dmem_max = dom->dmem_max;
+		rec->rate_low = dom->rate_low;
+		rec->rate_high = dom->rate_high;
+		rec->last_resize_time = dom->last_resize_time;
+		rec->last_resize_size = dom->last_resize_size;
+	}
+
+	return n;
+}
+
+/*
+ * Read consistent copy of status page at @path into @hdr and @domains.
+ * Does not interact with the daemon in any way.
+ * On error, return @false and error message in @message (malloc'ed).
+ */
+bool status_page_read(const char* path,
+		      status_page_hdr* hdr,
+		      std::vector<status_page_domain>& domains,
+		      char** message)
+{
+	const status_page_hdr* ph;
+	const status_page_domain* rec;
+	struct stat st;
+	uint64_t seq;
+	uint32_t n;
+	int fd, reopen, retry;
+	bool done = false;
+
+	*message = NULL;
+
+	/* reopen if the page gets replaced while reading it */
+	for (reopen = 0;  reopen < 10;  reopen++)
+	{
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+		{
+			*message = xprintf("unable to open status page %s: %s", path, strerror(errno));
+			return false;
+		}
+
+		if (fstat(fd, &st) || st.st_size < (off_t) sizeof(status_page_hdr))
+		{
+			close(fd);
+			*message = xprintf("status page %s is invalid", path);
+			return false;
+		}
+
+		ph = (const status_page_hdr*) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (ph == (const status_page_hdr*) MAP_FAILED)
+		{
+			*message = xprintf("unable to map status page %s: %s", path, strerror(errno));
+			return false;
+		}
+
+		if (memcmp(ph->magic, STATUS_PAGE_MAGIC, sizeof ph->magic) ||
+		    ph->version != STATUS_PAGE_VERSION ||
+		    ph->header_size != sizeof(status_page_hdr) ||
+		    ph->domain_size != sizeof(status_page_domain) ||
+		    sizeof(status_page_hdr) + (size_t) ph->capacity * sizeof(status_page_domain) >
+		    (size_t) st.st_size)
+		{
+			munmap((void*) ph, st.st_size);
+			*message = xprintf("status page %s has unknown format", path);
+			return false;
+		}
+
+		rec = (const status_page_domain*) (ph + 1);
+
+		for (retry = 0;  retry < 1000 && !done;  retry++)
+		{
+			seq = ph->seq;
+			if (seq & 1)
+			{
+				usleep(100);
+				continue;
+			}
+			__sync_synchronize();
+
+			memcpy(hdr, ph, sizeof(status_page_hdr));
+			n = min(hdr->ndomains, ph->capacity);
+			domains.assign(rec, rec + n);
+
+			__sync_synchronize();
+			done = (ph->seq == seq);
+		}
+
+		munmap((void*) ph, st.st_size);
+
+		if (!done)
+		{
+			*message = xprintf("status page %s is being updated, try again later", path);
+			return false;
+		}
+
+		if (!(hdr->flags & STATUS_PAGE_STALE))
+			return true;
+
+		done = false;
+	}
+
+	*message = xprintf("status page %s keeps being replaced, try again later", path);
+	return false;
+}
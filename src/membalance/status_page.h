@@ -0,0 +1,95 @@
+/*
+ *  MEMBALANCE daemon
+ *
+ *  status_page.h - Shared memory status page
+ *
+ *  Portions Copyright (C) 2014 Sergey Oboguev (oboguev@yahoo.com)
+ *  For licensing terms see license.txt
+ */
+
+#ifndef __MEMBALANCE_STATUS_PAGE_H__
+#define __MEMBALANCE_STATUS_PAGE_H__
+
+/*
+ * Status page is a file in membalance run directory, memory-mapped by the
+ * daemon and by readers (such as "membalancectl list --snapshot"). It holds
+ * the header followed by @capacity domain records, @ndomains of them in use:
+ * managed domains first, then pending, then unmanaged, each group in the
+ * order of domain id. All fields are in host byte order.
+ *
+ * The daemon updates the page at the end of every tick, and after processing
+ * pending domains. Updates are published under a sequence lock: @seq is odd
+ * while the page is being updated and is incremented once more when the
+ * update is complete. Readers copy the page without locking, and retry if
+ * @seq was odd or has changed during the copy.
+ *
+ * When the page needs to hold more domains than it has room for, the daemon
+ * creates a larger file in its place and marks the old one STATUS_PAGE_STALE,
+ * so readers holding the old one know to reopen the file.
+ */
+
+#define STATUS_PAGE_MAGIC	"MBSTATUS"
+#define STATUS_PAGE_VERSION	1
+#define STATUS_PAGE_NAME_SIZE	64
+
+/* header flags */
+#define STATUS_PAGE_STALE	(1 << 0)	/* file has been replaced */
+
+/* domain record flags */
+#define STATUS_DOM_VALID_MEMORY	(1 << 0)	/* @memsize is valid */
+#define STATUS_DOM_VALID_RATE	(1 << 1)	/* @rate and @slow_rate are valid */
+
+typedef struct __status_page_hdr
+{
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	header_size;		/* sizeof(status_page_hdr) */
+	uint32_t	domain_size;		/* sizeof(status_page_domain) */
+	uint32_t	capacity;		/* domain records the file has room for */
+	volatile uint64_t seq;			/* sequence lock */
+	uint32_t	flags;			/* STATUS_PAGE_xxx */
+	uint32_t	ndomains;		/* domain records in use */
+	uint32_t	nmanaged;		/* ... of them managed */
+	uint32_t	npending;		/* ... pending */
+	int32_t		daemon_pid;
+	uint32_t	pause_level;		/* memory adjustment pause depth */
+	int64_t		update_time;		/* time of the update (unix time) */
+	int64_t		tick;			/* scheduler tick number */
+	int64_t		interval;		/* scheduler interval (sec) */
+	int64_t		xen_free;		/* Xen free memory (kbs) */
+	int64_t		xen_free_slack;		/* Xen free memory slack (kbs) */
+	int64_t		host_lien;		/* outstanding lien (kbs) */
+	int64_t		freemem_lien;		/* ... of it set aside for free-memory requests */
+	int64_t		host_reserved_hard;	/* kbs */
+	int64_t		host_reserved_soft;	/* kbs */
+	uint64_t	reserved[4];
+} status_page_hdr;
+
+typedef struct __status_page_domain
+{
+	int32_t		domain_id;
+	char		state;			/* 'M'anaged, 'P'ending or 'U'nmanaged */
+	char		reserved[3];
+	uint32_t	flags;			/* STATUS_DOM_xxx */
+	uint32_t	reserved2;
+	int64_t		memsize;		/* current size (kbs) */
+	int64_t		rate;			/* data map-in rate (kbs/sec) */
+	int64_t		slow_rate;		/* ... its slow moving average */
+	int64_t		dmem_min;		/* kbs */
+	int64_t		dmem_quota;		/* kbs */
+	int64_t		dmem_max;		/* kbs */
+	int64_t		rate_low;		/* kbs/sec */
+	int64_t		rate_high;		/* kbs/sec */
+	int64_t		last_resize_time;	/* unix time, or 0 */
+	int64_t		last_resize_size;	/* kbs */
+	char		name[STATUS_PAGE_NAME_SIZE];	/* null-terminated, may be truncated */
+} status_page_domain;
+
+void status_page_update(void);
+void status_page_close(void);
+bool status_page_read(const char* path,
+		      status_page_hdr* hdr,
+		      std::vector<status_page_domain>& domains,
+		      char** message);
+
+#endif // __MEMBALANCE_STATUS_PAGE_H__
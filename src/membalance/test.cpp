@@ -61,6 +61,12 @@ int test_xcinfo_collect(xc_domaininfo_t** ppinfo)
 void test_debugger(void)
 {
 }
+
+int execute_bench(int argc, char** argv)
+{
+	error_msg("scheduler benchmark is not available: not a development build");
+	return EXIT_FAILURE;
+}
 #else
 
 
@@ -78,6 +84,8 @@ static void print_summary(bool use_pd_rate = false);
 static pseudo_domain* find_pd(long domain_id);
 static void reeval_target(domain_info* dom, pseudo_domain* pd);
 static void validate_free(const char* proc);
+static void setup_test_host(const std::vector<long>& domain_ids);
+static char* format_test_report(unsigned long long seq, long kbs, long kbs_sec, double free_pct);
 
 
 /******************************************************************************
@@ -204,13 +212,17 @@ public:
 	long    tot_pages;
 	long    outstanding_pages;
 	char*	report;
+	unsigned int report_len;
 	long	rate;
 
 public:
 	pseudo_domain(long domain_id)
 	{
 		this->domain_id = domain_id;
+		this->tot_pages = 0;
+		this->outstanding_pages = 0;
 		this->report = NULL;
+		this->report_len = 0;
 	}
 
 	~pseudo_domain()
@@ -235,9 +247,20 @@ static struct
 	long	  phys_pages;
 	long 	  dom0_pages;
 	long	  slack_kbs;
+	long	  alloc_pages;	/* sum of pages(pd) over @domains */
 }
 pseudo;
 
+/*
+ * Set allocation of @pd, keeping track of host-wide allocation
+ */
+inline static void set_pages(pseudo_domain* pd, long tot_pages, long outstanding_pages)
+{
+	pseudo.alloc_pages += tot_pages + outstanding_pages - pages(pd);
+	pd->tot_pages = tot_pages;
+	pd->outstanding_pages = outstanding_pages;
+}
+
 inline static long mb2kb(long mb)	{ return 1024 * mb; }
 inline static long gb2kb(long gb)	{ return 1024 * 1024 * gb; }
 
@@ -245,6 +268,18 @@ inline static long kb2pages(long kb)	{ return roundup(kb, pagesize_kbs) / pagesi
 inline static long mb2pages(long mb)	{ return kb2pages(mb2kb(mb)); }
 inline static long gb2pages(long gb)    { return kb2pages(gb2kb(gb)); }
 
+/*
+ * simulated workload profiles
+ */
+typedef enum __workload
+{
+	WL_MIXED = 0,	/* each domain flips its rate category at random */
+	WL_STEADY,	/* each domain keeps its initial rate category */
+	WL_SURGE,	/* all domains surge to high rate together */
+	WL_IDLE		/* all domains stay at low rate */
+}
+workload_t;
+
 static struct __test_config
 {
 	/*
@@ -257,11 +292,17 @@ static struct __test_config
 	 * exercise sched_freemem(...) every @sched_freemem_freq ticks
 	 */
 	int sched_freemem_freq;
+
+	/*
+	 * simulated workload
+	 */
+	workload_t workload;
 }
 test_config =
 {
 	.domain_flip_rate_tick = 40,
-	.sched_freemem_freq = 500
+	.sched_freemem_freq = 500,
+	.workload = WL_MIXED
 };
 
 /* global (static) data */
@@ -272,10 +313,7 @@ static int test_memsched(int argc, char** argv, char** message)
 {
 	domain_info* pdom;
 	test_domain_info* dom;
-	pseudo_domain* pd;
 	const int ndoms = 10;
-	long domain_id;
-	long delta;
 	int k;
 	long free_pages;
 	bool badarg = false;
@@ -316,79 +354,17 @@ static int test_memsched(int argc, char** argv, char** message)
 		return 1;
 	}
 
-	const long test_dmem_min = gb2kb(1);
-	const long test_dmem_quota = gb2kb(4);
-	const long test_dmem_max = gb2kb(32);
-
 	/*
 	 * Establish randomness
 	 */
 	srandom(test_seed);
 	srand48(test_seed);
 
-	/*
-	 * Disconnect memembalanced from real system
-	 */
-	doms.unmanaged.clear();
-	doms.managed.clear();
-	doms.pending.clear();
-	doms.qid.clear();
-	config.interval = 1;
-	memsched_pause_level = 0;
-
-	testmode = 1;
-	test_cycle = 0;
-
-	/*
-	 * RAM = 96 GB
-	 * Dom0 = 1 GB
-	 * Free slack = 15% of RAM
-	 * host_reserved_hard = (as set in config)
-	 * host_reserved_soft = (as set in config)
-	 *                      or hard + 10% of (RAM - Dom0 - slack)
-	 */
-	pseudo.phys_pages = gb2pages(96);
-	pseudo.dom0_pages = mb2pages(1024);
-	pseudo.slack_kbs = (long) (0.15 * (pseudo.phys_pages * pagesize_kbs));
-
-	if (!config.isset_host_reserved_soft())
-	{
-		delta = pagesize_kbs * (pseudo.phys_pages - pseudo.dom0_pages) - pseudo.slack_kbs;
-		delta = max(0, delta);
-		delta = (long) (delta * 0.1);
-		config.set_host_reserved_soft(config.host_reserved_hard + delta);
-	}
-
-	if (config.host_reserved_hard < 0 ||
-	    config.host_reserved_soft < 0 ||
-	    config.host_reserved_soft < config.host_reserved_hard)
-	{
-		fatal_msg("bug: test_memsched: inconsistent host_reserved_soft/hard");
-	}
-
+	std::vector<long> domain_ids;
 	for (k = 0;  k < ndoms;  k++)
-	{
-		domain_id = k + 1;
-		dom = new test_domain_info(domain_id);
-		pd = new pseudo_domain(domain_id);
-
-		dom->dmem_min = test_dmem_min;
-		dom->dmem_quota = test_dmem_quota;
-		dom->dmem_max = test_dmem_max;
-
-		dom->init_test_domain();
-
-		pd->tot_pages = kb2pages(dom->xs_mem_target) +
-				kb2pages(dom->xs_mem_videoram) +
-			        kb2pages(dom->xen_data_size);
-		pd->outstanding_pages = 0;
-
-		pseudo.domains[domain_id] = pd;
-		doms.managed[domain_id] = dom;
-		dom->on_enter_managed();
-	}
+		domain_ids.push_back(k + 1);
 
-	sched_slept(config.interval * 100 * MSEC_PER_SEC);
+	setup_test_host(domain_ids);
 
 	for (;; test_cycle++)
 	{
@@ -447,6 +423,90 @@ static int test_memsched(int argc, char** argv, char** message)
 	return 0;
 }
 
+/*
+ * Set up simulated host with test domains @domain_ids
+ * (at the start of the test)
+ */
+static void setup_test_host(const std::vector<long>& domain_ids)
+{
+	test_domain_info* dom;
+	pseudo_domain* pd;
+	long domain_id;
+	long delta;
+	int ndoms = (int) domain_ids.size();
+
+	const long test_dmem_min = gb2kb(1);
+	const long test_dmem_quota = gb2kb(4);
+	const long test_dmem_max = gb2kb(32);
+
+	/*
+	 * Disconnect memembalanced from real system
+	 */
+	doms.unmanaged.clear();
+	doms.managed.clear();
+	doms.pending.clear();
+	doms.qid.clear();
+	config.interval = 1;
+	memsched_pause_level = 0;
+
+	testmode = 1;
+	test_cycle = 0;
+
+	/*
+	 * RAM = 96 GB (per each 10 domains)
+	 * Dom0 = 1 GB
+	 * Free slack = 15% of RAM
+	 * host_reserved_hard = (as set in config)
+	 * host_reserved_soft = (as set in config)
+	 *                      or hard + 10% of (RAM - Dom0 - slack)
+	 */
+	pseudo.domains.clear();
+	pseudo.alloc_pages = 0;
+	pseudo.phys_pages = gb2pages(96) * max(ndoms, 10) / 10;
+	pseudo.dom0_pages = mb2pages(1024);
+	pseudo.slack_kbs = (long) (0.15 * (pseudo.phys_pages * pagesize_kbs));
+
+	if (!config.isset_host_reserved_soft())
+	{
+		delta = pagesize_kbs * (pseudo.phys_pages - pseudo.dom0_pages) - pseudo.slack_kbs;
+		delta = max(0, delta);
+		delta = (long) (delta * 0.1);
+		config.set_host_reserved_soft(config.host_reserved_hard + delta);
+	}
+
+	if (config.host_reserved_hard < 0 ||
+	    config.host_reserved_soft < 0 ||
+	    config.host_reserved_soft < config.host_reserved_hard)
+	{
+		fatal_msg("bug: setup_test_host: inconsistent host_reserved_soft/hard");
+	}
+
+	for (int k = 0;  k < ndoms;  k++)
+	{
+		domain_id = domain_ids[k];
+		dom = new test_domain_info(domain_id);
+		pd = new pseudo_domain(domain_id);
+
+		dom->dmem_min = test_dmem_min;
+		dom->dmem_quota = test_dmem_quota;
+		dom->dmem_max = test_dmem_max;
+
+		dom->init_test_domain();
+
+		set_pages(pd,
+			  kb2pages(dom->xs_mem_target) +
+			  kb2pages(dom->xs_mem_videoram) +
+			  kb2pages(dom->xen_data_size),
+			  0);
+
+		pseudo.domains[domain_id] = pd;
+		doms.managed[domain_id] = dom;
+		dom->on_enter_managed();
+	}
+
+	sched_slept(config.interval * 100 * MSEC_PER_SEC);
+}
+
 /*
  * Test sched_freemem, simulating "membalancectl free-memory" command
  */
@@ -454,10 +514,13 @@ static void exercise_sched_freemem(void)
 {
 	domain_info* dom;
 	pseudo_domain* pd;
-	long amt, kbs, aside = 0;
+	long amt, kbs, aside = 0, donated = 0;
 	int resp;
 	u_quad_t freemem_with_slack = 0;
 	u_quad_t freemem_less_slack = 0;
+	freemem_projection proj;
+	std::vector<long> sizes;
+	unsigned k;
 
 	static int flags = 0;
 	flags++;
@@ -495,12 +558,60 @@ static void exercise_sched_freemem(void)
 	if (amt <= 0)
 		return;
 
+	/* projection should find the amount attainable, and not shrink anything */
+	sizes.clear();
+	foreach_managed_domain(dom)
+	{
+		sizes.push_back(dom->memsize);
+		sizes.push_back(dom->memsize0);
+		sizes.push_back(dom->memgoal0);
+		sizes.push_back(dom->memsize_decr);
+	}
+
+	sched_freemem_plan(amt, above_slack, draw_reserved_hard, proj);
+
+	for (k = 0;  k < proj.donors.size();  k++)
+		donated += proj.donors[k].memsize - proj.donors[k].target;
+
+	if (proj.status != 'A')
+	{
+		error_msg("bug: exercise_sched_freemem: projected status is %c", proj.status);
+	}
+	else if ((long) (above_slack ? proj.freemem_less_slack : proj.freemem_with_slack) < amt)
+	{
+		error_msg("bug: exercise_sched_freemem: projected free memory (%ld) < amt (%ld)",
+			  above_slack ? proj.freemem_less_slack : proj.freemem_with_slack, amt);
+	}
+	else if (donated != proj.reclaim)
+	{
+		error_msg("bug: exercise_sched_freemem: donors yield %ld instead of %ld",
+			  donated, proj.reclaim);
+	}
+
+	k = 0;
+	foreach_managed_domain(dom)
+	{
+		if (k + 4 > sizes.size() ||
+		    dom->memsize != sizes[k] ||
+		    dom->memsize0 != sizes[k + 1] ||
+		    dom->memgoal0 != sizes[k + 2] ||
+		    dom->memsize_decr != sizes[k + 3])
+		{
+			error_msg("bug: exercise_sched_freemem: projection altered domain state");
+			break;
+		}
+		k += 4;
+	}
+
 	memsched_pause_level++;
 	resp = sched_freemem(amt, above_slack, draw_reserved_hard, must, 0,
 			     &freemem_with_slack,
 			     &freemem_less_slack);
 	memsched_pause_level--;
 
+	/* no domain is going to be started to use the memory */
+	release_freemem_liens();
+
 	if (resp != 'A')
 	{
 		error_msg("bug: exercise_sched_freemem: resp is %c", resp);
@@ -637,6 +748,8 @@ void test_domain_info::init_test_domain(void)
 	trim_unresponsive = xc_trim_unresponsive = config.trim_unresponsive;
 	trim_unmanaged = config.trim_unmanaged;
 	xc_trim_unmanaged = (tribool) config.trim_unmanaged;
+	superpage_align = xc_superpage_align = config.superpage_align;
+	priority = xc_priority = config.priority;
 
 	/*
 	 * Take initial memory allocation half-way between min and quota
@@ -656,11 +769,36 @@ void test_domain_info::test_tick(void)
 	double xrate = 0;
 	double fx = drand48();
 
-	/*
-	 * once in a while flip rate between low-mid-high ranges
-	 */
-	if ((++test_data.n_tick % test_config.domain_flip_rate_tick) == 0)
-		test_data.c_rate = (category_t) (random() % 3);
+	switch (test_config.workload)
+	{
+	case WL_MIXED:
+		/*
+		 * once in a while flip rate between low-mid-high ranges
+		 */
+		if ((++test_data.n_tick % test_config.domain_flip_rate_tick) == 0)
+			test_data.c_rate = (category_t) (random() % 3);
+		break;
+
+	case WL_STEADY:
+		++test_data.n_tick;
+		break;
+
+	case WL_SURGE:
+		/*
+		 * all domains surge together for one flip period out of four
+		 */
+		++test_data.n_tick;
+		if ((test_data.n_tick / test_config.domain_flip_rate_tick) % 4 == 3)
+			test_data.c_rate = C_HIGH;
+		else
+			test_data.c_rate = C_LOW;
+		break;
+
+	case WL_IDLE:
+		++test_data.n_tick;
+		test_data.c_rate = C_LOW;
+		break;
+	}
 
 	switch (test_data.c_rate)
 	{
@@ -679,16 +817,28 @@ void test_domain_info::test_tick(void)
 	if (!pd)
 		fatal_msg("bug: test_tick: missing pseudo-domain");
 
-	char struct_version = 'A';
-	const char* xprogname = "memprobed";
-	const char* xprogversion = "0.1";
 	unsigned long long report_seq = (unsigned long) test_data.n_tick;
 	long kbs_sec = (long) xrate;
 	long kbs = kbs_sec * config.interval;
 	double free_pct = 5.0;
 
 	free_ptr(pd->report);
-	pd->report = xprintf(
+	pd->report = format_test_report(report_seq, kbs, kbs_sec, free_pct);
+	pd->report_len = strlen(pd->report);
+
+	pd->rate = kbs_sec;
+}
+
+/*
+ * Format domain report the way memprobed does
+ */
+static char* format_test_report(unsigned long long seq, long kbs, long kbs_sec, double free_pct)
+{
+	char struct_version = 'A';
+	const char* xprogname = "memprobed";
+	const char* xprogversion = "0.1";
+
+	return xprintf(
 		    "%c\n"
 		    "action: report\n"
 		    "progname: %s\n"
@@ -700,12 +850,487 @@ void test_domain_info::test_tick(void)
 		struct_version,
 		xprogname,
 		xprogversion,
-		report_seq++,
+		seq,
 		(unsigned long) kbs,
 		(unsigned long) kbs_sec,
 		free_pct);
+}
 
-	pd->rate = kbs_sec;
+
+/******************************************************************************
+*                            scheduler benchmark                              *
+******************************************************************************/
+
+/*
+ * Runs sched_memory(...) against simulated host and domains (the same
+ * as memsched test) for given number of domains and ticks, and reports
+ * the latency of scheduling stages and heap allocations per tick:
+ *
+ *     membalanced --bench [--domains <n>] [--ticks <n>] [--seed <n>]
+ *                         [--profile mixed|steady|surge|idle]
+ *                         [--replay <trace-file>] [--trace <file>]
+ *
+ * With --replay, domain reports are taken from a trace file rather than
+ * generated. Trace file is either a binary trace recorded by membalanced
+ * (see trace.cpp), whereupon the recorded domain reports are submitted
+ * as they are, or a text file, one report per line:
+ *
+ *     <tick> <domain-id> <kbsec> <freepct>
+ *
+ * with lines starting with '#' ignored. The set of domains is defined by
+ * the trace, and domains without a record for a tick submit no report
+ * for that tick.
+ *
+ * With --trace, scheduler inputs and decisions during the run are recorded
+ * to binary trace @file.
+ */
+
+/* count of C++ heap allocations */
+static u_long test_nallocs = 0;
+
+#if __cplusplus >= 201103L
+  #define NEW_THROW_SPEC
+  #define DELETE_THROW_SPEC  noexcept
+#else
+  #define NEW_THROW_SPEC     throw(std::bad_alloc)
+  #define DELETE_THROW_SPEC  throw()
+#endif
+
+void* operator new(size_t size) NEW_THROW_SPEC
+{
+	void* p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	test_nallocs++;
+	return p;
+}
+
+void operator delete(void* p) DELETE_THROW_SPEC
+{
+	free(p);
+}
+
+/* record of replayed report trace */
+class trace_record
+{
+public:
+	long tick;
+	long domain_id;
+	long rate;
+	double freepct;
+	std::string report;	/* raw report from binary trace */
+
+	static bool less_by_tick(const trace_record& r1, const trace_record& r2)
+	{
+		return r1.tick < r2.tick;
+	}
+};
+
+typedef std::vector<trace_record> trace_vector;
+
+/* collected timing of one kind (nsec per tick) */
+typedef std::vector<int64_t> bench_samples;
+
+static const char* const bench_stage_names[SCHED_STAGE_COUNT] =
+{
+	"collect_data",
+	"reserved_hard",
+	"reserved_soft",
+	"rebalance",
+	"resize_domains"
+};
+
+static bool load_trace(const char* path, trace_vector& trace);
+static bool load_binary_trace(const char* path, FILE* fp, trace_vector& trace);
+static void replay_tick(const trace_vector& trace, size_t& pos, long tick);
+static void print_bench_samples(const char* name, bench_samples& v);
+
+int execute_bench(int argc, char** argv)
+{
+	long ndoms = 100;
+	long nticks = 1000;
+	long seed = 1;
+	const char* profile = "mixed";
+	const char* replay_path = NULL;
+	const char* trace_path = NULL;
+	trace_vector trace;
+	size_t trace_pos = 0;
+	long tick0 = 0;
+	std::vector<long> domain_ids;
+	bench_samples stage_samples[SCHED_STAGE_COUNT];
+	bench_samples total_samples;
+	u_long nallocs, nallocs_max = 0, nallocs_sum = 0;
+	domain_info* pdom;
+	long page_size;
+	long free_pages;
+	int64_t total;
+	long tick;
+	int k;
+
+	for (k = 0;  k < argc;  k++)
+	{
+		const char* arg = argv[k];
+		const char* val = (k + 1 < argc) ? argv[k + 1] : NULL;
+
+		if (!val)
+			goto badarg;
+		k++;
+
+		if (streq(arg, "--domains"))
+		{
+			if (!a2long(val, &ndoms) || ndoms < 1 || ndoms > 5000)
+				goto badarg;
+		}
+		else if (streq(arg, "--ticks"))
+		{
+			if (!a2long(val, &nticks) || nticks < 1)
+				goto badarg;
+		}
+		else if (streq(arg, "--seed"))
+		{
+			if (!a2long(val, &seed))
+				goto badarg;
+		}
+		else if (streq(arg, "--profile"))
+		{
+			profile = val;
+			if (streq(val, "mixed"))
+				test_config.workload = WL_MIXED;
+			else if (streq(val, "steady"))
+				test_config.workload = WL_STEADY;
+			else if (streq(val, "surge"))
+				test_config.workload = WL_SURGE;
+			else if (streq(val, "idle"))
+				test_config.workload = WL_IDLE;
+			else
+				goto badarg;
+		}
+		else if (streq(arg, "--replay"))
+		{
+			replay_path = val;
+		}
+		else if (streq(arg, "--trace"))
+		{
+			trace_path = val;
+		}
+		else
+		{
+			goto badarg;
+		}
+	}
+
+	/* simulated host uses local page size, as the daemon does */
+	page_size = sysconf(_SC_PAGESIZE);
+	if (page_size <= 0 || page_size % 1024)
+		fatal_msg("unable to get system page size");
+	memquant_kbs = pagesize_kbs = page_size / 1024;
+
+	test_seed = seed;
+	srandom(test_seed);
+	srand48(test_seed);
+
+	if (replay_path)
+	{
+		if (!load_trace(replay_path, trace))
+			return EXIT_FAILURE;
+
+		domid_set ids;
+		for (size_t i = 0;  i < trace.size();  i++)
+			ids.insert(trace[i].domain_id);
+		domain_ids.assign(ids.begin(), ids.end());
+
+		tick0 = trace[0].tick;
+		nticks = min(nticks, trace.back().tick - tick0 + 1);
+		profile = "replay";
+	}
+	else
+	{
+		for (k = 0;  k < ndoms;  k++)
+			domain_ids.push_back(k + 1);
+	}
+
+	setup_test_host(domain_ids);
+
+	if (trace_path && !trace_open(trace_path, 64))
+		return EXIT_FAILURE;
+
+	printf("membalance scheduler benchmark\n");
+	printf("domains: %lu, ticks: %ld, profile: %s, seed: %ld\n",
+	       (unsigned long) domain_ids.size(), nticks, profile, seed);
+	fflush(stdout);
+
+	for (tick = 0;  tick < nticks;  tick++, test_cycle++)
+	{
+		if (replay_path)
+		{
+			replay_tick(trace, trace_pos, tick0 + tick);
+		}
+		else
+		{
+			foreach_managed_domain(pdom)
+				((test_domain_info*) pdom)->test_tick();
+		}
+
+		nallocs = test_nallocs;
+		sched_memory();
+		nallocs = test_nallocs - nallocs;
+
+		free_pages = get_free_pages("bug: bench: free pages < 0");
+		if (free_pages * (long) pagesize_kbs - pseudo.slack_kbs < config.host_reserved_hard)
+			fatal_msg("bug: bench: below host_reserved_hard");
+
+		nallocs_sum += nallocs;
+		nallocs_max = max(nallocs_max, nallocs);
+
+		total = 0;
+		for (k = 0;  k < SCHED_STAGE_COUNT;  k++)
+		{
+			if (sched_stage_ns[k] >= 0)
+			{
+				stage_samples[k].push_back(sched_stage_ns[k]);
+				total += sched_stage_ns[k];
+			}
+		}
+		total_samples.push_back(total);
+	}
+
+	if (trace_path)
+		trace_close();
+
+	printf("\n");
+	printf("%-16s %8s %9s %9s %9s %9s %9s %9s\n",
+	       "stage (usec)", "runs", "min", "p50", "p90", "p99", "max", "mean");
+	for (k = 0;  k < SCHED_STAGE_COUNT;  k++)
+		print_bench_samples(bench_stage_names[k], stage_samples[k]);
+	print_bench_samples("total", total_samples);
+
+	printf("\n");
+	printf("heap allocations per tick: mean %.1f, max %lu\n",
+	       (double) nallocs_sum / nticks, nallocs_max);
+
+	return EXIT_SUCCESS;
+
+badarg:
+	error_msg("bench args: [--domains <n>] [--ticks <n>] [--seed <n>] "
+		  "[--profile mixed|steady|surge|idle] [--replay <trace-file>] "
+		  "[--trace <file>]");
+	return EXIT_FAILURE;
+}
+
+/*
+ * Load report trace from file @path into @trace sorted by tick.
+ * On error, log a message and return @false.
+ */
+static bool load_trace(const char* path, trace_vector& trace)
+{
+	FILE* fp;
+	char buf[256];
+	char* cp;
+	trace_record rec;
+	int lineno = 0;
+	bool ok = true;
+
+	fp = fopen(path, "r");
+	if (!fp)
+	{
+		error_perror("unable to open trace file %s", path);
+		return false;
+	}
+
+	if (fread(buf, 1, strlen(TRACE_MAGIC), fp) == strlen(TRACE_MAGIC) &&
+	    0 == memcmp(buf, TRACE_MAGIC, strlen(TRACE_MAGIC)))
+	{
+		ok = load_binary_trace(path, fp, trace);
+		goto loaded;
+	}
+
+	rewind(fp);
+
+	while (fgets(buf, sizeof buf, fp))
+	{
+		lineno++;
+
+		for (cp = buf;  isspace(*cp);  cp++)
+			;
+		if (*cp == '\0' || *cp == '#')
+			continue;
+
+		if (4 != sscanf(cp, "%ld %ld %ld %lf",
+				&rec.tick, &rec.domain_id, &rec.rate, &rec.freepct) ||
+		    rec.domain_id <= 0 || rec.rate < 0 || rec.freepct < 0)
+		{
+			error_msg("invalid record in trace file %s, line %d", path, lineno);
+			ok = false;
+			break;
+		}
+
+		trace.push_back(rec);
+	}
+
+	if (ok && ferror(fp))
+	{
+		error_perror("unable to read trace file %s", path);
+		ok = false;
+	}
+
+loaded:
+
+	fclose(fp);
+
+	if (ok && trace.empty())
+	{
+		error_msg("trace file %s is empty", path);
+		ok = false;
+	}
+
+	if (ok)
+		std::stable_sort(trace.begin(), trace.end(), trace_record::less_by_tick);
+
+	return ok;
+}
+
+/*
+ * Load domain reports from binary trace file @path opened as @fp into @trace.
+ * On error, log a message and return @false.
+ */
+static bool load_binary_trace(const char* path, FILE* fp, trace_vector& trace)
+{
+	std::vector<char> data;
+	trace_file_hdr hdr;
+	const trace_rec_hdr* rh;
+	const trace_rec_input* inp;
+	trace_record rec;
+	long tick = -1;
+	size_t pos;
+
+	rewind(fp);
+	if (fread(&hdr, sizeof hdr, 1, fp) != 1 ||
+	    hdr.version != TRACE_VERSION ||
+	    hdr.header_size != sizeof hdr ||
+	    hdr.used < sizeof hdr)
+	{
+		goto invalid;
+	}
+
+	data.resize(hdr.used - sizeof hdr);
+	if (data.size() && fread(&data[0], data.size(), 1, fp) != 1)
+		goto invalid;
+
+	for (pos = 0;  pos < data.size();  pos += rh->length)
+	{
+		rh = (const trace_rec_hdr*) &data[pos];
+		if (data.size() - pos < sizeof *rh ||
+		    rh->length < sizeof *rh || rh->length > data.size() - pos)
+		{
+			goto invalid;
+		}
+
+		switch (rh->type)
+		{
+		case TRACE_REC_TICK:
+			if (rh->length < sizeof(trace_rec_tick))
+				goto invalid;
+			tick = ((const trace_rec_tick*) rh)->tick;
+			break;
+
+		case TRACE_REC_INPUT:
+			inp = (const trace_rec_input*) rh;
+			if (rh->length < sizeof(*inp) + inp->report_len || tick < 0)
+				goto invalid;
+			if (inp->report_len == 0)
+				break;
+			rec.tick = tick;
+			rec.domain_id = inp->domain_id;
+			rec.rate = 0;
+			rec.freepct = 0;
+			rec.report.assign((const char*) (inp + 1), inp->report_len);
+			trace.push_back(rec);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	return true;
+
+invalid:
+
+	error_msg("invalid or truncated binary trace file %s", path);
+	return false;
+}
+
+/*
+ * Submit reports recorded in @trace for @tick, starting from @trace[@pos].
+ * Advance @pos past the records for @tick.
+ */
+static void replay_tick(const trace_vector& trace, size_t& pos, long tick)
+{
+	pseudo_domain* pd;
+
+	for (;  pos < trace.size() && trace[pos].tick <= tick;  pos++)
+	{
+		const trace_record& rec = trace[pos];
+
+		if (rec.tick < tick)
+			continue;
+
+		pd = find_pd(rec.domain_id);
+		if (!pd)
+			fatal_msg("bug: replay_tick: missing pseudo-domain");
+
+		free_ptr(pd->report);
+
+		if (rec.report.size())
+		{
+			pd->report = (char*) xmalloc(rec.report.size() + 1);
+			memcpy(pd->report, rec.report.data(), rec.report.size());
+			pd->report[rec.report.size()] = '\0';
+			pd->report_len = rec.report.size();
+		}
+		else
+		{
+			pd->report = format_test_report((unsigned long long) rec.tick,
+							rec.rate * config.interval,
+							rec.rate,
+							rec.freepct);
+			pd->report_len = strlen(pd->report);
+			pd->rate = rec.rate;
+		}
+	}
+}
+
+/*
+ * Print statistics line for timing samples @v (nsec)
+ */
+static void print_bench_samples(const char* name, bench_samples& v)
+{
+	double sum = 0;
+	size_t n = v.size();
+
+	if (n == 0)
+	{
+		printf("%-16s %8d\n", name, 0);
+		return;
+	}
+
+	std::sort(v.begin(), v.end());
+	for (size_t i = 0;  i < n;  i++)
+		sum += v[i];
+
+	#define PCT(p)  (v[min(n - 1, (size_t) ((p) * n))] / (double) NSEC_PER_USEC)
+
+	printf("%-16s %8lu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+	       name,
+	       (unsigned long) n,
+	       v[0] / (double) NSEC_PER_USEC,
+	       PCT(0.50),
+	       PCT(0.90),
+	       PCT(0.99),
+	       v[n - 1] / (double) NSEC_PER_USEC,
+	       sum / n / NSEC_PER_USEC);
+
+	#undef PCT
 }
 
 
@@ -732,15 +1357,7 @@ void test_debugger(void)
  */
 static long get_free_pages(const char* msg)
 {
-	long free_pages = pseudo.phys_pages - pseudo.dom0_pages;
-
-	for (domid2pd::const_iterator it = pseudo.domains.begin();
-	     it != pseudo.domains.end();
-	     ++it)
-	{
-		pseudo_domain* pd = it->second;
-		free_pages -= pages(pd);
-	}
+	long free_pages = pseudo.phys_pages - pseudo.dom0_pages - pseudo.alloc_pages;
 
 	if (msg && free_pages < 0)
 		fatal_msg("%s", msg);
@@ -782,6 +1399,7 @@ void test_read_domain_reports(void)
 		if (pd && pd->report && pd->report[0])
 		{
 			dom->report_raw = pd->report;
+			dom->report_len = pd->report_len;
 			pd->report = NULL;
 		}
 	}
@@ -850,11 +1468,11 @@ bool test_trim_to_quota(domain_info* dom)
 	delta /= pagesize_kbs;
 
 	dx = min(delta, pd->outstanding_pages);
-	pd->outstanding_pages -= dx;
+	set_pages(pd, pd->tot_pages, pd->outstanding_pages - dx);
 	delta -= dx;
 
 	dx = min(delta, pd->tot_pages);
-	pd->tot_pages -= dx;
+	set_pages(pd, pd->tot_pages - dx, pd->outstanding_pages);
 	delta -= dx;
 
 	if (delta > 0)
@@ -918,13 +1536,12 @@ void test_do_resize_domain(domain_info* dom, long size, char action)
 		/* extra pages needed to grow */
 		xpg = npg - pages_pd;
 		xpg = min(xpg, free_pages);
-		pd->tot_pages += xpg;
+		set_pages(pd, pd->tot_pages + xpg, pd->outstanding_pages);
 	}
 	else if (npg < pages_pd)
 	{
 		/* do shrink */
-		pd->tot_pages = npg;
-		pd->outstanding_pages = 0;
+		set_pages(pd, npg, 0);
 	}
 	else
 	{
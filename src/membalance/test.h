@@ -11,6 +11,7 @@
 #define __MEMBALANCE_TEST_H__
 
 int execute_test(int argc, char** argv, char** message);
+int execute_bench(int argc, char** argv);
 
 long test_get_xen_free_memory(void);
 long test_get_xen_free_slack(void);
@@ -0,0 +1,298 @@
+/*
+ *  MEMBALANCE daemon
+ *
+ *  trace.cpp - Binary trace of scheduler inputs and decisions
+ *
+ *  Portions Copyright (C) 2014 Sergey Oboguev (oboguev@yahoo.com)
+ *  For licensing terms see license.txt
+ */
+
+#include "membalanced.h"
+
+#include <sys/mman.h>
+
+/******************************************************************************
+*                             local definitions                               *
+******************************************************************************/
+
+/*
+ * Trace records scheduler inputs (domain reports, Xen domain allocation,
+ * host free memory and slack) and decisions (domain allocation targets and
+ * resize requests) for every tick, for offline analysis and replay by
+ * scheduler benchmark (membalanced --bench --replay <file>).
+ *
+ * Records are appended to a memory-mapped file of fixed size, with no
+ * formatting and no system calls on the recording path. When the file
+ * fills up, it is renamed to <path>.0 (replacing the previous one)
+ * and a new file is started.
+ */
+
+static char* trace_path = NULL;		/* trace file path */
+static size_t trace_size = 0;		/* trace file size */
+static int trace_fd = -1;		/* trace file handle */
+static char* trace_base = NULL;		/* trace file mapping */
+static trace_file_hdr* trace_hdr = NULL;	/* ... its header */
+static size_t trace_used = 0;		/* bytes used in the file */
+static trace_rec_tick trace_last_tick;	/* latest tick record */
+static bool trace_has_tick = false;	/* @trace_last_tick is valid */
+
+static bool trace_create(void);
+static void trace_unmap(void);
+static bool trace_rotate(void);
+static void* trace_alloc(trace_rec_type type, size_t length);
+
+
+/******************************************************************************
+*                                 routines                                    *
+******************************************************************************/
+
+/*
+ * Start recording trace to file @path of @size_mb megabytes.
+ * On error, log a message and return @false.
+ */
+bool trace_open(const char* path, long size_mb)
+{
+	trace_close();
+
+	trace_path = xstrdup(path);
+	trace_size = (size_t) size_mb * 1024 * 1024;
+	trace_has_tick = false;
+
+	if (!trace_create())
+	{
+		free_ptr(trace_path);
+		return false;
+	}
+
+	tracing = true;
+	return true;
+}
+
+/*
+ * Stop recording trace
+ */
+void trace_close(void)
+{
+	tracing = false;
+	trace_unmap();
+	free_ptr(trace_path);
+}
+
+/*
+ * Create new trace file and map it
+ */
+static bool trace_create(void)
+{
+	int err;
+
+	trace_fd = open(trace_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+	if (trace_fd < 0)
+	{
+		error_perror("unable to create trace file %s", trace_path);
+		return false;
+	}
+
+	/* allocate blocks upfront so that stores into the mapping cannot fault on ENOSPC */
+	err = posix_fallocate(trace_fd, 0, trace_size);
+	if (err)
+	{
+		errno = err;
+		error_perror("unable to allocate trace file %s", trace_path);
+		goto cleanup;
+	}
+
+	trace_base = (char*) mmap(NULL, trace_size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED, trace_fd, 0);
+	if (trace_base == (char*) MAP_FAILED)
+	{
+		trace_base = NULL;
+		error_perror("unable to map trace file %s", trace_path);
+		goto cleanup;
+	}
+
+	trace_hdr = (trace_file_hdr*) trace_base;
+	memcpy(trace_hdr->magic, TRACE_MAGIC, sizeof trace_hdr->magic);
+	trace_hdr->version = TRACE_VERSION;
+	trace_hdr->header_size = sizeof(trace_file_hdr);
+	trace_hdr->size = trace_size;
+	trace_hdr->start_time = time(NULL);
+	trace_hdr->pagesize_kbs = pagesize_kbs;
+	trace_used = sizeof(trace_file_hdr);
+	trace_hdr->used = trace_used;
+
+	return true;
+
+cleanup:
+
+	close(trace_fd);
+	trace_fd = -1;
+	unlink(trace_path);
+	return false;
+}
+
+/*
+ * Unmap and close current trace file, truncating it to used size
+ */
+static void trace_unmap(void)
+{
+	if (trace_base)
+	{
+		trace_hdr->used = trace_used;
+		munmap(trace_base, trace_size);
+		trace_base = NULL;
+		trace_hdr = NULL;
+	}
+
+	if (trace_fd >= 0)
+	{
+		if (ftruncate(trace_fd, trace_used))
+			warning_perror("unable to truncate trace file %s", trace_path);
+		close(trace_fd);
+		trace_fd = -1;
+	}
+}
+
+/*
+ * Move current trace file to <path>.0 and start a new one,
+ * beginning with the record for the current tick.
+ * On error, log a message, stop tracing and return @false.
+ */
+static bool trace_rotate(void)
+{
+	char* oldpath;
+	bool ok;
+
+	trace_unmap();
+
+	oldpath = xprintf("%s.0", trace_path);
+	if (rename(trace_path, oldpath))
+		error_perror("unable to rename %s to %s", trace_path, oldpath);
+	free(oldpath);
+
+	ok = trace_create();
+	if (!ok)
+	{
+		trace_close();
+		return false;
+	}
+
+	if (trace_has_tick)
+	{
+		memcpy(trace_base + trace_used, &trace_last_tick, sizeof trace_last_tick);
+		trace_used += sizeof trace_last_tick;
+		trace_hdr->used = trace_used;
+	}
+
+	return true;
+}
+
+/*
+ * Allocate space for trace record of @type and @length bytes (including
+ * the record header) and fill in the header. Record is committed
+ * by the next call to trace_alloc(...) or trace_close().
+ * Return NULL if tracing is not possible.
+ */
+static void* trace_alloc(trace_rec_type type, size_t length)
+{
+	trace_rec_hdr* hdr;
+
+	length = roundup(length, TRACE_ALIGN);
+
+	if (trace_hdr)
+		trace_hdr->used = trace_used;
+
+	if (length + sizeof(trace_file_hdr) + sizeof(trace_rec_tick) > trace_size)
+		return NULL;
+
+	if (trace_used + length > trace_size && !trace_rotate())
+		return NULL;
+
+	hdr = (trace_rec_hdr*) (trace_base + trace_used);
+	hdr->type = type;
+	hdr->flags = 0;
+	hdr->length = length;
+	trace_used += length;
+
+	return hdr;
+}
+
+/*
+ * Record the start of scheduler tick
+ */
+void trace_tick(long tick, long host_free, long slack)
+{
+	struct timespec ts;
+	trace_rec_tick* rec;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	/* keep the record to repeat it at the start of the next file on rotation */
+	trace_has_tick = false;
+
+	rec = (trace_rec_tick*) trace_alloc(TRACE_REC_TICK, sizeof(trace_rec_tick));
+	if (!rec)
+		return;
+
+	rec->tick = tick;
+	rec->time_ns = (int64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+	rec->host_free = host_free;
+	rec->slack = slack;
+
+	trace_last_tick = *rec;
+	trace_has_tick = true;
+}
+
+/*
+ * Record data collected for the domain: Xen domain information
+ * and domain report (if any), as read from xenstore.
+ */
+void trace_domain_input(const domain_info* dom, const xc_domaininfo_t* xcinfo)
+{
+	trace_rec_input* rec;
+	unsigned int len = dom->report_raw ? dom->report_len : 0;
+
+	rec = (trace_rec_input*) trace_alloc(TRACE_REC_INPUT, sizeof(trace_rec_input) + len);
+	if (!rec)
+		return;
+
+	rec->domain_id = dom->domain_id;
+	rec->report_len = len;
+	rec->tot_pages = xcinfo ? xcinfo->tot_pages : 0;
+	rec->outstanding_pages = xcinfo ? xcinfo->outstanding_pages : 0;
+	if (len)
+		memcpy(rec + 1, dom->report_raw, len);
+}
+
+/*
+ * Record the memory allocation for the domain (kbs) decided by the scheduler
+ */
+void trace_domain_decision(long domain_id, long memsize0, long memsize)
+{
+	trace_rec_decision* rec;
+
+	rec = (trace_rec_decision*) trace_alloc(TRACE_REC_DECISION, sizeof(trace_rec_decision));
+	if (!rec)
+		return;
+
+	rec->domain_id = domain_id;
+	rec->reserved = 0;
+	rec->memsize0 = memsize0;
+	rec->memsize = memsize;
+}
+
+/*
+ * Record resize request issued to Xen
+ */
+void trace_resize(long domain_id, long size, char action)
+{
+	trace_rec_resize* rec;
+
+	rec = (trace_rec_resize*) trace_alloc(TRACE_REC_RESIZE, sizeof(trace_rec_resize));
+	if (!rec)
+		return;
+
+	rec->domain_id = domain_id;
+	rec->action = action;
+	memset(rec->reserved, 0, sizeof rec->reserved);
+	rec->size = size;
+}
@@ -0,0 +1,100 @@
+/*
+ *  MEMBALANCE daemon
+ *
+ *  trace.h - Binary trace of scheduler inputs and decisions
+ *
+ *  Portions Copyright (C) 2014 Sergey Oboguev (oboguev@yahoo.com)
+ *  For licensing terms see license.txt
+ */
+
+#ifndef __MEMBALANCE_TRACE_H__
+#define __MEMBALANCE_TRACE_H__
+
+/*
+ * Trace file is a memory-mapped sequence of records following the header.
+ * All fields are in host byte order. Each record starts with trace_rec_hdr
+ * and its length (including the header) is a multiple of 8. Records of
+ * a scheduler tick follow the TRACE_REC_TICK record of that tick.
+ */
+
+#define TRACE_MAGIC		"MBTRACE1"
+#define TRACE_VERSION		1
+#define TRACE_ALIGN		8
+
+/* trace file header (@used includes the header) */
+typedef struct __trace_file_hdr
+{
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	header_size;
+	uint64_t	size;			/* file size */
+	uint64_t	used;			/* bytes used */
+	int64_t		start_time;		/* time trace was started (unix time) */
+	uint64_t	pagesize_kbs;		/* Xen page size */
+	uint64_t	reserved[2];
+} trace_file_hdr;
+
+typedef enum __trace_rec_type
+{
+	TRACE_REC_TICK = 1,			/* trace_rec_tick */
+	TRACE_REC_INPUT = 2,			/* trace_rec_input + report */
+	TRACE_REC_DECISION = 3,			/* trace_rec_decision */
+	TRACE_REC_RESIZE = 4			/* trace_rec_resize */
+}
+trace_rec_type;
+
+typedef struct __trace_rec_hdr
+{
+	uint16_t	type;			/* trace_rec_type */
+	uint16_t	flags;
+	uint32_t	length;
+} trace_rec_hdr;
+
+/* start of scheduler tick */
+typedef struct __trace_rec_tick
+{
+	trace_rec_hdr	hdr;
+	int64_t		tick;			/* sched_tick */
+	int64_t		time_ns;		/* CLOCK_REALTIME */
+	int64_t		host_free;		/* Xen free memory (kbs) */
+	int64_t		slack;			/* Xen free memory slack (kbs) */
+} trace_rec_tick;
+
+/* data collected for managed domain, followed by domain report */
+typedef struct __trace_rec_input
+{
+	trace_rec_hdr	hdr;
+	int32_t		domain_id;
+	uint32_t	report_len;		/* 0 if no report */
+	uint64_t	tot_pages;
+	uint64_t	outstanding_pages;
+} trace_rec_input;
+
+/* memory allocation for domain as decided by the scheduler (kbs) */
+typedef struct __trace_rec_decision
+{
+	trace_rec_hdr	hdr;
+	int32_t		domain_id;
+	uint32_t	reserved;
+	int64_t		memsize0;
+	int64_t		memsize;
+} trace_rec_decision;
+
+/* resize request issued to Xen */
+typedef struct __trace_rec_resize
+{
+	trace_rec_hdr	hdr;
+	int32_t		domain_id;
+	char		action;			/* '+', '-' or 0 */
+	char		reserved[3];
+	int64_t		size;			/* requested target size (kbs) */
+} trace_rec_resize;
+
+bool trace_open(const char* path, long size_mb);
+void trace_close(void);
+void trace_tick(long tick, long host_free, long slack);
+void trace_domain_input(const domain_info* dom, const xc_domaininfo_t* xcinfo);
+void trace_domain_decision(long domain_id, long memsize0, long memsize);
+void trace_resize(long domain_id, long size, char action);
+
+#endif // __MEMBALANCE_TRACE_H__
@@ -10,6 +10,46 @@
 #include "membalanced.h"
 
 
+/******************************************************************************
+*                           forward declarations                              *
+******************************************************************************/
+
+static long check_reqsize(long reqsize);
+static void issue_memory_target(long domain_id, long reqsize);
+static int verify_memory_target(domain_info* dom, long reqsize, long rsize,
+				const domid2xcinfo* xinfo);
+static void resize_failed_message(domain_info* dom, char action);
+static int next_wait_step(int step, long progress, long remaining, int64_t elapsed);
+static bool domains_at_target(const domid2xcinfo& xinfo,
+			      const std::vector<std::pair<long, uint64_t> >& prev_pages);
+
+
+/******************************************************************************
+*                             local definitions                               *
+******************************************************************************/
+
+/*
+ * Range of adaptive sleep intervals (ms) used while waiting for Xen free
+ * memory to reach the target or to stabilize
+ */
+static const int wait_step_min_ms = 5;
+static const int wait_step_max_ms = 100;
+
+/*
+ * Time (ms) free memory and domain allocations have to stay unchanged to be
+ * considered stable: when all domains have reached their targets, and
+ * otherwise (when some may be stalled in the middle of ballooning)
+ */
+static const int stable_quiet_short_ms = 30;
+static const int stable_quiet_long_ms = 500;
+
+/*
+ * Tolerance (kbs) for managed domain size vs. its target to be considered
+ * at target, allowing for drift in the estimate of xen_data_size
+ */
+static const long at_target_slack_kbs = 1024;
+
+
 /******************************************************************************
 *                          Xen interface routines                             *
 ******************************************************************************/
@@ -29,28 +69,62 @@
  */
 static int set_memory_target(domain_info* dom, long reqsize)
 {
-	xc_domaininfo_t info;
-	long rsize;
-	int rc;
-
-	if (reqsize % memquant_kbs)
-	{
-		error_msg("bug: safe_libxl_set_memory_target: "
-			  "target_memkb is not multiple of allocation quant");
-		reqsize = roundup(reqsize, memquant_kbs);
-	}
+	reqsize = check_reqsize(reqsize);
 
 	/*
 	 * The implementaion of libxl_set_memory_target(...) is such that its
 	 * return status is flaky and very little can be inferred from it.
 	 * Therefore we are forced to read data back from Xenstore.
 	 */
-	rc = libxl_set_memory_target(xl_ctx, (uint32_t) dom->domain_id, reqsize, 0, 1);
+	issue_memory_target(dom->domain_id, reqsize);
 
 	/*
 	 * Read back domain size and see if it was actually set to @target_memkb
 	 */
-	rsize = get_xen_dom_target(dom->domain_id);
+	return verify_memory_target(dom, reqsize, get_xen_dom_target(dom->domain_id), NULL);
+}
+
+/*
+ * Issue request to Xen to set domain memory target, without reading it back
+ */
+static void issue_memory_target(long domain_id, long reqsize)
+{
+	stat_timer timer(STAT_HIST_SET_TARGET);
+	stat_count(STAT_RESIZE_REQUESTS);
+	libxl_set_memory_target(xl_ctx, (uint32_t) domain_id, reqsize, 0, 1);
+}
+
+/*
+ * Requested size must be a multiple of allocation quant
+ */
+static long check_reqsize(long reqsize)
+{
+	if (reqsize % memquant_kbs)
+	{
+		error_msg("bug: safe_libxl_set_memory_target: "
+			  "target_memkb is not multiple of allocation quant");
+		reqsize = roundup(reqsize, memquant_kbs);
+	}
+
+	return reqsize;
+}
+
+/*
+ * Check domain target size @rsize read back from Xenstore after resize
+ * request for @reqsize has been issued. If @rsize is -1, domain record no
+ * longer exists in Xenstore.
+ *
+ * If @xinfo is not NULL, it is used to check whether the domain is still
+ * alive, otherwise the domain is queried from Xen individually.
+ *
+ * Returns 0 or -1 (errno = ESRCH), same as set_memory_target(...).
+ */
+static int verify_memory_target(domain_info* dom, long reqsize, long rsize,
+				const domid2xcinfo* xinfo)
+{
+	xc_domaininfo_t info;
+	const xc_domaininfo_t* pinfo;
+
 	if (rsize == -1)       /* domain record no longer exists in Xenstore? */
 		goto dead;
 	dom->xs_mem_target = rsize;
@@ -62,16 +136,20 @@ static int set_memory_target(domain_info* dom, long reqsize)
 	 * A discreapancy exists between the requested size and the resultant target.
 	 * Check if domain physically exists and is not dead.
 	 */
-	rc = xc_domain_getinfolist(xc_handle, (uint32_t) dom->domain_id, 1, &info);
+	if (xinfo)
+	{
+		pinfo = xinfo->get(dom->domain_id);
+		if (!pinfo)
+			goto dead;
+	}
+	else
+	{
+		if (!get_xen_domain_info(dom->domain_id, &info))
+			goto dead;
+		pinfo = &info;
+	}
 
-	/* no such domain? */
-	if (rc < 0 && errno == ESRCH)
-		goto dead;
-	if (rc < 0)
-		fatal_perror("unable to get Xen domain information (xc_domain_getinfolist)");
-	if (rc == 0 || info.domain != dom->domain_id)
-		goto dead;
-	if (info.flags & (XEN_DOMINF_dying | XEN_DOMINF_shutdown))
+	if (pinfo->flags & (XEN_DOMINF_dying | XEN_DOMINF_shutdown))
 		goto dead;
 
 	/*
@@ -117,6 +195,7 @@ bool trim_to_quota(domain_info* dom)
 	debug_msg(5, "trimming domain %s down to quota, %ld kbs -> %ld kbs",
 		      dom->printable_name(), goal, dom->dmem_quota);
 
+	note_memory_target(dom, dom->dmem_quota);
 	rc = set_memory_target(dom, dom->dmem_quota);
 
 	/* if error is other than "no such domain" (anymore), then log a message */
@@ -137,6 +216,13 @@ bool trim_to_quota(domain_info* dom)
  */
 void do_resize_domain(domain_info* dom, long size, char action)
 {
+	if (unlikely(tracing))
+		trace_resize(dom->domain_id, size, action);
+
+	dom->last_resize_time = time(NULL);
+	dom->last_resize_size = size;
+	note_memory_target(dom, size);
+
 	if (testmode)
 	{
 		test_do_resize_domain(dom, size, action);
@@ -147,16 +233,140 @@ void do_resize_domain(domain_info* dom, long size, char action)
 
 	/* if error is other than "no such domain" (anymore), then log a message */
 	if (rc < 0 && errno != ESRCH)
+		resize_failed_message(dom, action);
+}
+
+static void resize_failed_message(domain_info* dom, char action)
+{
+	const char* verb = "change";
+	switch (action)
 	{
-		const char* verb = "change";
-		switch (action)
+	case '+':  verb = "expand";  break;
+	case '-':  verb = "shrink";  break;
+	case 0:    break;
+	}
+	warning_perror("unable to %s memory allocation for domain %s",
+		       verb, dom->printable_name());
+}
+
+/*
+ * Execute all resize requests in the batch.
+ *
+ * Requests are issued to Xen back to back, without reading back the result
+ * of each one. Resultant target sizes are then read back from Xenstore within
+ * a single transaction, and if any of them is off, the liveness of domains
+ * is checked by a single collection of Xen domain information.
+ */
+void resize_batch::execute(void)
+{
+	time_t now = time(NULL);
+	std::vector<long> targets;
+	static domid2xcinfo xinfo;	/* reused across calls */
+	bool collected = false;
+	unsigned k;
+	int rc;
+
+	if (unlikely(tracing))
+	{
+		for (k = 0;  k < size();  k++)
+			trace_resize(at(k).dom->domain_id, at(k).size, action);
+	}
+
+	for (k = 0;  k < size();  k++)
+	{
+		at(k).dom->last_resize_time = now;
+		at(k).dom->last_resize_size = at(k).size;
+		note_memory_target(at(k).dom, at(k).size);
+	}
+
+	if (testmode)
+	{
+		for (k = 0;  k < size();  k++)
+			test_do_resize_domain(at(k).dom, at(k).size, action);
+		clear();
+		return;
+	}
+
+	if (empty())
+		return;
+
+	for (k = 0;  k < size();  k++)
+	{
+		resize_request& req = at(k);
+		req.size = check_reqsize(req.size);
+		issue_memory_target(req.dom->domain_id, req.size);
+	}
+
+	get_xen_dom_targets(*this, targets);
+
+	for (k = 0;  k < size();  k++)
+	{
+		resize_request& req = at(k);
+
+		if (targets[k] != -1 &&
+		    targets[k] + req.dom->xs_mem_videoram != req.size &&
+		    !collected)
 		{
-		case '+':  verb = "expand";  break;
-		case '-':  verb = "shrink";  break;
-		case 0:    break;
+			xinfo.collect();
+			collected = true;
 		}
-		warning_perror("unable to %s memory allocation for domain %s",
-			       verb, dom->printable_name());
+
+		rc = verify_memory_target(req.dom, req.size, targets[k],
+					  collected ? &xinfo : NULL);
+
+		/* if error is other than "no such domain" (anymore), then log a message */
+		if (rc < 0 && errno != ESRCH)
+			resize_failed_message(req.dom, action);
+	}
+
+	clear();
+}
+
+/*
+ * Estimate the amount of memory (kbs) yet to be released by the domains
+ * shrinking per requests in the batch, by comparing their current allocation
+ * in Xen @xinfo against requested sizes. Domains that are gone are not counted.
+ */
+long resize_batch::outstanding(const domid2xcinfo& xinfo) const
+{
+	const xc_domaininfo_t* xcinfo;
+	long size, total = 0;
+	unsigned k;
+
+	for (k = 0;  k < this->size();  k++)
+	{
+		const resize_request& req = at(k);
+
+		xcinfo = xinfo.get(req.dom->domain_id);
+		if (!xcinfo || (xcinfo->flags & XEN_DOMINF_dying))
+			continue;
+
+		size = pagesize_kbs * xcinfo->tot_pages - req.dom->xen_data_size;
+		total += max(0, size - req.size);
+	}
+
+	return total;
+}
+
+/*
+ * Drop requests for domains that are no longer managed.
+ * Used when the batch is kept across main loop iterations,
+ * during which domains may be deleted.
+ */
+void resize_batch::prune(void)
+{
+	domid2info::const_iterator it;
+
+	for (unsigned k = 0;  k < size();  )
+	{
+		/* do not touch @dom before it is known to be still alive */
+		const resize_request& req = at(k);
+		it = doms.managed.find(req.domain_id);
+
+		if (it == doms.managed.end() || it->second != req.dom)
+			erase(begin() + k);
+		else
+			k++;
 	}
 }
 
@@ -174,40 +384,119 @@ void do_shrink_domain(domain_info* dom, long size)
  * Wait until either Xen free memory reaches @free_target or a timeout
  * of @timeout_ms miliseconds expires.
  *
+ * If @shrinks is not NULL, it lists shrink requests the memory is expected
+ * to come from. In this case also return as soon as all the domains in it
+ * have come down to their requested sizes (according to their current
+ * allocation in Xen), since no more memory can be expected from them.
+ *
+ * Sleep intervals between the samples are adapted to the observed rate of
+ * free memory growth.
+ *
  * Return the attained amount of Xen free memory.
  */
-long xen_wait_free_memory(long free_target, int timeout_ms)
+long xen_wait_free_memory(long free_target, int timeout_ms, const resize_batch* shrinks)
 {
-	struct timespec ts0;
-	bool ts0_set = false;
-	long xfree;
+	xen_free_memory_waiter waiter;
 
-	if (testmode)
-		timeout_ms = 0;
+	waiter.start(free_target, timeout_ms, shrinks);
+	while (!waiter.poll())
+		usleep(waiter.step_ms() * USEC_PER_MSEC);
 
-	for (;;)
-	{
-		xfree = get_xen_free_memory();
-		if (xfree >= free_target)
-			return xfree;
+	return waiter.xfree;
+}
 
-		if (ts0_set)
-		{
-			if (timespec_diff_ms(getnow(), ts0) >= timeout_ms)
-				return xfree;
-		}
-		else if (timeout_ms == 0)
-		{
-			return xfree;
-		}
-		else
+/*
+ * Start waiting as described for xen_wait_free_memory(...)
+ */
+void xen_free_memory_waiter::start(long free_target, int timeout_ms, const resize_batch* shrinks)
+{
+	this->stable = false;
+	this->free_target = free_target;
+	this->timeout_ms = testmode ? 0 : timeout_ms;
+	this->shrinks = shrinks;
+	this->ts0 = this->ts_prev = getnow();
+	this->prev_xfree = -1;
+	this->prev_pages.clear();
+	this->step = wait_step_min_ms;
+	this->xfree = 0;
+}
+
+/*
+ * Take a sample and check if the wait is over.
+ */
+bool xen_free_memory_waiter::poll(void)
+{
+	return stable ? poll_stable() : poll_target();
+}
+
+/*
+ * Take a sample while waiting for Xen free memory to reach @free_target,
+ * and select the next sleep interval (@step).
+ * Return @true if the wait is over.
+ */
+bool xen_free_memory_waiter::poll_target(void)
+{
+	struct timespec now;
+	static domid2xcinfo xinfo;	/* reused across calls */
+	int64_t elapsed;
+
+	xfree = get_xen_free_memory();
+	if (xfree >= free_target || timeout_ms <= 0)
+		return true;
+
+	if (shrinks != NULL)
+	{
+		xinfo.collect();
+		if (shrinks->outstanding(xinfo) == 0)
 		{
-			ts0 = getnow();
-			ts0_set = true;
+			/* pick up the memory released since the reading above */
+			xfree = get_xen_free_memory();
+			debug_msg(5, "domains reached shrink targets in %ld ms",
+				  (long) timespec_diff_ms(getnow(), ts0));
+			return true;
 		}
+	}
 
-		usleep(100 * USEC_PER_MSEC);
+	now = getnow();
+	elapsed = timespec_diff_ms(now, ts0);
+	if (elapsed >= timeout_ms)
+		return true;
+
+	step = next_wait_step(step,
+			      prev_xfree < 0 ? 0 : xfree - prev_xfree,
+			      free_target - xfree,
+			      timespec_diff_ms(now, ts_prev));
+	step = min(step, (int) (timeout_ms - elapsed));
+
+	prev_xfree = xfree;
+	ts_prev = now;
+
+	return false;
+}
+
+/*
+ * Select next sleep interval while waiting for free memory.
+ *
+ * If @progress kbs were gained over past @elapsed ms, sleep for the time
+ * it is predicted to take to get @remaining kbs at the same rate.
+ * Otherwise back off exponentially.
+ */
+static int next_wait_step(int step, long progress, long remaining, int64_t elapsed)
+{
+	if (progress > 0 && elapsed > 0)
+	{
+		double eta = (double) remaining * elapsed / progress;
+		step = (int) min(eta, (double) wait_step_max_ms);
 	}
+	else
+	{
+		step *= 2;
+	}
+
+	step = max(step, wait_step_min_ms);
+	step = min(step, wait_step_max_ms);
+
+	return step;
 }
 
 static void get_xen_physinfo(xc_physinfo_t* info)
@@ -244,6 +533,133 @@ long get_xen_physical_memory(void)
 	return pagesize_kbs * (long) info.total_pages;
 }
 
+/*
+ * Get free memory (not accounting for slack) and total memory of each
+ * NUMA node (kbs). Offline nodes are reported with zero size.
+ * Return @false if node data is not available.
+ */
+bool get_xen_numa_memory(std::vector<long>& node_free, std::vector<long>& node_size)
+{
+	static bool warned = false;
+	std::vector<xc_meminfo_t> meminfo;
+	std::vector<uint32_t> distance;
+	unsigned nnodes = 0, max_nodes;
+
+	node_free.clear();
+	node_size.clear();
+
+	if (testmode)
+		return false;
+
+	if (xc_numainfo(xc_handle, &nnodes, NULL, NULL) || nnodes == 0)
+		goto error;
+
+	meminfo.resize(nnodes);
+	distance.resize(nnodes * nnodes);
+	max_nodes = nnodes;
+	if (xc_numainfo(xc_handle, &nnodes, &meminfo[0], &distance[0]))
+		goto error;
+	nnodes = min(nnodes, max_nodes);
+
+	for (unsigned k = 0;  k < nnodes;  k++)
+	{
+		if (meminfo[k].memsize == XEN_INVALID_MEM_SZ)
+		{
+			node_free.push_back(0);
+			node_size.push_back(0);
+		}
+		else
+		{
+			node_free.push_back((long) (meminfo[k].memfree / 1024));
+			node_size.push_back((long) (meminfo[k].memsize / 1024));
+		}
+	}
+
+	return true;
+
+error:
+
+	if (!warned)
+	{
+		warning_perror("unable to get Xen NUMA information (xc_numainfo)");
+		warned = true;
+	}
+
+	return false;
+}
+
+/*
+ * Query Xen information for domain @domain_id individually into @info.
+ * Return @false if the domain does not exist.
+ */
+bool get_xen_domain_info(long domain_id, xc_domaininfo_t* info)
+{
+	const xc_domaininfo_t* pinfo;
+	int rc;
+
+	if (testmode)
+	{
+		static domid2xcinfo xinfo;	/* reused across calls */
+		xinfo.collect();
+		pinfo = xinfo.get(domain_id);
+		if (!pinfo)
+			return false;
+		*info = *pinfo;
+		return true;
+	}
+
+	rc = xc_domain_getinfolist(xc_handle, (uint32_t) domain_id, 1, info);
+
+	/* no such domain? */
+	if (rc < 0 && errno == ESRCH)
+		return false;
+	if (rc < 0)
+		fatal_perror("unable to get Xen domain information (xc_domain_getinfolist)");
+	if (rc == 0 || (long) info->domain != domain_id)
+		return false;
+
+	return true;
+}
+
+/*
+ * Get NUMA node the domain is confined to by its node affinity,
+ * or -1 if it is not confined to a single node.
+ */
+int get_xen_domain_node(long domain_id)
+{
+	static xc_nodemap_t nodemap = NULL;
+	static int nodemap_size = 0;
+	int node = -1;
+
+	if (testmode)
+		return -1;
+
+	if (nodemap == NULL)
+	{
+		nodemap_size = xc_get_nodemap_size(xc_handle);
+		if (nodemap_size <= 0)
+			return -1;
+		nodemap = xc_nodemap_alloc(xc_handle);
+		if (nodemap == NULL)
+			return -1;
+	}
+
+	if (xc_domain_node_getaffinity(xc_handle, (uint32_t) domain_id, nodemap))
+		return -1;
+
+	for (int k = 0;  k < nodemap_size * 8;  k++)
+	{
+		if (nodemap[k / 8] & (1 << (k % 8)))
+		{
+			if (node >= 0)
+				return -1;
+			node = k;
+		}
+	}
+
+	return node;
+}
+
 /*
  * Get Dom0 minimal size (kbs)
  */
@@ -375,61 +791,155 @@ long xen_domain_uptime(long domain_id)
  */
 long xen_wait_free_memory_stable(int timeout_ms)
 {
-	if (timeout_ms <= 0 || testmode)
-		return get_xen_free_memory();
+	xen_free_memory_waiter waiter;
+
+	waiter.start_stable(timeout_ms);
+	while (!waiter.poll())
+		usleep(waiter.step_ms() * USEC_PER_MSEC);
+
+	return waiter.xfree;
+}
+
+/*
+ * Start waiting as described for xen_wait_free_memory_stable(...)
+ */
+void xen_free_memory_waiter::start_stable(int timeout_ms)
+{
+	start(0, timeout_ms);
+	this->stable = true;
+}
+
+/*
+ * Keep waiting for at least @timeout_ms milliseconds from now,
+ * if the wait would otherwise time out earlier
+ */
+void xen_free_memory_waiter::extend(int timeout_ms)
+{
+	int64_t elapsed = timespec_diff_ms(getnow(), ts0);
+
+	if (elapsed + timeout_ms > this->timeout_ms)
+		this->timeout_ms = (int) min(elapsed + timeout_ms, (int64_t) INT_MAX);
+}
 
+/*
+ * Take a sample while waiting for Xen free memory to stabilize,
+ * and select the next sleep interval (@step).
+ * Return @true if the wait is over.
+ */
+bool xen_free_memory_waiter::poll_stable(void)
+{
 	/*
-	 * The implementation is very simplistic. It waits for several samples
-	 * to match and return the reading. If runs out of timeout, return the
-	 * latest reading.
-	 *
-	 * It is probably sufficient since in practice most adjustments settle
-	 * after a short time.
-	 *
-	 * If we were in the need of more sophisticated algorithm, we could use
-	 * heuristics like:
+	 * Free memory is considered stable once neither its amount nor the
+	 * allocation (tot_pages) of any domain have changed for a quiet period.
 	 *
-	 *   - if free space is trending to increase and is exceeding the requested
-	 *     amount, return currently available space
+	 * If all domains are known to have reached their targets, a short quiet
+	 * period is sufficient. Otherwise some of them may be temporarily stalled
+	 * in the middle of ballooning (see the comment in sched_freemem), so
+	 * require a longer quiet period, comparable to what simple sampling would
+	 * need. Domains not managed by membalance, such as Dom0, have no known
+	 * target and are taken as settled if their allocation did not change
+	 * since the previous sample (see domains_at_target).
 	 *
-	 *   - if free space is decreasing, but available free space adjusted for
-	 *     the trend rate over say next 1 sec leaves still more than the
-	 *     requested amount, then return this residual
-	 *
-	 *   - etc.
+	 * Sleep intervals between the samples start short and back off while
+	 * nothing changes. Start of the quiet period is kept in @ts_prev.
 	 */
 
-	struct timespec ts0 = getnow();
-	long xf, prev_xf = 0;
-	int match = 0;
-	const int match_stable_at = 5;
+	struct timespec now;
+	static domid2xcinfo xinfo;	/* reused across calls */
+	std::vector<std::pair<long, uint64_t> > pages;
+	int64_t quiet, elapsed;
+	int quiet_needed;
+	bool at_target;
+
+	xfree = get_xen_free_memory();
+	if (timeout_ms <= 0)
+		return true;
 
-	for (;;)
+	xinfo.collect();
+	now = getnow();
+
+	for (int k = 0;  k < xinfo.count();  k++)
 	{
-		xf = get_xen_free_memory();
+		const xc_domaininfo_t* xcinfo = xinfo.at(k);
+		pages.push_back(std::make_pair((long) xcinfo->domain,
+					       (uint64_t) xcinfo->tot_pages));
+	}
 
-		if (match == 0 || prev_xf == xf)
-		{
-			match++;
-		}
-		else
-		{
-			match = 0;
-		}
+	at_target = domains_at_target(xinfo, prev_pages);
+
+	if (xfree != prev_xfree || pages != prev_pages)
+	{
+		ts_prev = now;
+		step = wait_step_min_ms;
+		prev_xfree = xfree;
+		prev_pages.swap(pages);
+	}
+	else
+	{
+		step = min(2 * step, wait_step_max_ms);
+	}
+
+	quiet_needed = at_target ? stable_quiet_short_ms : stable_quiet_long_ms;
+	quiet = timespec_diff_ms(now, ts_prev);
+	if (quiet >= quiet_needed)
+		return true;
+
+	elapsed = timespec_diff_ms(now, ts0);
+	if (elapsed >= timeout_ms)
+	{
+		error_msg("domain memory adjustment did not stabilize after %d ms", timeout_ms);
+		return true;
+	}
 
-		prev_xf = xf;
+	step = min(step, (int) (quiet_needed - quiet));
+	step = min(step, (int) (timeout_ms - elapsed));
+	step = max(step, 1);
 
-		if (match == match_stable_at)
-			return xf;
+	return false;
+}
 
-		if (timespec_diff_ms(getnow(), ts0) >= timeout_ms)
+/*
+ * Check if all domains in Xen @xinfo have reached their target sizes
+ * according to their current allocation.
+ *
+ * Managed domains are checked against their target as last known from
+ * xenstore, within at_target_slack_kbs since xen_data_size is only an
+ * estimate. The target of other domains (such as Dom0) is not known, they
+ * are considered settled if their allocation is the same as in the previous
+ * sample @prev_pages (sorted by domain id).
+ */
+static bool domains_at_target(const domid2xcinfo& xinfo,
+			      const std::vector<std::pair<long, uint64_t> >& prev_pages)
+{
+	const xc_domaininfo_t* xcinfo;
+	domid2info::const_iterator it;
+	domain_info* dom;
+	long size, goal;
+
+	for (int k = 0;  k < xinfo.count();  k++)
+	{
+		xcinfo = xinfo.at(k);
+
+		it = doms.managed.find((long) xcinfo->domain);
+		if (it == doms.managed.end())
 		{
-			error_msg("domain memory adjustment did not stabilize after %d ms", timeout_ms);
-			return xf;
+			std::pair<long, uint64_t> key((long) xcinfo->domain, 0);
+			std::vector<std::pair<long, uint64_t> >::const_iterator pp;
+			pp = std::lower_bound(prev_pages.begin(), prev_pages.end(), key);
+			if (pp == prev_pages.end() || pp->first != key.first ||
+			    pp->second != (uint64_t) xcinfo->tot_pages)
+				return false;
+			continue;
 		}
+		dom = it->second;
 
-		usleep(100 * USEC_PER_MSEC);
+		size = pagesize_kbs * xcinfo->tot_pages - dom->xen_data_size;
+		goal = roundup(dom->xs_mem_target + dom->xs_mem_videoram, pagesize_kbs);
+		if (labs(size - goal) > at_target_slack_kbs)
+			return false;
 	}
+
+	return true;
 }
 
 /******************************************************************************
@@ -439,6 +949,8 @@ long xen_wait_free_memory_stable(int timeout_ms)
 domid2xcinfo::domid2xcinfo()
 {
 	info = NULL;
+	capacity = 0;
+	ndomains = 0;
 }
 
 domid2xcinfo::~domid2xcinfo()
@@ -448,49 +960,86 @@ domid2xcinfo::~domid2xcinfo()
 
 void domid2xcinfo::reset(void)
 {
-	clear();
 	free_ptr(info);
+	capacity = 0;
+	ndomains = 0;
 }
 
-/* collect domain information */
+/* make sure buffer can hold at least @n entries */
+void domid2xcinfo::reserve(int n)
+{
+	if (n <= capacity)
+		return;
+
+	free_ptr(info);
+	info = (xc_domaininfo_t*) xmalloc(n * sizeof(xc_domaininfo_t));
+	capacity = n;
+}
+
+/*
+ * Collect domain information.
+ *
+ * The buffer is sized from the domain count seen by the last collection
+ * (by any instance), with some headroom, so normally a single call to Xen
+ * is sufficient and no allocation is needed.
+ */
 void domid2xcinfo::collect(void)
 {
 	static int max_domains = 50;
-	xc_domaininfo_t* pinfo = NULL;
 	int k, rc;
 
-	reset();
+	ndomains = 0;
 
 	if (testmode)
 	{
-		rc = test_xcinfo_collect(&pinfo);
+		reset();
+		rc = test_xcinfo_collect(&info);
+		capacity = rc;
 	}
 	else for (;;)
 	{
-		free_ptr(pinfo);
-		pinfo = (xc_domaininfo_t*) xmalloc(max_domains * sizeof(xc_domaininfo_t));
-		rc = xc_domain_getinfolist(xc_handle, 0, max_domains, pinfo);
+		reserve(max_domains);
+		rc = xc_domain_getinfolist(xc_handle, 0, capacity, info);
 		if (rc < 0)
 			fatal_perror("unable to get Xen domain information (xc_domain_getinfolist)");
-		if (rc != max_domains)
+		if (rc != capacity)
 			break;
-		max_domains *= 2;
+		max_domains = 2 * capacity;
 	}
 
-	this->info = pinfo;
+	ndomains = rc;
+	max_domains = max(max_domains, rc + rc / 4 + 16);
 
-	/* map: dom id -> xcinfo */
-	for (k = 0;  k < rc;  k++, pinfo++)
-		(*this)[(long) pinfo->domain] = pinfo;
+	/* Xen lists domains in the order of id, but do not rely on it */
+	for (k = 1;  k < ndomains;  k++)
+	{
+		if (!less_by_domain(info[k - 1], info[k]))
+		{
+			std::sort(info, info + ndomains, less_by_domain);
+			break;
+		}
+	}
 }
 
 /* get information element for specific domain */
 const xc_domaininfo_t* domid2xcinfo::get(long domain_id) const
 {
-	domid2xcinfo::const_iterator it = find(domain_id);
-	if (it == end())
-		return NULL;
-	else
-		return it->second;
+	int lo = 0;
+	int hi = ndomains - 1;
+	int k;
+
+	/* binary search */
+	while (lo <= hi)
+	{
+		k = (lo + hi) / 2;
+		if ((long) info[k].domain < domain_id)
+			lo = k + 1;
+		else if ((long) info[k].domain > domain_id)
+			hi = k - 1;
+		else
+			return info + k;
+	}
+
+	return NULL;
 }
 
@@ -37,10 +37,29 @@
  *     /local/domain/<domid>/membalance/report_path = "/tool/membalance/domain/{qid}/report"  [Dom0:rw, DomU:r]
  *     /tool/membalance/domain/{qid}/domid = <domid>  [Dom0:rw]
  *     /tool/membalance/domain/{qid}/report           [Dom0:rw, DomU:rw]
+ *     /tool/membalance/domain/{qid}/alarm            [Dom0:rw, DomU:rw]
+ *     /tool/membalance/domain/{qid}/shrink           [Dom0:rw, DomU:rw]
+ *
+ * "Alarm" key is written by memprobed only in between regular reports, on a sudden
+ * surge of memory pressure in the guest, and is located by memprobed next to the
+ * "report" key.
+ *
+ * "Shrink" key is used by "membalancectl free-memory" to ask memprobed to reclaim
+ * guest memory (such as clean page cache) before the domain is shrunk, so the
+ * balloon driver finds free pages to give away rather than having to reclaim
+ * them under pressure. The key is created blank, memprobed supporting the
+ * request writes "ready" to it on startup, membalanced then writes requests
+ * and memprobed replaces them with responses (see request_prepare_shrink).
  *
  * Global:
  *
  *     /tool/membalance/interval                      [Dom0:rw, all managed DomU's:r]
+ *     /tool/membalance/tick                          [Dom0:rw, all managed DomU's:r]
+ *
+ * "Tick" key holds the time of the next scheduling tick (unix time in ms), so
+ * memprobed can take its samples shortly before the tick. Ticks follow each
+ * other every @interval seconds, so the key is rewritten only when the phase
+ * of the ticks drifts off, rather than on every tick.
  *
  */
 
@@ -51,6 +70,9 @@
 /* no xenstore transaction */
 #define XS_TRANSACTION_NULL 0
 
+/* max number of domains handled in one transaction by bulk routines */
+#define XS_BATCH_MAX 32
+
 
 /******************************************************************************
 *                              static data                                    *
@@ -71,6 +93,14 @@ static const char local_domain_path[] = "/local/domain";
  */
 static const char membalance_interval_path[] = "/tool/membalance/interval";
 
+/*
+ * Path in xenstore for the time of the next scheduling tick.
+ * Created and written by MEMBALANCED, read only by MEMPROBED.
+ */
+static const char membalance_tick_path[] = "/tool/membalance/tick";
+static int64_t published_tick_ms = -1;	/* value written to @membalance_tick_path */
+static int published_tick_interval = 0;	/* ... and @interval it was written for */
+
 /*
  * Per-domain membalance keys are hosted under this root.
  */
@@ -83,6 +113,18 @@ static const char membalance_domain_root_path[] = "/tool/membalance/domain";
  */
 static const char membalance_report_link_path[] = "membalance/report_path";
 
+/*
+ * Token prefix for watches on domain report keys (when @report_watch is on).
+ * Followed by domain id.
+ */
+static const char report_watch_token_prefix[] = "membalance-report:";
+
+/*
+ * Token prefix for watches on domain alarm keys (when @pressure_alarm is on).
+ * Followed by domain id.
+ */
+static const char alarm_watch_token_prefix[] = "membalance-alarm:";
+
 /*
  * libxl logging information
  */
@@ -100,6 +142,19 @@ static void retry_wait(int cycle);
 static bool is_valid_membalance_report_link_path(const char* keyvalue,
 						 size_t report_path_size,
 						 char* qid);
+static bool is_valid_membalance_domain_key_path(const char* keyvalue,
+						size_t path_size,
+						char* qid,
+						const char* keyname);
+static bool is_watch_token(const char* token, const char* prefix, long* p_domid);
+static bool is_report_watch_token(const char* token, long* p_domid);
+static void handle_report_watch_event(long domain_id, const char* path);
+static bool is_alarm_watch_token(const char* token, long* p_domid);
+static void handle_alarm_watch_event(long domain_id, const char* path);
+static XsTransactionStatus init_membalance_report_batch(const long* ids, size_t n,
+							domid_set& failed,
+							int* p_nretries);
+static char init_membalance_report_xs(long domain_id, char* qid);
 
 
 /******************************************************************************
@@ -277,6 +332,8 @@ XsTransactionStatus commit_xs(int* p_nretries)
 	if (xst == XS_TRANSACTION_NULL)
 		fatal_msg("bug: commit_xs outside of a transaction");
 
+	stat_count(STAT_XS_COMMITS);
+
 	if (xs_transaction_end(xs, xst, FALSE))
 	{
 		debug_msg(40, "committed transaction");
@@ -291,9 +348,11 @@ XsTransactionStatus commit_xs(int* p_nretries)
 		if (++(*p_nretries) > config.max_xs_retries)
 		{
 			error_perror("unable to write xenstore (transaction retry limit exceeded)");
+			stat_count(STAT_XS_FAILURES);
 			return XSTS_NORETRY;
 		}
 
+		stat_count(STAT_XS_RETRIES);
 		retry_wait(*p_nretries);
 
 		debug_msg(2, "restarting xenstore transaction");
@@ -302,6 +361,7 @@ XsTransactionStatus commit_xs(int* p_nretries)
 	else
 	{
 		error_perror("unable to write xenstore (xs_transaction_end)");
+		stat_count(STAT_XS_FAILURES);
 		return XSTS_FAIL;
 	}
 }
@@ -368,21 +428,32 @@ XsTransactionStatus commit_singleop_xs(int* p_nretries)
 }
 
 /*
- * Enumerate all local domains
+ * Enumerate all local domains.
+ *
+ * Can be called either inside or outside of Xenstore transaction,
+ * same as domain_alive(...).
  */
 void enumerate_local_domains(domid_set& ids)
 {
 	char** domain_dir = NULL;
 	unsigned int domain_dir_count, j;
 	long domain_id;
+	bool quit_xst = false;
 
 	ids.clear();
 
-	begin_singleop_xs();
+	if (!in_transaction_xs())
+	{
+		begin_singleop_xs();
+		quit_xst = true;
+	}
+
 	domain_dir = xs_directory(xs, xst, local_domain_path, &domain_dir_count);
 	if (!domain_dir)
 		fatal_perror("unable to enumerate domains in xenstore (%s)", local_domain_path);
-	abort_singleop_xs();
+
+	if (quit_xst)
+		abort_singleop_xs();
 
 	for (j = 0;  j < domain_dir_count;  j++)
 	{
@@ -397,9 +468,10 @@ void enumerate_local_domains(domid_set& ids)
 
 
 /*
- * Called when a watched value in xenstore has been changed
+ * Called when a watched value in xenstore has been changed.
+ * Returns @false if unable to read the watch event.
  */
-void handle_xs_watch(void)
+bool handle_xs_watch(void)
 {
 	char* path;
 	char* token;
@@ -413,7 +485,7 @@ void handle_xs_watch(void)
 	if (vec == NULL)
 	{
 		error_perror("cannot read xenstore watch");
-		return;
+		return false;
 	}
 
 	for (k = 0;  k < num;  k += 2)
@@ -423,9 +495,14 @@ void handle_xs_watch(void)
 
 		if (is_local_domain_path(path, &domid, &subpath))
 			handle_xs_watch_event(domid, subpath);
+		else if (is_report_watch_token(token, &domid))
+			handle_report_watch_event(domid, path);
+		else if (is_alarm_watch_token(token, &domid))
+			handle_alarm_watch_event(domid, path);
 	}
 
 	free_ptr(vec);
+	return true;
 }
 
 /*
@@ -472,30 +549,17 @@ static bool is_local_domain_path(const char* path, long* p_domid, const char** p
 }
 
 /*
- * Try to process pending domain.
- *
- * Normally called once a second until the data has been collected,
- * but under heavy system load an interval between successive calls
- * can take longer than a second.
+ * Check if pending domain is due to be processed in this cycle.
  *
- * If domain still exists, return *@p_is_dead = @false and
- * return: @true if domain can and ready be managed.
- *         @false if domain is to be unmanaged.
- *         @maybe if still undetermined and should be tried again later.
- *
- * If domain does not exist anymore, return *@p_is_dead = @true
- * and return TriFalse.
+ * Normally domain is processed once a second until the data has been
+ * collected, but with increasing number of completed passes the scan
+ * frequency is reduced.
  */
-tribool domain_info::process_pending(bool* p_is_dead)
+bool domain_info::pending_due(void)
 {
-	tribool res = TriMaybe;
-	bool do_abort_xs = false;
-
-	*p_is_dead = false;
-
-	/* do not manage Dom0 unless permitted */
+	/* Dom0 that is not to be managed is resolved right away */
 	if (domain_id == 0 && !config.dom0_mode)
-		return TriFalse;
+		return true;
 
 	/*
 	 * with increasing number of completed passes,
@@ -510,49 +574,109 @@ tribool domain_info::process_pending(bool* p_is_dead)
 	{
 		/* do every other cycle */
 		if (++pending_skipped < 2)
-			return TriMaybe;
+			return false;
 	}
 	else if (pending_cycle <= 20)
 	{
 		/* do every 5th cycle */
 		if (++pending_skipped < 5)
-			return TriMaybe;
+			return false;
 	}
 	else
 	{
 		/* do every 10th cycle */
 		if (++pending_skipped < 10)
-			return TriMaybe;
+			return false;
 	}
 
 	pending_skipped = 0;
 
-	debug_msg(5, "processing pending domain %s", printable_name());
+	return true;
+}
 
-	if (!is_xs_data_complete())
+/*
+ * Check if data items for pending domain still have to be read from xenstore
+ */
+bool domain_info::pending_needs_xs(void)
+{
+	if (domain_id == 0 && !config.dom0_mode)
+		return false;
+	return !is_xs_data_complete();
+}
+
+/*
+ * Read xenstore data for pending domains @vdom and store the result of
+ * process_pending_read_xs(...) for each of them in @xs_status.
+ *
+ * Domains are read up to XS_BATCH_MAX at a time within one transaction,
+ * rather than in a transaction per domain. Transaction is read-only and
+ * is aborted, so it cannot conflict with other xenstore clients, whereas
+ * starting a transaction can be the most expensive xenstore operation
+ * (C xenstored copies the whole database for it). This matters when many
+ * domains become pending at once, such as on host startup.
+ */
+void domain_info::bulk_read_pending_xs(const std::vector<domain_info*>& vdom,
+				       std::map<long, char>& xs_status)
+{
+	size_t k, k0;
+
+	for (k0 = 0;  k0 < vdom.size();  k0 += XS_BATCH_MAX)
 	{
-		/*
-		 * read data items from xenstore in a transaction
-		 */
 		begin_xs();
-		do_abort_xs = true;
 
+		for (k = k0;  k < vdom.size() && k < k0 + XS_BATCH_MAX;  k++)
+		{
+			debug_msg(5, "reading xenstore data for pending domain %s",
+				  vdom[k]->printable_name());
+			xs_status[vdom[k]->domain_id] = vdom[k]->process_pending_read_xs();
+		}
+
+		abort_xs();
+	}
+}
+
+/*
+ * Try to process pending domain that is due for processing (see pending_due).
+ *
+ * Under heavy system load an interval between successive calls can take
+ * longer than a second.
+ *
+ * If xenstore data for the domain had to be read (pending_needs_xs), it
+ * must have been read by bulk_read_pending_xs(...) and @xs_status holds
+ * the result. Otherwise @xs_status is zero.
+ *
+ * If domain still exists, return *@p_is_dead = @false and
+ * return: @true if domain can and ready be managed.
+ *         @false if domain is to be unmanaged.
+ *         @maybe if still undetermined and should be tried again later.
+ *
+ * If domain does not exist anymore, return *@p_is_dead = @true
+ * and return TriFalse.
+ */
+tribool domain_info::process_pending(bool* p_is_dead, char xs_status)
+{
+	tribool res = TriMaybe;
+
+	*p_is_dead = false;
+
+	/* do not manage Dom0 unless permitted */
+	if (domain_id == 0 && !config.dom0_mode)
+		return TriFalse;
+
+	debug_msg(5, "processing pending domain %s", printable_name());
+
+	if (xs_status)
+	{
 		/*
-		 * read domain data from xenstore
+		 * domain data has been read from xenstore by bulk_read_pending_xs(...)
 		 */
-		switch (process_pending_read_xs())
+		switch (xs_status)
 		{
 		case 'c':  goto cleanup;	/* try again later */
 		case 'd':  goto dead;           /* domain is dead */
 		case 'u':  goto unmanage;       /* unmanage */
 		default:   break;		/* proceed (have data) */
 		}
-
-		/*
-		 * Release xenstore transaction before further steps
-		 */
-		abort_xs();
-		do_abort_xs = false;
 	}
 	else if (TriFalse == domain_alive(domain_id))
 	{
@@ -602,6 +726,13 @@ tribool domain_info::process_pending(bool* p_is_dead)
 	 * The size of Xen-private per-domain area actually is not static.
 	 * See details in sched.cpp under "Domain size calculus, fine details".
 	 */
+	/*
+	 * If the domain was managed before the restart of the daemon,
+	 * use the size learned then
+	 */
+	if (xen_data_size_phase == 0)
+		state_file_restore_xds(this);
+
 	if (xen_data_size_phase < config.xen_private_data_size_samples)
 	{
 		long xds = xen_data_size;
@@ -665,8 +796,6 @@ tribool domain_info::process_pending(bool* p_is_dead)
 	 */
 
 cleanup:
-	if (do_abort_xs)
-		abort_xs();
 	return res;
 
 dead:
@@ -674,13 +803,9 @@ dead:
 	/* fall through to unmanage */
 
 unmanage:
-	if (do_abort_xs)
-		abort_xs();
 	return TriFalse;
 
 again_1sec:
-	if (do_abort_xs)
-		abort_xs();
 	pending_skipped = 100;
 	return TriMaybe;
 }
@@ -1140,30 +1265,149 @@ tribool domain_alive(long domain_id)
  * Create domain-specific membalance structure (keys) in xenstore and assign them
  * approriate access rights for Dom0 and target domain.
  *
- * Return @true if successful, @false if not.
+ * Domains are handled up to XS_BATCH_MAX at a time within one transaction.
+ * If the transaction conflicts with another xenstore client or fails, it is
+ * retried with the batch cut in half, down to a single domain, so a busy
+ * or failing domain does not hold up the others; batch size grows back
+ * after successful commits. Retries are bounded by @max_xs_retries and are
+ * spaced by retry_wait(...) backoff.
+ *
+ * Domain ids of domains for which the structure could not be created are
+ * added to @failed.
  *
  * On error log a message, except if the error is due to non-existent parent
  * key, in which case the domain is being destroyed.
  */
-bool init_membalance_report(long domain_id)
+void init_membalance_reports(const domid_set& ids, domid_set& failed)
 {
+	std::vector<long> vids(ids.begin(), ids.end());
+	size_t batch = XS_BATCH_MAX;
+	size_t k = 0, n;
 	int nretries = 0;
+
+	for (domid_set::const_iterator it = ids.begin(); it != ids.end(); ++it)
+	{
+		if (!contains(doms.managed, *it))
+			fatal_msg("init_membalance_reports: domain %ld is not managed", *it);
+	}
+
+	while (k < vids.size())
+	{
+		n = min(batch, vids.size() - k);
+
+		switch (init_membalance_report_batch(&vids[k], n, failed, &nretries))
+		{
+		case XSTS_OK:
+			k += n;
+			nretries = 0;
+			batch = min(2 * batch, (size_t) XS_BATCH_MAX);
+			break;
+
+		case XSTS_RETRY:
+			/* conflicted, retry with smaller batch */
+			batch = max(n / 2, (size_t) 1);
+			break;
+
+		case XSTS_NORETRY:
+		case XSTS_FAIL:
+			if (n > 1)
+			{
+				/* isolate the domain that caused failure */
+				batch = max(n / 2, (size_t) 1);
+			}
+			else
+			{
+				failed.insert(vids[k]);
+				k++;
+			}
+			nretries = 0;
+			break;
+		}
+	}
+}
+
+/*
+ * Create membalance structure in xenstore for @n domains with ids @ids
+ * in a single xenstore transaction. Domains found dead are added to @failed.
+ * Returns commit status, see commit_xs(...).
+ */
+static XsTransactionStatus init_membalance_report_batch(const long* ids, size_t n,
+							domid_set& failed,
+							int* p_nretries)
+{
+	std::vector<std::string> qids(n);
+	char qid[UUID_STRING_SIZE];
+	XsTransactionStatus status;
+	size_t k;
+
+	begin_xs();
+
+	for (k = 0;  k < n;  k++)
+	{
+		switch (init_membalance_report_xs(ids[k], qid))
+		{
+		case 'y':
+			qids[k] = qid;
+			break;
+
+		case 'd':
+			/* domain is dead */
+			break;
+
+		default:
+			abort_xs();
+			return XSTS_FAIL;
+		}
+	}
+
+	/* commit the changes */
+	status = commit_xs(p_nretries);
+	if (status != XSTS_OK)
+		return status;
+
+	for (k = 0;  k < n;  k++)
+	{
+		if (qids[k].empty())
+		{
+			failed.insert(ids[k]);
+		}
+		else
+		{
+			domain_info* dom = doms.managed[ids[k]];
+			dom->set_qid(qids[k].c_str());
+			doms.qid[ids[k]] = qids[k];
+			watch_membalance_report(dom);
+			watch_membalance_alarm(dom);
+		}
+	}
+
+	return XSTS_OK;
+}
+
+/*
+ * Create membalance structure for domain @domain_id within current
+ * transaction, and store domain's qid in @qid.
+ *
+ * Return:
+ *      'y'  => done
+ *      'd'  => domain is dead
+ *      'e'  => error (message logged)
+ */
+static char init_membalance_report_xs(long domain_id, char* qid)
+{
 	struct xs_permissions perms[2];
 	const int nperms = 2;
 	char link_path[256];
 	char domid_path[256];
 	char report_path[256];
+	char alarm_path[256];
+	char shrink_path[256];
 	char* keyvalue;
 	unsigned int len;
 	uuid_t qid_uuid;
-	char qid[UUID_STRING_SIZE];
-	bool have_qid = false;
 	char buf[256];
 	const char* key;
 
-	if (!contains(doms.managed, domain_id))
-		fatal_msg("init_membalance_report: domain %ld is not managed", domain_id);
-
 	perms[0].id = 0;
 	perms[0].perms = (typeof(perms[0].perms)) (XS_PERM_READ | XS_PERM_WRITE);
 
@@ -1171,165 +1415,581 @@ bool init_membalance_report(long domain_id)
 
 	sprintf(link_path, "%s/%ld/%s", local_domain_path, domain_id, membalance_report_link_path);
 
-	for (;;)
+	/* check if domain is dead */
+	if (domain_alive(domain_id) != TriTrue)
+		return 'd';
+
+	/* check if the structure already exists */
+	keyvalue = (char*) xs_read(xs, xst, key = link_path, &len);
+
+	if (keyvalue != NULL &&
+	    is_valid_membalance_report_link_path(keyvalue, countof(report_path), qid))
 	{
-		begin_xs();
+		strcpy(report_path, keyvalue);
+		free(keyvalue);
 
-		/* check if domain is dead */
-		if (domain_alive(domain_id) != TriTrue)
+		/* blank out report key */
+		if (!xs_write(xs, xst, key = report_path, "", strlen("")))
+			goto key_write_error;
+	}
+	else
+	{
+		if (keyvalue == NULL)
 		{
-			abort_xs();
-			return false;
+			if (errno != ENOENT && errno != ENOTDIR)
+				goto key_read_error;
 		}
-
-		/* check if the structure already exists */
-		keyvalue = (char*) xs_read(xs, xst, key = link_path, &len);
-
-		if (keyvalue != NULL &&
-		    is_valid_membalance_report_link_path(keyvalue, countof(report_path), qid))
+		else
 		{
-			strcpy(report_path, keyvalue);
+			/* link path was invalid, so re-create the structure */
 			free(keyvalue);
-
-			/* blank out report key */
-			if (!xs_write(xs, xst, key = report_path, "", strlen("")))
-				goto key_write_error;
 		}
-		else
+
+		/*
+		 * generate unique @qid and format @domid_path and @report_path
+		 */
+		for (;;)
 		{
+			/* format paths */
+			uuid_generate(qid_uuid);
+			uuid_unparse(qid_uuid, qid);
+
+			sprintf(domid_path, "%s/%s/domid", membalance_domain_root_path, qid);
+			sprintf(report_path, "%s/%s/report", membalance_domain_root_path, qid);
+
+			/* check if generated qid is unique */
+			keyvalue = (char*) xs_read(xs, xst, key = domid_path, &len);
 			if (keyvalue == NULL)
 			{
 				if (errno != ENOENT && errno != ENOTDIR)
 					goto key_read_error;
-			}
-			else
-			{
-				/* link path was invalid, so re-create the structure */
-				free(keyvalue);
-			}
 
-			/*
-			 * generate unique @qid and format @domid_path and @report_path
-			 */
-			for (;;)
-			{
-				/* format paths */
-				if (!have_qid)
-				{
-					uuid_generate(qid_uuid);
-					uuid_unparse(qid_uuid, qid);
+				/* got unique qid */
+				break;
+			}
 
-					sprintf(domid_path, "%s/%s/domid", membalance_domain_root_path, qid);
-					sprintf(report_path, "%s/%s/report", membalance_domain_root_path, qid);
-				}
+			/* not unique - generate again */
+			free(keyvalue);
+		}
 
-				/* check if generated qid is unique */
-				keyvalue = (char*) xs_read(xs, xst, key = domid_path, &len);
-				if (keyvalue == NULL)
-				{
-					if (errno != ENOENT && errno != ENOTDIR)
-						goto key_read_error;
+		/* create @domid_path = <domid> */
+		sprintf(buf, "%ld", domain_id);
+		if (!xs_write(xs, xst, key = domid_path, buf, strlen(buf)))
+			goto key_write_error;
 
-					/* got unique qid */
-					have_qid = true;
-					break;
-				}
+		/* create @report_path = blank */
+		if (!xs_write(xs, xst, key = report_path, "", strlen("")))
+			goto key_write_error;
 
-				/* not unique - generate again */
-				free(keyvalue);
-				have_qid = false;
-			}
+		/* set protection on @report_path */
+		perms[1].perms = (typeof(perms[1].perms)) (XS_PERM_READ | XS_PERM_WRITE);
+		if (!xs_set_permissions(xs, xst, key = report_path, perms, nperms))
+			goto key_setperm_error;
 
-			/* create @domid_path = <domid> */
-			sprintf(buf, "%ld", domain_id);
-			if (!xs_write(xs, xst, key = domid_path, buf, strlen(buf)))
-				goto key_write_error;
+		/* create @link_path = @report_path */
+		if (!xs_write(xs, xst, key = link_path, report_path, strlen(report_path)))
+			goto key_write_error;
 
-			/* create @report_path = blank */
-			if (!xs_write(xs, xst, key = report_path, "", strlen("")))
-				goto key_write_error;
+		/* set protection on @link_path */
+		perms[1].perms = XS_PERM_READ;
+		if (!xs_set_permissions(xs, xst, key = link_path, perms, nperms))
+			goto key_setperm_error;
+	}
 
-			/* set protection on @report_path */
-			perms[1].perms = (typeof(perms[1].perms)) (XS_PERM_READ | XS_PERM_WRITE);
-			if (!xs_set_permissions(xs, xst, key = report_path, perms, nperms))
-				goto key_setperm_error;
+	/*
+	 * create @alarm_path = blank, also when the structure already exists
+	 * since it might have been created by a version without alarm keys
+	 */
+	sprintf(alarm_path, "%s/%s/alarm", membalance_domain_root_path, qid);
+	if (!xs_write(xs, xst, key = alarm_path, "", strlen("")))
+		goto key_write_error;
 
-			/* create @link_path = @report_path */
-			if (!xs_write(xs, xst, key = link_path, report_path, strlen(report_path)))
-				goto key_write_error;
+	perms[1].perms = (typeof(perms[1].perms)) (XS_PERM_READ | XS_PERM_WRITE);
+	if (!xs_set_permissions(xs, xst, key = alarm_path, perms, nperms))
+		goto key_setperm_error;
 
-			/* set protection on @link_path */
-			perms[1].perms = XS_PERM_READ;
-			if (!xs_set_permissions(xs, xst, key = link_path, perms, nperms))
-				goto key_setperm_error;
-		}
+	/*
+	 * create @shrink_path = blank if it does not exist yet, but keep it
+	 * if it does, since it holds memprobed readiness for the requests
+	 */
+	sprintf(shrink_path, "%s/%s/shrink", membalance_domain_root_path, qid);
+	keyvalue = (char*) xs_read(xs, xst, key = shrink_path, &len);
+	if (keyvalue != NULL)
+	{
+		free(keyvalue);
+	}
+	else if (errno != ENOENT && errno != ENOTDIR)
+	{
+		goto key_read_error;
+	}
+	else
+	{
+		if (!xs_write(xs, xst, key = shrink_path, "", strlen("")))
+			goto key_write_error;
 
-		/* commit the changes */
-		switch (commit_xs(&nretries))
-		{
-		case XSTS_RETRY:    continue;
-		case XSTS_NORETRY:  return false;
-		case XSTS_FAIL:     return false;
-		case XSTS_OK:
-			doms.managed[domain_id]->set_qid(qid);
-			doms.qid[domain_id] = std::string(qid);
-			return true;
-		}
+		if (!xs_set_permissions(xs, xst, key = shrink_path, perms, nperms))
+			goto key_setperm_error;
 	}
 
+	return 'y';
+
 	/* exception handlers */
 key_read_error:
 	error_perror("unable to read xenstore key (%s)", key);
-	goto cleanup;
+	return 'e';
 
 key_write_error:
 	error_perror("unable to write xenstore key (%s)", key);
-	goto cleanup;
+	return 'e';
 
 key_setperm_error:
 	error_perror("unable to set xenstore key permissions (%s)", key);
-	goto cleanup;
-
-cleanup:
-	abort_xs();
-	return false;
+	return 'e';
 }
 
 /*
- * Check if @keyvalue has expected structure:
- *
- *     {membalance_domain_root_path}/{qid}/report
- *
- * and length < @report_path_size.
- *
- * If yes, return @true and copy out @qid.
- * if no, return @false.
+ * If @report_watch is enabled, set xenstore watch on the domain report key,
+ * so reports are collected by handle_xs_watch() as they arrive.
  *
- * Preserves errno.
+ * If unable to set the watch, log a message and leave the domain to be polled
+ * by read_domain_reports().
  */
-static bool is_valid_membalance_report_link_path(const char* keyvalue,
-					       size_t report_path_size,
-					       char* qid)
+void watch_membalance_report(domain_info* dom)
 {
-	const char* cp = keyvalue;
-	const char* ep;
-	char* p;
-	int len;
-
-	if (strlen(cp) >= report_path_size)
-		return false;
+	char report_path[256];
+	char token[64];
 
-	len = strlen(membalance_domain_root_path);
-	if (0 != strncmp(cp, membalance_domain_root_path, len))
-		return false;
+	if (testmode || !config.report_watch || dom->report_watched || !dom->qid)
+		return;
 
-	cp += len;
-	if (*cp++ != '/')
-		return false;
+	sprintf(report_path, "%s/%s/report", membalance_domain_root_path, dom->qid);
+	sprintf(token, "%s%ld", report_watch_token_prefix, dom->domain_id);
 
-	ep = strchr(cp, '/');
-	if (!(ep && streq(ep, "/report")))
-		return false;
+	if (xs_watch(xs, report_path, token))
+	{
+		dom->report_watched = true;
+		debug_msg(5, "set watch on report key for domain %s", dom->printable_name());
+	}
+	else
+	{
+		error_perror("unable to set a watch on xenstore key (%s)", report_path);
+	}
+}
+
+/*
+ * Remove xenstore watch on the domain report key, if set
+ */
+void unwatch_membalance_report(domain_info* dom)
+{
+	char report_path[256];
+	char token[64];
+
+	if (!dom->report_watched)
+		return;
+
+	sprintf(report_path, "%s/%s/report", membalance_domain_root_path, dom->qid);
+	sprintf(token, "%s%ld", report_watch_token_prefix, dom->domain_id);
+
+	/*
+	 * Report key may be already gone, in which case xenstore drops the watch
+	 * by itself. Any events already queued for this watch will be disregarded
+	 * by handle_report_watch_event() since @report_watched is reset.
+	 */
+	if (!xs_unwatch(xs, report_path, token) && errno != ENOENT)
+		error_perror("unable to remove a watch on xenstore key (%s)", report_path);
+
+	dom->report_watched = false;
+	free_ptr(dom->report_raw);
+}
+
+/*
+ * Called when @report_watch configuration setting changes:
+ * set or remove watches on report keys for all managed domains.
+ *
+ * When switching from watches to polling, a report collected by the watch
+ * may be left in the key and will be picked up once more by the next poll,
+ * which is harmless since it is the latest available reading anyway.
+ */
+void update_membalance_report_watches(void)
+{
+	domain_info* dom;
+
+	foreach_managed_domain(dom)
+	{
+		if (config.report_watch)
+			watch_membalance_report(dom);
+		else
+			unwatch_membalance_report(dom);
+	}
+}
+
+/*
+ * Check if watch @token is for a domain report key (see watch_membalance_report)
+ * and if so, extract domain id from it.
+ */
+static bool is_report_watch_token(const char* token, long* p_domid)
+{
+	return is_watch_token(token, report_watch_token_prefix, p_domid);
+}
+
+/*
+ * Check if watch @token starts with @prefix followed by domain id,
+ * and if so, extract domain id from it.
+ */
+static bool is_watch_token(const char* token, const char* prefix, long* p_domid)
+{
+	int len = strlen(prefix);
+
+	if (0 != strncmp(token, prefix, len))
+		return false;
+
+	return a2long(token + len, p_domid) && *p_domid >= 0;
+}
+
+/*
+ * Called when domain report key has been written to.
+ *
+ * Read the report and store it in @report_raw to be consumed at next
+ * scheduling tick. If several reports arrive between the ticks, the latest
+ * one supersedes earlier ones.
+ *
+ * Unlike read_domain_reports(), do not reset the report key: every report
+ * write by the domain generates a watch event anyway. This also means that
+ * writes performed by membalanced itself (creation or blanking out of the key)
+ * are seen here as empty reports, and are ignored.
+ */
+static void handle_report_watch_event(long domain_id, const char* path)
+{
+	domid2info::const_iterator it;
+	domain_info* dom;
+	char qid[UUID_STRING_SIZE];
+	unsigned int len;
+	char* p;
+
+	/* ignore events for domains no longer managed or watched */
+	it = doms.managed.find(domain_id);
+	if (it == doms.managed.end())
+		return;
+	dom = it->second;
+	if (!dom->report_watched)
+		return;
+
+	/* ignore stale events for a previous incarnation of the domain */
+	if (!is_valid_membalance_report_link_path(path, strlen(path) + 1, qid) ||
+	    !dom->qid || !streq(qid, dom->qid))
+	{
+		return;
+	}
+
+	begin_singleop_xs();
+	p = (char*) xs_read(xs, xst, path, &len);
+	abort_singleop_xs();
+
+	if (!p)
+	{
+		if (errno != ENOENT && errno != ENOTDIR)
+			error_perror("unable to read xenstore key (%s)", path);
+		return;
+	}
+
+	if (*p)
+	{
+		free_ptr(dom->report_raw);
+		dom->report_raw = p;
+		dom->report_len = len;
+	}
+	else
+	{
+		free(p);
+	}
+}
+
+/*
+ * If @pressure_alarm is enabled, set xenstore watch on the domain alarm key,
+ * so alarms are handled by handle_xs_watch() as they arrive.
+ */
+void watch_membalance_alarm(domain_info* dom)
+{
+	char alarm_path[256];
+	char token[64];
+
+	if (testmode || !config.pressure_alarm || dom->alarm_watched || !dom->qid)
+		return;
+
+	sprintf(alarm_path, "%s/%s/alarm", membalance_domain_root_path, dom->qid);
+	sprintf(token, "%s%ld", alarm_watch_token_prefix, dom->domain_id);
+
+	if (xs_watch(xs, alarm_path, token))
+	{
+		dom->alarm_watched = true;
+		debug_msg(5, "set watch on alarm key for domain %s", dom->printable_name());
+	}
+	else
+	{
+		error_perror("unable to set a watch on xenstore key (%s)", alarm_path);
+	}
+}
+
+/*
+ * Remove xenstore watch on the domain alarm key, if set
+ */
+void unwatch_membalance_alarm(domain_info* dom)
+{
+	char alarm_path[256];
+	char token[64];
+
+	if (!dom->alarm_watched)
+		return;
+
+	sprintf(alarm_path, "%s/%s/alarm", membalance_domain_root_path, dom->qid);
+	sprintf(token, "%s%ld", alarm_watch_token_prefix, dom->domain_id);
+
+	if (!xs_unwatch(xs, alarm_path, token) && errno != ENOENT)
+		error_perror("unable to remove a watch on xenstore key (%s)", alarm_path);
+
+	dom->alarm_watched = false;
+	dom->pressure_alarm = false;
+}
+
+/*
+ * Called when @pressure_alarm configuration setting changes:
+ * set or remove watches on alarm keys for all managed domains.
+ */
+void update_membalance_alarm_watches(void)
+{
+	domain_info* dom;
+
+	foreach_managed_domain(dom)
+	{
+		if (config.pressure_alarm)
+			watch_membalance_alarm(dom);
+		else
+			unwatch_membalance_alarm(dom);
+	}
+}
+
+/*
+ * Check if watch @token is for a domain alarm key (see watch_membalance_alarm)
+ * and if so, extract domain id from it.
+ */
+static bool is_alarm_watch_token(const char* token, long* p_domid)
+{
+	return is_watch_token(token, alarm_watch_token_prefix, p_domid);
+}
+
+/*
+ * Called when domain alarm key has been written to.
+ *
+ * Flag the domain for sched_pressure_alarms(), to be called from the main
+ * loop. Writes performed by membalanced itself (creation of the key) are seen
+ * here as empty alarms, and are ignored.
+ */
+static void handle_alarm_watch_event(long domain_id, const char* path)
+{
+	domid2info::const_iterator it;
+	domain_info* dom;
+	char qid[UUID_STRING_SIZE];
+	unsigned int len;
+	char* p;
+
+	/* ignore events for domains no longer managed or watched */
+	it = doms.managed.find(domain_id);
+	if (it == doms.managed.end())
+		return;
+	dom = it->second;
+	if (!dom->alarm_watched)
+		return;
+
+	/* ignore stale events for a previous incarnation of the domain */
+	if (!is_valid_membalance_domain_key_path(path, strlen(path) + 1, qid, "alarm") ||
+	    !dom->qid || !streq(qid, dom->qid))
+	{
+		return;
+	}
+
+	begin_singleop_xs();
+	p = (char*) xs_read(xs, xst, path, &len);
+	abort_singleop_xs();
+
+	if (!p)
+	{
+		if (errno != ENOENT && errno != ENOTDIR)
+			error_perror("unable to read xenstore key (%s)", path);
+		return;
+	}
+
+	if (*p)
+	{
+		debug_msg(5, "domain %s raised pressure alarm", dom->printable_name());
+		dom->pressure_alarm = true;
+		pressure_alarms_pending = true;
+	}
+
+	free(p);
+}
+
+/*
+ * Ask memprobed in domain @dom to reclaim @kbs of guest memory ahead of
+ * shrinking the domain. Content of the domain "shrink" key is:
+ *
+ *     ""                                 memprobed does not support requests
+ *     "ready"                            memprobed supports requests
+ *     "prepare-shrink <seq> <kbs>"       request written by membalanced
+ *     "shrink-prepared <seq> <kbs>"      response written by memprobed,
+ *                                        with the amount it has reclaimed
+ *
+ * Return @false if memprobed in the domain does not support the request,
+ * has left an earlier request unanswered, or the request could not be
+ * written.
+ */
+bool request_prepare_shrink(domain_info* dom, u_long seq, long kbs)
+{
+	char path[256];
+	char buf[64];
+	unsigned int len;
+	int nretries = 0;
+	char* p;
+	bool ready;
+
+	if (testmode || !initialized_xs || !dom->qid)
+		return false;
+
+	sprintf(path, "%s/%s/shrink", membalance_domain_root_path, dom->qid);
+
+	begin_singleop_xs();
+	p = (char*) xs_read(xs, xst, path, &len);
+	abort_singleop_xs();
+
+	if (!p)
+	{
+		if (errno != ENOENT && errno != ENOTDIR)
+			error_perror("unable to read xenstore key (%s)", path);
+		return false;
+	}
+
+	/*
+	 * An unanswered "prepare-shrink" request left in the key means that
+	 * memprobed has died or been stopped, so do not wait for it again
+	 */
+	ready = streq(p, "ready") || starts_with(p, "shrink-prepared ");
+	if (!ready && *p)
+	{
+		debug_msg(5, "domain %s did not respond to earlier prepare-shrink request",
+			  dom->printable_name());
+	}
+	free(p);
+	if (!ready)
+		return false;
+
+	sprintf(buf, "prepare-shrink %lu %ld", seq, kbs);
+
+	begin_singleop_xs();
+
+	if (!xs_write(xs, xst, path, buf, strlen(buf)) ||
+	    commit_singleop_xs(&nretries) != XSTS_OK)
+	{
+		error_perror("unable to write xenstore key (%s)", path);
+		return false;
+	}
+
+	debug_msg(5, "asked domain %s to prepare for shrinking by %ld kbs",
+		  dom->printable_name(), kbs);
+
+	return true;
+}
+
+/*
+ * Check if memprobed in domain @dom has responded to prepare-shrink request
+ * @seq. If it has, return @true and the amount it has reclaimed (kbs)
+ * in *@p_reclaimed.
+ */
+bool prepare_shrink_done(domain_info* dom, u_long seq, long* p_reclaimed)
+{
+	char path[256];
+	unsigned int len;
+	unsigned long rseq;
+	long reclaimed;
+	bool done = false;
+	char* p;
+
+	if (testmode || !initialized_xs || !dom->qid)
+		return false;
+
+	sprintf(path, "%s/%s/shrink", membalance_domain_root_path, dom->qid);
+
+	begin_singleop_xs();
+	p = (char*) xs_read(xs, xst, path, &len);
+	abort_singleop_xs();
+
+	if (!p)
+		return false;
+
+	if (2 == sscanf(p, "shrink-prepared %lu %ld", &rseq, &reclaimed) && rseq == seq)
+	{
+		*p_reclaimed = max(reclaimed, 0);
+		done = true;
+	}
+
+	free(p);
+	return done;
+}
+
+/*
+ * Check if @keyvalue has expected structure:
+ *
+ *     {membalance_domain_root_path}/{qid}/report
+ *
+ * and length < @report_path_size.
+ *
+ * If yes, return @true and copy out @qid.
+ * if no, return @false.
+ *
+ * Preserves errno.
+ */
+static bool is_valid_membalance_report_link_path(const char* keyvalue,
+					       size_t report_path_size,
+					       char* qid)
+{
+	return is_valid_membalance_domain_key_path(keyvalue, report_path_size,
+						   qid, "report");
+}
+
+/*
+ * Check if @keyvalue has expected structure:
+ *
+ *     {membalance_domain_root_path}/{qid}/{keyname}
+ *
+ * and length < @path_size.
+ *
+ * If yes, return @true and copy out @qid.
+ * if no, return @false.
+ *
+ * Preserves errno.
+ */
+static bool is_valid_membalance_domain_key_path(const char* keyvalue,
+						size_t path_size,
+						char* qid,
+						const char* keyname)
+{
+	const char* cp = keyvalue;
+	const char* ep;
+	char* p;
+	int len;
+
+	if (strlen(cp) >= path_size)
+		return false;
+
+	len = strlen(membalance_domain_root_path);
+	if (0 != strncmp(cp, membalance_domain_root_path, len))
+		return false;
+
+	cp += len;
+	if (*cp++ != '/')
+		return false;
+
+	ep = strchr(cp, '/');
+	if (!(ep && streq(ep + 1, keyname)))
+		return false;
 
 	if (ep - cp != UUID_STRING_SIZE - 1)
 		return false;
@@ -1347,91 +2007,118 @@ static bool is_valid_membalance_report_link_path(const char* keyvalue,
  *
  * Delete /tool/membalance/domain/{qid} keys for domains that no longer exist.
  * Populate doms.qid (domain_id -> qid map).
+ *
+ * Keys are examined in a read-only transaction, and keys of dead domains
+ * are then deleted up to XS_BATCH_MAX at a time, each batch in its own
+ * transaction. Live domains keep writing their report keys, so a single
+ * transaction spanning all the keys would be prone to conflicts and retries
+ * of the whole scan when the host has many domains.
  */
 void resync_qid(void)
 {
 	char** domain_dir = NULL;
 	unsigned int domain_dir_count, j;
-	bool changed;
 	string_set qids;
+	std::vector<std::string> stale_qids;
 	char* keyvalue;
 	unsigned int len;
 	char path[256];
-	int nretries = 0;
 	long domain_id;
+	domid_set live_ids;
+	size_t k, k0;
 
-	for (;;)
+	begin_xs();
+
+	/*
+	 * enumerate all qids
+	 */
+	domain_dir = xs_directory(xs, xst, membalance_domain_root_path, &domain_dir_count);
+	if (!domain_dir)
 	{
-		begin_xs();
+		if (errno == ENOENT || errno == ENOTDIR)
+		{
+			abort_xs();
+			return;
+		}
+		else
+		{
+			fatal_perror("unable to enumerate membalance domain data in xenstore (%s)",
+				     membalance_domain_root_path);
+		}
+	}
+
+	for (j = 0;  j < domain_dir_count;  j++)
+		insert(qids, domain_dir[j]);
+	free_ptr(domain_dir);
 
-		changed = false;
-		qids.clear();
-		doms.qid.clear();
+	/*
+	 * enumerate live domains once, rather than check
+	 * each qid's domain separately
+	 */
+	enumerate_local_domains(live_ids);
 
+	/*
+	 * examine all qids
+	 */
+	for (string_set::const_iterator it = qids.begin(); it != qids.end();  ++it)
+	{
 		/*
-		 * enumerate all qids
+		 * get domain id for this qid
 		 */
-		domain_dir = xs_directory(xs, xst, membalance_domain_root_path, &domain_dir_count);
-		if (!domain_dir)
+		const char* qid = (*it).c_str();
+		sprintf(path, "%s/%s/domid", membalance_domain_root_path, qid);
+
+		keyvalue = (char*) xs_read(xs, xst, path, &len);
+		if (keyvalue == NULL)
 		{
 			if (errno == ENOENT || errno == ENOTDIR)
-			{
-				abort_xs();
-				return;
-			}
-			else
-			{
-				fatal_perror("unable to enumerate membalance domain data in xenstore (%s)",
-					     membalance_domain_root_path);
-			}
+				continue;
+			fatal_perror("unable to read xenstore key (%s)", path);
+		}
+
+		if (!a2long(keyvalue, &domain_id) || domain_id < 0)
+		{
+			error_msg("invalid value of xenstore key (%s) = (%s)",
+				  path, keyvalue);
+			free(keyvalue);
+			continue;
 		}
 
-		for (j = 0;  j < domain_dir_count;  j++)
-			insert(qids, domain_dir[j]);
-		free_ptr(domain_dir);
+		free(keyvalue);
 
 		/*
-		 * examine all qids
+		 * check if domain still exists
 		 */
-		for (string_set::const_iterator it = qids.begin(); it != qids.end();  ++it)
+		if (contains(live_ids, domain_id))
 		{
-			/*
-			 * get domain id for this qid
-			 */
-			const char* qid = (*it).c_str();
-			sprintf(path, "%s/%s/domid", membalance_domain_root_path, qid);
+			/* domain alive, enlist its qid */
+			doms.qid[domain_id] = *it;
+		}
+		else
+		{
+			/* domain is gone, its qid keys are to be deleted */
+			stale_qids.push_back(*it);
+		}
+	}
 
-			keyvalue = (char*) xs_read(xs, xst, path, &len);
-			if (keyvalue == NULL)
-			{
-				if (errno == ENOENT || errno == ENOTDIR)
-					continue;
-				fatal_perror("unable to read xenstore key (%s)", path);
-			}
+	abort_xs();
 
-			if (!a2long(keyvalue, &domain_id) || domain_id < 0)
-			{
-				error_msg("invalid value of xenstore key (%s) = (%s)",
-					  path, keyvalue);
-				free(keyvalue);
-				continue;
-			}
+	/*
+	 * delete qid keys of dead domains
+	 */
+	for (k0 = 0;  k0 < stale_qids.size();  k0 += XS_BATCH_MAX)
+	{
+		int nretries = 0;
 
-			free(keyvalue);
+		for (;;)
+		{
+			bool changed = false;
 
-			/*
-			 * check if domain still exists
-			 */
-			switch (domain_alive(domain_id))
-			{
-			case TriTrue:
-				/* domain alive, enlist its qid */
-				doms.qid[domain_id] = *it;
-				break;
+			begin_xs();
 
-			case TriFalse:
-				/* domain is gone, delete its qid keys */
-				sprintf(path, "%s/%s", membalance_domain_root_path, qid);
+			for (k = k0;  k < stale_qids.size() && k < k0 + XS_BATCH_MAX;  k++)
+			{
+				sprintf(path, "%s/%s", membalance_domain_root_path, stale_qids[k].c_str());
 				if (xs_rm(xs, xst, path))
 				{
 					changed = true;
@@ -1440,28 +2127,22 @@ void resync_qid(void)
 				{
 					error_perror("unable to remove xenstore key (%s)", path);
 				}
-				break;
+			}
 
-			case TriMaybe:
-				/* at worst, leave stale qid keys alone */
+			/*
+			 * If we deleted no keys, abort the transaction, otherwise commit it
+			 */
+			if (!changed)
+			{
+				abort_xs();
 				break;
 			}
-		}
 
-		/*
-		 * If we deleted no keys, abort the transaction, otherwise commit it
-		 */
-		if (!changed)
-		{
-			abort_xs();
-			return;
-		}
-		else switch (commit_xs(&nretries))
-		{
-		case XSTS_OK:	    return;
-		case XSTS_RETRY:    continue;
-		case XSTS_NORETRY:  /* fall through */
-		case XSTS_FAIL:     fatal_perror("unable to commit transaction (resync_qid)");
+			XsTransactionStatus status = commit_xs(&nretries);
+			if (status == XSTS_OK)
+				break;
+			else if (status != XSTS_RETRY)
+				fatal_perror("unable to commit transaction (resync_qid)");
 		}
 	}
 }
@@ -1505,14 +2186,15 @@ void qid_dead(long domain_id)
  * i.e. if @update_interval_in_xs = @true.
  * Reset @update_interval_in_xs to @false.
  *
- * Change protection on xenstore key @membalance_interval_path
- * to Dom0 = rw, all managed domains = r.
+ * Change protection on xenstore keys @membalance_interval_path
+ * and @membalance_tick_path to Dom0 = rw, all managed domains = r.
  *
  * On error, abort.
  */
 void update_membalance_interval_and_protection(void)
 {
 	int nretries = 0;
+	char buf[32];
 	struct xs_permissions* perms = NULL;
 	int nperms = doms.managed.size() + 1;
 	domid2info::const_iterator it;
@@ -1539,7 +2221,6 @@ void update_membalance_interval_and_protection(void)
 
 		if (update_interval_in_xs)
 		{
-			char buf[32];
 			sprintf(buf, "%d", config.interval);
 			if (!xs_write(xs, xst, membalance_interval_path, buf, strlen(buf)))
 				fatal_perror("unable to write xenstore key (%s)", membalance_interval_path);
@@ -1548,6 +2229,18 @@ void update_membalance_interval_and_protection(void)
 		if (!xs_set_permissions(xs, xst, membalance_interval_path, perms, nperms))
 			fatal_perror("unable to change xenstore key permissions (%s)", membalance_interval_path);
 
+		/* re-write the value to make sure the key exists */
+		if (published_tick_ms >= 0)
+			sprintf(buf, "%lld", (long long) published_tick_ms);
+		else
+			buf[0] = '\0';
+
+		if (!xs_write(xs, xst, membalance_tick_path, buf, strlen(buf)))
+			fatal_perror("unable to write xenstore key (%s)", membalance_tick_path);
+
+		if (!xs_set_permissions(xs, xst, membalance_tick_path, perms, nperms))
+			fatal_perror("unable to change xenstore key permissions (%s)", membalance_tick_path);
+
 		switch (commit_xs(&nretries))
 		{
 		case XSTS_OK:	    goto cleanup;
@@ -1593,10 +2286,62 @@ void update_membalance_interval(void)
 	update_interval_in_xs = false;
 }
 
+/*
+ * Called after scheduling tick point @ts0 has been established.
+ * Publish the time of the next tick in @membalance_tick_path,
+ * unless the value published earlier still matches the phase of the ticks.
+ *
+ * On error, log a message and keep going.
+ */
+void update_membalance_tick(const struct timespec& ts0)
+{
+	struct timespec rt;
+	int64_t tick_ms, period, drift;
+	int nretries = 0;
+	char buf[32];
+
+	if (testmode || !initialized_xs)
+		return;
+
+	if (clock_gettime(CLOCK_REALTIME, &rt))
+		fatal_perror("clock_gettime");
+
+	period = (int64_t) config.interval * MSEC_PER_SEC;
+	tick_ms = (int64_t) rt.tv_sec * MSEC_PER_SEC + rt.tv_nsec / NSEC_PER_MSEC;
+	tick_ms += period - timespec_diff_ms(getnow(), ts0);
+
+	if (published_tick_ms >= 0 && published_tick_interval == config.interval)
+	{
+		drift = (tick_ms - published_tick_ms) % period;
+		if (drift < 0)
+			drift += period;
+		if (min(drift, period - drift) <= config.tolerance_ms)
+			return;
+	}
+
+	sprintf(buf, "%lld", (long long) tick_ms);
+
+	begin_singleop_xs();
+
+	if (!xs_write(xs, xst, membalance_tick_path, buf, strlen(buf)) ||
+	    commit_singleop_xs(&nretries) != XSTS_OK)
+	{
+		error_perror("unable to write xenstore key (%s)", membalance_tick_path);
+		return;
+	}
+
+	published_tick_ms = tick_ms;
+	published_tick_interval = config.interval;
+}
+
 
 /*
  * For each domain managed by membalance read its xenstore "report" key
- * and reset the key
+ * and reset the key.
+ *
+ * Domains with a watch set on the report key (@report_watch mode) are skipped,
+ * as their reports are collected by handle_xs_watch() as they arrive. If all
+ * managed domains are watched, no xenstore transaction is performed at all.
  */
 void read_domain_reports(void)
 {
@@ -1611,8 +2356,18 @@ void read_domain_reports(void)
 	char* p;
 	unsigned int len;
 	bool done = false;
+	bool any = false;
 	domain_info* dom;
 
+	foreach_managed_domain(dom)
+	{
+		if (!dom->report_watched)
+			any = true;
+	}
+
+	if (!any)
+		return;
+
 	while (!done)
 	{
 		bool changed = false;
@@ -1621,6 +2376,9 @@ void read_domain_reports(void)
 
 		foreach_managed_domain(dom)
 		{
+			if (dom->report_watched)
+				continue;
+
 			free_ptr(dom->report_raw);
 
 			sprintf(report_path, "%s/%s/report",
@@ -1634,6 +2392,7 @@ void read_domain_reports(void)
 			if (*p)
 			{
 				dom->report_raw = p;
+				dom->report_len = len;
 
 				if (!xs_write(xs, xst, report_path, "", strlen("")))
 					fatal_perror("unable to write xenstore key (%s)", report_path);
@@ -1713,3 +2472,35 @@ long get_xen_dom_target(long domain_id)
 	}
 }
 
+
+/*
+ * Get Xen target sizes for all domains in @batch, as recorded in Xenstore,
+ * reading them within a single transaction.
+ * Store sizes in kbs into @targets, or -1 if the key no longer exists.
+ */
+void get_xen_dom_targets(const resize_batch& batch, std::vector<long>& targets)
+{
+	char path[256];
+	long lv;
+
+	targets.clear();
+
+	begin_xs();
+
+	for (unsigned k = 0;  k < batch.size();  k++)
+	{
+		sprintf(path, "%s/%ld/memory/target", local_domain_path,
+			batch[k].dom->domain_id);
+
+		switch (read_xs(path, &lv, 0))
+		{
+		case TriTrue:   targets.push_back(lv);  break;
+		case TriMaybe:  targets.push_back(-1);  break;
+		case TriFalse:  /* fall through */
+		default:        ::terminate();
+		}
+	}
+
+	/* read-only transaction, nothing to commit */
+	abort_xs();
+}
@@ -66,6 +66,7 @@
 
 #define countof(x)  (sizeof(x) / sizeof((x)[0]))
 #define min(a, b)  ((a) < (b) ? (a) : (b))
+#define max(a, b)  ((a) > (b) ? (a) : (b))
 
 #define CHECK(cond)  do { if (!(cond))  goto cleanup; } while (0)
 #define PCHECK(cond, msg)  do { if (!(cond)) { error_perror(msg);  goto cleanup; }} while (0)
@@ -109,6 +110,43 @@
 #define COMPILE_TIME_ASSERT2(X, L)        COMPILE_TIME_ASSERT3(X, static_assertion_at_line_##L)
 #define COMPILE_TIME_ASSERT(X)            COMPILE_TIME_ASSERT2(X, __LINE__)
 
+/* binary report format ('B') */
+#define REPORT_B_PSI		(1 << 0)	/* flag: PSI data included */
+#define REPORT_B_HEARTBEAT	(1 << 1)	/* flag: heartbeat included */
+#define REPORT_B_SIZE		30		/* length without PSI data */
+#define REPORT_B_SIZE_PSI	54		/* length with PSI data */
+#define REPORT_B_SIZE_HEARTBEAT	4		/* length of heartbeat field */
+
+/* maximum number of cgroups sampled for PSI with --cgroup */
+#define MAX_CGROUPS  8
+
+/* memory pressure stall information (PSI) */
+struct psi_data
+{
+	/* reading is available */
+	bool valid;
+
+	/* share of time some/all tasks were stalled on memory
+	   over the last 10 seconds, as computed by the kernel (%) */
+	double some_avg10;
+	double full_avg10;
+
+	/* running counters of total stall time (usec) */
+	uintmax_t some_total;
+	uintmax_t full_total;
+};
+
+/* a /proc or cgroup file kept open for repeated reading */
+struct stat_file
+{
+	const char *path;	/* file path */
+	int fd;			/* file handle, -1 if not open */
+	char *buf;		/* read buffer */
+	size_t size;		/* ... and its size */
+	bool disabled;		/* do not try to open again */
+	bool reported;		/* failure to open has been logged */
+};
+
 struct paging_data
 {
 	/* data capture timestamp */
@@ -123,6 +161,12 @@ struct paging_data
 
 	/* system memory pages */
 	long mem_pages;
+
+	/* system-wide memory PSI */
+	struct psi_data psi;
+
+	/* memory PSI of cgroups listed with --cgroup */
+	struct psi_data cgroup_psi[MAX_CGROUPS];
 };
 
 /* XenStore transaction status */
@@ -214,6 +258,113 @@ const static int xen_init_retry_msg = 15;
  */
 static const bool enable_simulation = IF_DEVEL_ELSE(true, false);
 
+/*
+ * Pressure alarm.
+ *
+ * In between regular samples memprobed takes a quick reading of paging data
+ * every @alarm_probe_ms and raises an urgent alarm to membalanced (by writing
+ * to "alarm" key located next to the report key), if either:
+ *
+ *   - data map-in rate since the previous reading has spiked to over
+ *     @alarm_rate_factor times the rate in the latest regular sample,
+ *     and to at least @alarm_rate_min KB/s
+ *
+ *   - guest free memory has collapsed to less than @alarm_free_frac
+ *     of free memory at the time of the latest regular sample
+ *
+ * Alarm is raised at most once per regular sampling interval.
+ * Alarms can be disabled with --no-alarm.
+ */
+const static int alarm_probe_ms = 250;
+const static int alarm_rate_factor = 4;
+const static int64_t alarm_rate_min = 1024;	/* KB/s */
+const static double alarm_free_frac = 0.5;
+static bool enable_alarm = true;
+
+/*
+ * Memory pressure stall information.
+ *
+ * On kernels with PSI support memprobed also reports system-wide memory
+ * stall data from /proc/pressure/memory and, optionally, memory.pressure
+ * of up to MAX_CGROUPS cgroups (v2) listed with --cgroup.
+ * PSI reporting can be disabled with --no-psi.
+ */
+static bool enable_psi = true;
+static const char cgroup_root[] = "/sys/fs/cgroup";
+
+/*
+ * Send reports in compact binary format ('B') rather than text ('A').
+ * Requires membalanced that understands binary reports.
+ * Enabled with --binary-report.
+ */
+static bool binary_report = false;
+
+/*
+ * Change-only reporting.
+ *
+ * If @heartbeat is not 0 (set with --heartbeat), memprobed sends a report
+ * only if data map-in rate has changed by more than @report_delta_rate
+ * or free memory percentage by more than @report_delta_free since the last
+ * report sent, or if @heartbeat seconds have passed since then. Reports
+ * carry @heartbeat value, so membalanced presumes readings unchanged
+ * in between and does not take the domain for unresponsive till the
+ * heartbeat deadline expires.
+ *
+ * While readings stay unchanged and the guest is idle, sampling period is
+ * lengthened by @interval after each sample, up to @idle_interval_factor
+ * times @interval, and falls back to @interval once a change is seen.
+ * The guest is taken for idle if its data map-in rate is at most @idle_rate
+ * or its free memory is over @idle_free_pct, same as membalanced does with
+ * default "rate_zero" and "guest_free_threshold" settings. Under steady
+ * pressure membalanced keeps expanding the domain on every tick, so the
+ * effect of an expansion must be seen by the next sample. For the same
+ * reason, sampling falls back to @interval and a report is sent when
+ * guest memory size changes, i.e. the domain has been resized.
+ */
+static int heartbeat = 0;
+static int64_t report_delta_rate = 64;		/* KB/s */
+static double report_delta_free = 1.0;		/* percent */
+const static int idle_interval_factor = 4;
+const static int64_t idle_rate = 30;		/* KB/s */
+const static double idle_free_pct = 15.0;	/* percent */
+const static int max_heartbeat = 3600;
+
+/*
+ * Phase-aligned sampling.
+ *
+ * Membalanced publishes the time of its next scheduling tick, and memprobed
+ * takes its samples @sample_lead_ms before a tick, so membalanced gets fresh
+ * readings rather than ones taken up to a whole interval ago. Lead time is
+ * @tick_lead_ms plus a random offset of up to @tick_spread_ms picked at
+ * startup, so the reports of the guests do not arrive all at once.
+ *
+ * Tick time is published as unix time, thus alignment relies on guest clock
+ * being in sync with the host.
+ */
+const static int tick_lead_ms = 400;
+const static int tick_spread_ms = 600;
+
+/*
+ * Prepare-shrink.
+ *
+ * Before "membalancectl free-memory" shrinks the domain, membalanced may ask
+ * memprobed (via "shrink" key located next to the report key) to reclaim guest
+ * memory by the amount the domain is going to be shrunk, so the balloon driver
+ * finds free pages to give away rather than has to reclaim them under pressure.
+ * Memprobed reclaims the part of the amount not already free, through
+ * memory.reclaim of the root cgroup (v2), and reports how much free memory
+ * has grown. Can be disabled with --no-prepare-shrink.
+ *
+ * Kernels without memory.reclaim can only drop all of clean page cache at
+ * once, regardless of the amount requested, which is more of a latency hit
+ * than shrinking under pressure would be. Hence on such kernels nothing is
+ * reclaimed, unless dropping page cache is enabled with --drop-caches.
+ */
+static bool enable_prepare_shrink = true;
+static bool enable_drop_caches = false;
+static const char memory_reclaim_file[] = "memory.reclaim";
+static const char drop_caches_path[] = "/proc/sys/vm/drop_caches";
+
 
 /******************************************************************************
 *                              static data                                    *
@@ -222,8 +373,11 @@ static const bool enable_simulation = IF_DEVEL_ELSE(true, false);
 static int fd_sighup = -1;      	  /* handle for SIGHUP */
 static int fd_sigterm = -1;     	  /* handle for SIGTERM */
 static clockid_t clk_id;		  /* clock to use for timing (CLOCK_BOOTTIME etc.) */
-static char *vmstat = NULL;     	  /* buffer for reading /proc/vmstat */
-static size_t vmstat_size = 0;  	  /* ... */
+static struct stat_file vmstat_file;	  /* /proc/vmstat */
+static struct stat_file psi_file;	  /* /proc/pressure/memory */
+static struct stat_file cgroup_files[MAX_CGROUPS];  /* cgroup memory.pressure */
+static const char *cgroup_names[MAX_CGROUPS];	     /* ... as listed in --cgroup */
+static int ncgroups = 0;		  /* ... count */
 
 // static long page_size;		  /* system page size */
 
@@ -232,6 +386,26 @@ static xs_transaction_t xst = XS_TRANSACTION_NULL;      /* xenstore transaction
 
 static unsigned long long report_seq = 1;		/* seq# of report to membalance */
 
+static unsigned long long alarm_seq = 1;		/* seq# of alarm to membalance */
+
+static int64_t last_kbs_sec = -1;	/* rate in the latest regular sample */
+
+static struct paging_data alarm_pd;	/* previous reading for alarm probing */
+
+static bool alarm_raised = false;	/* alarm raised in current interval */
+
+static int64_t sample_period_ms = -1;	/* current sampling period */
+
+static bool report_sent = false;	/* a report has been delivered ... */
+static bool force_report = false;	/* ... or must be sent regardless of change */
+static int64_t reported_kbs_sec;	/* rate in the last delivered report */
+static double reported_free_pct;	/* free memory %-age in the last delivered report */
+static long reported_mem_pages;		/* guest memory size in the last delivered report */
+static struct timespec ts_reported;	/* sample time of the last delivered report */
+
+static int64_t tick_ms = -1;		/* membalanced tick time (unix ms), -1 if unknown */
+static int sample_lead_ms;		/* take samples this much before the tick */
+
 // static char vm_uuid[UUID_STRING_SIZE]; /* uuid of local VM */
 
 static bool subscribed_membalance = false;  /* subscribed to watching @membalance_interval_path */
@@ -252,6 +426,12 @@ static bool run_as_daemon = false;	  /* run as a daemon */
  */
 static const char membalance_interval_path[] = "/tool/membalance/interval";
 
+/*
+ * Path in xenstore for the time of membalanced next scheduling tick.
+ * Created and written by MEMBALANCED, read only by MEMPROBED.
+ */
+static const char membalance_tick_path[] = "/tool/membalance/tick";
+
 /*
  * Path in xenstore that points to report key location.
  * Created by MEMBALANCED, read by MEMPROBED.
@@ -266,6 +446,20 @@ static const char membalance_report_link_path[] = "membalance/report_path";
  */
 static char* membalance_report_path = NULL;
 
+/*
+ * Path in xenstore to raise pressure alarm at, located next to
+ * @membalance_report_path. Created by MEMBALANCED, written by MEMPROBED.
+ * If the key cannot be written to (older MEMBALANCED), alarms are disabled.
+ */
+static char* membalance_alarm_path = NULL;
+
+/*
+ * Path in xenstore to receive prepare-shrink requests at and respond to them,
+ * located next to @membalance_report_path. Created by MEMBALANCED, written
+ * by both. NULL if not available (older MEMBALANCED) or disabled.
+ */
+static char* membalance_shrink_path = NULL;
+
 /*
  * Simulated data rate (if >=0, overrides actual rate in the report)
  */
@@ -295,11 +489,39 @@ static void error_msg(const char *fmt, ...) __format_printf__;
 static void notice_msg(const char *fmt, ...) __format_printf__;
 static void out_of_memory(void) __noreturn__;
 static void terminate(void) __noreturn__;
+static void open_stat_files(void);
 static void get_paging_data(struct paging_data *pd);
-static void read_whole_file(const char *path, char **ppbuf, size_t *psize, size_t initial_size);
+static void get_vmstat_data(struct paging_data *pd);
+static void get_psi_data(struct stat_file *sf, struct psi_data *psi);
+static bool parse_psi_line(char **pp, const char *key, double *p_avg10, uintmax_t *p_total);
+static void init_stat_file(struct stat_file *sf, const char *path);
+static bool read_stat_file(struct stat_file *sf, bool must);
+static void close_stat_file(struct stat_file *sf);
 static bool is_key(char **pp, const char *key);
 static bool consume_umax(char **pp, uintmax_t *pval);
+static unsigned long long psi_stall(uintmax_t t1, uintmax_t t0);
+static void put_le(unsigned char *bp, uint64_t val, int size);
+static uint64_t pct_milli(double pct);
+static size_t format_binary_report(unsigned char *bp, unsigned long long seq,
+				   int64_t kbs, int64_t kbs_sec, double free_pct,
+				   const struct paging_data *pd1, const struct paging_data *pd0);
+static size_t format_psi_report(char *bp, size_t size, const struct paging_data *pd1,
+				const struct paging_data *pd0);
 static void process_sample(const struct paging_data *pd1, const struct paging_data *pd0);
+static bool report_due(const struct paging_data *pd1, int64_t kbs_sec, double free_pct);
+static void reset_sample_period(void);
+static int64_t sample_wait_ms(const struct paging_data *pd0);
+static bool alarm_armed(void);
+static void reset_alarm(const struct paging_data *pd);
+static void probe_alarm(const struct paging_data *pd0);
+static void raise_alarm(const char *cause, int64_t kbs_sec, double free_pct);
+static void subscribe_prepare_shrink(void);
+static void handle_prepare_shrink(void);
+static int64_t reclaim_guest_memory(int64_t kbs);
+static int64_t free_memory_kbs(void);
+static bool write_control_file(const char *path, const char *value);
+static bool write_shrink_key(const char *value);
+static char *sibling_path(const char *path, const char *name);
 static void shutdown_xs(void);
 static bool begin_xs(void);
 static void abort_xs(void);
@@ -313,6 +535,7 @@ static void initialize_xs(struct pollfd *pollfds);
 static void open_xs_connection(struct pollfd *pollfds);
 static void try_subscribe_membalance_settings(void);
 static void update_membalance_settings(void);
+static void update_membalance_tick(void);
 static void handle_xs_watch(void);
 
 
@@ -328,6 +551,22 @@ static void usage(int exitcode)
 	fprintf(fp, "    --version          print version (%s %s)\n", progname, progversion);
 	fprintf(fp, "    --help             print this text\n");
 	fprintf(fp, "    --debug-level <n>  set debug level\n");
+	fprintf(fp, "    --no-alarm         do not raise pressure alarms between samples\n");
+	fprintf(fp, "    --no-psi           do not report pressure stall information\n");
+	fprintf(fp, "    --no-prepare-shrink\n");
+	fprintf(fp, "                       do not reclaim memory when asked to before shrinking\n");
+	fprintf(fp, "    --drop-caches      drop page cache when asked to reclaim memory before\n");
+	fprintf(fp, "                       shrinking, if the kernel has no memory.reclaim\n");
+	fprintf(fp, "    --binary-report    send reports in compact binary format\n");
+	fprintf(fp, "    --heartbeat <sec>  report only on change, but at least every <sec> seconds\n");
+	fprintf(fp, "    --report-delta-rate <n>\n");
+	fprintf(fp, "                       ... on rate change over <n> KB/sec (default: %ld)\n",
+		(long) report_delta_rate);
+	fprintf(fp, "    --report-delta-free <n>\n");
+	fprintf(fp, "                       ... on free memory change over <n>%% (default: %g)\n",
+		report_delta_free);
+	fprintf(fp, "    --cgroup <path>    also report memory pressure stall of cgroup\n");
+	fprintf(fp, "                       (up to %d times, relative to %s)\n", MAX_CGROUPS, cgroup_root);
 	if (enable_simulation)
 	{
 		fprintf(fp, "    --fake-rate <n>    simulate rate of <n> KB/sec\n");
@@ -346,6 +585,7 @@ int main(int argc, char **argv)
 	struct paging_data pd0;
 	struct paging_data pd1;
 	bool recheck_time;
+	bool probing;
 	int init_pass = 0;
 
 	/*
@@ -409,6 +649,9 @@ int main(int argc, char **argv)
 	/* verify we are running under a hypervisor */
 	verify_hypervisor();
 
+	/* open statistics files to be sampled */
+	open_stat_files();
+
 	pollfds[NPFD_SIGTERM].fd = fd_sigterm;
 	pollfds[NPFD_SIGTERM].events = POLLIN|POLLPRI;
 
@@ -424,6 +667,11 @@ int main(int argc, char **argv)
 	pollfds[NPFD_XS].fd = xs_fileno(xs);
 
 	get_paging_data(&pd0);
+	reset_alarm(&pd0);
+	reset_sample_period();
+
+	srandom((unsigned) getpid() ^ (unsigned) time(NULL));
+	sample_lead_ms = tick_lead_ms + random() % tick_spread_ms;
 
         for (;;)
 	{
@@ -432,7 +680,7 @@ int main(int argc, char **argv)
 		/* calculate sleep time till next sample point */
 		if (initialized_xs)
 		{
-			wait_ms = timespec_diff_ms(pd0.ts, getnow()) + interval * MSEC_PER_SEC;
+			wait_ms = sample_wait_ms(&pd0);
 		}
 		else
 		{
@@ -442,6 +690,11 @@ int main(int argc, char **argv)
 				wait_ms *= 2;
 		}
 
+		/* if pressure alarm is armed, probe in between samples */
+		probing = alarm_armed() && wait_ms > alarm_probe_ms;
+		if (probing)
+			wait_ms = alarm_probe_ms;
+
 		if (wait_ms >= tolerance_ms)
 		{
 			for (k = 0;  k < countof(pollfds);  k++)
@@ -473,7 +726,10 @@ int main(int argc, char **argv)
 				initialize_xs(NULL);
 				/* if successful, start monitoring page map-in rate */
 				if (initialized_xs)
+				{
 					get_paging_data(&pd0);
+					reset_alarm(&pd0);
+				}
 				continue;
 			}
 
@@ -487,11 +743,15 @@ int main(int argc, char **argv)
 			if (need_update_membalance_settings)
 				update_membalance_settings();
 
-			if (recheck_time)
+			if (recheck_time || probing)
 			{
 				/* go sleep again if wait interval has not expired yet */
-				if (timespec_diff_ms(getnow(), pd0.ts) < interval * MSEC_PER_SEC - tolerance_ms)
+				if (sample_wait_ms(&pd0) >= tolerance_ms)
+				{
+					if (probing)
+						probe_alarm(&pd0);
 					continue;
+				}
 			}
 		}
 
@@ -501,7 +761,10 @@ int main(int argc, char **argv)
 			initialize_xs(NULL);
 			/* if successful, start monitoring page map-in rate */
 			if (initialized_xs)
+			{
 				get_paging_data(&pd0);
+				reset_alarm(&pd0);
+			}
 			continue;
 		}
 
@@ -509,6 +772,7 @@ int main(int argc, char **argv)
 		get_paging_data(&pd1);
 		process_sample(&pd1, &pd0);
 		pd0 = pd1;
+		reset_alarm(&pd0);
 	}
 
 	/* close connection to xenstore */
@@ -525,6 +789,7 @@ static void handle_cmdline(int argc, char **argv)
 	int k;
 	char *cp, *ep = NULL;
 	long val;
+	double dval;
 
 	for (k = 1;  k < argc;  k++)
 	{
@@ -552,6 +817,68 @@ static void handle_cmdline(int argc, char **argv)
 				ivarg(cp);
 			debug_level = (int) val;
 		}
+		else if (0 == strcmp(argv[k], "--no-alarm"))
+		{
+			enable_alarm = false;
+		}
+		else if (0 == strcmp(argv[k], "--no-psi"))
+		{
+			enable_psi = false;
+		}
+		else if (0 == strcmp(argv[k], "--no-prepare-shrink"))
+		{
+			enable_prepare_shrink = false;
+		}
+		else if (0 == strcmp(argv[k], "--drop-caches"))
+		{
+			enable_drop_caches = true;
+		}
+		else if (0 == strcmp(argv[k], "--binary-report"))
+		{
+			binary_report = true;
+		}
+		else if (0 == strcmp(argv[k], "--heartbeat"))
+		{
+			if (k == argc - 1)
+				ivarg(argv[k]);
+			cp = argv[++k];
+			errno = 0;
+			val = strtol(cp, &ep, 10);
+			if (errno || ep == cp || *ep || val < 0 || val > max_heartbeat)
+				ivarg(cp);
+			heartbeat = (int) val;
+		}
+		else if (0 == strcmp(argv[k], "--report-delta-rate"))
+		{
+			if (k == argc - 1)
+				ivarg(argv[k]);
+			cp = argv[++k];
+			errno = 0;
+			val = strtol(cp, &ep, 10);
+			if (errno || ep == cp || *ep || val < 0)
+				ivarg(cp);
+			report_delta_rate = val;
+		}
+		else if (0 == strcmp(argv[k], "--report-delta-free"))
+		{
+			if (k == argc - 1)
+				ivarg(argv[k]);
+			cp = argv[++k];
+			errno = 0;
+			dval = strtod(cp, &ep);
+			if (errno || ep == cp || *ep || !(dval >= 0 && dval <= 100))
+				ivarg(cp);
+			report_delta_free = dval;
+		}
+		else if (0 == strcmp(argv[k], "--cgroup"))
+		{
+			if (k == argc - 1)
+				ivarg(argv[k]);
+			cp = argv[++k];
+			if (*cp == '\0' || ncgroups == MAX_CGROUPS)
+				ivarg(cp);
+			cgroup_names[ncgroups++] = cp;
+		}
 		else if (enable_simulation && 0 == strcmp(argv[k], "--fake-rate"))
 		{
 			if (k == argc - 1)
@@ -960,6 +1287,9 @@ static void initialize_xs(struct pollfd *pollfds)
 			}
 
 			membalance_report_path = keyvalue;
+			membalance_alarm_path = sibling_path(keyvalue, "alarm");
+			if (enable_prepare_shrink)
+				membalance_shrink_path = sibling_path(keyvalue, "shrink");
 			abort_singleop_xs();
 		}
 
@@ -1025,6 +1355,7 @@ static void initialize_xs(struct pollfd *pollfds)
 
 	initialized_xs = true;
 
+	subscribe_prepare_shrink();
 	try_subscribe_membalance_settings();
 
 	return;
@@ -1111,6 +1442,10 @@ static void try_subscribe_membalance_settings(void)
 	if (!xs_watch(xs, membalance_interval_path, membalance_interval_path))
 		return;
 
+	/* older membalanced does not publish tick time */
+	if (!xs_watch(xs, membalance_tick_path, membalance_tick_path))
+		debug_msg(2, "unable to watch xenstore (%s)", membalance_tick_path);
+
 	subscribed_membalance = true;
 	debug_msg(2, "subscribed membalance settings");
 
@@ -1162,6 +1497,7 @@ static void update_membalance_settings(void)
 	}
 
 	interval = v;
+	reset_sample_period();
 
 	debug_msg(2, "updated interval to %d seconds", interval);
 
@@ -1169,6 +1505,36 @@ cleanup:
 
 	if (pv)
 		free(pv);
+
+	update_membalance_tick();
+}
+
+/*
+ * Read time of membalanced scheduling tick.
+ * If it is not available, sample on own schedule.
+ */
+static void update_membalance_tick(void)
+{
+	char *pv = NULL;
+	unsigned int len;
+	long long v;
+	char* ep = NULL;
+
+	tick_ms = -1;
+
+	pv = xs_read(xs, xst, membalance_tick_path, &len);
+	if (!pv)
+		return;
+
+	errno = 0;
+	v = strtoll(pv, &ep, 10);
+	if (!errno && ep != pv && !*ep && v > 0)
+	{
+		tick_ms = v;
+		debug_msg(3, "membalance tick time updated to %lld", v);
+	}
+
+	free(pv);
 }
 
 /*
@@ -1195,15 +1561,75 @@ static void handle_xs_watch(void)
 		token = vec[k + XS_WATCH_TOKEN];
 		if (0 == strcmp(path, membalance_interval_path))
 			update_membalance_settings();
+		else if (0 == strcmp(path, membalance_tick_path) && subscribed_membalance)
+			update_membalance_tick();
+		else if (membalance_shrink_path && 0 == strcmp(path, membalance_shrink_path))
+			handle_prepare_shrink();
 	}
 
 	free(vec);
 }
 
+/*
+ * Open statistics files sampled by get_paging_data(...)
+ */
+static void open_stat_files(void)
+{
+	char *path;
+	int k;
+
+	init_stat_file(&vmstat_file, "/proc/vmstat");
+	read_stat_file(&vmstat_file, true);
+
+	/* kernel may be built without PSI or have it disabled at boot time */
+	init_stat_file(&psi_file, "/proc/pressure/memory");
+	if (!enable_psi || access(psi_file.path, R_OK))
+	{
+		psi_file.disabled = true;
+		debug_msg(1, "system memory pressure stall information is not available");
+	}
+
+	/*
+	 * cgroups that cannot be opened now are retried on every sample,
+	 * since they may get created later by the service manager
+	 */
+	for (k = 0;  k < ncgroups;  k++)
+	{
+		const char *name = cgroup_names[k];
+		const char *root = (name[0] == '/') ? "" : cgroup_root;
+		const char *sep = (name[0] == '/') ? "" : "/";
+
+		path = malloc(strlen(root) + strlen(sep) + strlen(name) + sizeof("/memory.pressure"));
+		if (!path)
+			out_of_memory();
+		sprintf(path, "%s%s%s/memory.pressure", root, sep, name);
+
+		init_stat_file(&cgroup_files[k], path);
+		if (!enable_psi)
+			cgroup_files[k].disabled = true;
+		else
+			read_stat_file(&cgroup_files[k], false);
+	}
+}
+
 /*
  * Read memory statistics data
  */
 static void get_paging_data(struct paging_data *pd)
+{
+	int k;
+
+	get_vmstat_data(pd);
+
+	get_psi_data(&psi_file, &pd->psi);
+	for (k = 0;  k < ncgroups;  k++)
+		get_psi_data(&cgroup_files[k], &pd->cgroup_psi[k]);
+}
+
+/*
+ * Read paging data from /proc/vmstat
+ */
+static void get_vmstat_data(struct paging_data *pd)
 {
 	static const char *key_pgpgin = "pgpgin";
 	static const char *key_nr_free_pages = "nr_free_pages";
@@ -1220,9 +1646,9 @@ static void get_paging_data(struct paging_data *pd)
 	if (pd->mem_pages <= 0)
 		fatal_msg("unable to get system memory size");
 
-	read_whole_file("/proc/vmstat", &vmstat, &vmstat_size, 4096);
+	read_stat_file(&vmstat_file, true);
 
-	for (cp = vmstat; *cp != '\0';)
+	for (cp = vmstat_file.buf; *cp != '\0';)
 	{
 		if (is_key(&cp, key_pgpgin))
 		{
@@ -1260,6 +1686,88 @@ static void get_paging_data(struct paging_data *pd)
 		fatal_msg(parse_error_msg);
 }
 
+/*
+ * Read memory pressure stall information from PSI file @sf
+ * (/proc/pressure/memory or cgroup memory.pressure) formatted as
+ *
+ *     some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+ *     full avg10=0.00 avg60=0.00 avg300=0.00 total=0
+ *
+ * If the data is not available, @psi->valid is set to @false.
+ */
+static void get_psi_data(struct stat_file *sf, struct psi_data *psi)
+{
+	char *cp;
+
+	memset(psi, 0, sizeof(*psi));
+
+	if (!read_stat_file(sf, false))
+		return;
+
+	cp = sf->buf;
+	if (parse_psi_line(&cp, "some", &psi->some_avg10, &psi->some_total) &&
+	    parse_psi_line(&cp, "full", &psi->full_avg10, &psi->full_total))
+	{
+		psi->valid = true;
+		sf->reported = false;
+	}
+	else if (!sf->reported)
+	{
+		error_msg("error parsing %s", sf->path);
+		sf->reported = true;
+	}
+}
+
+/*
+ * Parse PSI line starting with @key at *@pp, extract avg10 and total values.
+ * Advance *@pp to the next line.
+ * Return @true if both values were found.
+ */
+static bool parse_psi_line(char **pp, const char *key, double *p_avg10, uintmax_t *p_total)
+{
+	char *p, *ep;
+	bool found_avg10 = false;
+	bool found_total = false;
+
+	if (!is_key(pp, key))
+		return false;
+
+	for (p = *pp;  *p != '\0' && *p != '\n';)
+	{
+		if (0 == strncmp(p, "avg10=", 6))
+		{
+			errno = 0;
+			*p_avg10 = strtod(p + 6, &ep);
+			if (errno || ep == p + 6)
+				return false;
+			found_avg10 = true;
+			p = ep;
+		}
+		else if (0 == strncmp(p, "total=", 6))
+		{
+			errno = 0;
+			*p_total = strtoumax(p + 6, &ep, 10);
+			if (errno || ep == p + 6)
+				return false;
+			found_total = true;
+			p = ep;
+		}
+		else
+		{
+			p += strcspn(p, " \t\n");
+		}
+
+		while (isblank(*p))
+			p++;
+	}
+
+	if (*p == '\n')
+		p++;
+	*pp = p;
+
+	return found_avg10 && found_total;
+}
+
 /*
  * Check if *@pp points to the line with specified @key.
  * If not, return false and leave *@pp unaltered.
@@ -1335,9 +1843,11 @@ static void process_sample(const struct paging_data *pd1, const struct paging_da
 	int64_t ms;
 	int64_t kbs, kbs_sec;
 	double free_pct;
-	char report[512];
+	char report[2048];
+	size_t len;
 	char struct_version = 'A';
 	int nretries = 0;
+	bool delivered = false;
 
 	/* discard sample if weird timing */
 	ms = timespec_diff_ms(pd1->ts, pd0->ts);
@@ -1349,6 +1859,7 @@ static void process_sample(const struct paging_data *pd1, const struct paging_da
 	if (kbs < 0)
 		return;
 	kbs_sec = (kbs * MSEC_PER_SEC) / ms;
+	last_kbs_sec = kbs_sec;
 
 	free_pct = 100.0 * (double) pd1->nr_free_pages / (double) pd1->mem_pages;
 
@@ -1369,9 +1880,29 @@ static void process_sample(const struct paging_data *pd1, const struct paging_da
 			free_pct);
 	}
 
+	if (log_fp && debug_level >= 3 && pd1->psi.valid)
+	{
+		fprintf(log_fp, "psi: some avg10=%.2f total=%llu, full avg10=%.2f total=%llu\n",
+			pd1->psi.some_avg10,
+			(unsigned long long) pd1->psi.some_total,
+			pd1->psi.full_avg10,
+			(unsigned long long) pd1->psi.full_total);
+	}
+
+	/* with change-only reporting, skip the report if nothing has changed */
+	if (!report_due(pd1, kbs_sec, free_pct))
+		return;
+
+	if (binary_report)
+	{
+		len = format_binary_report((unsigned char *) report, report_seq++,
+					   kbs, kbs_sec, free_pct, pd1, pd0);
+		goto submit;
+	}
+
 	/* format memory pressure report string */
 	/* (could use json if data structure were more complicated and changeable) */
-	sprintf(report, "%c\n"
+	len = sprintf(report, "%c\n"
 			"action: report\n"
 			"progname: %s\n"
 			"progversion: %s\n"
@@ -1387,24 +1918,614 @@ static void process_sample(const struct paging_data *pd1, const struct paging_da
 		(unsigned long) kbs_sec,
 		free_pct);
 
+	/* append optional PSI data */
+	len += format_psi_report(report + len, sizeof(report) - len, pd1, pd0);
+
+	if (heartbeat)
+		len += snprintf(report + len, sizeof(report) - len, "heartbeat: %d\n", heartbeat);
+
+submit:
 	/* write report data to xenstore */
 	for (;;)
 	{
 		if (!begin_singleop_xs())
 			break;
 
-		if (!xs_write(xs, xst, membalance_report_path, report, strlen(report)))
+		if (!xs_write(xs, xst, membalance_report_path, report, len))
 		{
 			error_perror("unable to write xenstore");
 			abort_singleop_xs();
 			break;
 		}
 
+		switch (commit_singleop_xs(&nretries))
+		{
+		case XSTS_RETRY:
+			continue;
+		case XSTS_OK:
+			delivered = true;
+			break;
+		default:
+			break;
+		}
+
+		break;
+	}
+
+	if (delivered)
+	{
+		report_sent = true;
+		force_report = false;
+		reported_kbs_sec = kbs_sec;
+		reported_free_pct = free_pct;
+		reported_mem_pages = pd1->mem_pages;
+		ts_reported = pd1->ts;
+	}
+	else
+	{
+		/* try again with the next sample */
+		force_report = true;
+	}
+}
+
+/*
+ * Check if the report with readings @kbs_sec and @free_pct taken in sample @pd1
+ * is to be sent, and adjust sampling period for the next sample.
+ */
+static bool report_due(const struct paging_data *pd1, int64_t kbs_sec, double free_pct)
+{
+	int64_t interval_ms = interval * MSEC_PER_SEC;
+	int64_t dr, remain_ms;
+	double df;
+	bool changed;
+
+	if (heartbeat == 0)
+		return true;
+
+	dr = kbs_sec - reported_kbs_sec;
+	df = free_pct - reported_free_pct;
+	changed = !report_sent || force_report ||
+		  dr > report_delta_rate || -dr > report_delta_rate ||
+		  df > report_delta_free || -df > report_delta_free ||
+		  pd1->mem_pages != reported_mem_pages;
+
+	if (changed)
+	{
+		sample_period_ms = interval_ms;
+		return true;
+	}
+
+	/* nothing has changed, back off if idle */
+	if (kbs_sec <= idle_rate || free_pct > idle_free_pct)
+		sample_period_ms = min(sample_period_ms + interval_ms, idle_interval_factor * interval_ms);
+	else
+		sample_period_ms = interval_ms;
+
+	remain_ms = heartbeat * MSEC_PER_SEC - timespec_diff_ms(pd1->ts, ts_reported);
+	if (remain_ms < tolerance_ms)
+	{
+		debug_msg(3, "sending heartbeat report");
+		return true;
+	}
+
+	/* take the next sample no later than at the heartbeat deadline */
+	sample_period_ms = max(min(sample_period_ms, remain_ms), interval_ms);
+
+	debug_msg(3, "readings unchanged, next sample in %ld ms", (long) sample_period_ms);
+
+	return false;
+}
+
+/*
+ * Sample every @interval, and send the next report regardless of change
+ */
+static void reset_sample_period(void)
+{
+	sample_period_ms = interval * MSEC_PER_SEC;
+	force_report = true;
+}
+
+/*
+ * Return time (ms) till the next sample after the one in @pd0 is due.
+ * If membalanced tick time is known, move the sample point to the nearest
+ * point @sample_lead_ms before a tick.
+ */
+static int64_t sample_wait_ms(const struct paging_data *pd0)
+{
+	int64_t wait_ms = timespec_diff_ms(pd0->ts, getnow()) + sample_period_ms;
+	int64_t period = interval * MSEC_PER_SEC;
+	int64_t lead = min(sample_lead_ms, period / 2);
+	int64_t now_ms, off;
+	struct timespec rt;
+
+	if (tick_ms < 0 || clock_gettime(CLOCK_REALTIME, &rt))
+		return wait_ms;
+
+	now_ms = (int64_t) rt.tv_sec * MSEC_PER_SEC + rt.tv_nsec / NSEC_PER_MSEC;
+
+	/* offset of nominal sample point past the aligned one */
+	off = (now_ms + wait_ms - (tick_ms - lead)) % period;
+	if (off < 0)
+		off += period;
+
+	if (off <= period / 2)
+		return wait_ms - off;
+	else
+		return wait_ms + period - off;
+}
+
+
+
+/*
+ * Store @size low bytes of @val at @bp in little-endian order
+ */
+static void put_le(unsigned char *bp, uint64_t val, int size)
+{
+	int k;
+
+	for (k = 0;  k < size;  k++, val >>= 8)
+		bp[k] = (unsigned char) (val & 0xFF);
+}
+
+/*
+ * Convert percentage @pct to units of 1/1000 of percent
+ */
+static uint64_t pct_milli(double pct)
+{
+	if (pct <= 0)
+		return 0;
+	if (pct >= 100)
+		return 100 * 1000;
+	return (uint64_t) (pct * 1000 + 0.5);
+}
+
+/*
+ * Format compact binary report ('B') into the buffer @bp, which must
+ * be at least REPORT_B_SIZE_PSI + REPORT_B_SIZE_HEARTBEAT bytes long.
+ * Return the length of the report.
+ *
+ * Layout (integers are little-endian):
+ *
+ *     offset  size
+ *        0      1    'B'
+ *        1      1    flags (REPORT_B_PSI, REPORT_B_HEARTBEAT)
+ *        2      8    seq
+ *       10      8    kb
+ *       18      8    kbsec
+ *       26      4    freepct, in 1/1000 of percent
+ *     with REPORT_B_PSI:
+ *       30      4    psisome, in 1/1000 of percent
+ *       34      4    psifull, in 1/1000 of percent
+ *       38      8    psisomeus
+ *       46      8    psifullus
+ *     with REPORT_B_HEARTBEAT, after the above:
+ *        +      4    heartbeat, in seconds
+ *
+ * Cgroup PSI data is not included in binary reports.
+ */
+static size_t format_binary_report(unsigned char *bp, unsigned long long seq,
+				   int64_t kbs, int64_t kbs_sec, double free_pct,
+				   const struct paging_data *pd1, const struct paging_data *pd0)
+{
+	const struct psi_data *p1 = &pd1->psi;
+	const struct psi_data *p0 = &pd0->psi;
+	size_t len = REPORT_B_SIZE;
+
+	bp[0] = 'B';
+	bp[1] = 0;
+	put_le(bp + 2, seq, 8);
+	put_le(bp + 10, (uint64_t) kbs, 8);
+	put_le(bp + 18, (uint64_t) kbs_sec, 8);
+	put_le(bp + 26, pct_milli(free_pct), 4);
+
+	if (p1->valid && p0->valid)
+	{
+		bp[1] |= REPORT_B_PSI;
+		put_le(bp + 30, pct_milli(p1->some_avg10), 4);
+		put_le(bp + 34, pct_milli(p1->full_avg10), 4);
+		put_le(bp + 38, psi_stall(p1->some_total, p0->some_total), 8);
+		put_le(bp + 46, psi_stall(p1->full_total, p0->full_total), 8);
+		len = REPORT_B_SIZE_PSI;
+	}
+
+	if (heartbeat)
+	{
+		bp[1] |= REPORT_B_HEARTBEAT;
+		put_le(bp + len, (uint64_t) heartbeat, REPORT_B_SIZE_HEARTBEAT);
+		len += REPORT_B_SIZE_HEARTBEAT;
+	}
+
+	return len;
+}
+
+/*
+ * Stall time accumulated between readings @t0 and @t1 of PSI total counter
+ */
+static unsigned long long psi_stall(uintmax_t t1, uintmax_t t0)
+{
+	return (t1 >= t0) ? (unsigned long long) (t1 - t0) : 0;
+}
+
+/*
+ * Format PSI part of the report for the interval from @pd0 to @pd1
+ * into the buffer @bp of @size bytes, return the length of formatted text.
+ *
+ * System-wide data is reported as
+ *
+ *     psisome: <some avg10 %>
+ *     psifull: <full avg10 %>
+ *     psisomeus: <some stall usec during the interval>
+ *     psifullus: <full stall usec during the interval>
+ *
+ * and cgroup data as
+ *
+ *     cgroup<k>: <some avg10 %> <full avg10 %> <some usec> <full usec> <cgroup>
+ *
+ * Entries for which data is not available or that do not fit are left out.
+ */
+static size_t format_psi_report(char *bp, size_t size, const struct paging_data *pd1,
+				const struct paging_data *pd0)
+{
+	const struct psi_data *p1;
+	const struct psi_data *p0;
+	size_t len = 0;
+	int n, k;
+
+	*bp = '\0';
+
+	p1 = &pd1->psi;
+	p0 = &pd0->psi;
+	if (p1->valid && p0->valid)
+	{
+		n = snprintf(bp + len, size - len,
+			     "psisome: %f\n"
+			     "psifull: %f\n"
+			     "psisomeus: %llu\n"
+			     "psifullus: %llu\n",
+			     p1->some_avg10,
+			     p1->full_avg10,
+			     psi_stall(p1->some_total, p0->some_total),
+			     psi_stall(p1->full_total, p0->full_total));
+		if (n < 0 || (size_t) n >= size - len)
+			goto truncated;
+		len += n;
+	}
+
+	for (k = 0;  k < ncgroups;  k++)
+	{
+		p1 = &pd1->cgroup_psi[k];
+		p0 = &pd0->cgroup_psi[k];
+		if (!(p1->valid && p0->valid))
+			continue;
+
+		n = snprintf(bp + len, size - len,
+			     "cgroup%d: %f %f %llu %llu %s\n",
+			     k,
+			     p1->some_avg10,
+			     p1->full_avg10,
+			     psi_stall(p1->some_total, p0->some_total),
+			     psi_stall(p1->full_total, p0->full_total),
+			     cgroup_names[k]);
+		if (n < 0 || (size_t) n >= size - len)
+			goto truncated;
+		len += n;
+	}
+
+	return len;
+
+truncated:
+	bp[len] = '\0';
+	return len;
+}
+
+
+/******************************************************************************
+*                               pressure alarm                                *
+******************************************************************************/
+
+/*
+ * Check if pressure alarm can be raised in the current sampling interval
+ */
+static bool alarm_armed(void)
+{
+	return enable_alarm &&
+	       initialized_xs &&
+	       membalance_alarm_path != NULL &&
+	       !alarm_raised &&
+	       simulated_kbs < 0 &&
+	       simulated_free_pct < 0;
+}
+
+/*
+ * Re-arm pressure alarm at the start of sampling interval
+ * beginning with reading @pd
+ */
+static void reset_alarm(const struct paging_data *pd)
+{
+	alarm_pd = *pd;
+	alarm_raised = false;
+}
+
+/*
+ * Take a quick reading of paging data in between regular samples
+ * and raise pressure alarm if the reading deviated sharply.
+ * @pd0 = latest regular sample
+ */
+static void probe_alarm(const struct paging_data *pd0)
+{
+	struct paging_data pd;
+	int64_t ms, kbs_sec;
+	double free_pct;
+	const char *cause = NULL;
+
+	/* PSI is not needed for probing, just read vmstat */
+	memset(&pd, 0, sizeof(pd));
+	get_vmstat_data(&pd);
+
+	ms = timespec_diff_ms(pd.ts, alarm_pd.ts);
+	if (ms < alarm_probe_ms / 2)
+		return;
+
+	/* disregard weird data */
+	if (pd.pgpgin < alarm_pd.pgpgin)
+	{
+		alarm_pd = pd;
+		return;
+	}
+
+	kbs_sec = (int64_t) ((pd.pgpgin - alarm_pd.pgpgin) * MSEC_PER_SEC) / ms;
+	free_pct = 100.0 * (double) pd.nr_free_pages / (double) pd.mem_pages;
+	alarm_pd = pd;
+
+	if (kbs_sec >= alarm_rate_min &&
+	    kbs_sec > alarm_rate_factor * max(last_kbs_sec, 0))
+	{
+		cause = "rate";
+	}
+	else if ((double) pd.nr_free_pages < alarm_free_frac * (double) pd0->nr_free_pages)
+	{
+		cause = "free";
+	}
+
+	if (cause)
+		raise_alarm(cause, kbs_sec, free_pct);
+}
+
+/*
+ * Write pressure alarm to xenstore
+ */
+static void raise_alarm(const char *cause, int64_t kbs_sec, double free_pct)
+{
+	char alarm[256];
+	char struct_version = 'A';
+	int nretries = 0;
+
+	alarm_raised = true;
+
+	debug_msg(2, "raising pressure alarm (%s): kbs_sec=%ld, free%%=%f",
+		  cause, (long) kbs_sec, free_pct);
+
+	sprintf(alarm, "%c\n"
+		       "action: alarm\n"
+		       "seq: %llu\n"
+		       "cause: %s\n"
+		       "kbsec: %lu\n"
+		       "freepct: %f\n",
+		struct_version,
+		alarm_seq++,
+		cause,
+		(unsigned long) kbs_sec,
+		free_pct);
+
+	for (;;)
+	{
+		if (!begin_singleop_xs())
+			break;
+
+		if (!xs_write(xs, xst, membalance_alarm_path, alarm, strlen(alarm)))
+		{
+			/* MEMBALANCED does not provide alarm key */
+			if (errno == EACCES || errno == ENOENT)
+			{
+				debug_msg(1, "pressure alarm key (%s) is not available, "
+					     "disabling alarms", membalance_alarm_path);
+				free(membalance_alarm_path);
+				membalance_alarm_path = NULL;
+			}
+			else
+			{
+				error_perror("unable to write xenstore");
+			}
+			abort_singleop_xs();
+			break;
+		}
+
 		if (commit_singleop_xs(&nretries) != XSTS_RETRY)
 			break;
 	}
 }
 
+/*
+ * Set watch on @membalance_shrink_path and let membalanced know
+ * prepare-shrink requests can be sent. If the key is not available,
+ * disable prepare-shrink.
+ */
+static void subscribe_prepare_shrink(void)
+{
+	if (!membalance_shrink_path)
+		return;
+
+	if (!xs_watch(xs, membalance_shrink_path, membalance_shrink_path) ||
+	    !write_shrink_key("ready"))
+	{
+		debug_msg(1, "prepare-shrink key (%s) is not available, "
+			     "disabling prepare-shrink", membalance_shrink_path);
+		free(membalance_shrink_path);
+		membalance_shrink_path = NULL;
+		return;
+	}
+
+	debug_msg(2, "accepting prepare-shrink requests");
+}
+
+/*
+ * Called when @membalance_shrink_path has been written to.
+ * If it holds a request, reclaim memory and respond.
+ * Writes of responses by memprobed itself are seen here too, and are ignored.
+ */
+static void handle_prepare_shrink(void)
+{
+	unsigned long long seq;
+	long long kbs;
+	int64_t reclaimed;
+	unsigned int len;
+	char buf[64];
+	char *pv;
+	int n;
+
+	pv = xs_read(xs, xst, membalance_shrink_path, &len);
+	if (!pv)
+		return;
+	n = sscanf(pv, "prepare-shrink %llu %lld", &seq, &kbs);
+	free(pv);
+
+	if (n != 2 || kbs <= 0)
+		return;
+
+	reclaimed = reclaim_guest_memory(kbs);
+
+	debug_msg(2, "prepared for shrinking by %lld kbs: reclaimed %lld kbs",
+		  kbs, (long long) reclaimed);
+
+	sprintf(buf, "shrink-prepared %llu %lld", seq, (long long) reclaimed);
+	if (!write_shrink_key(buf))
+		error_perror("unable to write xenstore (%s)", membalance_shrink_path);
+}
+
+/*
+ * Reclaim guest memory, so that at least @kbs is free.
+ * Return the amount by which free memory has grown (kbs).
+ */
+static int64_t reclaim_guest_memory(int64_t kbs)
+{
+	int64_t free0 = free_memory_kbs();
+	int64_t need = kbs - free0;
+	int64_t free1;
+	char path[256];
+	char value[64];
+
+	if (free0 < 0 || need <= 0)
+		return 0;
+
+	snprintf(path, sizeof path, "%s/%s", cgroup_root, memory_reclaim_file);
+	snprintf(value, sizeof value, "%lldK", (long long) need);
+
+	/* memory.reclaim fails with EAGAIN if it could not reclaim the full amount */
+	if (!write_control_file(path, value) && errno != EAGAIN)
+	{
+		if (!enable_drop_caches)
+		{
+			debug_msg(3, "unable to write %s, not reclaiming", path);
+			return 0;
+		}
+
+		debug_msg(3, "unable to write %s, dropping page cache instead", path);
+		if (!write_control_file(drop_caches_path, "1"))
+			error_perror("unable to write %s", drop_caches_path);
+	}
+
+	free1 = free_memory_kbs();
+	if (free1 < free0)
+		return 0;
+
+	return free1 - free0;
+}
+
+/*
+ * Guest free memory (kbs), or -1 if unknown
+ */
+static int64_t free_memory_kbs(void)
+{
+	struct paging_data pd;
+	long page_size = sysconf(_SC_PAGESIZE);
+
+	if (page_size <= 0)
+		return -1;
+
+	memset(&pd, 0, sizeof(pd));
+	get_vmstat_data(&pd);
+
+	return (int64_t) pd.nr_free_pages * (page_size / 1024);
+}
+
+/*
+ * Write @value to kernel control file @path (in /proc or cgroup fs).
+ * On error, return @false with errno set.
+ */
+static bool write_control_file(const char *path, const char *value)
+{
+	ssize_t len = strlen(value);
+	bool ok;
+	int fd;
+	int err;
+
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	ok = (write(fd, value, len) == len);
+	err = errno;
+	close(fd);
+	errno = err;
+
+	return ok;
+}
+
+/*
+ * Write @value to @membalance_shrink_path
+ */
+static bool write_shrink_key(const char *value)
+{
+	int nretries = 0;
+
+	for (;;)
+	{
+		if (!begin_singleop_xs())
+			return false;
+
+		if (!xs_write(xs, xst, membalance_shrink_path, value, strlen(value)))
+		{
+			abort_singleop_xs();
+			return false;
+		}
+
+		switch (commit_singleop_xs(&nretries))
+		{
+		case XSTS_OK:       return true;
+		case XSTS_RETRY:    continue;
+		default:            return false;
+		}
+	}
+}
+
+/*
+ * Make path of key @name located next to the key @path
+ */
+static char *sibling_path(const char *path, const char *name)
+{
+	const char *cp = strrchr(path, '/');
+	size_t len = cp ? (size_t) (cp - path + 1) : 0;
+	char *p = malloc(len + strlen(name) + 1);
+
+	if (!p)
+		out_of_memory();
+
+	memcpy(p, path, len);
+	strcpy(p + len, name);
+
+	return p;
+}
+
 /*
  * Verify we are running under Xen,
  * and not in the root domain
@@ -1491,61 +2612,104 @@ static void select_clk_id(void)
 
 
 /*
- * Read in the whole content of file @path into the buffer pointed by *@ppbuf,
- * as nul-terminated string.
- * Reallocate *@ppbuf if necessary to be large enough.
- * The size of the buffer is kept in *@psize.
- * Initial size of the buffer to use on first allocation is given by @initial_size.
- * Abort on error.
+ * Initialize descriptor @sf for file @path
  */
-static void read_whole_file(const char *path, char **ppbuf, size_t *psize, size_t initial_size)
+static void init_stat_file(struct stat_file *sf, const char *path)
+{
+	memset(sf, 0, sizeof(*sf));
+	sf->path = path;
+	sf->fd = -1;
+}
+
+/*
+ * Read the whole content of file @sf into sf->buf (null-terminated).
+ *
+ * The file is opened on the first call and then kept open: subsequent calls
+ * re-read it with pread(...) from offset 0, which makes kernel regenerate
+ * the content, without going through open/close each time.
+ *
+ * If @must is @true, failure is fatal. Otherwise on failure return @false,
+ * log it (once until the next successful reading) and close the file,
+ * so the next call will try to reopen it.
+ */
+static bool read_stat_file(struct stat_file *sf, bool must)
 {
 	ssize_t rsz;
-	ssize_t rd;
-	ssize_t rem;
-	int fd = -1;
+	size_t rd;
+
+	if (sf->disabled)
+		return false;
 
-	if (*psize == 0)
+	if (sf->size == 0)
 	{
-		*psize = initial_size;
-		*ppbuf = malloc(*psize);
-		if (!*ppbuf)
+		sf->size = 4096;
+		sf->buf = malloc(sf->size);
+		if (!sf->buf)
 			out_of_memory();
 	}
 
+	if (sf->fd == -1)
+	{
+		sf->fd = open(sf->path, O_RDONLY | O_CLOEXEC);
+		if (sf->fd == -1)
+		{
+			if (must)
+				fatal_perror("unable to open file %s", sf->path);
+			if (!sf->reported)
+				error_perror("unable to open file %s", sf->path);
+			sf->reported = true;
+			return false;
+		}
+	}
+
 	for (;;)
 	{
-		if (fd == -1)
-			close (fd);
-		fd = open(path, O_RDONLY);
-		if (fd == -1)
-			fatal_perror("unable to open file %s", path);
 		rd = 0;
 
-		for (;;)
+		while (rd < sf->size)
 		{
-			rem = *psize - rd;
-			if (rem <= 0) break;
-			rsz = read(fd, *ppbuf, rem);
+			rsz = pread(sf->fd, sf->buf + rd, sf->size - rd, (off_t) rd);
+			if (rsz < 0 && errno == EINTR)
+				continue;
 			if (rsz < 0)
-				fatal_perror("unable to read file %s", path);
-			if (rsz == 0)  break;
+				goto failed;
+			if (rsz == 0)
+				break;
 			rd += rsz;
 		}
 
-		if (rd <= *psize - 1)
+		if (rd < sf->size)
 		{
-			(*ppbuf)[rd] = '\0';
-			break;
+			sf->buf[rd] = '\0';
+			return true;
 		}
 
-		*psize += *psize / 2;
-		*ppbuf = realloc(*ppbuf, *psize);
-		if (!*ppbuf)
+		sf->size += sf->size / 2;
+		sf->buf = realloc(sf->buf, sf->size);
+		if (!sf->buf)
 			out_of_memory();
 	}
 
-	close(fd);
+failed:
+	if (must)
+		fatal_perror("unable to read file %s", sf->path);
+	if (!sf->reported)
+		error_perror("unable to read file %s", sf->path);
+	sf->reported = true;
+	close_stat_file(sf);
+	return false;
+}
+
+/*
+ * Close file @sf if it is open
+ */
+static void close_stat_file(struct stat_file *sf)
+{
+	if (sf->fd != -1)
+	{
+		close(sf->fd);
+		sf->fd = -1;
+	}
 }
 
 /******************************************************************************